@@ -0,0 +1,422 @@
+// File Name    : batch.c
+// Project      : Simple File System by SPI
+// Description  : Batches of operations for bulk jobs. A script is parsed
+//                and checked in full, against the file sizes the master
+//                knows and those the batch itself leaves, before anything
+//                goes on the wire. Then the operations go as framed
+//                bursts, as many as fit behind each SYNC, reads and writes
+//                larger than a frame cut into PREAD and PWRITE pieces: the
+//                slave answers each request on the bytes after the next
+//                one's, so the master never stops for a command to come
+//                back before sending the next, and a burst moves at the
+//                link's clock.
+
+#include "common.h"
+#include "batch.h"
+#include "filesys.h"
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct
+{
+	const char *name;
+	uint8_t op;
+} batch_ops[] = {
+	{ "create", CMD_CREATE },
+	{ "write", CMD_WRITE },
+	{ "read", CMD_READ },
+	{ "delete", CMD_DELETE },
+	{ "copy", CMD_COPY },
+	{ "move", CMD_MOVE },
+};
+
+// The batch as frames, at most one more per operation than its data fills
+#define BATCH_FRAMES (2 * BATCH_MAX_OPS + BATCH_DATA_SIZE / (FRAME_MAX_DATA - 2))
+
+static struct frame_op batch_frames[BATCH_FRAMES];
+static uint16_t batch_owner[BATCH_FRAMES];
+
+// The batch's clock: microseconds up to the cycle count at batch_mark,
+// so it runs past the 43 s the counter takes to wrap
+static uint32_t batch_mark;
+static uint32_t batch_base_us;
+
+
+void batch_init(struct batch *b)
+{
+	uint8_t n;
+
+	b->count = 0;
+	b->data_used = 0;
+	b->lines = 0;
+	b->error = NULL;
+	b->total_us = 0;
+	b->size[0] = 0;
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		b->size[n] = cache_size(n);
+	}
+}
+
+// The next word from *p up to end, NULL if there is none
+static const char *batch_word(const char **p, const char *end, uint16_t *length)
+{
+	const char *s = *p;
+
+	while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) {
+		s++;
+	}
+	*p = s;
+	while (*p < end && **p != ' ' && **p != '\t' && **p != '\r') {
+		(*p)++;
+	}
+	*length = (uint16_t)(*p - s);
+	return (*length > 0) ? s : NULL;
+}
+
+// The next word as a number up to max: 0, 1 if there is no word, -1 if
+// it is not such a number
+static int batch_number(const char **p, const char *end, uint32_t max, uint32_t *value)
+{
+	char text[12];
+	char *stop;
+	uint16_t length;
+	const char *s = batch_word(p, end, &length);
+
+	if (s == NULL) {
+		return 1;
+	}
+	if (length >= sizeof(text)) {
+		return -1;
+	}
+	memcpy(text, s, length);
+	text[length] = '\0';
+	*value = strtoul(text, &stop, 0);
+	return (*stop == '\0' && text[0] != '-' && *value <= max) ? 0 : -1;
+}
+
+// One operation from s to end into op, checked against size[], which it
+// updates; write bytes go to b->data from *used. Returns NULL or why not.
+static const char *batch_line(struct batch *b, const char *s, const char *end,
+			      struct batch_op *op, int32_t *size, uint16_t *used)
+{
+	const char *name;
+	uint16_t length;
+	uint32_t n, value;
+	uint8_t k;
+	int rc;
+
+	name = batch_word(&s, end, &length);
+	for (k = 0; k < sizeof(batch_ops) / sizeof(batch_ops[0]); k++) {
+		if (strlen(batch_ops[k].name) == length && memcmp(name, batch_ops[k].name, length) == 0) {
+			break;
+		}
+	}
+	if (k == sizeof(batch_ops) / sizeof(batch_ops[0])) {
+		return "unknown operation";
+	}
+
+	memset(op, 0, sizeof(*op));
+	op->op = batch_ops[k].op;
+	if (batch_number(&s, end, MAX_FILE_NUMBER, &n) != 0 || n == 0) {
+		return "file numbers are 1 to 100";
+	}
+	op->file_number = (uint8_t)n;
+
+	switch (op->op)
+	{
+		case CMD_CREATE:
+			if (batch_number(&s, end, MAX_FILE_SIZE, &value) != 0 || value == 0) {
+				return "sizes are 1 to 65535";
+			}
+			op->size = (uint16_t)value;
+			size[n] = value;
+			break;
+
+		case CMD_WRITE:
+			op->data = *used;
+			while ((rc = batch_number(&s, end, 0xff, &value)) == 0) {
+				if (*used == BATCH_DATA_SIZE) {
+					return "more data than the batch holds";
+				}
+				b->data[(*used)++] = (uint8_t)value;
+			}
+			if (rc < 0) {
+				return "bytes are 0 to 255";
+			}
+			op->size = *used - op->data;
+			if (op->size == 0) {
+				return "nothing to write";
+			}
+			if (size[n] == 0) {
+				return "no such file";
+			}
+			if (size[n] > 0 && size[n] != op->size) {
+				return "a write is the whole file";
+			}
+			break;
+
+		case CMD_READ:
+			if (batch_number(&s, end, MAX_FILE_SIZE, &value) != 0 || value == 0) {
+				return "sizes are 1 to 65535";
+			}
+			if (size[n] == 0) {
+				return "no such file";
+			}
+			if (size[n] > 0 && (int32_t)value > size[n]) {
+				return "read past the end of the file";
+			}
+			if (value > BATCH_DATA_SIZE - *used) {
+				return "more data than the batch holds";
+			}
+			op->size = (uint16_t)value;
+			op->data = *used;
+			*used += op->size;
+			break;
+
+		case CMD_DELETE:
+			size[n] = 0;
+			break;
+
+		case CMD_COPY:
+		case CMD_MOVE:
+			if (batch_number(&s, end, MAX_FILE_NUMBER, &value) != 0 || value == 0) {
+				return "file numbers are 1 to 100";
+			}
+			if (value == n) {
+				return "source and destination are the same file";
+			}
+			if (size[n] == 0) {
+				return "no such file";
+			}
+			op->size = (uint16_t)value;
+			size[value] = size[n];
+			if (op->op == CMD_MOVE) {
+				size[n] = 0;
+			}
+			break;
+	}
+
+	if (batch_word(&s, end, &length) != NULL) {
+		return "too many arguments";
+	}
+	return NULL;
+}
+
+int batch_parse(struct batch *b, const char *script)
+{
+	static int32_t size[MAX_FILE_NUMBER + 1];
+	struct batch_op *op;
+	const char *end, *stop, *word;
+	uint16_t count = b->count;
+	uint16_t used = b->data_used;
+	uint16_t lines = b->lines;
+	uint16_t length;
+
+	memcpy(size, b->size, sizeof(size));
+	b->error = NULL;
+
+	while (*script != '\0') {
+		// up to ';' or the end of the line, a comment cut off
+		end = script + strcspn(script, ";\n");
+		stop = script + strcspn(script, "#;\n");
+		if (stop > end) {
+			stop = end;
+		}
+
+		lines++;
+		word = script;
+		if (batch_word(&word, stop, &length) != NULL) {
+			if (count == BATCH_MAX_OPS) {
+				b->error = "more operations than the batch holds";
+				return lines;
+			}
+			op = &b->ops[count];
+			b->error = batch_line(b, script, stop, op, size, &used);
+			if (b->error != NULL) {
+				return lines;
+			}
+			op->line = lines;
+			count++;
+		}
+
+		script = (*end != '\0') ? end + 1 : end;
+	}
+
+	b->count = count;
+	b->data_used = used;
+	b->lines = lines;
+	memcpy(b->size, size, sizeof(size));
+	return 0;
+}
+
+
+// Frames an operation takes: reads and writes past one frame go as
+// PREAD and PWRITE pieces
+#define BATCH_PWRITE_MAX (FRAME_MAX_DATA - 2)	// the offset takes two bytes
+
+static uint16_t batch_pieces(const struct batch_op *op)
+{
+	if (op->op == CMD_WRITE && op->size > FRAME_MAX_DATA) {
+		return (op->size + BATCH_PWRITE_MAX - 1) / BATCH_PWRITE_MAX;
+	}
+	if (op->op == CMD_READ && op->size > FRAME_MAX_DATA) {
+		return (op->size + FRAME_MAX_DATA - 1) / FRAME_MAX_DATA;
+	}
+	return 1;
+}
+
+// The batch's operations as frames, and the operation each frame is for
+static uint16_t batch_frame_ops(struct batch *b)
+{
+	struct frame_op *fop;
+	struct batch_op *op;
+	uint16_t count = 0;
+	uint16_t k, piece, pieces, step;
+
+	for (k = 0; k < b->count; k++) {
+		op = &b->ops[k];
+		pieces = batch_pieces(op);
+		step = (op->op == CMD_WRITE) ? BATCH_PWRITE_MAX : FRAME_MAX_DATA;
+
+		for (piece = 0; piece < pieces; piece++) {
+			fop = &batch_frames[count];
+			memset(fop, 0, sizeof(*fop));
+			fop->op = op->op;
+			fop->file_number = op->file_number;
+			fop->size = op->size;
+			fop->data = &b->data[op->data];
+			fop->status = FRAME_ERR_LOST;
+
+			if (pieces > 1) {
+				fop->op = (op->op == CMD_WRITE) ? CMD_PWRITE : CMD_PREAD;
+				fop->offset = piece * step;
+				fop->size = (op->size - fop->offset < step) ? op->size - fop->offset : step;
+				fop->data += fop->offset;
+			}
+			batch_owner[count++] = k;
+		}
+	}
+	return count;
+}
+
+static uint32_t batch_us(void)
+{
+	uint32_t cycles = DWT->CYCCNT - batch_mark;
+
+	batch_base_us += cycles / CPU_CYCLES_PER_US;
+	batch_mark += cycles - cycles % CPU_CYCLES_PER_US;
+	return batch_base_us;
+}
+
+int batch_run(struct batch *b)
+{
+	struct batch_op *op;
+	uint16_t count, done, n, k;
+	uint32_t now;
+	int ok = 0;
+
+	// write-back: the slave gets what the cache holds first
+	if (cache_mode == CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+
+	for (k = 0; k < b->count; k++) {
+		b->ops[k].status = ASYNC_OK;
+		b->ops[k].length = 0;
+	}
+	count = batch_frame_ops(b);
+
+	batch_base_us = 0;
+	batch_mark = DWT->CYCCNT;
+
+	// a burst at a time, to know when each operation was answered
+	for (done = 0; done < count; done += n) {
+		n = framed_fit(&batch_frames[done], count - done);
+		if (n == 0 || framed(&batch_frames[done], n) < 0) {
+			break;
+		}
+		now = batch_us();
+
+		for (k = done; k < done + n; k++) {
+			op = &b->ops[batch_owner[k]];
+			op->done_us = now;
+			if (batch_frames[k].op == CMD_READ || batch_frames[k].op == CMD_PREAD) {
+				op->length += batch_frames[k].length;
+			}
+			if (op->status != ASYNC_OK) {
+				continue;
+			}
+			if (batch_frames[k].status == FRAME_ERR_FILE
+			    || (batch_frames[k].op == CMD_READ && batch_frames[k].length == 0)) {
+				op->status = ASYNC_ERR_FILE;
+			}
+			else if (batch_frames[k].status != FRAME_OK) {
+				op->status = ASYNC_ERR_TIMEOUT;
+			}
+		}
+	}
+	b->total_us = batch_us();
+
+	// what the slave did not take
+	for (k = (done < count) ? batch_owner[done] : b->count; k < b->count; k++) {
+		b->ops[k].status = ASYNC_ERR_NACK;
+	}
+
+	for (k = 0; k < b->count; k++) {
+		if (b->ops[k].status == ASYNC_OK) {
+			ok++;
+		}
+	}
+	return ok;
+}
+
+
+void batch_print(const struct batch *b)
+{
+	static const char * const status_names[] = {
+		"pending", "ok", "no ack", "bad file", "timeout"
+	};
+	const struct batch_op *op;
+	uint64_t bytes = 0;
+	uint16_t k, i, ok = 0;
+	uint8_t name;
+
+	printf("%5s %-7s %4s %6s %-8s %10s\n", "line", "op", "file", "size", "status", "done us");
+	for (k = 0; k < b->count; k++) {
+		op = &b->ops[k];
+		for (name = 0; batch_ops[name].op != op->op; name++)
+			;
+		printf("%5u %-7s %4u %6u %-8s %10lu\n", op->line, batch_ops[name].name,
+		       op->file_number, op->size,
+		       (op->status < 5) ? status_names[op->status] : "?",
+		       (unsigned long)op->done_us);
+
+		if (op->status != ASYNC_OK) {
+			continue;
+		}
+		ok++;
+		if (op->op == CMD_WRITE) {
+			bytes += op->size;
+		}
+		else if (op->op == CMD_READ) {
+			bytes += op->length;
+			for (i = 0; i < op->length; i++) {
+				printf("%s%02x", (i % 16 == 0) ? "      " : " ", b->data[op->data + i]);
+				if (i % 16 == 15 || i == op->length - 1) {
+					printf("\n");
+				}
+			}
+		}
+	}
+
+	printf("%u of %u ok, %lu bytes in %lu us", ok, b->count,
+	       (unsigned long)bytes, (unsigned long)b->total_us);
+	if (b->total_us > 0) {
+		printf(": %lu ops/s, %lu bytes/s",
+		       (unsigned long)((uint64_t)b->count * 1000000 / b->total_us),
+		       (unsigned long)(bytes * 1000000 / b->total_us));
+	}
+	printf("\n");
+}
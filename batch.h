@@ -0,0 +1,73 @@
+// File Name    : batch.h
+// Project      : Simple File System by SPI
+// Description  : Master-side batches of create, write, read, delete, copy
+//                and move operations, parsed and checked in full before
+//                any is sent, then run back to back
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "storage.h"
+
+#define BATCH_MAX_OPS 256
+#define BATCH_DATA_SIZE 8192	// bytes written and read by one batch
+
+// One operation. A script has one per line, or several separated by ';',
+// with '#' starting a comment:
+//   create <n> <size>
+//   write <n> <byte>...	the whole file, as WRITE
+//   read <n> <size>
+//   delete <n>
+//   copy <src> <dst>
+//   move <src> <dst>
+struct batch_op
+{
+	uint8_t op;		// CMD_CREATE, CMD_WRITE, CMD_READ, CMD_DELETE,
+				// CMD_COPY or CMD_MOVE
+	uint8_t file_number;	// COPY, MOVE: the source
+	uint16_t size;		// CREATE: file size, WRITE: bytes to write, READ:
+				// bytes to read, COPY, MOVE: the destination
+	uint16_t data;		// WRITE, READ: where its bytes are in data[]
+	uint16_t line;		// of the script, a ';' starting a new one, counted
+				// over batch_parse() calls
+	uint8_t status;		// ASYNC_OK, ASYNC_ERR_FILE if the slave refused it,
+				// ASYNC_ERR_TIMEOUT if its reply was lost,
+				// ASYNC_ERR_NACK if it was not sent
+	uint16_t length;	// READ: bytes returned
+	uint32_t done_us;	// from the start of batch_run() to its reply
+};
+
+struct batch
+{
+	uint16_t count;		// ops
+	uint16_t data_used;	// of data[]
+	uint16_t lines;
+	int32_t size[MAX_FILE_NUMBER + 1];	// each file's size after the ops so
+						// far, -1 if the master does not know
+	const char *error;	// why batch_parse() refused a line
+	uint32_t total_us;	// batch_run() from start to end
+	struct batch_op ops[BATCH_MAX_OPS];
+	uint8_t data[BATCH_DATA_SIZE];
+};
+
+// Start an empty batch, with the file sizes the master cache knows
+void batch_init(struct batch *b);
+
+// Add the operations in script to the batch. Every line is checked first,
+// against the sizes the batch's earlier operations leave; if one is bad,
+// none is added and the number of that line comes back, with b->error
+// saying why. Returns 0 once they are all added.
+int batch_parse(struct batch *b, const char *script);
+
+// Send the batch as framed bursts, one SYNC each, reads and writes past
+// FRAME_MAX_DATA as PREAD and PWRITE pieces. The master cache learns what
+// they write and read. Returns how many came back ASYNC_OK; those after
+// a burst the slave did not accept are ASYNC_ERR_NACK.
+int batch_run(struct batch *b);
+
+// One line per operation, with its status and when it completed, then
+// the totals and throughput
+void batch_print(const struct batch *b);
+
+#endif
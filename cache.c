@@ -0,0 +1,277 @@
+// File Name    : cache.c
+// Project      : Simple File System by SPI
+// Description  : Master-side cache. The size of every file seen by LIST,
+//                CREATE, READ or WRITE is kept, and the contents of the
+//                CACHE_ENTRIES most recently used files, so that polling the
+//                same files does not go over the link again. The master is
+//                the only writer, so what went over the wire last is taken
+//                as the truth.
+
+#include "cache.h"
+#include "filesys.h"
+#include <string.h>
+
+struct cache_entry
+{
+	uint8_t file_number;	// 0 = empty
+	uint8_t dirty;
+	uint16_t size;
+	uint32_t used;		// for least recently used replacement
+	uint8_t data[CACHE_DATA_SIZE];
+};
+
+volatile enum cache_mode cache_mode = CACHE_WRITE_THROUGH;
+
+static struct cache_entry entries[CACHE_ENTRIES];
+static uint16_t sizes[MAX_FILE_NUMBER + 1];
+static uint8_t size_known[MAX_FILE_NUMBER + 1];
+static uint32_t use_clock = 0;
+static struct cache_stats stats;
+static uint8_t flush_buf[CACHE_DATA_SIZE];	// a dirty file on its way out
+
+
+static struct cache_entry * find(uint8_t file_number)
+{
+	uint8_t i;
+
+	for (i = 0; i < CACHE_ENTRIES; i++) {
+		if (entries[i].file_number == file_number) {
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+// Write a dirty entry back. write_file() fills the cache with what it
+// wrote, so the entry is let go first and written from a copy; if the
+// write fails, nothing was filled and the entry is put back as it was.
+static int flush(struct cache_entry *e)
+{
+	uint8_t file_number = e->file_number;
+	uint16_t size = e->size;
+
+	memcpy(flush_buf, e->data, size);
+	e->file_number = 0;
+	e->dirty = 0;
+
+	if (write_file(file_number, flush_buf, size) != 0) {
+		e->file_number = file_number;	// nothing filled it meanwhile
+		e->dirty = 1;
+		return -1;
+	}
+	stats.flushes++;
+	return 0;
+}
+
+// An entry for file_number: its own, an empty one, or the least recently
+// used one, written back first if it is dirty
+static struct cache_entry * take(uint8_t file_number)
+{
+	struct cache_entry *e = find(file_number);
+	uint8_t i;
+
+	if (e == NULL) {
+		e = &entries[0];
+		for (i = 0; i < CACHE_ENTRIES; i++) {
+			if (entries[i].file_number == 0) {
+				e = &entries[i];
+				break;
+			}
+			if (entries[i].used < e->used) {
+				e = &entries[i];
+			}
+		}
+
+		// written back, then taken whether or not write_file()
+		// filled it again
+		if (e->file_number != 0 && e->dirty) {
+			flush(e);
+		}
+		e->file_number = file_number;
+		e->dirty = 0;
+	}
+
+	e->used = ++use_clock;
+	return e;
+}
+
+// Let a file's entry go, written back first if it is dirty; one whose
+// write-back failed stays
+static void drop(uint8_t file_number)
+{
+	struct cache_entry *e = find(file_number);
+
+	if (e && e->dirty && flush(e) != 0) {
+		return;
+	}
+
+	e = find(file_number);
+	if (e) {
+		e->file_number = 0;
+		e->dirty = 0;
+	}
+}
+
+
+void cache_set_mode(enum cache_mode mode)
+{
+	if (cache_mode == CACHE_WRITE_BACK && mode != CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+
+	if (mode == CACHE_OFF) {
+		memset(entries, 0, sizeof(entries));
+		memset(size_known, 0, sizeof(size_known));
+	}
+
+	cache_mode = mode;
+}
+
+
+void cache_set_size(uint8_t file_number, uint16_t size)
+{
+	if (cache_mode == CACHE_OFF || file_number > MAX_FILE_NUMBER) {
+		return;
+	}
+
+	if (!size_known[file_number] || sizes[file_number] != size) {
+		drop(file_number);
+	}
+	sizes[file_number] = size;
+	size_known[file_number] = 1;
+}
+
+void cache_fill(uint8_t file_number, const uint8_t *data, uint16_t size)
+{
+	struct cache_entry *e;
+
+	if (cache_mode == CACHE_OFF || file_number > MAX_FILE_NUMBER) {
+		return;
+	}
+
+	// what the slave has is older than what is waiting to go to it
+	e = find(file_number);
+	if (e && e->dirty) {
+		return;
+	}
+
+	sizes[file_number] = size;
+	size_known[file_number] = 1;
+
+	if (size == 0 || size > CACHE_DATA_SIZE) {
+		drop(file_number);
+		return;
+	}
+
+	e = take(file_number);
+	memcpy(e->data, data, size);
+	e->size = size;
+	e->dirty = 0;
+}
+
+void cache_patch(uint8_t file_number, uint16_t offset, const uint8_t *data, uint16_t length)
+{
+	struct cache_entry *e = find(file_number);
+
+	if (e == NULL) {
+		return;
+	}
+
+	if ((uint32_t)offset + length > e->size) {
+		drop(file_number);
+		return;
+	}
+	memcpy(e->data + offset, data, length);
+}
+
+void cache_flush(uint8_t file_number)
+{
+	struct cache_entry *e = find(file_number);
+
+	if (e && file_number != 0 && e->dirty) {
+		flush(e);
+	}
+}
+
+void cache_forget(uint8_t file_number)
+{
+	if (file_number > MAX_FILE_NUMBER) {
+		return;
+	}
+
+	drop(file_number);
+	size_known[file_number] = 0;
+}
+
+
+int32_t cache_size(uint8_t file_number)
+{
+	if (cache_mode == CACHE_OFF || file_number > MAX_FILE_NUMBER
+	    || !size_known[file_number]) {
+		return -1;
+	}
+	return sizes[file_number];
+}
+
+const uint8_t * cache_data(uint8_t file_number, uint16_t *size)
+{
+	struct cache_entry *e;
+
+	if (cache_mode == CACHE_OFF) {
+		return NULL;
+	}
+
+	e = find(file_number);
+	if (e == NULL || file_number == 0) {
+		stats.misses++;
+		return NULL;
+	}
+
+	stats.hits++;
+	e->used = ++use_clock;
+	*size = e->size;
+	return e->data;
+}
+
+
+int cache_write(uint8_t file_number, const uint8_t *data, uint16_t size)
+{
+	struct cache_entry *e;
+
+	if (size == 0 || size > CACHE_DATA_SIZE || file_number == 0
+	    || file_number > MAX_FILE_NUMBER) {
+		return -1;
+	}
+
+	e = find(file_number);
+	if (e && e->dirty) {
+		stats.coalesced++;
+	}
+
+	e = take(file_number);
+	memcpy(e->data, data, size);
+	e->size = size;
+	e->dirty = 1;
+
+	// its size is what goes to the slave, so LIST seeing it is no change
+	sizes[file_number] = size;
+	size_known[file_number] = 1;
+	return 0;
+}
+
+void cache_sync(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < CACHE_ENTRIES; i++) {
+		if (entries[i].file_number != 0 && entries[i].dirty) {
+			flush(&entries[i]);
+		}
+	}
+}
+
+
+void cache_get_stats(struct cache_stats *s)
+{
+	*s = stats;
+}
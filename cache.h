@@ -0,0 +1,61 @@
+// File Name    : cache.h
+// Project      : Simple File System by SPI
+// Description  : Master-side cache of file sizes and contents
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#define CACHE_ENTRIES 8		// files whose contents are kept
+#define CACHE_DATA_SIZE 255	// larger files only have their size kept
+
+// OFF: every call goes over the wire. WRITE_THROUGH: reads of cached
+// files are served locally, writes go out at once. WRITE_BACK: writes
+// stay in the cache, coalesced per file, until cache_sync().
+enum cache_mode {CACHE_OFF, CACHE_WRITE_THROUGH, CACHE_WRITE_BACK};
+
+struct cache_stats
+{
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t flushes;	// dirty files written back
+	uint32_t coalesced;	// writes merged into one not yet written back
+};
+
+extern volatile enum cache_mode cache_mode;
+
+void cache_set_mode(enum cache_mode mode);
+
+// What the master learned from the wire: a size (LIST, CREATE; 0 after
+// DELETE), the whole contents (READ, WRITE) or some bytes of them.
+// cache_forget() drops everything known about a file. Contents that are
+// dirty are written back before they are let go, and are not replaced by
+// what a READ brought in; the calls that change a file on the slave or
+// read it write it back first with cache_flush().
+void cache_set_size(uint8_t file_number, uint16_t size);
+void cache_fill(uint8_t file_number, const uint8_t *data, uint16_t size);
+void cache_patch(uint8_t file_number, uint16_t offset, const uint8_t *data, uint16_t length);
+void cache_forget(uint8_t file_number);
+
+// Size last seen, or -1 if not known
+int32_t cache_size(uint8_t file_number);
+
+// Cached contents, or NULL on a miss
+const uint8_t * cache_data(uint8_t file_number, uint16_t *size);
+
+// Write-back: replace a file's contents in the cache only. Returns -1 if
+// the file is too large to cache, the caller then writes it directly.
+int cache_write(uint8_t file_number, const uint8_t *data, uint16_t size);
+
+// Write one file, or every dirty file, to the slave. In write-back mode
+// the slave's copy of a dirty file is stale, so a call that reads the
+// file on the slave, or changes it there, flushes it first; otherwise the
+// slave's copy would be read back over the unsynced bytes, or the cache
+// would let them go unwritten.
+void cache_flush(uint8_t file_number);
+void cache_sync(void);
+
+void cache_get_stats(struct cache_stats *s);
+
+#endif
@@ -0,0 +1,168 @@
+// File Name    : dir.c
+// Project      : Simple File System by SPI
+// Description  : Slave-side directory. Names hash (FNV-1a) into DIR_SLOTS
+//                slots with linear probing, and each file number remembers
+//                the slot holding its name, so a lookup, an insert and a
+//                removal cost a few probes whatever the number of files.
+//                Removal shifts the rest of the probe run back instead of
+//                leaving tombstones, so runs do not grow as files come and
+//                go. A file that is deleted or shrunk to nothing loses its
+//                name (storage_resize() calls dir_remove()).
+
+#include "dir.h"
+#include "storage.h"
+#include <string.h>
+
+#define DIR_SLOT_NONE 0xffffu
+
+struct dir_entry
+{
+	uint8_t file_number;	// 0 = empty slot
+	uint8_t length;
+	uint8_t name[DIR_NAME_SIZE];
+};
+
+static struct dir_entry slots[DIR_SLOTS];
+static uint16_t name_slot[MAX_FILE_NUMBER + 1];	// DIR_SLOT_NONE if unnamed
+
+
+void dir_init(void)
+{
+	uint16_t i;
+
+	memset(slots, 0, sizeof(slots));
+	for (i = 0; i <= MAX_FILE_NUMBER; i++) {
+		name_slot[i] = DIR_SLOT_NONE;
+	}
+}
+
+static uint16_t dir_hash(const uint8_t *name, uint8_t length)
+{
+	uint32_t h = 2166136261u;
+	uint8_t i;
+
+	for (i = 0; i < length; i++) {
+		h ^= name[i];
+		h *= 16777619u;
+	}
+	return (uint16_t)(h & (DIR_SLOTS - 1));
+}
+
+// Slot holding the name, or the empty slot that ends its probe run
+static uint16_t dir_find(const uint8_t *name, uint8_t length)
+{
+	uint16_t i = dir_hash(name, length);
+
+	while (slots[i].file_number != 0
+	       && (slots[i].length != length || memcmp(slots[i].name, name, length) != 0)) {
+		i = (i + 1) & (DIR_SLOTS - 1);
+	}
+	return i;
+}
+
+uint8_t dir_lookup(const uint8_t *name, uint8_t length)
+{
+	if (length == 0 || length > DIR_NAME_SIZE) {
+		return 0;
+	}
+	return slots[dir_find(name, length)].file_number;
+}
+
+int dir_insert(const uint8_t *name, uint8_t length, uint8_t file_number)
+{
+	uint16_t i;
+
+	if (length == 0 || length > DIR_NAME_SIZE
+	    || file_number == 0 || file_number > MAX_FILE_NUMBER) {
+		return -1;
+	}
+
+	i = dir_find(name, length);
+	if (slots[i].file_number == file_number) {
+		return 0;
+	}
+	if (slots[i].file_number != 0) {
+		return -1;
+	}
+
+	// at most MAX_FILE_NUMBER names in DIR_SLOTS slots, so an empty
+	// slot is always there
+	dir_remove(file_number);
+	i = dir_find(name, length);
+
+	slots[i].file_number = file_number;
+	slots[i].length = length;
+	memcpy(slots[i].name, name, length);
+	name_slot[file_number] = i;
+
+	storage_mark_dirty(file_number);	// the name is logged with the file
+	return 0;
+}
+
+uint8_t dir_create(const uint8_t *name, uint8_t length, uint16_t size)
+{
+	uint8_t n = dir_lookup(name, length);
+
+	if (size == 0 || length == 0 || length > DIR_NAME_SIZE) {
+		return 0;
+	}
+
+	if (n == 0) {
+		n = storage_first_free();
+		if (n == 0 || storage_resize(n, size) != 0) {
+			return 0;
+		}
+		dir_insert(name, length, n);
+		return n;
+	}
+
+	return (storage_resize(n, size) == 0) ? n : 0;
+}
+
+void dir_remove(uint8_t file_number)
+{
+	uint16_t i, j, home;
+
+	if (file_number == 0 || file_number > MAX_FILE_NUMBER
+	    || name_slot[file_number] == DIR_SLOT_NONE) {
+		return;
+	}
+
+	i = name_slot[file_number];
+	name_slot[file_number] = DIR_SLOT_NONE;
+	slots[i].file_number = 0;
+
+	// move back every later entry of the run that a probe from its home
+	// slot would no longer reach across the hole at i
+	j = i;
+	for (;;) {
+		j = (j + 1) & (DIR_SLOTS - 1);
+		if (slots[j].file_number == 0) {
+			break;
+		}
+
+		home = dir_hash(slots[j].name, slots[j].length);
+		if (((j - home) & (DIR_SLOTS - 1)) >= ((j - i) & (DIR_SLOTS - 1))) {
+			slots[i] = slots[j];
+			name_slot[slots[i].file_number] = i;
+			slots[j].file_number = 0;
+			i = j;
+		}
+	}
+
+	storage_mark_dirty(file_number);
+}
+
+uint8_t dir_name(uint8_t file_number, uint8_t *name)
+{
+	uint16_t i;
+
+	if (file_number == 0 || file_number > MAX_FILE_NUMBER
+	    || name_slot[file_number] == DIR_SLOT_NONE) {
+		return 0;
+	}
+
+	i = name_slot[file_number];
+	memcpy(name, slots[i].name, slots[i].length);
+	return slots[i].length;
+}
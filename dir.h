@@ -0,0 +1,36 @@
+// File Name    : dir.h
+// Project      : Simple File System by SPI
+// Description  : Slave-side directory of file names, an open-addressing
+//                hash table from short names to file numbers
+
+#ifndef DIR_H
+#define DIR_H
+
+#include <stdint.h>
+
+#define DIR_NAME_SIZE 12	// bytes in a name, at least 1
+#define DIR_SLOTS 256		// power of two, kept at least twice MAX_FILE_NUMBER
+				// so probe runs stay short
+
+void dir_init(void);
+
+// File number of a name, 0 if there is none
+uint8_t dir_lookup(const uint8_t *name, uint8_t length);
+
+// Give file_number a name, replacing any name it had. Returns -1 if the
+// name is empty or too long, or belongs to another file.
+int dir_insert(const uint8_t *name, uint8_t length, uint8_t file_number);
+
+// Create a file of size bytes under a name, in the lowest unused file
+// number, or resize the file that has the name. Returns the file number,
+// 0 if the size is 0, the name is not valid or there is no room.
+uint8_t dir_create(const uint8_t *name, uint8_t length, uint16_t size);
+
+// Drop the name of a file, if it has one
+void dir_remove(uint8_t file_number);
+
+// Copy the name of a file into name (DIR_NAME_SIZE bytes of room) and
+// return its length, 0 if the file has no name
+uint8_t dir_name(uint8_t file_number, uint8_t *name);
+
+#endif
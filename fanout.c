@@ -0,0 +1,265 @@
+// File Name    : fanout.c
+// Project      : Simple File System by SPI
+// Description  : Files spread over the slaves on the SPI1 bus. A file's
+//                home slave comes from a hash of its number, and files
+//                larger than one stripe are cut into FAN_STRIPE_SIZE
+//                stripes dealt out round robin from there. Each slave keeps
+//                its stripes, in order, as an ordinary file of the same
+//                number, so its own LIST, READ and WRITE still work on it.
+//                Reads and writes queue one asynchronous request per slave
+//                back to back, and the engine sends each board's bytes in
+//                the pauses the others' handshakes leave, while each board
+//                logs its part to flash on its own.
+
+#include "fanout.h"
+#include "filesys.h"
+#include "cache.h"
+#include <stdio.h>
+#include <string.h>
+
+// The parts of one file, one slave's after the other's
+static uint8_t fan_buf[FAN_MAX_SIZE];
+
+
+uint8_t fan_slave(uint8_t file_number)
+{
+	// Fibonacci hashing, so consecutive numbers land on different slaves
+	return (uint8_t)(((file_number * 0x9e3779b1u) >> 24) % spi_slaves);
+}
+
+uint16_t fan_part(uint8_t file_number, uint16_t size, uint8_t slave)
+{
+	uint16_t stripes = (size + FAN_STRIPE_SIZE - 1) / FAN_STRIPE_SIZE;
+	uint16_t part = 0;
+	uint16_t k;
+
+	for (k = (slave + spi_slaves - fan_slave(file_number)) % spi_slaves;
+	     k < stripes; k += spi_slaves) {
+		part += (k == stripes - 1) ? size - k * FAN_STRIPE_SIZE : FAN_STRIPE_SIZE;
+	}
+	return part;
+}
+
+// Where each slave's part starts in fan_buf
+static void fan_layout(uint8_t file_number, uint16_t size, uint16_t *part, uint16_t *base)
+{
+	uint16_t offset = 0;
+	uint8_t s;
+
+	for (s = 0; s < spi_slaves; s++) {
+		part[s] = fan_part(file_number, size, s);
+		base[s] = offset;
+		offset += part[s];
+	}
+}
+
+// Stripes of data to their places in fan_buf, or back with to_buf 0
+static void fan_copy(uint8_t file_number, uint8_t *data, uint16_t size,
+		     const uint16_t *base, int to_buf)
+{
+	uint16_t pos[SPI_MAX_SLAVES];
+	uint16_t offset, length;
+	uint8_t s = fan_slave(file_number);
+
+	memcpy(pos, base, sizeof(pos));
+	for (offset = 0; offset < size; offset += length) {
+		length = (size - offset < FAN_STRIPE_SIZE) ? size - offset : FAN_STRIPE_SIZE;
+		if (to_buf) {
+			memcpy(fan_buf + pos[s], data + offset, length);
+		}
+		else {
+			memcpy(data + offset, fan_buf + pos[s], length);
+		}
+		pos[s] += length;
+		s = (s + 1) % spi_slaves;
+	}
+}
+
+// A full queue only frees a place as it runs, whatever handle is polled
+static int32_t fan_submit(struct async_req *req)
+{
+	int32_t handle;
+
+	while ((handle = async_submit(req)) < 0) {
+		async_poll(0);
+	}
+	return handle;
+}
+
+// Queue a READ or WRITE for every slave with a part, then wait for all
+static int fan_run(uint8_t op, uint8_t file_number, const uint16_t *part, const uint16_t *base)
+{
+	struct async_req req[SPI_MAX_SLAVES];
+	int32_t handle[SPI_MAX_SLAVES];
+	int rc = 0;
+	uint8_t s;
+
+	cache_flush(file_number);
+
+	for (s = 0; s < spi_slaves; s++) {
+		handle[s] = -1;
+		if (part[s] == 0) {
+			continue;
+		}
+
+		memset(&req[s], 0, sizeof(req[s]));
+		req[s].op = op;
+		req[s].slave = s;
+		req[s].file_number = file_number;
+		req[s].size = part[s];
+		req[s].data = fan_buf + base[s];
+
+		handle[s] = fan_submit(&req[s]);
+	}
+
+	for (s = 0; s < spi_slaves; s++) {
+		if (handle[s] >= 0 && async_wait(handle[s]) != ASYNC_OK) {
+			rc = -1;
+		}
+	}
+
+	cache_forget(file_number);
+	return rc;
+}
+
+
+// A framed CREATE, for the 16-bit size, on each slave with a part, and a
+// DELETE of any old part on the others
+int fan_create(uint8_t file_number, uint16_t size)
+{
+	struct frame_op op;
+	uint8_t selected = spi_slave;
+	int rc = 0;
+	uint8_t s;
+
+	cache_flush(file_number);
+
+	for (s = 0; s < spi_slaves; s++) {
+		memset(&op, 0, sizeof(op));
+		op.file_number = file_number;
+		op.size = fan_part(file_number, size, s);
+		op.op = (op.size > 0) ? CMD_CREATE : CMD_DELETE;
+
+		spi_slave = s;
+		if (framed(&op, 1) != 1 && op.op == CMD_CREATE) {
+			rc = -1;
+		}
+	}
+
+	spi_slave = selected;
+	cache_forget(file_number);
+	return rc;
+}
+
+int fan_write(uint8_t file_number, const uint8_t *data, uint16_t size)
+{
+	uint16_t part[SPI_MAX_SLAVES], base[SPI_MAX_SLAVES];
+
+	if (size > FAN_MAX_SIZE) {
+		return -1;
+	}
+
+	fan_layout(file_number, size, part, base);
+	fan_copy(file_number, (uint8_t *)data, size, base, 1);	// only read
+	return fan_run(CMD_WRITE, file_number, part, base);
+}
+
+int fan_read(uint8_t file_number, uint8_t *data, uint16_t size)
+{
+	uint16_t part[SPI_MAX_SLAVES], base[SPI_MAX_SLAVES];
+
+	if (size > FAN_MAX_SIZE) {
+		return -1;
+	}
+
+	fan_layout(file_number, size, part, base);
+	if (fan_run(CMD_READ, file_number, part, base) != 0) {
+		return -1;
+	}
+	fan_copy(file_number, data, size, base, 0);
+	return 0;
+}
+
+// DELETE on every slave; one that never had a part of the file does not
+// ACK the file number, which is not an error here
+int fan_delete(uint8_t file_number)
+{
+	struct async_req req[SPI_MAX_SLAVES];
+	int32_t handle[SPI_MAX_SLAVES];
+	uint8_t status;
+	int rc = -1;
+	int failed = 0;
+	uint8_t s;
+
+	cache_flush(file_number);
+
+	for (s = 0; s < spi_slaves; s++) {
+		memset(&req[s], 0, sizeof(req[s]));
+		req[s].op = CMD_DELETE;
+		req[s].slave = s;
+		req[s].file_number = file_number;
+
+		handle[s] = fan_submit(&req[s]);
+	}
+
+	for (s = 0; s < spi_slaves; s++) {
+		status = async_wait(handle[s]);
+		if (status == ASYNC_OK) {
+			rc = 0;
+		}
+		else if (status != ASYNC_ERR_FILE) {
+			failed = 1;
+		}
+	}
+
+	cache_forget(file_number);
+	return failed ? -1 : rc;
+}
+
+void fan_list(void)
+{
+	static struct name_entry entries[MAX_FILE_NUMBER];
+	static uint32_t sizes[MAX_FILE_NUMBER + 1];
+	static char names[MAX_FILE_NUMBER + 1][DIR_NAME_SIZE + 1];
+	uint8_t held[MAX_FILE_NUMBER + 1] = {0};
+	uint8_t selected = spi_slave;
+	int count, i;
+	uint8_t s, n;
+
+	for (s = 0; s < spi_slaves; s++) {
+		spi_slave = s;
+		count = name_list_get(entries, MAX_FILE_NUMBER);
+		if (count < 0) {
+			printf("slave %d did not list \n", s);
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			n = entries[i].file_number;
+			if (!held[n]) {
+				sizes[n] = 0;
+				names[n][0] = '\0';
+			}
+			held[n] |= 1u << s;
+			sizes[n] += entries[i].size;
+			if (entries[i].name[0] != '\0') {
+				strcpy(names[n], entries[i].name);
+			}
+		}
+	}
+	spi_slave = selected;
+
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		if (!held[n]) {
+			continue;
+		}
+		printf("%d  %lu  ", n, (unsigned long)sizes[n]);
+		for (s = 0; s < spi_slaves; s++) {
+			if (held[n] & (1u << s)) {
+				printf("%d", s);
+			}
+		}
+		printf("  %s\n", names[n]);
+	}
+	printf("\n");
+}
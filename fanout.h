@@ -0,0 +1,33 @@
+// File Name    : fanout.h
+// Project      : Simple File System by SPI
+// Description  : Master-side spreading of files over several slaves on
+//                the SPI1 bus, each selected by its own chip select
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+
+#define FAN_STRIPE_SIZE 64	// bytes of a file on one slave before the next
+#define FAN_MAX_SIZE 4096	// largest file fan_write() and fan_read() move
+
+// Slave that holds the start of a file; stripe k of the file is on slave
+// (fan_slave(n) + k) % spi_slaves, so a file of one stripe lives on one
+// slave and larger ones on all of them
+uint8_t fan_slave(uint8_t file_number);
+
+// Bytes of a file of size bytes that a slave holds
+uint16_t fan_part(uint8_t file_number, uint16_t size, uint8_t slave);
+
+// Each returns 0 once every slave involved ACKed, -1 otherwise.
+// fan_create() and fan_write() take the whole file, as CREATE and WRITE.
+int fan_create(uint8_t file_number, uint16_t size);
+int fan_write(uint8_t file_number, const uint8_t *data, uint16_t size);
+int fan_read(uint8_t file_number, uint8_t *data, uint16_t size);
+int fan_delete(uint8_t file_number);
+
+// NLIST every slave and print one line per file: number, total size and
+// the slaves holding part of it
+void fan_list(void);
+
+#endif
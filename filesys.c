@@ -6,7 +6,17 @@
 //                and the other as slave
 
 #include "common.h"
+#include "filesys.h"
+#include "dir.h"
+#include "persist.h"
+#include "cache.h"
+#include "fanout.h"
+#include "batch.h"
+#include "rle.h"
+#include "stats.h"
+#include "trace.h"
 #include <stdio.h>
+#include <string.h>
 
 //SPI1 - Master
 //PB3 SCK
@@ -17,10 +27,16 @@
 //PB10 SCK
 //PB14 MISO
 //PB15 MOSI
-
-
-#define MAX_FILE_NUMBER 100	// file_number: 1 to 100
-#define MAX_FILE_SIZE 100	// max 100 byte in each file
+//PB12 NSS, with SPI2_HW_NSS
+//
+//Slave chip selects, driven by the master
+//PC0 to PC3, slave 0 to 3
+//
+//Payload DMA
+//SPI1_RX DMA2 Stream0 Channel3
+//SPI1_TX DMA2 Stream3 Channel3
+//SPI2_RX DMA1 Stream3 Channel0
+//SPI2_TX DMA1 Stream4 Channel0
 
 
 volatile uint8_t rxData1 = 0;
@@ -28,25 +44,233 @@ volatile uint8_t rxData2 = 0;
 volatile uint8_t rxData1_f = 0;
 volatile uint8_t rxData2_f = 0;
 
-enum state {SYNC, CMD, LIST, CREATE, WRITE, READ, DELETE};
+enum state {SYNC, CMD, LIST, CREATE, WRITE, READ, DELETE, FRAME, CREATE_FREE, PREAD, PWRITE, BAUD,
+	    OPEN, NCREATE, NLIST, ZWRITE, ZREAD, CWRITE, CREAD, BLIST, WREAD, WWRITE,
+	    SOPEN, APPEND, SNAPSHOT, RESTORE, COPY, MOVE};
 
 volatile enum state current_state = SYNC;
 
-struct file_record 
-{
-	uint8_t size;
-	uint8_t data[MAX_FILE_SIZE];
-};
-
-volatile struct file_record file[MAX_FILE_NUMBER + 1] = {0};
 volatile uint8_t file_number = 0;
 volatile uint8_t flag_filename = 0;
 volatile uint8_t flag_rx_count = 0;
 volatile uint8_t create_file_number = 0;
 volatile uint8_t write_file_number = 0;
-volatile uint8_t write_count = 0;
+volatile uint16_t write_count = 0;
 volatile uint8_t read_file_number = 0;
-volatile uint8_t read_count = 0;
+volatile uint16_t read_count = 0;
+volatile uint8_t range_file_number = 0;
+volatile uint16_t range_offset = 0;
+volatile uint16_t range_length = 0;
+volatile uint16_t range_count = 0;
+volatile uint8_t put_failed = 0;	// a byte of the WRITE, PWRITE, APPEND or WWRITE
+					// running was not stored (see storage_put())
+volatile uint8_t baud_count = 0;
+volatile uint8_t baud_errors = 0;
+volatile uint8_t name_length = 0;
+volatile uint8_t name_count = 0;
+volatile uint16_t name_size = 0;
+uint8_t name_buf[DIR_NAME_SIZE];
+volatile uint8_t zfile_number = 0;
+volatile uint16_t zlength = 0;		// encoded bytes of a ZWRITE or ZREAD
+volatile uint16_t zcount = 0;		// of them received or staged
+volatile uint16_t zpos = 0;		// ZWRITE: file bytes decoded
+volatile uint8_t zerror = 0;
+static struct rle_decoder zdecoder;
+static uint8_t zplain[ZREAD_MAX_SIZE];	// ZREAD: the file, then encoded
+static uint8_t zpacked[ZREAD_MAX_SIZE];
+volatile uint8_t cfile_number = 0;
+volatile uint16_t clength = 0;		// bytes of a CWRITE or CREAD
+volatile uint16_t cchunk = 0;		// chunk being received or sent
+volatile uint16_t ccount = 0;		// of its bytes received, or staged
+volatile uint16_t cprobes = 0;		// CREAD: master bytes that clocked it
+volatile uint8_t cbad = 0;		// CWRITE: bad copies of the chunk in a row
+static uint8_t cbuf[CRC_CHUNK_SIZE + 4];	// a chunk and its CRC
+volatile uint16_t blist_length = 0;	// bytes in the BLIST image
+volatile uint16_t blist_count = 0;	// of them staged
+static uint8_t blist_image[LIST_IMAGE_SIZE];
+volatile uint8_t wfile_number = 0;
+volatile uint16_t wlength = 0;		// bytes of a WREAD or WWRITE
+volatile uint16_t wcount = 0;		// of them staged, or received
+volatile uint16_t wprobes = 0;		// WREAD: master bytes that clocked them
+volatile uint8_t afile_number = 0;	// file open for APPEND, 0 if none
+volatile uint16_t abase = 0;		// where the APPEND running goes in it
+volatile uint16_t alength = 0;		// its bytes
+volatile uint16_t acount = 0;		// of them received
+static uint8_t snap_head[SNAP_HEAD_SIZE];	// SNAPSHOT/RESTORE image up to the contents
+static uint16_t snap_head_length = 0;
+static uint16_t snap_entry = 0;		// RESTORE: where the entry being received starts
+static uint8_t snap_files = 0;
+static uint8_t snap_number[MAX_FILE_NUMBER];	// the files in the image, in order
+static uint16_t snap_size[MAX_FILE_NUMBER];
+volatile uint32_t snap_length = 0;	// bytes in the image
+volatile uint32_t snap_pos = 0;		// of them staged or received
+volatile uint8_t snap_k = 0;		// file whose contents are going
+volatile uint16_t snap_offset = 0;	// byte of it
+volatile uint32_t snap_crc = 0;
+volatile uint8_t snap_bad = 0;		// RESTORE: the image did not fit or check out
+volatile uint8_t snap_applied = 0;	// RESTORE: its table replaced the slave's
+volatile uint8_t copy_source = 0;	// COPY/MOVE: the file copied or moved
+
+// Master clock divisor, kept across spiinit until the next negotiation
+volatile uint8_t spi_link_br = SPI_BR_SLOWEST;
+
+// Slaves on the bus, and the one the blocking calls and the monitor
+// commands talk to
+volatile uint8_t spi_slaves = 1;
+volatile uint8_t spi_slave = 0;
+static volatile uint8_t spi_cs = 0xff;	// chip select driven low, 0xff none yet
+#define SPI_CS_PINS ((1u << SPI_MAX_SLAVES) - 1)
+
+// Test pattern of CMD_BAUD: alternating bits, all zeros and ones and a
+// walking bit, so a bit sampled off its edge shows in any position
+static const uint8_t baud_pattern[BAUD_PATTERN_SIZE] = {
+	0x55, 0xaa, 0x00, 0xff, 0x01, 0x02, 0x04, 0x08,
+	0x10, 0x20, 0x40, 0x80, 0xfe, 0x7f, 0x33, 0xcc
+};
+
+volatile enum handshake handshake_mode = HANDSHAKE_DELAY;
+volatile uint32_t spi_rx_timeouts = 0;
+
+#define DMA_CHANNEL0	0
+#define DMA_CHANNEL3	(DMA_SxCR_CHSEL_0 | DMA_SxCR_CHSEL_1)
+// every event flag of a stream, as laid out in LIFCR/HIFCR
+#define DMA_FLAGS_S0	(0x3du << 0)
+#define DMA_FLAGS_S3	(0x3du << 22)
+#define DMA_FLAGS_S4	(0x3du << 0)
+
+volatile uint8_t payload_dma = 0;
+volatile uint8_t payload_compress = 0;
+volatile uint8_t payload_crc = 0;	// read_file() and write_file() use CREAD/CWRITE
+volatile uint8_t payload_wide = 0;	// and WREAD/WWRITE, 16-bit data frames
+uint32_t crc_chunks = 0;		// chunks sent and received with it on
+uint32_t crc_resends = 0;		// of them that went again after a bad CRC
+uint32_t compress_plain_bytes = 0;	// payload bytes read and written with it on
+uint32_t compress_wire_bytes = 0;	// the bytes that crossed the link for them
+volatile uint8_t spi1_dma_done = 0;
+uint8_t spi1_dma_rx[SPI_DMA_BUF_SIZE];
+// 16 bits, for 16-bit frames; 8-bit transfers take the low byte
+static const uint16_t spi_dma_fill = 0xffff;
+static volatile uint16_t spi1_dma_sink;
+static uint16_t spi2_dma_sink;
+// the file a slave receive DMA is writing into, 0 for none; it is marked
+// dirty when the transfer completes, so a persist_poll() during it does
+// not log it half written and take the mark
+static volatile uint8_t spi2_dma_file;
+
+// Asynchronous requests: async_tail is the handle of the oldest one not
+// complete, async_head that of the next one submitted. Each slave has at
+// most one in flight, in the order they were submitted. async_wire is the
+// one whose state is in the variables below; the others wait out their
+// pause with theirs in async_parked[]. ASYNC_TURN is the slave's
+// turnaround before the next byte with the event handshake, ASYNC_PAUSE
+// the 50 ms of the delay handshake; in either, nothing is on the wire.
+enum async_phase {ASYNC_IDLE, ASYNC_BYTE, ASYNC_TURN, ASYNC_PAUSE, ASYNC_DMA};
+enum async_state {ASYNC_WAITING, ASYNC_RUNNING, ASYNC_DONE};
+
+static struct async_req * volatile async_queue[ASYNC_QUEUE_SIZE];
+static volatile uint8_t async_state[ASYNC_QUEUE_SIZE];
+static volatile uint32_t async_head = 0;
+static volatile uint32_t async_tail = 0;
+static volatile uint32_t async_wire;
+static volatile enum async_phase async_phase = ASYNC_IDLE;
+static volatile uint16_t async_sent;	// frames of the request sent so far
+static volatile uint16_t async_tx;	// next frame, for the TXE interrupt
+static volatile uint8_t async_ack;	// a mid-command ACK was there
+static volatile uint32_t async_stamp;	// DWT->CYCCNT or HAL_GetTick() of the last step
+static volatile uint8_t async_settle;	// a WREAD or WWRITE went back to 8-bit frames
+static volatile uint16_t async_dma_pos;	// payload bytes moved by DMA so far
+static volatile uint16_t async_dma_chunk;	// bytes in the DMA transfer running
+static volatile uint16_t async_dma_total;	// payload bytes to move
+static volatile uint16_t async_zlength;	// ZREAD: encoded length the slave sent
+static volatile uint16_t async_reported;	// READ: data handed to received() so far
+static volatile uint16_t async_chunk;	// CWRITE, CREAD: chunk on the wire
+static volatile uint16_t async_cpos;	// its bytes sent, or probes sent for it
+static volatile uint8_t async_retries;	// bad copies of it so far
+static volatile uint32_t async_crc;	// CWRITE: its CRC, CREAD: the CRC received
+
+// A request in flight on another slave, between two of its bytes
+struct async_ctx
+{
+	uint32_t handle;
+	enum async_phase phase;		// ASYNC_IDLE for none
+	uint8_t wide;			// in 16-bit frames
+	uint16_t sent, tx;
+	uint8_t ack;
+	uint32_t stamp;
+	uint16_t dma_pos, dma_total;
+	uint16_t zlength, reported, chunk, cpos;
+	uint8_t retries;
+	uint32_t crc;
+};
+static struct async_ctx async_parked[SPI_MAX_SLAVES];
+
+static void async_rx(uint16_t reply);
+static void async_schedule(void);
+static void async_dma_done(void);
+static void async_drain(void);
+
+// Slave byte queues, each with one producer and one consumer: RX from
+// SPI2_IRQHandler to the worker, TX (replies) from the worker back
+static volatile uint8_t spi2_rx_ring[SPI2_RX_RING_SIZE];
+static volatile uint16_t spi2_rx_head = 0;
+static volatile uint16_t spi2_rx_tail = 0;
+static volatile uint8_t spi2_tx_ring[SPI2_TX_RING_SIZE];
+static volatile uint16_t spi2_tx_head = 0;
+static volatile uint16_t spi2_tx_tail = 0;
+volatile uint32_t spi2_rx_overruns = 0;
+static void spi2_reply(uint8_t data);
+static void spi2_set_wide(uint8_t wide);
+
+// Framed protocol: the slave's current request frame and the queue of
+// responses it streams back while later frames are still coming in
+static uint8_t frame_buf[FRAME_MAX_SIZE];
+static uint16_t frame_pos = 0;
+static uint8_t frame_crc = 0;
+static uint8_t frame_resp[FRAME_BURST_SIZE];
+static uint16_t frame_resp_head = 0;
+static uint16_t frame_resp_tail = 0;
+static uint8_t frame_resp_crc = 0;
+
+// Master side of the framed protocol
+static uint8_t frame_tx[FRAME_BURST_SIZE];
+static uint8_t frame_rx[FRAME_BURST_SIZE];
+static uint8_t frame_seq = 0;
+
+// CRC-8, polynomial 0x07
+static const uint8_t crc8_table[256] = {
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+	0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+	0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+	0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5,
+	0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85,
+	0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+	0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+	0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+	0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2,
+	0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32,
+	0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+	0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+	0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+	0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c,
+	0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec,
+	0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+	0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+	0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+	0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c,
+	0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b,
+	0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+	0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+	0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+	0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb,
+	0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb,
+	0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3
+};
 
 
 void spi_init(void) {
@@ -54,6 +278,10 @@ void spi_init(void) {
         RCC->AHB1ENR |= RCC_AHB1ENR_GPIOAEN;
         //Enable the clock for GPIOB
         RCC->AHB1ENR |= RCC_AHB1ENR_GPIOBEN;
+        //Enable the clock for GPIOC
+        RCC->AHB1ENR |= RCC_AHB1ENR_GPIOCEN;
+        //Enable the clock for the CRC unit, for CWRITE and CREAD
+        RCC->AHB1ENR |= RCC_AHB1ENR_CRCEN;
 
 	//Reset SPI1 peripheral
         RCC->APB2RSTR |= RCC_APB2RSTR_SPI1RST;
@@ -103,6 +331,19 @@ void spi_init(void) {
         GPIOB->AFR[1] |= GPIO_AFRH_AFRH6_0 | GPIO_AFRH_AFRH6_2;
         GPIOB->AFR[1] |= GPIO_AFRH_AFRH7_0 | GPIO_AFRH_AFRH7_2;
 
+#if SPI2_HW_NSS
+        //SPI2: NSS on PB12, AF05
+        GPIOB->MODER |= GPIO_MODER_MODER12_1;
+        GPIOB->AFR[1] |= GPIO_AFRH_AFRH4_0 | GPIO_AFRH_AFRH4_2;
+#endif
+
+        //Chip selects: outputs, all slaves deselected, then the current one
+        GPIOC->BSRR = SPI_CS_PINS;
+        GPIOC->MODER |= GPIO_MODER_MODER0_0 | GPIO_MODER_MODER1_0
+                      | GPIO_MODER_MODER2_0 | GPIO_MODER_MODER3_0;
+        spi_cs = 0xff;
+        spi_select(spi_slave);
+
 
 // SPI1 configuration:
 
@@ -114,8 +355,8 @@ void spi_init(void) {
         SPI1->CR1 &= ~SPI_CR1_CPHA;
         //LSB first
         SPI1->CR1 |= SPI_CR1_LSBFIRST;
-        //Baudrate 100MHz/256
-        SPI1->CR1 |= SPI_CR1_BR_1 | SPI_CR1_BR_2 | SPI_CR1_BR_0;
+        //Baudrate 100MHz/256, or what baud_negotiate() settled on
+        SPI1->CR1 |= spi_link_br * SPI_CR1_BR_0;
 
         //Use software to control the NSS
         //This is for slave
@@ -145,6 +386,9 @@ void spi_init(void) {
 
 // SPI2 configuration:
 
+        //Rebuild the file table from the flash log
+        persist_mount();
+
         //Data frame format 8-bit
         SPI2->CR1 &= ~SPI_CR1_DFF;
         //Clock low while idling
@@ -156,9 +400,14 @@ void spi_init(void) {
         //Baudrate 100MHz/256
         SPI2->CR1 |= SPI_CR1_BR_1 | SPI_CR1_BR_2 | SPI_CR1_BR_0;
 
+#if SPI2_HW_NSS
+        //NSS from the master's chip select
+        SPI2->CR1 &= ~SPI_CR1_SSM;
+#else
         //Use software to control the NSS
         //This is for slave
         SPI2->CR1 |= SPI_CR1_SSM;
+#endif
 
         //This is for master
  //       SPI2->CR1 |= SPI_CR1_SSM;
@@ -177,689 +426,6009 @@ void spi_init(void) {
         //Enable SPI2 interrupt
         NVIC_EnableIRQ(SPI2_IRQn);
 
+        //Protocol worker, pended by the SPI2 interrupt, below its priority
+        NVIC_SetPriority(SPI2_WORKER_IRQn, SPI2_WORKER_PRIORITY);
+        NVIC_EnableIRQ(SPI2_WORKER_IRQn);
+
         //Enable SPI2
         SPI2->CR1 |= SPI_CR1_SPE;
 
 
+	//Enable the DMA clocks and the completion interrupts of the payload streams
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN | RCC_AHB1ENR_DMA2EN;
+	NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+	NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+
+
+	//Start the cycle counter used for handshake timing
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
 }
 	
 
-void SPI1_IRQHandler(void)
+// Pull one slave's chip select low and the others' high. The frame on
+// the wire finishes first; a slave keeps its protocol state while it is
+// deselected, so the async engine can go on with another slave's command
+// between two bytes of one.
+void spi_select(uint8_t slave)
 {
-	if (SPI1->SR & SPI_SR_RXNE) {
-		rxData1 = SPI1->DR;
-		rxData1_f = 1;
+	if (slave == spi_cs || slave >= SPI_MAX_SLAVES) {
+		return;
 	}
+
+	while (SPI1->SR & SPI_SR_BSY);
+	GPIOC->BSRR = (SPI_CS_PINS & ~(1u << slave)) | (1u << (slave + 16));
+	spi_cs = slave;
 }
 
 
-void SPI2_IRQHandler(void)
+// Point a stream at a peripheral data register and a memory buffer and
+// enable it; the SPI starts issuing requests once its DMAEN bit is set
+static void dma_stream_start(DMA_Stream_TypeDef *stream, uint32_t channel,
+			     volatile void *periph, const volatile void *mem,
+			     uint16_t count, uint32_t flags)
 {
+	stream->CR &= ~DMA_SxCR_EN;
+	while (stream->CR & DMA_SxCR_EN);
+
+	stream->PAR = (uintptr_t)periph;
+	stream->M0AR = (uintptr_t)mem;
+	stream->NDTR = count;
+	stream->CR = channel | flags;
+	stream->CR |= DMA_SxCR_EN;
+}
 
-        if (SPI2->SR & SPI_SR_RXNE) {
-                      rxData2 = SPI2->DR;
-                      rxData2_f = 1;
-
+// Peripheral and memory sizes that match an SPI's frame format, so a
+// 16-bit frame moves a halfword, which has to be at an even address
+static uint32_t dma_frame_size(SPI_TypeDef *spi)
+{
+	return (spi->CR1 & SPI_CR1_DFF) ? DMA_SxCR_PSIZE_0 | DMA_SxCR_MSIZE_0 : 0;
+}
 
-		switch(current_state)
-		{
-			case SYNC:
-				if (rxData2 == 0xfe) {
-					current_state = CMD;
-				}
-				break;
-		
-			case CMD:
-				if (rxData2 == 0x00) {
-					current_state = LIST;
-					SPI2->DR = 1;		// ACK
-					file_number = 0;
-					flag_filename = 1;
-				}
-				else if (rxData2 == 0x03) {
-					current_state = CREATE;
-					SPI2->DR = 1;		// ACK
-					flag_rx_count = 0;
-				}
-				else if (rxData2 == 0x02) {
-					current_state = WRITE;
-					SPI2->DR = 1;		// ACK
-					flag_rx_count = 0;
-					write_count = 0;
-				}
-				else if (rxData2 == 0x01) {
-	                                current_state = READ;
-	                                SPI2->DR = 1;           // ACK
-	                                flag_rx_count = 0;
-	                                read_count = 0;
-	                        }
-	                        else if (rxData2 == 0x04) {
-	                                current_state = DELETE;
-	                                SPI2->DR = 1;           // ACK
-	                                flag_rx_count = 0;
-	                        }
-				else {
-					current_state = SYNC;
-				}
-				break;
-		
-			case LIST:
-				if (flag_filename == 1) {
-					if (file_number > MAX_FILE_NUMBER) {
-						SPI2->DR = 0;	   	// NACK
-					   	current_state = SYNC;	
-					} 
-					else {
-						while (file[file_number].size == 0) {
-							file_number++;
-							if (file_number > MAX_FILE_NUMBER) {
-								break;
-							}
-						}
-	
-						if (file_number > MAX_FILE_NUMBER) {
-							SPI2->DR = 0;		// NACK
-						   	current_state = SYNC;	
-						}
-						else {
-							SPI2->DR = file_number;	// file number
-						   	flag_filename = 0;
-						}
-					   }
-				}
-				else {
-					   SPI2->DR = file[file_number].size;
-					   flag_filename = 1;
-					   file_number++;
-				}
-				break;
 
-			case CREATE:
-				if (flag_rx_count == 0) {
-					flag_rx_count = 1;
-					SPI2->DR = 1;			// ACK
-				}
-				else if (flag_rx_count == 1) {
-					create_file_number = rxData2;
-					flag_rx_count = 2;
-					SPI2->DR = 1;			// ACK
-				}
-				else if (flag_rx_count == 2) {
-					file[create_file_number].size = rxData2;
-					flag_rx_count = 3;
-					current_state = SYNC;
-				}	
-
-				break;	
-
-
-			case WRITE:
-	                        if (flag_rx_count == 0) {
-	                                flag_rx_count = 1;		// skip this dummy data
-	                        }
-	                        else if (flag_rx_count == 1) {
-	                                write_file_number = rxData2;	// receive the file number
-	                                flag_rx_count = 2;
-                                
-	                        }
-	                        else if (flag_rx_count == 2) {
-	                                if (file[write_file_number].size == 1) {
-						flag_rx_count = 4;
-						SPI2->DR = 1;		// ACK
-					}
-					else {
-						flag_rx_count = 3;		// skip this dummy data
-					}
-				}
-				else if (flag_rx_count == 3) {
-                                
-					file[write_file_number].data[write_count] = rxData2;	// receive data
-	                                write_count++;
-					if (write_count == file[write_file_number].size - 1) {
-						flag_rx_count = 4;
-						SPI2->DR = 1;		// ACK
-					}
-	                        }
-	                        else if (flag_rx_count == 4) {
-	                                file[write_file_number].data[write_count] = rxData2;
-	                                current_state = SYNC;
-	                        }
-
-	                        break;
-
-			case READ:
-	                        if (flag_rx_count == 0) {
-	                                flag_rx_count = 1;              // skip this dummy data
-	                        }
-	                        else if (flag_rx_count == 1) {
-	                                read_file_number = rxData2;    // receive the file number
-	                                SPI2->DR = 1;			// ACK
-					flag_rx_count = 2;
-	                        }
-	                        else if (flag_rx_count == 2) {
-					SPI2->DR = file[read_file_number].data[read_count];
-					read_count++;
-					if (read_count == file[read_file_number].size) {
-						current_state = SYNC;
-					}
-				}
+// Slave payload by DMA: tx (NULL for none) goes out while rx_count frames
+// are received into rx (NULL to discard them). The RX stream completion,
+// DMA1_Stream3_IRQHandler, ends the command.
+static void spi2_dma_start(const volatile uint8_t *tx, uint16_t tx_count,
+			   volatile uint8_t *rx, uint16_t rx_count)
+{
+	uint32_t size = dma_frame_size(SPI2);
 
-				break;
+	DMA1->LIFCR = DMA_FLAGS_S3;
+	DMA1->HIFCR = DMA_FLAGS_S4;
 
-	 		case DELETE:
-	                        if (flag_rx_count == 0) {
-	                                flag_rx_count = 1;              // skip this dummy data
-	                        }
-	                        else if (flag_rx_count == 1) {
-	                                file[rxData2].size = 0;		// receive the file number
-	                                SPI2->DR = 1;                   // ACK
-	                                current_state = SYNC;
-	                        }
+	SPI2->CR2 &= ~SPI_CR2_RXNEIE;
 
-				break;
+	if (rx != NULL) {
+		dma_stream_start(DMA1_Stream3, DMA_CHANNEL0, &SPI2->DR, rx, rx_count,
+				 size | DMA_SxCR_MINC | DMA_SxCR_TCIE);
+	}
+	else {
+		dma_stream_start(DMA1_Stream3, DMA_CHANNEL0, &SPI2->DR, &spi2_dma_sink,
+				 rx_count, size | DMA_SxCR_TCIE);
+	}
+	SPI2->CR2 |= SPI_CR2_RXDMAEN;
 
-			default:
-				current_state = SYNC;
-			
-		}
+	if (tx != NULL) {
+		dma_stream_start(DMA1_Stream4, DMA_CHANNEL0, &SPI2->DR, tx, tx_count,
+				 size | DMA_SxCR_DIR_0 | DMA_SxCR_MINC);
+		SPI2->CR2 |= SPI_CR2_TXDMAEN;
 	}
 }
 
 
-
-void spi_write(uint8_t * data, uint8_t length)
+void DMA1_Stream3_IRQHandler(void)
 {
-	uint32_t i;
-	
-	for (i = 0; i < 100000; i++) {
-		while (!(SPI1->SR & SPI_SR_TXE));
-		SPI1->DR = 170;
-	}
-	while (SPI1->SR & SPI_SR_BSY);
-}
+	if (DMA1->LISR & DMA_LISR_TCIF3) {
+		DMA1->LIFCR = DMA_LIFCR_CTCIF3;
 
-void spi_write_spi2(uint8_t * data, uint8_t length)
-{
-        uint32_t i;
+		SPI2->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+		DMA1_Stream4->CR &= ~DMA_SxCR_EN;
+		SPI2->CR2 |= SPI_CR2_RXNEIE;
 
-        for (i = 0; i < 100000; i++) {
-                while (!(SPI2->SR & SPI_SR_TXE));
-                SPI2->DR = 170;
-        }
-        while (SPI2->SR & SPI_SR_BSY);
+		if (spi2_dma_file != 0) {
+			storage_mark_dirty(spi2_dma_file);
+			spi2_dma_file = 0;
+		}
+
+		// WREAD, WWRITE: back to 8-bit frames, and WWRITE ACKs the data
+		if (SPI2->CR1 & SPI_CR1_DFF) {
+			spi2_set_wide(0);
+			if (current_state == WWRITE) {
+				spi2_reply(1);
+			}
+		}
+		// APPEND: the ACK for the master's trailing 0xff
+		if (current_state == APPEND) {
+			spi2_reply(1);
+		}
+		current_state = SYNC;
+	}
 }
 
 
-void spi_write_1B(uint8_t * data)
+void DMA2_Stream0_IRQHandler(void)
 {
-        rxData1_f = 0;
-	rxData2_f = 0;
+	if (DMA2->LISR & DMA_LISR_TCIF0) {
+		DMA2->LIFCR = DMA_LIFCR_CTCIF0;
+		spi1_dma_done = 1;
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = data[0];
-//	SPI2->DR = data[0];        
-        while (SPI1->SR & SPI_SR_BSY);
+		if (async_phase == ASYNC_DMA) {
+			async_dma_done();
+			async_schedule();
+		}
+	}
+}
 
-	HAL_Delay(200);
 
-	if (rxData1_f == 1) {
-		printf("M: %d\n", rxData1);
-		rxData1_f = 0;
-	}
+static uint8_t crc8(uint8_t crc, uint8_t data)
+{
+	return crc8_table[crc ^ data];
+}
 
-	if (rxData2_f == 1) {
-		printf("S: %d\n", rxData2);
-		rxData2_f = 0;
+// CRC of a CWRITE/CREAD chunk on the CRC unit: its number, then its bytes
+// a word at a time, low byte first, the last word padded with zeros
+static uint32_t chunk_crc(uint16_t chunk, const uint8_t *data, uint16_t length)
+{
+	uint32_t word;
+	uint16_t i, j;
+
+	CRC->CR = CRC_CR_RESET;
+	CRC->DR = chunk;
+	for (i = 0; i < length; i += 4) {
+		word = 0;
+		for (j = 0; j < 4 && i + j < length; j++) {
+			word |= (uint32_t)data[i + j] << (8 * j);
+		}
+		CRC->DR = word;
 	}
+	return (uint32_t)CRC->DR;
+}
 
+// Bytes in chunk k of a length-byte payload
+static uint16_t chunk_length(uint16_t k, uint16_t length)
+{
+	return (length - k * CRC_CHUNK_SIZE < CRC_CHUNK_SIZE)
+	       ? length - k * CRC_CHUNK_SIZE : CRC_CHUNK_SIZE;
+}
 
+static uint16_t chunk_count(uint16_t length)
+{
+	return (length + CRC_CHUNK_SIZE - 1) / CRC_CHUNK_SIZE;
 }
 
 
-void create(uint8_t file_number, uint8_t file_size)
+static uint16_t frame_resp_free(void)
 {
-        rxData1_f = 0;
-
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xfe;                        // SYNC
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+	return (uint16_t)(FRAME_BURST_SIZE - 1
+			  - (frame_resp_head - frame_resp_tail + FRAME_BURST_SIZE) % FRAME_BURST_SIZE);
+}
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0x03;                        // CREATE
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+static void frame_resp_put(uint8_t data)
+{
+	frame_resp[frame_resp_head] = data;
+	frame_resp_head = (frame_resp_head + 1) % FRAME_BURST_SIZE;
+	frame_resp_crc = crc8(frame_resp_crc, data);
+}
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xff;                        // 0xff
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+// Queue the header of a response; returns 0 when the queue has no room
+// for it and its payload_len data bytes, in which case it is dropped
+static uint8_t frame_resp_begin(uint8_t seq, uint8_t status, uint8_t payload_len)
+{
+	if (frame_resp_free() < FRAME_RESP_OVERHEAD + payload_len) {
+		return 0;
+	}
 
-        if (rxData1_f == 1 && rxData1 == 1) {
+	frame_resp_crc = 0;
+	frame_resp_put(payload_len + 2);	// length: seq + status + payload
+	frame_resp_put(seq);
+	frame_resp_put(status);
+	return 1;
+}
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = file_number;                     // file name
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+static void frame_resp_end(void)
+{
+	uint8_t crc = frame_resp_crc;
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = file_size;                       // file size
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+	frame_resp_put(crc);
+}
 
-		rxData1_f = 0;
-        }
+static void frame_resp_status(uint8_t seq, uint8_t status)
+{
+	if (frame_resp_begin(seq, status, 0)) {
+		frame_resp_end();
+	}
 }
 
 
-void delete(uint8_t file_number)
+// Run one complete request frame: len, opcode, seq, arguments, crc
+static void frame_execute(void)
 {
-        rxData1_f = 0;
-
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xfe;                        // SYNC
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+	uint8_t len = frame_buf[0];
+	uint8_t op = frame_buf[1];
+	uint8_t seq = (len >= 2) ? frame_buf[2] : 0;
+	uint8_t *arg = &frame_buf[3];
+	uint8_t arg_len = (len >= 2) ? len - 2 : 0;
+	uint8_t n;
+	uint8_t i;
+	uint8_t failed = 0;
+	uint16_t size;
+
+	if (len < 2 || frame_crc != frame_buf[len + 1]) {
+		frame_resp_status(seq, FRAME_ERR_CRC);
+		return;
+	}
 
-        rxData1_f = 0;
+	n = (arg_len >= 1) ? arg[0] : 0;
+	if (n < 1 || n > MAX_FILE_NUMBER) {
+		frame_resp_status(seq, FRAME_ERR_FILE);
+		return;
+	}
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0x04;                        // DELETE
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+	switch (op)
+	{
+		case CMD_CREATE:
+			// 8-bit size, or 16-bit little-endian for larger files
+			if (arg_len != 2 && arg_len != 3) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			size = (arg_len == 3) ? arg[1] | (arg[2] << 8) : arg[1];
+			if (storage_resize(n, size) != 0) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			frame_resp_status(seq, FRAME_OK);
+			break;
 
-        rxData1_f = 0;
+		case CMD_WRITE:
+			if (arg_len - 1 > file[n].size) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			for (i = 1; i < arg_len; i++) {
+				failed |= storage_put(n, i - 1, arg[i]) != 0;
+			}
+			frame_resp_status(seq, failed ? FRAME_ERR_FILE : FRAME_OK);
+			break;
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xff;                        // 0xff
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+		case CMD_READ:
+			if (arg_len != 2) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			size = (arg[1] < FRAME_MAX_DATA) ? arg[1] : FRAME_MAX_DATA;
+			len = (file[n].size < size) ? file[n].size : size;
+			if (frame_resp_begin(seq, FRAME_OK, len)) {
+				for (i = 0; i < len; i++) {
+					frame_resp_put(storage_get(n, i));
+				}
+				frame_resp_end();
+			}
+			break;
+
+		case CMD_DELETE:
+			storage_delete(n);
+			frame_resp_status(seq, FRAME_OK);
+			break;
+
+		case CMD_COPY:
+		case CMD_MOVE:
+			// source, destination
+			if (arg_len != 2 || ((op == CMD_COPY) ? storage_copy(n, arg[1])
+							      : storage_move(n, arg[1])) != 0) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			frame_resp_status(seq, FRAME_OK);
+			break;
+
+		case CMD_PREAD:
+			// file number, offset (2), length
+			size = arg[1] | (arg[2] << 8);
+			len = (arg[3] < FRAME_MAX_DATA) ? arg[3] : FRAME_MAX_DATA;
+			if (arg_len != 4 || (uint32_t)size + len > file[n].size) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			if (frame_resp_begin(seq, FRAME_OK, len)) {
+				for (i = 0; i < len; i++) {
+					frame_resp_put(storage_get(n, size + i));
+				}
+				frame_resp_end();
+			}
+			break;
 
-        if (rxData1_f == 1 && rxData1 == 1) {
+		case CMD_PWRITE:
+			// file number, offset (2), data
+			size = arg[1] | (arg[2] << 8);
+			if (arg_len < 3 || (uint32_t)size + arg_len - 3 > file[n].size) {
+				frame_resp_status(seq, FRAME_ERR_FILE);
+				break;
+			}
+			for (i = 3; i < arg_len; i++) {
+				failed |= storage_put(n, size + i - 3, arg[i]) != 0;
+			}
+			frame_resp_status(seq, failed ? FRAME_ERR_FILE : FRAME_OK);
+			break;
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = file_number;                       // file number 
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+		default:
+			frame_resp_status(seq, FRAME_ERR_OP);
+	}
+}
 
-		rxData1_f = 0;
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = 0xff;                           // send dummy byte 0xff
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+// One received byte of a burst. A zero length byte ends the burst.
+static void frame_rx_byte(uint8_t data)
+{
+	if (frame_pos == 0) {
+		if (data == 0) {
+			flag_rx_count = 2;
+			return;
+		}
+		frame_crc = 0;
+	}
 
-                if (rxData1_f != 1 || rxData1 != 1) {
-                        printf("master Delete: No ACK received after sending file number");
-                }
+	// the CRC covers everything up to the last argument
+	frame_buf[frame_pos] = data;
+	if (frame_pos <= frame_buf[0]) {
+		frame_crc = crc8(frame_crc, data);
+	}
+	frame_pos++;
 
-		rxData1_f = 0;
-        }
-        else {
-                printf("Delete error! \n\n");
-        }
+	if (frame_pos == frame_buf[0] + 2) {
+		frame_execute();
+		frame_pos = 0;
+	}
 }
 
 
-
-void read(uint8_t file_number, uint8_t file_size)
+// RXNE hands the reply to a running asynchronous request, TXE sends the
+// next byte of one
+void SPI1_IRQHandler(void)
 {
-        uint8_t i = 0;
+	uint16_t frame;
 
-        rxData1_f = 0;
+	if (SPI1->SR & SPI_SR_RXNE) {
+		frame = SPI1->DR;
+		rxData1 = (uint8_t)frame;
+		rxData1_f = 1;
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xfe;                        // SYNC
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+		if (async_phase == ASYNC_BYTE) {
+			async_rx(frame);
+			async_schedule();
+		}
+	}
 
-        rxData1_f = 0;
+	if ((SPI1->CR2 & SPI_CR2_TXEIE) && (SPI1->SR & SPI_SR_TXE)) {
+		SPI1->CR2 &= ~SPI_CR2_TXEIE;
+		SPI1->DR = async_tx;
+		async_sent++;
+	}
+}
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0x01;                        // READ
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
 
-        rxData1_f = 0;
+// Arguments of PREAD and PWRITE, one per byte: file number, offset and
+// length, both low byte first. Returns 1 once the last one is in.
+static uint8_t range_rx(uint8_t data)
+{
+	switch (flag_rx_count)
+	{
+		case 1:
+			range_file_number = data;
+			break;
+		case 2:
+			range_offset = data;
+			break;
+		case 3:
+			range_offset |= data << 8;
+			break;
+		case 4:
+			range_length = data;
+			break;
+		case 5:
+			range_length |= data << 8;
+			break;
+	}
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xff;                        // 0xff
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+	flag_rx_count++;
+	return flag_rx_count == 6;
+}
 
-        if (rxData1_f == 1 && rxData1 == 1) {
+// Name of OPEN and NCREATE: its length, then its bytes. Returns 1 once the
+// last one is in, at once with name_length 0 if the length is over
+// DIR_NAME_SIZE.
+static uint8_t name_rx(uint8_t data)
+{
+	if (flag_rx_count == 1) {
+		name_length = (data <= DIR_NAME_SIZE) ? data : 0;
+		name_count = 0;
+		flag_rx_count = 2;
+		return name_length == 0;
+	}
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = file_number;                       // file number 
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+	name_buf[name_count] = data;
+	name_count++;
+	return name_count == name_length;
+}
 
-                rxData1_f = 0;
+static uint8_t range_valid(void)
+{
+	return range_file_number >= 1 && range_file_number <= MAX_FILE_NUMBER
+	       && (uint32_t)range_offset + range_length <= file[range_file_number].size;
+}
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = 0xff;                           // send dummy byte 0xff
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
 
-                if (rxData1_f != 1 || rxData1 != 1) {
-                        printf("master Write: No ACK received after sending file number");
-                }
+// Queue a reply byte. The TXE interrupt moves it into DR as soon as the
+// transmit buffer is free, so it goes out on the frame after the current one.
+static void spi2_reply(uint8_t data)
+{
+	uint16_t next = (spi2_tx_head + 1) % SPI2_TX_RING_SIZE;
 
+	if (next == spi2_tx_tail) {
+		return;		// bulk data checks spi2_tx_free() first
+	}
+	spi2_tx_ring[spi2_tx_head] = data;
+	spi2_tx_head = next;
+	SPI2->CR2 |= SPI_CR2_TXEIE;
+}
 
-                for (i = 0; i < file_size; i++) {
-                        rxData1_f = 0;
-                        while (!(SPI1->SR & SPI_SR_TXE));
-                        SPI1->DR = 0xff;			// send 0xff
-                        while (SPI1->SR & SPI_SR_BSY);
-                        HAL_Delay(50);
+static uint16_t spi2_tx_queued(void)
+{
+	return (uint16_t)((spi2_tx_head - spi2_tx_tail + SPI2_TX_RING_SIZE) % SPI2_TX_RING_SIZE);
+}
 
-			printf("%d   ", rxData1);
-                }
-		
-		printf("\n\n");
+static uint16_t spi2_tx_free(void)
+{
+	return (uint16_t)(SPI2_TX_RING_SIZE - 1 - spi2_tx_queued());
+}
 
-                rxData1_f = 0;
-        }
-        else {
-                printf("Read error! \n\n");
-        }
+// Slave frame format, 8 or 16 bits. Only switched between frames with
+// nothing loaded to send, SPE off as the reference manual asks; the byte
+// interrupt then moves two queued bytes per 16-bit frame, low byte first.
+static void spi2_set_wide(uint8_t wide)
+{
+	SPI2->CR1 &= ~SPI_CR1_SPE;
+	if (wide) {
+		SPI2->CR1 |= SPI_CR1_DFF;
+	}
+	else {
+		SPI2->CR1 &= ~SPI_CR1_DFF;
+	}
+	SPI2->CR1 |= SPI_CR1_SPE;
 }
 
+// Drop replies nobody clocked out, left by a command the master gave up
+// on. The TXE interrupt owns the tail, so it is held off meanwhile.
+static void spi2_tx_flush(void)
+{
+	if (spi2_tx_tail == spi2_tx_head) {
+		return;
+	}
 
+	NVIC_DisableIRQ(SPI2_IRQn);
+	spi2_tx_tail = spi2_tx_head;
+	SPI2->CR2 &= ~SPI_CR2_TXEIE;
+	NVIC_EnableIRQ(SPI2_IRQn);
+}
 
+// The slave is between commands: back in SYNC, with no byte waiting for
+// the worker. persist_poll() only erases and programs the flash then.
+uint8_t spi2_idle(void)
+{
+	return current_state == SYNC && spi2_rx_head == spi2_rx_tail;
+}
 
+// Queue file bytes ahead of the master's clocks, as many as the transmit
+// queue has room for. Returns 1 once the last of length bytes is queued.
+static uint8_t spi2_stage(uint8_t n, uint16_t offset, volatile uint16_t *count, uint16_t length)
+{
+	uint16_t room = spi2_tx_free();
 
+	while (room > 0 && *count < length) {
+		spi2_reply(storage_get(n, offset + *count));
+		(*count)++;
+		room--;
+	}
+	return *count == length;
+}
 
-void write(uint8_t para_num, uint32_t * para)
+// The same from a buffer
+static uint8_t spi2_stage_buf(const uint8_t *buf, volatile uint16_t *count, uint16_t length)
 {
-	uint8_t i = 0;
-
-	rxData1_f = 0;
+	uint16_t room = spi2_tx_free();
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xfe;                        // SYNC
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+	while (room > 0 && *count < length) {
+		spi2_reply(buf[*count]);
+		(*count)++;
+		room--;
+	}
+	return *count == length;
+}
 
-        rxData1_f = 0;
-	
-	while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0x02;                        // WRITE
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
 
-        rxData1_f = 0;
+// The BLIST image of the file table, from the occupancy index
+static void blist_build(void)
+{
+	uint8_t count = 0;
+	uint8_t n;
+
+	memset(blist_image, 0, 1 + LIST_BITMAP_SIZE);
+	blist_length = 1 + LIST_BITMAP_SIZE;
+
+	for (n = storage_next_file(1); n != 0; n = storage_next_file(n + 1)) {
+		blist_image[1 + (n - 1) / 8] |= 1u << ((n - 1) % 8);
+		blist_image[blist_length] = file[n].size & 0xff;
+		blist_image[blist_length + 1] = file[n].size >> 8;
+		blist_length += 2;
+		count++;
+	}
+	blist_image[0] = count;
+}
 
-	while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xff;                        // 0xff
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+// CRC-32 of a SNAPSHOT image, a byte at a time with a nibble table, as
+// both sides work it out while the bytes go by; the CRC unit takes words
+static const uint32_t snap_crc_table[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
 
-        if (rxData1_f == 1 && rxData1 == 1) {
+static uint32_t snap_crc_byte(uint32_t crc, uint8_t data)
+{
+	crc = (crc >> 4) ^ snap_crc_table[(crc ^ data) & 0x0f];
+	return (crc >> 4) ^ snap_crc_table[(crc ^ (data >> 4)) & 0x0f];
+}
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = *para;                     	// file name 
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+// The SNAPSHOT image up to the contents, from the occupancy index
+static void snap_build(void)
+{
+	uint32_t contents = 0;
+	uint8_t length;
+	uint8_t n;
+
+	snap_files = 0;
+	snap_head_length = 1;
+	for (n = storage_next_file(1); n != 0; n = storage_next_file(n + 1)) {
+		snap_number[snap_files] = n;
+		snap_size[snap_files] = file[n].size;
+		contents += file[n].size;
+		snap_files++;
+
+		length = dir_name(n, snap_head + snap_head_length + 4);
+		snap_head[snap_head_length] = n;
+		snap_head[snap_head_length + 1] = file[n].size & 0xff;
+		snap_head[snap_head_length + 2] = file[n].size >> 8;
+		snap_head[snap_head_length + 3] = length;
+		snap_head_length += 4 + length;
+	}
+	snap_head[0] = snap_files;
 
-		rxData1_f = 0;
+	snap_length = snap_head_length + contents + 4;
+	snap_pos = 0;
+	snap_k = 0;
+	snap_offset = 0;
+	snap_crc = 0xffffffffu;
+}
 
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = 0xff;                    	   // send dummy byte 0xff
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
+// Queue SNAPSHOT image bytes ahead of the master's clocks, as many as the
+// transmit queue has room for. Returns 1 once the last is queued.
+static uint8_t snap_stage(void)
+{
+	uint16_t room = spi2_tx_free();
+	uint8_t data;
+
+	while (room > 0 && snap_pos < snap_length) {
+		if (snap_pos < snap_head_length) {
+			data = snap_head[snap_pos];
+		}
+		else if (snap_pos < snap_length - 4) {
+			data = storage_get(snap_number[snap_k], snap_offset);
+			if (++snap_offset == snap_size[snap_k]) {
+				snap_k++;
+				snap_offset = 0;
+			}
+		}
+		else {
+			if (snap_pos == snap_length - 4) {
+				snap_crc = ~snap_crc;
+			}
+			data = snap_crc >> (8 * (snap_pos - (snap_length - 4)));
+		}
+
+		if (snap_pos < snap_length - 4) {
+			snap_crc = snap_crc_byte(snap_crc, data);
+		}
+		spi2_reply(data);
+		snap_pos++;
+		room--;
+	}
+	return snap_pos == snap_length;
+}
+
+// RESTORE: the table in the image replaces the slave's, if every file
+// number is valid and once, and the contents add up to the image length.
+// The files come back empty of data, at their sizes and with their names.
+static void snap_apply(void)
+{
+	uint32_t seen[(MAX_FILE_NUMBER + 32) / 32] = {0};
+	uint32_t contents = 0;
+	uint16_t entry = 1;
+	uint8_t k, n;
+
+	for (k = 0; k < snap_files; k++) {
+		n = snap_number[k];
+		if (n == 0 || n > MAX_FILE_NUMBER || snap_size[k] == 0
+		    || (seen[n >> 5] & (1u << (n & 31)))) {
+			snap_bad = 1;
+			return;
+		}
+		seen[n >> 5] |= 1u << (n & 31);
+		contents += snap_size[k];
+	}
+	if ((uint32_t)snap_head_length + contents + 4 != snap_length) {
+		snap_bad = 1;
+		return;
+	}
+
+	for (n = storage_next_file(1); n != 0; n = storage_next_file(n + 1)) {
+		storage_delete(n);
+	}
+	snap_applied = 1;
+	for (k = 0; k < snap_files; k++) {
+		if (storage_resize(snap_number[k], snap_size[k]) != 0) {
+			snap_bad = 1;
+		}
+		if (snap_head[entry + 3] > 0) {
+			dir_insert(snap_head + entry + 4, snap_head[entry + 3], snap_number[k]);
+		}
+		entry += 4 + snap_head[entry + 3];
+	}
+	snap_k = 0;
+	snap_offset = 0;
+}
+
+// One RESTORE image byte: the table is gathered in snap_head and applied
+// once it is all in, the contents go straight into the files
+static void snap_receive(uint8_t data)
+{
+	if (snap_pos < snap_length - 4) {
+		snap_crc = snap_crc_byte(snap_crc, data);
+	}
+
+	if (snap_pos < snap_head_length && snap_pos < snap_length - 4) {
+		snap_head[snap_pos] = data;
+		if (snap_pos == 0) {
+			snap_files = data;
+			snap_entry = 1;
+			snap_head_length = (data > 0) ? 5 : 1;
+			if (data > MAX_FILE_NUMBER) {
+				snap_bad = 1;
+			}
+		}
+		else if (snap_pos == snap_entry + 3) {
+			// the name length: the entry ends after the name
+			snap_head_length += data;
+			if (data > DIR_NAME_SIZE) {
+				snap_bad = 1;
+			}
+		}
+
+		if (snap_pos + 1 == snap_head_length && !snap_bad) {
+			if (snap_pos > 0) {
+				snap_number[snap_k] = snap_head[snap_entry];
+				snap_size[snap_k] = snap_head[snap_entry + 1]
+						    | (snap_head[snap_entry + 2] << 8);
+				snap_k++;
+				snap_entry = snap_head_length;
+				if (snap_k < snap_files) {
+					snap_head_length += 4;
+				}
+			}
+			if (snap_k == snap_files) {
+				snap_apply();
+			}
+		}
+		if (snap_head_length > SNAP_HEAD_SIZE) {
+			snap_bad = 1;
+			snap_head_length = 0;	// nothing more goes in snap_head
+		}
+	}
+	else if (snap_pos < snap_length - 4) {
+		if (!snap_bad) {
+			if (storage_put(snap_number[snap_k], snap_offset, data) != 0) {
+				snap_bad = 1;
+			}
+			if (++snap_offset == snap_size[snap_k]) {
+				snap_k++;
+				snap_offset = 0;
+			}
+		}
+	}
+	else {
+		// the CRC, low byte first
+		if (data != (uint8_t)(~snap_crc >> (8 * (snap_pos - (snap_length - 4))))) {
+			snap_bad = 1;
+		}
+	}
+
+	snap_pos++;
+}
+
+// One received byte through the slave protocol
+static void spi2_process(uint8_t data)
+{
+	uint8_t *span;
+	uint16_t span_length;
+	uint32_t crc_word;
+	uint8_t n;
+
+	switch(current_state)
+	{
+		case SYNC:
+			if (data == 0xfe) {
+				spi2_tx_flush();
+				current_state = CMD;
+			}
+			break;
+	
+		case CMD:
+			if (data == 0x00) {
+				current_state = LIST;
+				spi2_reply(1);		// ACK
+				file_number = 0;
+				flag_filename = 1;
+			}
+			else if (data == 0x03) {
+				current_state = CREATE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == 0x02) {
+				current_state = WRITE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+				write_count = 0;
+			}
+			else if (data == 0x01) {
+                                current_state = READ;
+                                spi2_reply(1);           // ACK
+                                flag_rx_count = 0;
+                                read_count = 0;
+                        }
+                        else if (data == 0x04) {
+                                current_state = DELETE;
+                                spi2_reply(1);           // ACK
+                                flag_rx_count = 0;
+                        }
+			else if (data == CMD_FRAMED) {
+				current_state = FRAME;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+				frame_pos = 0;
+				frame_resp_head = 0;
+				frame_resp_tail = 0;
+			}
+			else if (data == CMD_CREATE_FREE) {
+				current_state = CREATE_FREE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_PREAD) {
+				current_state = PREAD;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_PWRITE) {
+				current_state = PWRITE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_BAUD) {
+				current_state = BAUD;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_OPEN) {
+				current_state = OPEN;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_NCREATE) {
+				current_state = NCREATE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_NLIST) {
+				current_state = NLIST;
+				spi2_reply(1);		// ACK
+				file_number = 0;
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_ZWRITE) {
+				current_state = ZWRITE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_ZREAD) {
+				current_state = ZREAD;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_CWRITE) {
+				current_state = CWRITE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_CREAD) {
+				current_state = CREAD;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_BLIST) {
+				// the whole image staged behind the ACK
+				current_state = BLIST;
+				spi2_reply(1);		// ACK
+				blist_build();
+				blist_count = 0;
+				if (spi2_stage_buf(blist_image, &blist_count, blist_length)) {
+					current_state = SYNC;
+				}
+			}
+			else if (data == CMD_WREAD) {
+				current_state = WREAD;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_WWRITE) {
+				current_state = WWRITE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_SOPEN) {
+				current_state = SOPEN;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_APPEND) {
+				current_state = APPEND;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_SNAPSHOT) {
+				// the image's length, then the image, staged
+				// behind the ACK and topped up as the master clocks
+				current_state = SNAPSHOT;
+				spi2_reply(1);		// ACK
+				snap_build();
+				spi2_reply(snap_length & 0xff);
+				spi2_reply((snap_length >> 8) & 0xff);
+				spi2_reply((snap_length >> 16) & 0xff);
+				spi2_reply(snap_length >> 24);
+				if (snap_stage()) {
+					current_state = SYNC;
+				}
+			}
+			else if (data == CMD_RESTORE) {
+				current_state = RESTORE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_COPY) {
+				current_state = COPY;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_MOVE) {
+				current_state = MOVE;
+				spi2_reply(1);		// ACK
+				flag_rx_count = 0;
+			}
+			else if (data == CMD_SCLOSE) {
+				// the file's size staged behind the ACK, or 0 with
+				// nothing open
+				if (afile_number != 0) {
+					spi2_reply(1);		// ACK
+					spi2_reply(file[afile_number].size & 0xff);
+					spi2_reply(file[afile_number].size >> 8);
+					afile_number = 0;
+				}
+				else {
+					spi2_reply(0);
+				}
+				current_state = SYNC;
+			}
+			else {
+				current_state = SYNC;
+			}
+			break;
+	
+		case LIST:
+			if (flag_filename == 1) {
+				// next used file from the occupancy bitmap
+				file_number = storage_next_file(file_number);
+				if (file_number == 0) {
+					spi2_reply(0);		// NACK
+				   	current_state = SYNC;	
+				}
+				else {
+					spi2_reply(file_number);	// file number
+				   	flag_filename = 0;
+				}
+			}
+			else {
+				   // sizes past one byte read as 255
+				   spi2_reply((file[file_number].size > 0xff) ? 0xff : file[file_number].size);
+				   flag_filename = 1;
+				   file_number++;
+			}
+			break;
+
+		case CREATE:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;
+				spi2_reply(1);			// ACK
+			}
+			else if (flag_rx_count == 1) {
+				create_file_number = data;
+				flag_rx_count = 2;
+				spi2_reply(1);			// ACK
+			}
+			else if (flag_rx_count == 2) {
+				storage_resize(create_file_number, data);
+				flag_rx_count = 3;
+				current_state = SYNC;
+			}	
+
+			break;	
+
+		case CREATE_FREE:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				// receive the size, reply with the file number
+				create_file_number = storage_first_free();
+				if (create_file_number != 0
+				    && (data == 0 || storage_resize(create_file_number, data) != 0)) {
+					create_file_number = 0;
+				}
+				spi2_reply(create_file_number);
+				current_state = SYNC;
+			}
+			break;
+
+
+		case WRITE:
+                        if (flag_rx_count == 0) {
+                                flag_rx_count = 1;		// skip this dummy data
+                        }
+                        else if (flag_rx_count == 1) {
+                                write_file_number = data;	// receive the file number
+                                flag_rx_count = 2;
+                        
+                        }
+                        else if (flag_rx_count == 2) {
+				// DMA needs the whole file in one extent
+				// and the ACK goes out before the last byte is in, so
+				// every block is made the file's own here
+				span = storage_span_write(write_file_number, 0,
+							  file[write_file_number].size, &span_length);
+				put_failed = (span == NULL);
+				if (payload_dma && span && span_length == file[write_file_number].size) {
+					flag_rx_count = 4;
+					spi2_reply(1);		// ACK, repeated until the last data byte
+					spi2_dma_file = write_file_number;
+					spi2_dma_start(NULL, 0, span, span_length);
+				}
+                                else if (file[write_file_number].size == 1) {
+					flag_rx_count = 4;
+					spi2_reply(!put_failed);	// ACK
+				}
+				else {
+					flag_rx_count = 3;		// skip this dummy data
+				}
+			}
+			else if (flag_rx_count == 3) {
+                        
+				// receive data
+				put_failed |= storage_put(write_file_number, write_count, data) != 0;
+                                write_count++;
+				if (write_count == file[write_file_number].size - 1) {
+					flag_rx_count = 4;
+					spi2_reply(!put_failed);	// ACK
+				}
+                        }
+                        else if (flag_rx_count == 4) {
+                                storage_put(write_file_number, write_count, data);
+                                current_state = SYNC;
+                        }
+
+                        break;
+
+		case READ:
+                        if (flag_rx_count == 0) {
+                                flag_rx_count = 1;              // skip this dummy data
+                        }
+                        else if (flag_rx_count == 1) {
+                                read_file_number = data;    // receive the file number
+                                spi2_reply(1);			// ACK
+				flag_rx_count = 2;
+
+				// the dummy byte, then one 0xff per data byte
+				span = storage_span(read_file_number, 0, &span_length);
+				if (payload_dma && span && span_length == file[read_file_number].size
+				    && span_length < 0xffff) {
+					spi2_dma_start(span, span_length, NULL, span_length + 1);
+				}
+				// or staged behind the ACK, topped up as the master clocks
+				else if (spi2_stage(read_file_number, 0, &read_count,
+						    file[read_file_number].size)) {
+					current_state = SYNC;
+				}
+                        }
+                        else if (flag_rx_count == 2) {
+				if (spi2_stage(read_file_number, 0, &read_count,
+					       file[read_file_number].size)) {
+					current_state = SYNC;
+				}
+			}
+
+			break;
+
+ 		case DELETE:
+                        if (flag_rx_count == 0) {
+                                flag_rx_count = 1;              // skip this dummy data
+                        }
+                        else if (flag_rx_count == 1) {
+                                storage_delete(data);	// receive the file number
+                                spi2_reply(1);                   // ACK
+                                current_state = SYNC;
+                        }
+
+			break;
+
+		case PREAD:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count < 6) {
+				if (range_rx(data)) {
+					if (!range_valid()) {
+						spi2_reply(0);		// NACK
+						current_state = SYNC;
+						break;
+					}
+					spi2_reply(1);			// ACK
+					range_count = 0;
+					if (range_length == 0) {
+						current_state = SYNC;
+						break;
+					}
+
+					// the dummy byte, then one 0xff per data byte
+					span = storage_span(range_file_number, range_offset, &span_length);
+					if (payload_dma && span && span_length >= range_length
+					    && range_length < 0xffff) {
+						spi2_dma_start(span, range_length, NULL, range_length + 1);
+					}
+					else if (spi2_stage(range_file_number, range_offset,
+							    &range_count, range_length)) {
+						current_state = SYNC;
+					}
+				}
+			}
+			else {
+				if (spi2_stage(range_file_number, range_offset, &range_count,
+					       range_length)) {
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case PWRITE:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count < 6) {
+				if (range_rx(data)) {
+					if (!range_valid()) {
+						spi2_reply(0);		// NACK
+						current_state = SYNC;
+						break;
+					}
+					spi2_reply(1);			// ACK
+					range_count = 0;
+					put_failed = 0;
+					if (range_length == 0) {
+						current_state = SYNC;
+					}
+				}
+			}
+			else if (flag_rx_count == 6) {
+				flag_rx_count = 7;		// skip this dummy data
+
+				span = storage_span_write(range_file_number, range_offset,
+							  range_length, &span_length);
+				if (payload_dma && span && span_length >= range_length) {
+					spi2_reply(1);		// ACK, repeated until the end
+					spi2_dma_file = range_file_number;
+					spi2_dma_start(NULL, 0, span, range_length);
+				}
+			}
+			else {
+				put_failed |= storage_put(range_file_number, range_offset + range_count,
+							  data) != 0;
+				range_count++;
+				if (range_count == range_length) {
+					spi2_reply(!put_failed);	// ACK
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case BAUD:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				// the master's proposed divisor; the slave's own
+				// BR bits do not matter, it follows the master's clock
+				if (data < SPI_SLAVE_MIN_BR || data > SPI_BR_SLOWEST) {
+					spi2_reply(0);		// NACK
+					current_state = SYNC;
+					break;
+				}
+				spi2_reply(1);			// ACK
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				flag_rx_count = 3;		// skip this dummy data
+				baud_count = 0;
+				baud_errors = 0;
+			}
+			else {
+				// pattern at the new clock: echo each byte, then
+				// answer how many of them arrived wrong
+				if (data != baud_pattern[baud_count]) {
+					baud_errors++;
+				}
+				baud_count++;
+				if (baud_count < BAUD_PATTERN_SIZE) {
+					spi2_reply(data);
+				}
+				else {
+					spi2_reply(baud_errors);
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case OPEN:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (name_rx(data)) {
+				// file number, 0 if there is no such name, and size
+				n = dir_lookup(name_buf, name_length);
+				spi2_reply(n);
+				spi2_reply(file[n].size & 0xff);
+				spi2_reply(file[n].size >> 8);
+				current_state = SYNC;
+			}
+			break;
+
+		case NCREATE:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count <= 2) {
+				if (name_rx(data)) {
+					flag_rx_count = 3;
+				}
+			}
+			else if (flag_rx_count == 3) {
+				name_size = data;
+				flag_rx_count = 4;
+			}
+			else {
+				// size high byte in, the file number out
+				name_size |= data << 8;
+				spi2_reply(dir_create(name_buf, name_length, name_size));
+				current_state = SYNC;
+			}
+			break;
+
+		case NLIST:
+			// per file: number, size (low byte first), name length,
+			// name; a 0 after the last file
+			if (flag_rx_count == 0) {
+				file_number = storage_next_file(file_number);
+				spi2_reply(file_number);
+				if (file_number == 0) {
+					current_state = SYNC;
+					break;
+				}
+				name_length = dir_name(file_number, name_buf);
+				flag_rx_count = 1;
+			}
+			else if (flag_rx_count == 1) {
+				spi2_reply(file[file_number].size & 0xff);
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				spi2_reply(file[file_number].size >> 8);
+				flag_rx_count = 3;
+			}
+			else if (flag_rx_count == 3) {
+				spi2_reply(name_length);
+				name_count = 0;
+				flag_rx_count = 4;
+			}
+			else {
+				spi2_reply(name_buf[name_count]);
+				name_count++;
+			}
+
+			if (flag_rx_count == 4 && name_count == name_length) {
+				file_number++;
+				flag_rx_count = 0;
+			}
+			break;
+
+		case ZWRITE:
+			// file number, a dummy for its ACK, the encoded length
+			// (low byte first), the encoded bytes, decoded into the
+			// file as they come, and a dummy for the final ACK
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				zfile_number = data;
+				if (data < 1 || data > MAX_FILE_NUMBER || file[data].size == 0) {
+					spi2_reply(0);
+					current_state = SYNC;
+					break;
+				}
+				spi2_reply(1);			// ACK
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				flag_rx_count = 3;		// skip this dummy data
+			}
+			else if (flag_rx_count == 3) {
+				zlength = data;
+				flag_rx_count = 4;
+			}
+			else if (flag_rx_count == 4) {
+				zlength |= data << 8;
+				zcount = 0;
+				zpos = 0;
+				zerror = 0;
+				rle_decoder_init(&zdecoder);
+				flag_rx_count = 5;
+				if (zlength == 0) {
+					spi2_reply(0);
+					current_state = SYNC;
+				}
+			}
+			else {
+				n = rle_decoder_put(&zdecoder, data, &data);
+				if (zpos + n > file[zfile_number].size) {
+					zerror = 1;
+				}
+				while (n > 0 && !zerror) {
+					zerror = storage_put(zfile_number, zpos, data) != 0;
+					zpos++;
+					n--;
+				}
+
+				zcount++;
+				if (zcount == zlength) {
+					spi2_reply(!zerror && rle_decoder_done(&zdecoder)
+						   && zpos == file[zfile_number].size);
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case ZREAD:
+			// file number in; ACK (0 if it is not worth it), the
+			// encoded length, low byte first, and the encoded bytes
+			// staged behind it
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				zfile_number = data;
+				zlength = 0;
+				if (data >= 1 && data <= MAX_FILE_NUMBER
+				    && file[data].size > 1 && file[data].size <= ZREAD_MAX_SIZE) {
+					for (zpos = 0; zpos < file[data].size; zpos += span_length) {
+						span = storage_span(data, zpos, &span_length);
+						if (span_length > file[data].size - zpos) {
+							span_length = file[data].size - zpos;
+						}
+						memcpy(zplain + zpos, span, span_length);
+					}
+					zlength = rle_encode(zplain, file[data].size, zpacked,
+							     file[data].size - 1);
+				}
+				if (zlength == 0) {
+					spi2_reply(0);
+					current_state = SYNC;
+					break;
+				}
+
+				spi2_reply(1);			// ACK
+				spi2_reply(zlength & 0xff);
+				spi2_reply(zlength >> 8);
+				zcount = 0;
+				flag_rx_count = 2;
+				if (spi2_stage_buf(zpacked, &zcount, zlength)) {
+					current_state = SYNC;
+				}
+			}
+			else if (spi2_stage_buf(zpacked, &zcount, zlength)) {
+				current_state = SYNC;
+			}
+			break;
+
+		case BLIST:
+			// what the transmit queue had no room for before
+			if (spi2_stage_buf(blist_image, &blist_count, blist_length)) {
+				current_state = SYNC;
+			}
+			break;
+
+		case CWRITE:
+			// file number, the length (low byte first), ACKed if it
+			// is the file's size, a dummy, then per chunk its bytes,
+			// its CRC and a dummy for the number of the chunk wanted
+			// next
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				cfile_number = data;
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				clength = data;
+				flag_rx_count = 3;
+			}
+			else if (flag_rx_count == 3) {
+				clength |= data << 8;
+				// chunks are stored as they check out, so the file's
+				// blocks are made its own before any is
+				if (cfile_number < 1 || cfile_number > MAX_FILE_NUMBER
+				    || clength == 0 || clength != file[cfile_number].size
+				    || !storage_span_write(cfile_number, 0, clength, &span_length)) {
+					spi2_reply(0);
+					current_state = SYNC;
+					break;
+				}
+				spi2_reply(1);			// ACK
+				cchunk = 0;
+				ccount = 0;
+				cbad = 0;
+				flag_rx_count = 4;
+			}
+			else if (flag_rx_count == 4) {
+				flag_rx_count = 5;		// skip this dummy data
+			}
+			else if (flag_rx_count == 5) {
+				cbuf[ccount] = data;
+				ccount++;
+				n = chunk_length(cchunk, clength);
+				if (ccount < n + 4) {
+					break;
+				}
+
+				if (chunk_crc(cchunk, cbuf, n)
+				    == (cbuf[n] | cbuf[n + 1] << 8 | (uint32_t)cbuf[n + 2] << 16
+					| (uint32_t)cbuf[n + 3] << 24)) {
+					for (ccount = 0; ccount < n; ccount++) {
+						storage_put(cfile_number, cchunk * CRC_CHUNK_SIZE + ccount,
+							    cbuf[ccount]);
+					}
+					cchunk++;
+					cbad = 0;
+				}
+				else {
+					cbad++;
+				}
+				spi2_reply(cchunk & 0x7f);	// the chunk wanted next
+				ccount = 0;
+				flag_rx_count = 6;
+			}
+			else {
+				// the dummy that clocked the reply out
+				if (cchunk == chunk_count(clength) || cbad == CRC_RETRIES) {
+					current_state = SYNC;
+				}
+				else {
+					flag_rx_count = 5;
+				}
+			}
+			break;
+
+		case CREAD:
+			// file number, the length, ACKed if the file has that
+			// many bytes, then per chunk the number of the chunk
+			// wanted and a dummy for each of its bytes and its CRC,
+			// until the next SYNC
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				cfile_number = data;
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				clength = data;
+				flag_rx_count = 3;
+			}
+			else if (flag_rx_count == 3) {
+				clength |= data << 8;
+				if (cfile_number < 1 || cfile_number > MAX_FILE_NUMBER
+				    || clength == 0 || clength > file[cfile_number].size) {
+					spi2_reply(0);
+					current_state = SYNC;
+					break;
+				}
+				spi2_reply(1);			// ACK
+				cchunk = 0;
+				flag_rx_count = 4;
+			}
+			else if (flag_rx_count == 4) {
+				if (data == 0xfe) {
+					spi2_tx_flush();	// SYNC: the master has it all
+					current_state = CMD;
+					break;
+				}
+				// the next chunk, or this one again
+				if (data == ((cchunk + 1) & 0x7f) && cchunk + 1 < chunk_count(clength)) {
+					cchunk++;
+				}
+
+				n = chunk_length(cchunk, clength);
+				for (ccount = 0; ccount < n; ccount++) {
+					cbuf[ccount] = storage_get(cfile_number,
+								   cchunk * CRC_CHUNK_SIZE + ccount);
+				}
+				crc_word = chunk_crc(cchunk, cbuf, n);
+				cbuf[n] = crc_word & 0xff;
+				cbuf[n + 1] = (crc_word >> 8) & 0xff;
+				cbuf[n + 2] = (crc_word >> 16) & 0xff;
+				cbuf[n + 3] = crc_word >> 24;
+
+				ccount = 0;
+				cprobes = 0;
+				spi2_stage_buf(cbuf, &ccount, n + 4);
+				flag_rx_count = 5;
+			}
+			else {
+				n = chunk_length(cchunk, clength);
+				spi2_stage_buf(cbuf, &ccount, n + 4);
+				cprobes++;
+				if (cprobes == n + 4) {
+					flag_rx_count = 4;
+				}
+			}
+			break;
+
+		case SOPEN:
+			// file number, 0 for the lowest free one, and flags;
+			// the number opened comes back, 0 if none
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				afile_number = (data != 0) ? data : storage_first_free();
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				if (afile_number > MAX_FILE_NUMBER) {
+					afile_number = 0;
+				}
+				if (afile_number != 0 && (data & STREAM_NEW)) {
+					storage_resize(afile_number, 0);
+				}
+				spi2_reply(afile_number);
+				current_state = SYNC;
+			}
+			break;
+
+		case COPY:
+		case MOVE:
+			// source and destination file numbers; the copy shares
+			// the source's blocks, so either takes the same few
+			// microseconds whatever the file's size
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				copy_source = data;
+				flag_rx_count = 2;
+			}
+			else {
+				if (current_state == COPY) {
+					spi2_reply(storage_copy(copy_source, data) == 0);
+				}
+				else {
+					spi2_reply(storage_move(copy_source, data) == 0);
+				}
+				current_state = SYNC;
+			}
+			break;
+
+		case SNAPSHOT:
+			// what the transmit queue had no room for before
+			if (snap_stage()) {
+				current_state = SYNC;
+			}
+			break;
+
+		case RESTORE:
+			// the image's length, ACKed if an image can be that
+			// long, a dummy, the image, and 1 for the master's 0xff
+			// if it all checked out
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+				snap_length = 0;
+			}
+			else if (flag_rx_count < 5) {
+				snap_length |= (uint32_t)data << (8 * (flag_rx_count - 1));
+				flag_rx_count++;
+				if (flag_rx_count == 5) {
+					if (snap_length < 5 || snap_length > SNAP_MAX_SIZE) {
+						spi2_reply(0);
+						current_state = SYNC;
+						break;
+					}
+					spi2_reply(1);		// ACK
+				}
+			}
+			else if (flag_rx_count == 5) {
+				// the 0xff that took the ACK
+				snap_pos = 0;
+				snap_head_length = 1;
+				snap_k = 0;
+				snap_crc = 0xffffffffu;
+				snap_bad = 0;
+				snap_applied = 0;
+				flag_rx_count = 6;
+			}
+			else {
+				snap_receive(data);
+				if (snap_pos == snap_length) {
+					spi2_reply((snap_applied && !snap_bad) ? 1 : 0);
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case APPEND:
+			// a 16-bit length, ACKed once the open file has grown by
+			// that much, then the bytes, each stored as it comes in,
+			// and 0xff for the ACK of them all
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				alength = data;
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				alength |= data << 8;
+				abase = file[afile_number].size;
+				if (afile_number == 0 || alength == 0
+				    || (uint32_t)abase + alength > MAX_FILE_SIZE
+				    || storage_resize(afile_number, abase + alength) != 0) {
+					spi2_reply(0);
+					current_state = SYNC;
+					break;
+				}
+				spi2_reply(1);			// ACK
+				acount = 0;
+				put_failed = 0;
+				flag_rx_count = 3;
+			}
+			else if (flag_rx_count == 3) {
+				// the 0xff that took the ACK; DMA needs the bytes in
+				// one extent
+				span = storage_span_write(afile_number, abase, alength, &span_length);
+				if (payload_dma && span && span_length >= alength) {
+					spi2_dma_file = afile_number;
+					spi2_dma_start(NULL, 0, span, alength);
+				}
+				flag_rx_count = 4;
+			}
+			else {
+				put_failed |= storage_put(afile_number, abase + acount, data) != 0;
+				acount++;
+				if (acount == alength) {
+					spi2_reply(!put_failed);	// ACK
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case WREAD:
+		case WWRITE:
+			// file number, the length, ACKed if the file has that
+			// many bytes for WREAD or is that long for WWRITE, then
+			// the 0xff that takes the ACK, after which the data goes
+			// in 16-bit frames, the last one padded if the length is
+			// odd. Storage blocks are 64 bytes, so a file of odd
+			// length has room in its last block for the pad byte.
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				wfile_number = data;
+				flag_rx_count = 2;
+			}
+			else if (flag_rx_count == 2) {
+				wlength = data;
+				flag_rx_count = 3;
+			}
+			else if (flag_rx_count == 3) {
+				wlength |= data << 8;
+				if (wfile_number < 1 || wfile_number > MAX_FILE_NUMBER || wlength == 0
+				    || wlength > file[wfile_number].size
+				    || (current_state == WWRITE && wlength != file[wfile_number].size)) {
+					spi2_reply(0);
+					current_state = SYNC;
+					break;
+				}
+				spi2_reply(1);			// ACK
+				flag_rx_count = 4;
+			}
+			else if (flag_rx_count == 4) {
+				spi2_set_wide(1);
+				wcount = 0;
+				wprobes = 0;
+				put_failed = 0;
+				flag_rx_count = 5;
+
+				// DMA needs the bytes in one extent, at an even address
+				span = (current_state == WREAD)
+					? storage_span(wfile_number, 0, &span_length)
+					: storage_span_write(wfile_number, 0, wlength, &span_length);
+				if (!payload_dma || !span || span_length < wlength || ((uintptr_t)span & 1)) {
+					if (current_state == WREAD) {
+						spi2_stage(wfile_number, 0, &wcount, (wlength + 1) & ~1u);
+					}
+				}
+				else if (current_state == WREAD) {
+					spi2_dma_start(span, (wlength + 1) / 2, NULL, (wlength + 1) / 2);
+				}
+				else {
+					spi2_dma_file = wfile_number;
+					spi2_dma_start(NULL, 0, span, (wlength + 1) / 2);
+				}
+			}
+			else if (current_state == WREAD) {
+				// the master's probes; anything else means it gave up
+				if (data != 0xff) {
+					spi2_set_wide(0);
+					spi2_tx_flush();
+					current_state = SYNC;
+					break;
+				}
+				wprobes++;
+				if (wprobes == ((wlength + 1) & ~1u)) {
+					spi2_set_wide(0);
+					current_state = SYNC;
+				}
+				else {
+					spi2_stage(wfile_number, 0, &wcount, (wlength + 1) & ~1u);
+				}
+			}
+			else {
+				if (wcount < wlength) {		// the pad goes nowhere
+					put_failed |= storage_put(wfile_number, wcount, data) != 0;
+				}
+				wcount++;
+				if (wcount == ((wlength + 1) & ~1u)) {
+					spi2_set_wide(0);
+					spi2_reply(!put_failed);	// ACK
+					current_state = SYNC;
+				}
+			}
+			break;
+
+		case FRAME:
+			if (flag_rx_count == 0) {
+				flag_rx_count = 1;		// skip this dummy data
+			}
+			else if (flag_rx_count == 1) {
+				frame_rx_byte(data);		// frames until the end byte
+			}
+
+			// next response byte, 0 while there is none
+			if (frame_resp_tail != frame_resp_head) {
+				spi2_reply(frame_resp[frame_resp_tail]);
+				frame_resp_tail = (frame_resp_tail + 1) % FRAME_BURST_SIZE;
+			}
+			else {
+				spi2_reply(0);
+				if (flag_rx_count == 2) {
+					current_state = SYNC;	// burst ended and answered
+				}
+			}
+
+			break;
+
+		default:
+			current_state = SYNC;
+		
+	}
+}
+
+// Deferred half of the slave, pended by SPI2_IRQHandler: runs the protocol
+// over the queued bytes. It can take as long as a whole frame per byte
+// without losing any, because the interrupt only queues them.
+void SPI2_WORKER_IRQHandler(void)
+{
+	uint8_t data;
+
+	while (spi2_rx_tail != spi2_rx_head) {
+		STATS_START(stats_t0);
+		STATS_KEY(stats_entry, current_state);
+
+		data = spi2_rx_ring[spi2_rx_tail];
+		spi2_rx_tail = (spi2_rx_tail + 1) % SPI2_RX_RING_SIZE;
+		spi2_process(data);
+
+		STATS_STOP(stats_state[stats_entry], stats_t0);
+	}
+}
+
+static void spi2_rx_put(uint8_t data)
+{
+	uint16_t next = (spi2_rx_head + 1) % SPI2_RX_RING_SIZE;
+
+	if (next != spi2_rx_tail) {
+		spi2_rx_ring[spi2_rx_head] = data;
+		spi2_rx_head = next;
+	}
+	else {
+		spi2_rx_overruns++;
+	}
+}
+
+static uint8_t spi2_tx_take(void)
+{
+	uint8_t data = spi2_tx_ring[spi2_tx_tail];
+
+	spi2_tx_tail = (spi2_tx_tail + 1) % SPI2_TX_RING_SIZE;
+	return data;
+}
+
+// Byte interrupt of the slave. It only moves bytes between DR and the
+// queues: RXNE queues the byte and pends the worker, TXE loads the next
+// staged reply, and TXEIE is kept on only while replies are waiting.
+// With no reply loaded the slave underruns and repeats its last frame.
+// A 16-bit frame carries two bytes each way, and goes out only once both
+// are queued.
+void SPI2_IRQHandler(void)
+{
+	uint16_t frame;
+	uint8_t width;
+	STATS_START(stats_t0);
+
+	width = (SPI2->CR1 & SPI_CR1_DFF) ? 2 : 1;
+
+	if (SPI2->SR & SPI_SR_RXNE) {
+		frame = SPI2->DR;
+		rxData2 = (uint8_t)frame;
+		rxData2_f = 1;
+
+		spi2_rx_put((uint8_t)frame);
+		TRACE(TRACE_RX, current_state, (uint8_t)frame);
+		if (width == 2) {
+			spi2_rx_put(frame >> 8);
+			TRACE(TRACE_RX, current_state, frame >> 8);
+		}
+		NVIC_SetPendingIRQ(SPI2_WORKER_IRQn);
+	}
+
+	if ((SPI2->CR2 & SPI_CR2_TXEIE) && (SPI2->SR & SPI_SR_TXE)) {
+		if (spi2_tx_queued() >= width) {
+			frame = spi2_tx_take();
+			TRACE(TRACE_TX, current_state, (uint8_t)frame);
+			if (width == 2) {
+				frame |= spi2_tx_take() << 8;
+				TRACE(TRACE_TX, current_state, frame >> 8);
+			}
+			SPI2->DR = frame;
+		}
+		if (spi2_tx_queued() < width) {
+			SPI2->CR2 &= ~SPI_CR2_TXEIE;
+		}
+	}
+
+	STATS_STOP(stats_byte_isr, stats_t0);
+}
+
+
+
+void spi_write(uint8_t * data, uint8_t length)
+{
+	uint32_t i;
+	
+	for (i = 0; i < 100000; i++) {
+		while (!(SPI1->SR & SPI_SR_TXE));
+		SPI1->DR = 170;
+	}
+	while (SPI1->SR & SPI_SR_BSY);
+}
+
+void spi_write_spi2(uint8_t * data, uint8_t length)
+{
+        uint32_t i;
+
+        for (i = 0; i < 100000; i++) {
+                while (!(SPI2->SR & SPI_SR_TXE));
+                SPI2->DR = 170;
+        }
+        while (SPI2->SR & SPI_SR_BSY);
+}
+
+
+void spi_write_1B(uint8_t * data)
+{
+        rxData1_f = 0;
+	rxData2_f = 0;
+
+        while (!(SPI1->SR & SPI_SR_TXE));
+        SPI1->DR = data[0];
+//	SPI2->DR = data[0];        
+        while (SPI1->SR & SPI_SR_BSY);
+
+	HAL_Delay(200);
+
+	if (rxData1_f == 1) {
+		printf("M: %d\n", rxData1);
+		rxData1_f = 0;
+	}
+
+	if (rxData2_f == 1) {
+		printf("S: %d\n", rxData2);
+		rxData2_f = 0;
+	}
+
+
+}
+
+
+void delay_us(uint32_t us)
+{
+	uint32_t start = DWT->CYCCNT;
+
+	while ((DWT->CYCCNT - start) < us * CPU_CYCLES_PER_US);
+}
+
+
+// Wait for SPI1_IRQHandler to receive the reply to the byte just sent
+static int spi1_wait_rx(void)
+{
+	uint32_t start = DWT->CYCCNT;
+
+	while (rxData1_f == 0) {
+		if ((DWT->CYCCNT - start) > SPI_RX_TIMEOUT_US * CPU_CYCLES_PER_US) {
+			spi_rx_timeouts++;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+// Send one byte on SPI1 and return the byte the slave shifted back.
+// HANDSHAKE_DELAY waits for BSY to clear and then sleeps 50 ms, which is
+// what every command used to do. HANDSHAKE_EVENT moves on as soon as
+// SPI1_IRQHandler has the reply (rxData1_f), leaving the slave
+// SPI_TURNAROUND_US to queue the byte and have its worker stage the next, and
+// gives up after SPI_RX_TIMEOUT_US with rxData1_f still 0.
+uint8_t spi1_transfer(uint8_t data)
+{
+	async_drain();
+	rxData1_f = 0;
+
+        while (!(SPI1->SR & SPI_SR_TXE));
+        SPI1->DR = data;
+
+	if (handshake_mode == HANDSHAKE_DELAY) {
+	        while (SPI1->SR & SPI_SR_BSY);
+	        HAL_Delay(50);
+		return rxData1;
+	}
+
+	if (spi1_wait_rx() == 0) {
+		delay_us(SPI_TURNAROUND_US);
+	}
+
+	return rxData1;
+}
+
+
+// Clock a whole burst without waiting on the slave between bytes: by DMA
+// when payload DMA is on, otherwise one byte as soon as the last is back.
+// Returns -1 on timeout.
+int spi1_transfer_burst(const uint8_t *tx, uint8_t *rx, uint16_t length)
+{
+	uint16_t i;
+
+	if (payload_dma) {
+		return spi1_transfer_dma(tx, rx, length);
+	}
+
+	async_drain();
+
+	for (i = 0; i < length; i++) {
+		rxData1_f = 0;
+
+	        while (!(SPI1->SR & SPI_SR_TXE));
+	        SPI1->DR = tx[i];
+
+		if (spi1_wait_rx() != 0) {
+			return -1;
+		}
+		rx[i] = rxData1;
+	}
+
+	return 0;
+}
+
+
+// Start clocking length frames through SPI1 by DMA, back to back. tx NULL
+// sends 0xff probes, rx NULL keeps only the last reply, in spi1_dma_sink.
+// DMA2_Stream0_IRQHandler sets spi1_dma_done once the last reply is in.
+static void spi1_dma_start(const uint8_t *tx, volatile uint8_t *rx, uint16_t length)
+{
+	uint32_t size = dma_frame_size(SPI1);
+
+	spi1_dma_done = 0;
+
+	DMA2->LIFCR = DMA_FLAGS_S0 | DMA_FLAGS_S3;
+
+	SPI1->CR2 &= ~SPI_CR2_RXNEIE;
+
+	if (rx != NULL) {
+		dma_stream_start(DMA2_Stream0, DMA_CHANNEL3, &SPI1->DR, rx, length,
+				 size | DMA_SxCR_MINC | DMA_SxCR_TCIE);
+	}
+	else {
+		dma_stream_start(DMA2_Stream0, DMA_CHANNEL3, &SPI1->DR, &spi1_dma_sink,
+				 length, size | DMA_SxCR_TCIE);
+	}
+	SPI1->CR2 |= SPI_CR2_RXDMAEN;
+
+	if (tx != NULL) {
+		dma_stream_start(DMA2_Stream3, DMA_CHANNEL3, &SPI1->DR, tx, length,
+				 size | DMA_SxCR_DIR_0 | DMA_SxCR_MINC);
+	}
+	else {
+		dma_stream_start(DMA2_Stream3, DMA_CHANNEL3, &SPI1->DR, &spi_dma_fill,
+				 length, size | DMA_SxCR_DIR_0);
+	}
+	SPI1->CR2 |= SPI_CR2_TXDMAEN;
+}
+
+static void spi1_dma_stop(void)
+{
+	SPI1->CR2 &= ~(SPI_CR2_TXDMAEN | SPI_CR2_RXDMAEN);
+	DMA2_Stream3->CR &= ~DMA_SxCR_EN;
+	DMA2_Stream0->CR &= ~DMA_SxCR_EN;
+	SPI1->CR2 |= SPI_CR2_RXNEIE;
+}
+
+// Master frame format, 8 or 16 bits, the same way as spi2_set_wide()
+static void spi1_set_wide(uint8_t wide)
+{
+        while (SPI1->SR & SPI_SR_BSY);
+        SPI1->CR1 &= ~SPI_CR1_SPE;
+	if (wide) {
+		SPI1->CR1 |= SPI_CR1_DFF;
+	}
+	else {
+		SPI1->CR1 &= ~SPI_CR1_DFF;
+	}
+        SPI1->CR1 |= SPI_CR1_SPE;
+}
+
+// Clock length bytes through SPI1 by DMA, back to back, and collect the
+// replies in rx. tx == NULL sends 0xff probes. The last reply is left in
+// rxData1/rxData1_f like spi1_transfer() does. Returns -1 on timeout.
+int spi1_transfer_dma(const uint8_t *tx, uint8_t *rx, uint16_t length)
+{
+	uint32_t start;
+
+	async_drain();
+	rxData1_f = 0;
+	spi1_dma_start(tx, rx, length);
+
+	start = DWT->CYCCNT;
+	while (spi1_dma_done == 0) {
+		if ((DWT->CYCCNT - start) > SPI_DMA_TIMEOUT_US * CPU_CYCLES_PER_US) {
+			break;
+		}
+	}
+
+	spi1_dma_stop();
+
+	if (spi1_dma_done == 0) {
+		spi_rx_timeouts++;
+		return -1;
+	}
+
+	rxData1 = rx[length - 1];
+	rxData1_f = 1;
+
+	return 0;
+}
+
+
+// Asynchronous master: the SPI1 interrupts step a queue of requests
+// through the same bytes the blocking calls used to send one at a time.
+// The next byte goes out from the TXE interrupt once the pause after the
+// reply is over: SPI_TURNAROUND_US by DWT->CYCCNT with the event
+// handshake, 50 ms with the delay handshake. No interrupt waits on the
+// slave; while one request waits, the wire goes to a request for another
+// slave, so the pauses of different boards overlap.
+
+static void async_send(uint16_t data)
+{
+	async_tx = data;
+	async_stamp = DWT->CYCCNT;
+	async_phase = ASYNC_BYTE;
+	SPI1->CR2 |= SPI_CR2_TXEIE;
+}
+
+// Send data after the slave's turnaround
+static void async_turn(uint16_t data)
+{
+	async_tx = data;
+	async_stamp = DWT->CYCCNT;
+	async_phase = ASYNC_TURN;
+}
+
+static void async_next(uint16_t data)
+{
+	if (handshake_mode == HANDSHAKE_DELAY) {
+		async_tx = data;
+		async_stamp = HAL_GetTick();
+		async_phase = ASYNC_PAUSE;
+		return;
+	}
+
+	async_turn(data);
+}
+
+static void async_begin(uint32_t handle)
+{
+	struct async_req *req = async_queue[handle % ASYNC_QUEUE_SIZE];
+
+	async_wire = handle;
+	async_state[handle % ASYNC_QUEUE_SIZE] = ASYNC_RUNNING;
+	req->length = 0;
+	async_sent = 0;
+	async_ack = 1;
+	async_reported = 0;
+	spi_select(req->slave);
+
+	// SYNC, after the turnaround if the slave just left 16-bit frames
+	if (async_settle) {
+		async_settle = 0;
+		async_turn(0xfe);
+	}
+	else {
+		async_send(0xfe);
+	}
+}
+
+// 1 once a request's pause after the reply is over
+static int async_ready(enum async_phase phase, uint32_t stamp)
+{
+	if (phase == ASYNC_TURN) {
+		return DWT->CYCCNT - stamp >= SPI_TURNAROUND_US * CPU_CYCLES_PER_US;
+	}
+	return phase == ASYNC_PAUSE && HAL_GetTick() - stamp >= 50;
+}
+
+// Put the request on the wire aside while it waits out its pause
+static void async_park(void)
+{
+	struct async_ctx *c = &async_parked[async_queue[async_wire % ASYNC_QUEUE_SIZE]->slave];
+
+	c->handle = async_wire;
+	c->phase = async_phase;
+	c->wide = (SPI1->CR1 & SPI_CR1_DFF) != 0;
+	c->sent = async_sent;
+	c->tx = async_tx;
+	c->ack = async_ack;
+	c->stamp = async_stamp;
+	c->dma_pos = async_dma_pos;
+	c->dma_total = async_dma_total;
+	c->zlength = async_zlength;
+	c->reported = async_reported;
+	c->chunk = async_chunk;
+	c->cpos = async_cpos;
+	c->retries = async_retries;
+	c->crc = async_crc;
+
+	if (c->wide) {
+		spi1_set_wide(0);
+	}
+	async_phase = ASYNC_IDLE;
+}
+
+// Back on the wire with a parked request, and send its next byte
+static void async_unpark(uint8_t slave)
+{
+	struct async_ctx *c = &async_parked[slave];
+
+	async_wire = c->handle;
+	async_sent = c->sent;
+	async_ack = c->ack;
+	async_dma_pos = c->dma_pos;
+	async_dma_total = c->dma_total;
+	async_zlength = c->zlength;
+	async_reported = c->reported;
+	async_chunk = c->chunk;
+	async_cpos = c->cpos;
+	async_retries = c->retries;
+	async_crc = c->crc;
+	c->phase = ASYNC_IDLE;
+
+	spi_select(slave);
+	if (c->wide) {
+		spi1_set_wide(1);
+	}
+	async_send(c->tx);
+}
+
+// With nothing on the wire, give it to the first request that can use
+// it: the one there if its pause is over, a parked one whose pause is
+// over, or the oldest waiting one for a slave with none in flight
+static void async_schedule(void)
+{
+	uint8_t busy = 0;		// slaves with a request in flight or ahead
+	uint32_t handle;
+	uint8_t s;
+
+	if (async_phase == ASYNC_BYTE || async_phase == ASYNC_DMA) {
+		return;
+	}
+	if (async_phase != ASYNC_IDLE) {
+		if (async_ready(async_phase, async_stamp)) {
+			async_send(async_tx);
+			return;
+		}
+		busy |= 1u << async_queue[async_wire % ASYNC_QUEUE_SIZE]->slave;
+	}
+
+	for (s = 0; s < SPI_MAX_SLAVES; s++) {
+		if (async_parked[s].phase == ASYNC_IDLE) {
+			continue;
+		}
+		if (async_ready(async_parked[s].phase, async_parked[s].stamp)) {
+			if (async_phase != ASYNC_IDLE) {
+				async_park();
+			}
+			async_unpark(s);
+			return;
+		}
+		busy |= 1u << s;
+	}
+
+	for (handle = async_tail; handle != async_head; handle++) {
+		s = async_queue[handle % ASYNC_QUEUE_SIZE]->slave;
+		if (async_state[handle % ASYNC_QUEUE_SIZE] == ASYNC_WAITING
+		    && !(busy & (1u << s))) {
+			if (async_phase != ASYNC_IDLE) {
+				async_park();
+			}
+			async_begin(handle);
+			return;
+		}
+		if (async_state[handle % ASYNC_QUEUE_SIZE] != ASYNC_DONE) {
+			busy |= 1u << s;
+		}
+	}
+}
+
+// Complete the request on the wire and give the wire to the next one
+static void async_finish(uint8_t status)
+{
+	struct async_req *req = async_queue[async_wire % ASYNC_QUEUE_SIZE];
+
+	if (SPI1->CR1 & SPI_CR1_DFF) {
+		// out of a WREAD or WWRITE data phase; the slave goes back to
+		// 8-bit frames after the last one, before the next SYNC
+		spi1_set_wide(0);
+		async_settle = 1;
+	}
+
+	async_phase = ASYNC_IDLE;
+	req->status = status;
+	async_state[async_wire % ASYNC_QUEUE_SIZE] = ASYNC_DONE;
+	while (async_tail != async_head
+	       && async_state[async_tail % ASYNC_QUEUE_SIZE] == ASYNC_DONE) {
+		async_tail++;
+	}
+
+	async_schedule();
+
+	if (req->done) {
+		req->done(req);
+	}
+}
+
+// Hand the READ data that came in since the last call to received(), if
+// the slave ACKed the file number; the caller's buffer is the only copy
+static void async_report(struct async_req *req)
+{
+	if (req->received && async_ack && req->length > async_reported) {
+		req->received(req, async_reported, req->length - async_reported);
+		async_reported = req->length;
+	}
+}
+
+// WWRITE: send 16-bit frame k of the data, the last one padded with 0 if
+// the length is odd, or after the last go back to 8-bit frames for the
+// 0xff that brings the ACK back
+static void async_wide_next(struct async_req *req, uint16_t k)
+{
+	uint16_t i = 2 * k;
+
+	if (i < req->size) {
+		async_next(req->data[i] | ((i + 1 < req->size) ? req->data[i + 1] << 8 : 0));
+	}
+	else {
+		spi1_set_wide(0);
+		async_next(0xff);
+	}
+}
+
+// Move the next chunk of a READ or WRITE payload by DMA, at most
+// SPI_DMA_BUF_SIZE bytes so each has the same timeout as before
+static void async_dma_next(void)
+{
+	struct async_req *req = async_queue[async_wire % ASYNC_QUEUE_SIZE];
+	uint8_t wide = (SPI1->CR1 & SPI_CR1_DFF) != 0;
+
+	// whole 16-bit frames with those on
+	async_dma_chunk = async_dma_total - async_dma_pos;
+	if (async_dma_chunk > SPI_DMA_BUF_SIZE) {
+		async_dma_chunk = wide ? SPI_DMA_BUF_SIZE & ~1u : SPI_DMA_BUF_SIZE;
+	}
+
+	async_stamp = DWT->CYCCNT;
+	async_phase = ASYNC_DMA;
+
+	if (req->op == CMD_READ || req->op == CMD_ZREAD || req->op == CMD_BLIST
+	    || req->op == CMD_WREAD) {
+		spi1_dma_start(NULL, req->data + async_dma_pos, async_dma_chunk >> wide);
+	}
+	else {
+		spi1_dma_start(req->data + async_dma_pos, NULL, async_dma_chunk >> wide);
+	}
+}
+
+static void async_dma_done(void)
+{
+	struct async_req *req = async_queue[async_wire % ASYNC_QUEUE_SIZE];
+
+	spi1_dma_stop();
+	async_dma_pos += async_dma_chunk;
+
+	if (req->op == CMD_READ || req->op == CMD_ZREAD || req->op == CMD_BLIST
+	    || req->op == CMD_WREAD) {
+		req->length = async_dma_pos;
+	}
+	if (req->op == CMD_READ || req->op == CMD_WREAD) {
+		async_report(req);
+	}
+	if (async_dma_pos < async_dma_total) {
+		async_dma_next();
+		return;
+	}
+
+	if (req->op == CMD_READ) {
+		async_finish(async_ack ? ASYNC_OK : ASYNC_ERR_FILE);
+	}
+	else if (req->op == CMD_WREAD) {
+		// the odd last byte in a frame of its own
+		if (req->length < req->size) {
+			async_next(0xffff);
+		}
+		else {
+			async_finish(ASYNC_OK);
+		}
+	}
+	else if (req->op == CMD_WWRITE) {
+		async_sent = 7 + async_dma_total / 2;
+		async_wide_next(req, async_dma_total / 2);
+	}
+	else if (req->op == CMD_ZREAD || req->op == CMD_BLIST) {
+		async_finish(ASYNC_OK);
+	}
+	else if (req->op == CMD_ZWRITE) {
+		// on to the dummy byte that brings the ACK back
+		async_sent = 7 + req->size;
+		async_next(0xff);
+	}
+	else if (req->op == CMD_APPEND) {
+		async_sent = 6 + req->size;
+		async_next(0xff);
+	}
+	else {
+		// WRITE: the reply to the last data byte is the ACK
+		async_finish((uint8_t)spi1_dma_sink == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+	}
+}
+
+// CWRITE: start sending chunk async_chunk, or its next byte; its bytes
+// come from data, then its CRC
+static void async_chunk_next(struct async_req *req)
+{
+	uint16_t length = chunk_length(async_chunk, req->size);
+	uint16_t pos = async_cpos;
+
+	async_cpos++;
+	if (pos < length) {
+		async_next(req->data[async_chunk * CRC_CHUNK_SIZE + pos]);
+	}
+	else {
+		async_next((async_crc >> (8 * (pos - length))) & 0xff);
+	}
+}
+
+static void async_chunk_send(struct async_req *req)
+{
+	async_crc = chunk_crc(async_chunk, req->data + async_chunk * CRC_CHUNK_SIZE,
+			      chunk_length(async_chunk, req->size));
+	async_cpos = 0;
+	crc_chunks++;
+	async_chunk_next(req);
+}
+
+// CREAD: ask for chunk async_chunk
+static void async_chunk_request(void)
+{
+	async_cpos = 0;
+	async_crc = 0;
+	async_next(async_chunk & 0x7f);
+}
+
+// The reply to byte async_sent - 1 of the request on the wire is in:
+// byte 0 was SYNC, 1 the command, 2 the 0xff that brings the ACK back
+static void async_rx(uint16_t reply)
+{
+	struct async_req *req = async_queue[async_wire % ASYNC_QUEUE_SIZE];
+	uint16_t n = async_sent;
+	uint16_t i;
+
+	if (n == 1) {
+		async_next(req->op);
+		return;
+	}
+	if (n == 2) {
+		async_next(0xff);
+		return;
+	}
+	if (n == 3 && reply != 1) {
+		async_finish(ASYNC_ERR_NACK);
+		return;
+	}
+
+	switch (req->op)
+	{
+		case CMD_CREATE:
+			// file number, size
+			if (n == 3) {
+				async_next(req->file_number);
+			}
+			else if (n == 4) {
+				async_next((uint8_t)req->size);
+			}
+			else {
+				async_finish(ASYNC_OK);
+			}
+			break;
+
+		case CMD_DELETE:
+			// file number, 0xff for the ACK
+			if (n == 3) {
+				async_next(req->file_number);
+			}
+			else if (n == 4) {
+				async_next(0xff);
+			}
+			else {
+				async_finish(reply == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_READ:
+			// file number, 0xff for the ACK, then 0xff per data byte
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 5) {
+				async_ack = (reply == 1);
+				if (payload_dma && req->size > 0) {
+					async_dma_pos = 0;
+					async_dma_total = req->size;
+					async_dma_next();
+					break;
+				}
+			}
+			else {
+				req->data[req->length] = reply;
+				req->length++;
+				if (req->length - async_reported >= SPI_DMA_BUF_SIZE) {
+					async_report(req);
+				}
+			}
+
+			if (req->length < req->size) {
+				async_next(0xff);
+			}
+			else {
+				async_report(req);
+				async_finish(async_ack ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_WRITE:
+			// file number, 0xff for the ACK, the data; the slave
+			// ACKs the last data byte
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(0xff);
+				break;
+			}
+
+			i = n - 5;
+			if (i == req->size) {
+				async_finish(reply == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			else if (i == 0 && payload_dma) {
+				async_dma_pos = 0;
+				async_dma_total = req->size;
+				async_dma_next();
+			}
+			else {
+				async_next(req->data[i]);
+			}
+			break;
+
+		case CMD_ZWRITE:
+			// file number, 0xff for its ACK, the encoded length, the
+			// encoded bytes, 0xff for the ACK of the whole file
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 5) {
+				if (reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+				}
+				else {
+					async_next(req->size & 0xff);
+				}
+				break;
+			}
+			if (n == 6) {
+				async_next(req->size >> 8);
+				break;
+			}
+
+			i = n - 7;
+			if (i == 0 && payload_dma) {
+				async_dma_pos = 0;
+				async_dma_total = req->size;
+				async_dma_next();
+			}
+			else if (i < req->size) {
+				async_next(req->data[i]);
+			}
+			else if (i == req->size) {
+				async_next(0xff);
+			}
+			else {
+				async_finish(reply == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_ZREAD:
+			// file number, 0xff for the ACK, two for the encoded
+			// length, then 0xff per encoded byte; bytes past the room
+			// in data are clocked out and dropped
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 5) {
+				if (reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+				}
+				else {
+					async_next(0xff);
+				}
+				break;
+			}
+			if (n == 6) {
+				async_zlength = reply;
+				async_next(0xff);
+				break;
+			}
+			if (n == 7) {
+				async_zlength |= reply << 8;
+				if (async_zlength == 0) {
+					async_finish(ASYNC_ERR_FILE);
+				}
+				else if (payload_dma && async_zlength <= req->size) {
+					async_dma_pos = 0;
+					async_dma_total = async_zlength;
+					async_dma_next();
+				}
+				else {
+					async_next(0xff);
+				}
+				break;
+			}
+
+			i = n - 8;
+			if (i < req->size) {
+				req->data[i] = reply;
+				req->length = i + 1;
+			}
+			if (i + 1 < async_zlength) {
+				async_next(0xff);
+			}
+			else {
+				async_finish(async_zlength <= req->size ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_CWRITE:
+			// file number, length, 0xff for the ACK, then per chunk
+			// its bytes, its CRC and 0xff for the number of the
+			// chunk the slave wants next
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(req->size & 0xff);
+				break;
+			}
+			if (n == 5) {
+				async_next(req->size >> 8);
+				break;
+			}
+			if (n == 6) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 7) {
+				if (reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+					break;
+				}
+				async_chunk = 0;
+				async_retries = 0;
+				async_chunk_send(req);
+				break;
+			}
+
+			i = chunk_length(async_chunk, req->size);
+			if (async_cpos < i + 4) {
+				async_chunk_next(req);
+			}
+			else if (async_cpos == i + 4) {
+				async_cpos++;
+				async_next(0xff);
+			}
+			else if (reply == ((async_chunk + 1) & 0x7f)) {
+				async_chunk++;
+				async_retries = 0;
+				if (async_chunk == chunk_count(req->size)) {
+					async_finish(ASYNC_OK);
+				}
+				else {
+					async_chunk_send(req);
+				}
+			}
+			else {
+				crc_resends++;
+				async_retries++;
+				if (async_retries == CRC_RETRIES) {
+					async_finish(ASYNC_ERR_FILE);
+				}
+				else {
+					async_chunk_send(req);
+				}
+			}
+			break;
+
+		case CMD_CREAD:
+			// file number, length, then per chunk its number and
+			// 0xff for each of its bytes and its CRC; the ACK comes
+			// back on the first chunk number
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(req->size & 0xff);
+				break;
+			}
+			if (n == 5) {
+				async_next(req->size >> 8);
+				break;
+			}
+			if (n == 6) {
+				async_chunk = 0;
+				async_retries = 0;
+				async_chunk_request();
+				break;
+			}
+			if (async_cpos == 0) {
+				// the reply to the byte before the chunk number
+				if (n == 7 && reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+					break;
+				}
+				async_cpos = 1;
+				async_next(0xff);
+				break;
+			}
+
+			i = chunk_length(async_chunk, req->size);
+			if (async_cpos <= i) {
+				req->data[async_chunk * CRC_CHUNK_SIZE + async_cpos - 1] = reply;
+			}
+			else {
+				async_crc |= (uint32_t)reply << (8 * (async_cpos - 1 - i));
+			}
+			if (async_cpos < i + 4) {
+				async_cpos++;
+				async_next(0xff);
+				break;
+			}
+
+			crc_chunks++;
+			if (async_crc == chunk_crc(async_chunk,
+						   req->data + async_chunk * CRC_CHUNK_SIZE, i)) {
+				async_chunk++;
+				async_retries = 0;
+				req->length = async_chunk * CRC_CHUNK_SIZE - CRC_CHUNK_SIZE + i;
+				async_report(req);
+				if (async_chunk == chunk_count(req->size)) {
+					async_finish(ASYNC_OK);
+				}
+				else {
+					async_chunk_request();
+				}
+			}
+			else {
+				crc_resends++;
+				async_retries++;
+				if (async_retries == CRC_RETRIES) {
+					async_finish(ASYNC_ERR_FILE);
+				}
+				else {
+					async_chunk_request();
+				}
+			}
+			break;
+
+		case CMD_BLIST:
+			// 0xff for the file count, then the rest of the image
+			// in one DMA burst whatever the handshake, as the slave
+			// staged it all behind the ACK
+			if (n == 3) {
+				async_next(0xff);
+				break;
+			}
+
+			async_dma_total = 1 + LIST_BITMAP_SIZE + 2 * reply;
+			if (reply > MAX_FILE_NUMBER || async_dma_total > req->size) {
+				async_finish(ASYNC_ERR_FILE);
+				break;
+			}
+			req->data[0] = reply;
+			req->length = 1;
+			async_dma_pos = 1;
+			async_dma_next();
+			break;
+
+		case CMD_WREAD:
+			// file number, the length, 0xff for the ACK, then in
+			// 16-bit frames 0xffff per two data bytes; the slave pads
+			// the last frame if the length is odd
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(req->size & 0xff);
+				break;
+			}
+			if (n == 5) {
+				async_next(req->size >> 8);
+				break;
+			}
+			if (n == 6) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 7) {
+				if (reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+					break;
+				}
+				spi1_set_wide(1);
+				// DMA for the whole frames, into an even address
+				if (payload_dma && req->size > 1 && !((uintptr_t)req->data & 1)) {
+					async_dma_pos = 0;
+					async_dma_total = req->size & ~1u;
+					async_dma_next();
+					break;
+				}
+			}
+			else {
+				req->data[req->length] = reply & 0xff;
+				req->length++;
+				if (req->length < req->size) {
+					req->data[req->length] = reply >> 8;
+					req->length++;
+				}
+				if (req->length - async_reported >= SPI_DMA_BUF_SIZE) {
+					async_report(req);
+				}
+			}
+
+			if (req->length < req->size) {
+				async_next(0xffff);
+			}
+			else {
+				async_report(req);
+				async_finish(ASYNC_OK);
+			}
+			break;
+
+		case CMD_COPY:
+		case CMD_MOVE:
+			// source, destination, 0xff for the result
+			if (n == 3) {
+				async_next(req->file_number);
+			}
+			else if (n == 4) {
+				async_next((uint8_t)req->size);
+			}
+			else if (n == 5) {
+				async_next(0xff);
+			}
+			else {
+				async_finish(reply == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_SOPEN:
+			// file number, flags, 0xff for the number opened
+			if (n == 3) {
+				async_next(req->file_number);
+			}
+			else if (n == 4) {
+				async_next((uint8_t)req->size);
+			}
+			else if (n == 5) {
+				async_next(0xff);
+			}
+			else {
+				req->length = reply;
+				async_finish(reply != 0 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_APPEND:
+			// the length, 0xff for the ACK, the data, 0xff for the
+			// ACK of the data
+			if (n == 3) {
+				async_next(req->size & 0xff);
+				break;
+			}
+			if (n == 4) {
+				async_next(req->size >> 8);
+				break;
+			}
+			if (n == 5) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 6) {
+				if (reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+					break;
+				}
+				if (payload_dma) {
+					async_dma_pos = 0;
+					async_dma_total = req->size;
+					async_dma_next();
+					break;
+				}
+			}
+
+			i = n - 6;
+			if (i < req->size) {
+				async_next(req->data[i]);
+			}
+			else if (i == req->size) {
+				async_next(0xff);
+			}
+			else {
+				async_finish(reply == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_SCLOSE:
+			// the file's size, staged behind the ACK
+			if (n == 3) {
+				async_next(0xff);
+			}
+			else if (n == 4) {
+				req->length = reply;
+				async_next(0xff);
+			}
+			else {
+				req->length |= reply << 8;
+				async_finish(ASYNC_OK);
+			}
+			break;
+
+		case CMD_WWRITE:
+			// file number, the length, 0xff for the ACK, the data in
+			// 16-bit frames, then 0xff in an 8-bit one for the ACK of
+			// the whole file
+			if (n == 3) {
+				async_next(req->file_number);
+				break;
+			}
+			if (n == 4) {
+				async_next(req->size & 0xff);
+				break;
+			}
+			if (n == 5) {
+				async_next(req->size >> 8);
+				break;
+			}
+			if (n == 6) {
+				async_next(0xff);
+				break;
+			}
+			if (n == 7) {
+				if (reply != 1) {
+					async_finish(ASYNC_ERR_FILE);
+					break;
+				}
+				spi1_set_wide(1);
+				if (payload_dma && req->size > 1 && !((uintptr_t)req->data & 1)) {
+					async_dma_pos = 0;
+					async_dma_total = req->size & ~1u;
+					async_dma_next();
+					break;
+				}
+			}
+
+			i = n - 7;
+			if (i <= (req->size + 1) / 2) {
+				async_wide_next(req, i);
+			}
+			else {
+				async_finish(reply == 1 ? ASYNC_OK : ASYNC_ERR_FILE);
+			}
+			break;
+
+		case CMD_LIST:
+			// 0xff until a 0 comes back
+			if (n > 3) {
+				if (reply == 0) {
+					async_finish(ASYNC_OK);
+					break;
+				}
+				if (req->length < req->size) {
+					req->data[req->length] = reply;
+					req->length++;
+				}
+			}
+			async_next(0xff);
+			break;
+
+		default:
+			async_finish(ASYNC_ERR_NACK);
+	}
+}
+
+// Queue a request. Returns its handle, or -1 while the queue is full.
+// done(), if set, runs from the SPI1 or DMA interrupt (or from async_poll()
+// on a timeout); it may submit another request but not wait for one. A
+// READ's received(), if set, runs from the same places each time a DMA
+// chunk, or SPI_DMA_BUF_SIZE bytes, or the rest of the file has landed in
+// data, so the data can go on before the whole file is in. The request
+// and its data have to stay put until it completes. Requests do not
+// update the master cache; the blocking calls do that.
+int32_t async_submit(struct async_req *req)
+{
+	uint32_t handle;
+
+	if (async_head - async_tail >= ASYNC_QUEUE_SIZE) {
+		return -1;
+	}
+
+	req->status = ASYNC_PENDING;
+	req->length = 0;
+
+	NVIC_DisableIRQ(SPI1_IRQn);
+	NVIC_DisableIRQ(DMA2_Stream0_IRQn);
+
+	handle = async_head;
+	async_queue[handle % ASYNC_QUEUE_SIZE] = req;
+	async_state[handle % ASYNC_QUEUE_SIZE] = ASYNC_WAITING;
+	async_head = handle + 1;
+	async_schedule();
+
+	NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+	NVIC_EnableIRQ(SPI1_IRQn);
+
+	return (int32_t)handle;
+}
+
+// Returns 1 once the request is complete. Also runs what waits on time
+// rather than on an interrupt: the next byte once the turnaround or the
+// delay handshake's pause is over, and giving up on a reply or a DMA
+// transfer that did not come.
+int async_poll(int32_t handle)
+{
+	enum async_phase phase = async_phase;
+	uint32_t stamp = async_stamp;
+	uint32_t limit;
+
+	if (phase != ASYNC_BYTE && phase != ASYNC_DMA) {
+		// nothing on the wire, no interrupt to race with
+		if (async_tail != async_head) {
+			async_schedule();
+		}
+	}
+	else {
+		limit = (phase == ASYNC_DMA) ? SPI_DMA_TIMEOUT_US : SPI_RX_TIMEOUT_US;
+		if (DWT->CYCCNT - stamp > limit * CPU_CYCLES_PER_US) {
+			NVIC_DisableIRQ(SPI1_IRQn);
+			NVIC_DisableIRQ(DMA2_Stream0_IRQn);
+
+			// unless the reply came in while we looked at the clock
+			if (phase == async_phase && stamp == async_stamp) {
+				if (phase == ASYNC_DMA) {
+					spi1_dma_stop();
+				}
+				SPI1->CR2 &= ~SPI_CR2_TXEIE;
+				spi_rx_timeouts++;
+				async_finish(ASYNC_ERR_TIMEOUT);
+			}
+
+			NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+			NVIC_EnableIRQ(SPI1_IRQn);
+		}
+	}
+
+	return (int32_t)((uint32_t)handle - async_tail) < 0
+	       || async_state[(uint32_t)handle % ASYNC_QUEUE_SIZE] == ASYNC_DONE;
+}
+
+// Wait for a request and return its status. The request has to be the
+// one the handle was given for, not yet reused by a later submit.
+uint8_t async_wait(int32_t handle)
+{
+	struct async_req *req = async_queue[(uint32_t)handle % ASYNC_QUEUE_SIZE];
+
+	while (!async_poll(handle)) {
+		if (handshake_mode == HANDSHAKE_DELAY
+		    && async_phase != ASYNC_BYTE && async_phase != ASYNC_DMA) {
+			HAL_Delay(1);
+		}
+	}
+
+	return req->status;
+}
+
+// Submit and wait, for the blocking calls
+static uint8_t async_run(struct async_req *req)
+{
+	int32_t handle;
+
+	while ((handle = async_submit(req)) < 0) {
+		async_poll((int32_t)async_tail);
+	}
+
+	return async_wait(handle);
+}
+
+// CWRITE and CREAD recover from bad chunks on their own, but not from a
+// hit on the command bytes around them; those run again from the start
+static uint8_t async_run_checked(struct async_req *req)
+{
+	uint8_t status = async_run(req);
+	uint8_t tries = 1;
+
+	while ((req->op == CMD_CWRITE || req->op == CMD_CREAD) && tries < CRC_RETRIES
+	       && (status == ASYNC_ERR_FILE || status == ASYNC_ERR_TIMEOUT)) {
+		status = async_run(req);
+		tries++;
+	}
+	return status;
+}
+
+// The blocking byte calls wait until the queue is empty, and talk to
+// spi_slave whichever slave the last request went to
+static void async_drain(void)
+{
+	while (async_tail != async_head) {
+		async_poll((int32_t)(async_head - 1));
+	}
+	if (async_settle) {
+		async_settle = 0;
+		delay_us(SPI_TURNAROUND_US);
+	}
+	spi_select(spi_slave);
+}
+
+
+void create(uint8_t file_number, uint8_t file_size)
+{
+	struct async_req req = {0};
+	STATS_START(stats_t0);
+
+	cache_flush(file_number);
+
+	req.op = CMD_CREATE;
+	req.slave = spi_slave;
+	req.file_number = file_number;
+	req.size = file_size;
+
+	if (async_run(&req) == ASYNC_OK) {
+		cache_set_size(file_number, file_size);
+	}
+	else {
+		STATS_COUNT(stats_no_ack[CMD_CREATE]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_CREATE], stats_t0);
+}
+
+
+// CREATE in the lowest unused file number. Returns that number, or 0 if
+// the table or the block pool is full.
+uint8_t create_free(uint8_t file_size)
+{
+	uint8_t file_number = 0;
+	STATS_START(stats_t0);
+
+        spi1_transfer(0xfe);                    // SYNC
+        spi1_transfer(CMD_CREATE_FREE);         // CREATE_FREE
+        spi1_transfer(0xff);                    // 0xff
+
+        if (rxData1_f == 1 && rxData1 == 1) {
+
+                spi1_transfer(file_size);                   // file size
+                spi1_transfer(0xff);                        // send dummy byte 0xff
+
+		if (rxData1_f == 1) {
+			file_number = rxData1;              // file number
+		}
+		if (file_number != 0) {
+			cache_set_size(file_number, file_size);
+		}
+
+		rxData1_f = 0;
+        }
+	else {
+		STATS_COUNT(stats_no_ack[CMD_CREATE_FREE]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_CREATE_FREE], stats_t0);
+	return file_number;
+}
+
+
+void delete(uint8_t file_number)
+{
+	struct async_req req = {0};
+	uint8_t status;
+	STATS_START(stats_t0);
+
+	cache_flush(file_number);
+
+	req.op = CMD_DELETE;
+	req.slave = spi_slave;
+	req.file_number = file_number;
+
+	status = async_run(&req);
+	if (status == ASYNC_OK) {
+		cache_set_size(file_number, 0);
+	}
+	else if (status == ASYNC_ERR_NACK) {
+		printf("Delete error! \n\n");
+		STATS_COUNT(stats_no_ack[CMD_DELETE]);
+	}
+	else {
+		printf("master Delete: No ACK received after sending file number");
+		STATS_COUNT(stats_no_ack[CMD_DELETE]);
+		cache_forget(file_number);
+	}
+
+	STATS_STOP(stats_cmd[CMD_DELETE], stats_t0);
+}
+
+
+// COPY or MOVE: the slave does the work, so three bytes cross the wire
+// whatever the file's size
+static int copy_move(uint8_t cmd, uint8_t src, uint8_t dst)
+{
+	struct async_req req = {0};
+	int32_t size;
+	STATS_START(stats_t0);
+
+	// write-back: the slave must have the source as the cache holds it
+	if (cache_mode == CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+	size = cache_size(src);
+
+	req.op = cmd;
+	req.slave = spi_slave;
+	req.file_number = src;
+	req.size = dst;
+
+	if (async_run(&req) != ASYNC_OK) {
+		STATS_COUNT(stats_no_ack[cmd]);
+		STATS_STOP(stats_cmd[cmd], stats_t0);
+		return -1;
+	}
+
+	// the destination now holds what the source did
+	cache_forget(dst);
+	if (size >= 0) {
+		cache_set_size(dst, (uint16_t)size);
+	}
+	if (cmd == CMD_MOVE) {
+		cache_set_size(src, 0);
+	}
+
+	STATS_STOP(stats_cmd[cmd], stats_t0);
+	return 0;
+}
+
+int copy_file(uint8_t src, uint8_t dst)
+{
+	return copy_move(CMD_COPY, src, dst);
+}
+
+int move_file(uint8_t src, uint8_t dst)
+{
+	return copy_move(CMD_MOVE, src, dst);
+}
+
+
+
+// Buffer for the encoded side of ZREAD and ZWRITE
+static uint8_t packed[READ_BUF_SIZE];
+
+// The master's receive buffer, see read_buffer()
+static uint8_t read_buf[READ_BUF_SIZE];
+
+// ZREAD into data, room bytes at most. Returns the file's length, or -1
+// if the slave would not send it compressed.
+static int32_t read_compressed(uint8_t file_number, uint8_t *data, uint16_t room)
+{
+	struct async_req req = {0};
+	int32_t length;
+	STATS_START(stats_t0);
+
+	req.op = CMD_ZREAD;
+	req.slave = spi_slave;
+	req.file_number = file_number;
+	req.size = sizeof(packed);
+	req.data = packed;
+
+	if (async_run(&req) != ASYNC_OK) {
+		STATS_STOP(stats_cmd[CMD_ZREAD], stats_t0);
+		return -1;
+	}
+
+	length = rle_decode(packed, req.length, data, room);
+	if (length >= 0) {
+		compress_plain_bytes += length;
+		compress_wire_bytes += req.length + 2;	// with the length bytes
+	}
+
+	STATS_STOP(stats_cmd[CMD_ZREAD], stats_t0);
+	return length;
+}
+
+// CREAD with CRC-checked chunks on, else WREAD with 16-bit frames on,
+// else the plain READ
+static uint8_t read_op(uint16_t size)
+{
+	if (size == 0) {
+		return CMD_READ;
+	}
+	if (payload_crc) {
+		return CMD_CREAD;
+	}
+	return payload_wide ? CMD_WREAD : CMD_READ;
+}
+
+// READ the whole file into data, size bytes, compressed first if that is
+// on. Returns the bytes read, or -1 if the slave did not ACK the command
+// or the file number.
+int32_t read_file(uint8_t file_number, uint8_t *data, uint16_t size)
+{
+	struct async_req req = {0};
+	uint8_t status;
+	STATS_START(stats_t0);
+
+	cache_flush(file_number);
+
+	// the slave sends it plain if encoding would not save anything
+	if (!payload_crc && payload_compress
+	    && read_compressed(file_number, data, size) == size) {
+		cache_fill(file_number, data, size);
+		STATS_STOP(stats_cmd[CMD_READ], stats_t0);
+		return size;
+	}
+
+	req.op = read_op(size);
+	req.slave = spi_slave;
+	req.file_number = file_number;
+	req.size = size;
+	req.data = data;
+
+	status = async_run_checked(&req);
+	if (status == ASYNC_ERR_NACK && req.op != CMD_READ) {
+		req.op = CMD_READ;
+		status = async_run(&req);
+	}
+	if (payload_compress && status == ASYNC_OK) {
+		compress_plain_bytes += req.length;
+		compress_wire_bytes += req.length;
+	}
+	if (status == ASYNC_OK) {
+		cache_fill(file_number, data, size);
+	}
+	else if (status == ASYNC_ERR_NACK) {
+		printf("Read error! \n\n");
+		STATS_COUNT(stats_no_ack[CMD_READ]);
+	}
+	else {
+		printf("master Read: No ACK received after sending file number");
+		STATS_COUNT(stats_no_ack[CMD_READ]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_READ], stats_t0);
+	return (status == ASYNC_OK) ? size : -1;
+}
+
+// The file without a copy: the cached contents if the cache has all size
+// bytes, else READ into the master's receive buffer, which stays valid
+// until the next read_buffer() or read_stream(). Files past READ_BUF_SIZE
+// are read only that far. Returns NULL if the read failed.
+const uint8_t *read_buffer(uint8_t file_number, uint16_t size, uint16_t *length)
+{
+	const uint8_t *data;
+	uint16_t cached_size;
+
+	if (size > READ_BUF_SIZE) {
+		size = READ_BUF_SIZE;
+	}
+
+	data = cache_data(file_number, &cached_size);
+	if (data && cached_size == size) {
+		*length = size;
+		return data;
+	}
+
+	if (read_file(file_number, read_buf, size) < 0) {
+		return NULL;
+	}
+	*length = size;
+	return read_buf;
+}
+
+struct read_target
+{
+	read_sink sink;
+	void *context;
+};
+
+static void read_received(struct async_req *req, uint16_t offset, uint16_t length)
+{
+	const struct read_target *to = req->context;
+
+	to->sink(req->data + offset, length, to->context);
+}
+
+// READ the file into the receive buffer and hand each piece to sink as it
+// lands, so a slow sink (a UART) runs alongside the SPI transfer and
+// nothing is copied in between. Never ZREAD, whose data is of no use to
+// the sink before the whole file is decoded; CREAD with payload_crc on,
+// each chunk handed on once its CRC checks, but not run again from the
+// start; WREAD with payload_wide on. Returns 0, or -1 if the read failed;
+// the sink may have had part of the file by then.
+int read_stream(uint8_t file_number, uint16_t size, read_sink sink, void *context)
+{
+	struct read_target to = {sink, context};
+	struct async_req req = {0};
+	const uint8_t *data;
+	uint16_t cached_size;
+	uint8_t status;
+	STATS_START(stats_t0);
+
+	if (size > READ_BUF_SIZE) {
+		size = READ_BUF_SIZE;
+	}
+
+	data = cache_data(file_number, &cached_size);
+	if (data && cached_size == size) {
+		sink(data, size, context);
+		sink(data + size, 0, context);
+		return 0;
+	}
+	cache_flush(file_number);
+
+	req.op = read_op(size);
+	req.slave = spi_slave;
+	req.file_number = file_number;
+	req.size = size;
+	req.data = read_buf;
+	req.received = read_received;
+	req.context = &to;
+
+	status = async_run(&req);
+	if (status == ASYNC_ERR_NACK && req.op == CMD_WREAD) {
+		req.op = CMD_READ;
+		status = async_run(&req);
+	}
+	sink(read_buf + req.length, 0, context);	// done with read_buf
+
+	if (status == ASYNC_OK) {
+		cache_fill(file_number, read_buf, size);
+	}
+	else {
+		STATS_COUNT(stats_no_ack[CMD_READ]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_READ], stats_t0);
+	return (status == ASYNC_OK) ? 0 : -1;
+}
+
+
+// USART2, the monitor's console, as a read_stream() sink: each piece goes
+// out by DMA (DMA1 stream 6, channel 4) straight from the receive buffer.
+// Pieces that come in while a transfer runs are joined, as they follow
+// each other in the buffer, and sent when it completes.
+#define DMA_CHANNEL4	DMA_SxCR_CHSEL_2
+#define DMA_FLAGS_S6	(0x3du << 16)
+
+static const uint8_t * volatile uart_next;	// start of the pieces waiting
+static volatile uint16_t uart_pending;		// their bytes
+static volatile uint8_t uart_busy;
+
+static void uart_dma_start(const uint8_t *data, uint16_t length)
+{
+	uart_busy = 1;
+	DMA1->HIFCR = DMA_FLAGS_S6;
+	dma_stream_start(DMA1_Stream6, DMA_CHANNEL4, &USART2->DR, data, length,
+			 DMA_SxCR_DIR_0 | DMA_SxCR_MINC | DMA_SxCR_TCIE);
+	USART2->CR3 |= USART_CR3_DMAT;
+}
+
+void DMA1_Stream6_IRQHandler(void)
+{
+	if (DMA1->HISR & DMA_HISR_TCIF6) {
+		DMA1->HIFCR = DMA_HIFCR_CTCIF6;
+
+		if (uart_pending > 0) {
+			uart_dma_start(uart_next, uart_pending);
+			uart_pending = 0;
+		}
+		else {
+			USART2->CR3 &= ~USART_CR3_DMAT;
+			uart_busy = 0;
+		}
+	}
+}
+
+void uart_dma_sink(const uint8_t *data, uint16_t length, void *context)
+{
+	uint32_t start;
+
+	(void)context;
+
+	if (length == 0) {
+		start = DWT->CYCCNT;
+		while (uart_busy
+		       && DWT->CYCCNT - start < UART_DMA_TIMEOUT_US * CPU_CYCLES_PER_US);
+		return;
+	}
+
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+
+	NVIC_DisableIRQ(DMA1_Stream6_IRQn);
+	if (!uart_busy) {
+		uart_dma_start(data, length);
+	}
+	else {
+		if (uart_pending == 0) {
+			uart_next = data;
+		}
+		uart_pending += length;
+	}
+	NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+}
+
+
+
+
+// para[0] is the file number, para[1] to para[para_num - 1] the data
+void write(uint8_t para_num, uint32_t * para)
+{
+	uint8_t data[0xff];
+	uint8_t i = 0;
+
+	for (i = 1; i < para_num; i++) {
+		data[i - 1] = (uint8_t)*(para + i);
+	}
+
+	write_file((uint8_t)*para, data, (para_num > 0) ? para_num - 1 : 0);
+}
+
+// WRITE the whole file. Returns 0 if the slave acknowledged the data.
+int write_file(uint8_t file_number, const uint8_t *data, uint16_t length)
+{
+	struct async_req req = {0};
+	uint8_t status = ASYNC_ERR_NACK;
+	uint16_t packed_length = 0;
+	int rc = -1;
+	STATS_START(stats_t0);
+
+	// CWRITE if CRC-checked chunks are on, else ZWRITE if encoding saves
+	// anything, else WWRITE if 16-bit frames are on; either way the plain
+	// WRITE if the slave does not take it
+	if (payload_crc && length > 0) {
+		req.op = CMD_CWRITE;
+		req.slave = spi_slave;
+		req.file_number = file_number;
+		req.size = length;
+		req.data = (uint8_t *)data;		// only read
+
+		status = async_run_checked(&req);
+	}
+	else if (payload_compress && length > 1 && length <= sizeof(packed)) {
+		packed_length = rle_encode(data, length, packed, length - 1);
+	}
+	if (packed_length > 0) {
+		req.op = CMD_ZWRITE;
+		req.slave = spi_slave;
+		req.file_number = file_number;
+		req.size = packed_length;
+		req.data = packed;
+
+		status = async_run(&req);
+	}
+	else if (!payload_crc && payload_wide && length > 0) {
+		req.op = CMD_WWRITE;
+		req.slave = spi_slave;
+		req.file_number = file_number;
+		req.size = length;
+		req.data = (uint8_t *)data;		// only read
+
+		status = async_run(&req);
+	}
+
+	if (status == ASYNC_ERR_NACK) {
+		packed_length = 0;
+		req.op = CMD_WRITE;
+		req.slave = spi_slave;
+		req.file_number = file_number;
+		req.size = length;
+		req.data = (uint8_t *)data;		// only read
+
+		status = async_run(&req);
+	}
+
+	if (payload_compress && status == ASYNC_OK) {
+		compress_plain_bytes += length;
+		compress_wire_bytes += (packed_length > 0) ? packed_length + 2 : length;
+	}
+	if (status == ASYNC_OK) {
+		cache_fill(file_number, data, length);
+		rc = 0;
+	}
+	else if (status == ASYNC_ERR_NACK || status == ASYNC_ERR_FILE) {
+		printf("Write error! \n\n");
+		STATS_COUNT(stats_no_ack[CMD_WRITE]);
+	}
+	else {
+		printf("master Write: No ACK received after data");
+		STATS_COUNT(stats_no_ack[CMD_WRITE]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_WRITE], stats_t0);
+	return rc;
+}
+
+
+
+
+
+// The file stream_open() opened, 0 if none, and the buffers stream_feed()
+// fills in turn
+static uint8_t stream_number = 0;
+static uint8_t stream_buf[2][STREAM_CHUNK_SIZE];
+
+// Open a file for APPEND: file_number, or the lowest free one with 0,
+// emptied first with STREAM_NEW. Returns the file number, or 0 if the
+// slave opened none. The slave has one file open at a time; opening
+// another replaces it.
+uint8_t stream_open(uint8_t file_number, uint8_t flags)
+{
+	struct async_req req = {0};
+	STATS_START(stats_t0);
+
+	// write-back: what the cache holds for it goes first
+	if (cache_mode == CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+
+	req.op = CMD_SOPEN;
+	req.slave = spi_slave;
+	req.file_number = file_number;
+	req.size = flags;
+
+	stream_number = (async_run(&req) == ASYNC_OK) ? (uint8_t)req.length : 0;
+	if (stream_number != 0) {
+		cache_forget(stream_number);
+	}
+	else {
+		STATS_COUNT(stats_no_ack[CMD_SOPEN]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_SOPEN], stats_t0);
+	return stream_number;
+}
+
+// APPEND length bytes to the open file. Returns 0 once the slave has
+// them all, -1 if it did not take them (nothing open, or no room).
+int stream_append(const uint8_t *data, uint16_t length)
+{
+	struct async_req req = {0};
+	uint8_t status;
+	STATS_START(stats_t0);
+
+	if (length == 0) {
+		return 0;
+	}
+
+	req.op = CMD_APPEND;
+	req.slave = spi_slave;
+	req.size = length;
+	req.data = (uint8_t *)data;		// only read
+
+	status = async_run(&req);
+	if (status != ASYNC_OK) {
+		STATS_COUNT(stats_no_ack[CMD_APPEND]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_APPEND], stats_t0);
+	return (status == ASYNC_OK) ? 0 : -1;
+}
+
+// APPEND what source fills in, up to STREAM_CHUNK_SIZE bytes a call,
+// until it returns 0. Two buffers take turns, so source fills one while
+// the other is on the wire. Returns the bytes appended, or -1 if an
+// APPEND failed; source is not called again after that.
+int32_t stream_feed(stream_source source, void *context)
+{
+	struct async_req req[2];
+	int32_t handle[2] = {-1, -1};
+	int32_t total = 0;
+	uint16_t length;
+	uint8_t k = 0;
+	int failed = 0;
+
+	for (;;) {
+		if (handle[k] >= 0 && async_wait(handle[k]) != ASYNC_OK) {
+			failed = 1;
+		}
+		handle[k] = -1;
+
+		length = failed ? 0 : source(stream_buf[k], STREAM_CHUNK_SIZE, context);
+		if (length == 0) {
+			break;
+		}
+
+		memset(&req[k], 0, sizeof(req[k]));
+		req[k].op = CMD_APPEND;
+		req[k].slave = spi_slave;
+		req[k].size = length;
+		req[k].data = stream_buf[k];
+
+		while ((handle[k] = async_submit(&req[k])) < 0) {
+			async_poll((int32_t)async_tail);
+		}
+		total += length;
+		k ^= 1;
+	}
+
+	k ^= 1;
+	if (handle[k] >= 0 && async_wait(handle[k]) != ASYNC_OK) {
+		failed = 1;
+	}
+
+	if (failed) {
+		STATS_COUNT(stats_no_ack[CMD_APPEND]);
+	}
+	return failed ? -1 : total;
+}
+
+// Close the open file. Returns its size, or -1 if none was open.
+int32_t stream_close(void)
+{
+	struct async_req req = {0};
+	uint8_t status;
+	STATS_START(stats_t0);
+
+	req.op = CMD_SCLOSE;
+	req.slave = spi_slave;
+
+	status = async_run(&req);
+	if (status == ASYNC_OK && stream_number != 0) {
+		cache_set_size(stream_number, req.length);
+	}
+	else if (status != ASYNC_OK) {
+		STATS_COUNT(stats_no_ack[CMD_SCLOSE]);
+	}
+	stream_number = 0;
+
+	STATS_STOP(stats_cmd[CMD_SCLOSE], stats_t0);
+	return (status == ASYNC_OK) ? req.length : -1;
+}
+
+
+
+// SNAPSHOT/RESTORE bursts, each at most what one DMA transfer moves
+static uint8_t snap_tx[SPI_DMA_BUF_SIZE];
+static uint8_t snap_rx[SPI_DMA_BUF_SIZE];
+
+// SYNC, the command and its ACK, then the image length: sent, or with
+// length NULL received. Returns 0, or -1 if the slave did not ACK.
+static int snap_start(uint8_t cmd, uint32_t *length)
+{
+	uint8_t i;
+
+        spi1_transfer(0xfe);                    // SYNC
+        spi1_transfer(cmd);                     // SNAPSHOT or RESTORE
+        spi1_transfer(0xff);                    // 0xff
+
+        if (rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[cmd]);
+		return -1;
+	}
+
+	if (cmd == CMD_SNAPSHOT) {
+		*length = 0;
+		for (i = 0; i < 4; i++) {
+			*length |= (uint32_t)spi1_transfer(0xff) << (8 * i);
+		}
+		return (rxData1_f == 1) ? 0 : -1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		spi1_transfer((*length >> (8 * i)) & 0xff);
+	}
+	spi1_transfer(0xff);                    // ACK of the length
+	return (rxData1_f == 1 && rxData1 == 1) ? 0 : -1;
+}
+
+// Take the slave's whole file table in one SNAPSHOT and hand the image to
+// sink a burst at a time, then a last call with length 0. The bursts
+// follow each other back to back whatever the handshake. Returns the
+// image length, or -1 if the slave did not ACK, a burst timed out or the
+// image failed its CRC.
+int32_t snapshot(read_sink sink, void *context)
+{
+	uint32_t length, done, crc = 0xffffffffu, got = 0;
+	uint16_t chunk, i;
+	int rc = 0;
+	STATS_START(stats_t0);
+
+	// write-back: the slave gets what the cache holds first
+	if (cache_mode == CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+
+	if (snap_start(CMD_SNAPSHOT, &length) != 0 || length < 5 || length > SNAP_MAX_SIZE) {
+		rxData1_f = 0;
+		STATS_STOP(stats_cmd[CMD_SNAPSHOT], stats_t0);
+		return -1;
+	}
+
+	memset(snap_tx, 0xff, sizeof(snap_tx));
+	for (done = 0; done < length && rc == 0; done += chunk) {
+		chunk = (length - done > sizeof(snap_rx)) ? sizeof(snap_rx) : length - done;
+		rc = spi1_transfer_burst(snap_tx, snap_rx, chunk);
+
+		for (i = 0; i < chunk; i++) {
+			if (done + i < length - 4) {
+				crc = snap_crc_byte(crc, snap_rx[i]);
+			}
+			else {
+				got |= (uint32_t)snap_rx[i] << (8 * (done + i - (length - 4)));
+			}
+		}
+		sink(snap_rx, chunk, context);
+	}
+	sink(snap_rx, 0, context);
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_SNAPSHOT], stats_t0);
+	return (rc == 0 && got == ~crc) ? (int32_t)length : -1;
+}
+
+// Replace the slave's whole file table with a SNAPSHOT image of length
+// bytes, taken from source a burst at a time and sent back to back. A
+// source that runs short is padded, and the CRC then fails. Returns 0
+// once the slave has checked the image and applied it, -1 if it refused
+// the length, the table or the CRC; after a bad CRC the files are there
+// but their contents are not to be trusted.
+int restore(stream_source source, void *context, uint32_t length)
+{
+	uint32_t done;
+	uint16_t chunk, got;
+	int rc = 0;
+	uint8_t n;
+	STATS_START(stats_t0);
+
+	// the cache knows nothing about the files that come back
+	if (cache_mode == CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		cache_forget(n);
+	}
+
+	if (snap_start(CMD_RESTORE, &length) != 0) {
+		rxData1_f = 0;
+		STATS_STOP(stats_cmd[CMD_RESTORE], stats_t0);
+		return -1;
+	}
+
+	for (done = 0; done < length && rc == 0; done += chunk) {
+		chunk = (length - done > sizeof(snap_tx)) ? sizeof(snap_tx) : length - done;
+		got = source(snap_tx, chunk, context);
+		if (got < chunk) {
+			memset(snap_tx + got, 0, chunk - got);
+		}
+		rc = spi1_transfer_burst(snap_tx, snap_rx, chunk);
+	}
+
+	spi1_transfer(0xff);                    // 1 if the image checked out
+	if (rc != 0 || rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[CMD_RESTORE]);
+		rc = -1;
+	}
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_RESTORE], stats_t0);
+	return rc;
+}
+
+
+
+// Master clock divisor; only changed between bytes
+static void spi1_set_br(uint8_t br)
+{
+        while (SPI1->SR & SPI_SR_BSY);
+        SPI1->CR1 = (SPI1->CR1 & ~SPI_CR1_BR) | (br * SPI_CR1_BR_0);
+}
+
+// Run the test pattern at divisor br. The command, the slave's ACK and its
+// verdict go at the current divisor, only the pattern at br, so a bad
+// clock cannot lose the command itself. Returns 0 if every byte made it
+// there and back, -1 if the slave refused br, else the bytes that did not.
+static int baud_probe(uint8_t br)
+{
+	uint8_t reply;
+	int bad = 0;
+	uint8_t i;
+
+        spi1_transfer(0xfe);                    // SYNC
+        spi1_transfer(CMD_BAUD);                // BAUD
+        spi1_transfer(0xff);                    // 0xff
+
+        if (rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[CMD_BAUD]);
+		return -1;
+	}
+
+	spi1_transfer(br);                      // proposed divisor
+	spi1_transfer(0xff);                    // send dummy byte 0xff
+        if (rxData1_f != 1 || rxData1 != 1) {
+		return -1;
+	}
+
+	spi1_set_br(br);
+	for (i = 0; i < BAUD_PATTERN_SIZE; i++) {
+		reply = spi1_transfer(baud_pattern[i]);
+		// each byte comes back on the next one
+		if (i > 0 && (rxData1_f != 1 || reply != baud_pattern[i - 1])) {
+			bad++;
+		}
+	}
+	spi1_set_br(spi_link_br);
+
+	reply = spi1_transfer(0xff);            // the slave's error count
+	if (rxData1_f != 1) {
+		reply = BAUD_PATTERN_SIZE;
+	}
+	if (reply > bad) {
+		bad = reply;
+	}
+
+	if (bad != 0) {
+		// the slave may have lost bytes too: clock it back to SYNC
+		for (i = 0; i < BAUD_PATTERN_SIZE; i++) {
+			spi1_transfer(0xff);
+		}
+	}
+
+	return bad;
+}
+
+// Step the clock up from the current divisor towards fastest_br, probing
+// each one, and stay at the last that passed. If the current divisor
+// fails its own probe, start again from the slowest. Returns the divisor
+// in use, which spi_init() keeps for the rest of the session.
+uint8_t baud_negotiate(uint8_t fastest_br)
+{
+	int bad;
+	uint8_t br;
+
+	if (spi_link_br != SPI_BR_SLOWEST && baud_probe(spi_link_br) != 0) {
+		printf("100MHz/%u failed, back to the slowest clock\n", 2u << spi_link_br);
+		spi_link_br = SPI_BR_SLOWEST;
+		spi1_set_br(spi_link_br);
+	}
+
+	for (br = spi_link_br; br > fastest_br; br--) {
+		bad = baud_probe(br - 1);
+		if (bad < 0) {
+			printf("100MHz/%u refused by the slave\n", 2u << (br - 1));
+			break;
+		}
+		if (bad > 0) {
+			printf("100MHz/%u: %d of %d bytes wrong\n", 2u << (br - 1), bad,
+			       BAUD_PATTERN_SIZE);
+			break;
+		}
+		printf("100MHz/%u: ok\n", 2u << (br - 1));
+		spi_link_br = br - 1;
+		spi1_set_br(spi_link_br);
+	}
+
+	return spi_link_br;
+}
+
+
+// Send the range arguments and take the slave's ACK, or NACK (0) if the
+// range is not inside the file
+static int range_start(uint8_t cmd, uint8_t file_number, uint16_t offset, uint16_t length)
+{
+        spi1_transfer(0xfe);                    // SYNC
+        spi1_transfer(cmd);                     // PREAD or PWRITE
+        spi1_transfer(0xff);                    // 0xff
+
+        if (rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[cmd]);
+		return -1;
+	}
+
+	spi1_transfer(file_number);             // file number
+	spi1_transfer(offset & 0xff);           // offset
+	spi1_transfer(offset >> 8);
+	spi1_transfer(length & 0xff);           // length
+	spi1_transfer(length >> 8);
+	spi1_transfer(0xff);                    // send dummy byte 0xff
+
+	return (rxData1_f == 1 && rxData1 == 1) ? 0 : -1;
+}
+
+// READ length bytes from offset into data. Only the range goes over the
+// wire. Returns 0, or -1 if the slave refused the range or stopped replying.
+int read_range(uint8_t file_number, uint16_t offset, uint8_t *data, uint16_t length)
+{
+	uint16_t i, done, chunk;
+	int rc = 0;
+	STATS_START(stats_t0);
+
+	cache_flush(file_number);
+
+	if (range_start(CMD_PREAD, file_number, offset, length) != 0) {
+		rxData1_f = 0;
+		STATS_STOP(stats_cmd[CMD_PREAD], stats_t0);
+		return -1;
+	}
+
+	if (payload_dma && length > 0) {
+		for (done = 0; done < length && rc == 0; done += chunk) {
+			chunk = length - done;
+			if (chunk > SPI_DMA_BUF_SIZE) {
+				chunk = SPI_DMA_BUF_SIZE;
+			}
+			rc = spi1_transfer_dma(NULL, data + done, chunk);
+		}
+	}
+	else {
+		for (i = 0; i < length; i++) {
+			spi1_transfer(0xff);			// send 0xff
+			data[i] = rxData1;
+			if (rxData1_f != 1) {
+				rc = -1;
+			}
+		}
+	}
+
+	if (rc == 0) {
+		cache_patch(file_number, offset, data, length);
+	}
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_PREAD], stats_t0);
+	return rc;
+}
+
+// WRITE length bytes at offset, leaving the rest of the file as it is.
+// Returns 0 once the slave acknowledged the data.
+int write_range(uint8_t file_number, uint16_t offset, const uint8_t *data, uint16_t length)
+{
+	uint16_t i, done, chunk;
+	int rc = 0;
+	STATS_START(stats_t0);
+
+	if (range_start(CMD_PWRITE, file_number, offset, length) != 0) {
+		rxData1_f = 0;
+		STATS_STOP(stats_cmd[CMD_PWRITE], stats_t0);
+		return -1;
+	}
+	if (length == 0) {
+		rxData1_f = 0;
+		STATS_STOP(stats_cmd[CMD_PWRITE], stats_t0);
+		return 0;
+	}
+
+	if (payload_dma) {
+		for (done = 0; done < length && rc == 0; done += chunk) {
+			chunk = length - done;
+			if (chunk > SPI_DMA_BUF_SIZE) {
+				chunk = SPI_DMA_BUF_SIZE;
+			}
+			rc = spi1_transfer_dma(data + done, spi1_dma_rx, chunk);
+		}
+	}
+	else {
+		for (i = 0; i < length; i++) {
+			spi1_transfer(data[i]);    		// send data byte
+		}
+	}
+
+	spi1_transfer(0xff);                    // ACK after the data
+	if (rc != 0 || rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[CMD_PWRITE]);
+		rc = -1;
+	}
+	else {
+		cache_patch(file_number, offset, data, length);
+	}
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_PWRITE], stats_t0);
+	return rc;
+}
+
+
+// Bytes a request frame and its response take on the wire
+static uint16_t frame_req_size(const struct frame_op *op)
+{
+	switch (op->op)
+	{
+		case CMD_CREATE:
+			// file number, size (two bytes past 255)
+			return FRAME_REQ_OVERHEAD + ((op->size > 0xff) ? 3 : 2);
+		case CMD_WRITE:
+			return FRAME_REQ_OVERHEAD + 1 + op->size;	// file number, data
+		case CMD_READ:
+			return FRAME_REQ_OVERHEAD + 2;		// file number, max length
+		case CMD_PREAD:
+			return FRAME_REQ_OVERHEAD + 4;		// file number, offset, length
+		case CMD_PWRITE:
+			return FRAME_REQ_OVERHEAD + 3 + op->size;	// file number, offset, data
+		case CMD_COPY:
+		case CMD_MOVE:
+			return FRAME_REQ_OVERHEAD + 2;		// source, destination
+		default:
+			return FRAME_REQ_OVERHEAD + 1;		// file number
+	}
+}
+
+static uint16_t frame_resp_size(const struct frame_op *op)
+{
+	if (op->op != CMD_READ && op->op != CMD_PREAD) {
+		return FRAME_RESP_OVERHEAD;
+	}
+	return FRAME_RESP_OVERHEAD + ((op->size < FRAME_MAX_DATA) ? op->size : FRAME_MAX_DATA);
+}
+
+
+// Work out how many of ops fit in one burst and how long it is. The slave
+// starts a response on the byte after the frame's CRC, or right after the
+// previous response, so the exchange length is known before sending.
+static uint16_t frame_pack(const struct frame_op *ops, uint16_t count, uint16_t *length)
+{
+	uint16_t pos = 0;		// request bytes so far
+	uint16_t resp_end = 0;		// byte after the last response so far
+	uint16_t start, end;
+	uint16_t n;
+
+	for (n = 0; n < count; n++) {
+		start = pos + frame_req_size(&ops[n]);
+		if (start < resp_end) {
+			start = resp_end;
+		}
+		end = start + frame_resp_size(&ops[n]);
+
+		// this frame, its response and the end byte must all fit
+		if (end >= FRAME_BURST_SIZE || pos + frame_req_size(&ops[n]) + 1 >= FRAME_BURST_SIZE) {
+			break;
+		}
+
+		pos += frame_req_size(&ops[n]);
+		resp_end = end;
+	}
+
+	*length = (resp_end > pos + 1) ? resp_end : pos + 1;
+	return n;
+}
+
+
+static uint16_t frame_encode(struct frame_op *ops, uint16_t count, uint16_t length)
+{
+	uint16_t pos = 0;
+	uint16_t first, k;
+	uint8_t crc;
+	uint8_t i;
+
+	for (k = 0; k < count; k++) {
+		first = pos;
+		ops[k].seq = frame_seq++;
+
+		frame_tx[pos++] = frame_req_size(&ops[k]) - 2;	// length
+		frame_tx[pos++] = ops[k].op;
+		frame_tx[pos++] = ops[k].seq;
+		frame_tx[pos++] = ops[k].file_number;
+
+		if (ops[k].op == CMD_CREATE) {
+			frame_tx[pos++] = ops[k].size & 0xff;
+			if (ops[k].size > 0xff) {
+				frame_tx[pos++] = ops[k].size >> 8;
+			}
+		}
+		else if (ops[k].op == CMD_READ) {
+			frame_tx[pos++] = (ops[k].size < FRAME_MAX_DATA) ? ops[k].size : FRAME_MAX_DATA;
+		}
+		else if (ops[k].op == CMD_WRITE) {
+			for (i = 0; i < ops[k].size; i++) {
+				frame_tx[pos++] = ops[k].data[i];
+			}
+		}
+		else if (ops[k].op == CMD_COPY || ops[k].op == CMD_MOVE) {
+			frame_tx[pos++] = (uint8_t)ops[k].size;
+		}
+		else if (ops[k].op == CMD_PREAD) {
+			frame_tx[pos++] = ops[k].offset & 0xff;
+			frame_tx[pos++] = ops[k].offset >> 8;
+			frame_tx[pos++] = (ops[k].size < FRAME_MAX_DATA) ? ops[k].size : FRAME_MAX_DATA;
+		}
+		else if (ops[k].op == CMD_PWRITE) {
+			frame_tx[pos++] = ops[k].offset & 0xff;
+			frame_tx[pos++] = ops[k].offset >> 8;
+			for (i = 0; i < ops[k].size; i++) {
+				frame_tx[pos++] = ops[k].data[i];
+			}
+		}
+
+		crc = 0;
+		while (first < pos) {
+			crc = crc8(crc, frame_tx[first++]);
+		}
+		frame_tx[pos++] = crc;
+	}
+
+	frame_tx[pos++] = 0;			// end of burst
+	while (pos < length) {
+		frame_tx[pos++] = 0xff;		// clock out the remaining responses
+	}
+
+	return pos;
+}
+
+
+// Match the responses in frame_rx to ops, in order. Filler bytes (0) are
+// skipped, and a response that fails its CRC leaves its op FRAME_ERR_LOST.
+static void frame_decode(struct frame_op *ops, uint16_t count, uint16_t length)
+{
+	uint16_t pos = 0;
+	uint16_t k = 0;
+	uint16_t j;
+	uint8_t len, crc, i;
+
+	while (pos < length && k < count) {
+		len = frame_rx[pos];
+		if (len < 2 || pos + len + 2 > length) {
+			pos++;
+			continue;
+		}
+
+		crc = 0;
+		for (j = pos; j <= pos + len; j++) {
+			crc = crc8(crc, frame_rx[j]);
+		}
+		if (crc != frame_rx[pos + len + 1]) {
+			pos++;
+			continue;
+		}
+
+		while (k < count && ops[k].seq != frame_rx[pos + 1]) {
+			ops[k++].status = FRAME_ERR_LOST;
+		}
+		if (k < count) {
+			ops[k].status = frame_rx[pos + 2];
+			ops[k].length = 0;
+			if ((ops[k].op == CMD_READ || ops[k].op == CMD_PREAD)
+			    && ops[k].status == FRAME_OK) {
+				// no further than the caller's buffer; more data
+				// than was asked for is a length the CRC missed
+				ops[k].length = (len - 2 < ops[k].size) ? len - 2 : ops[k].size;
+				for (i = 0; i < ops[k].length; i++) {
+					ops[k].data[i] = frame_rx[pos + 3 + i];
+				}
+				if (len - 2 > ops[k].size) {
+					ops[k].status = FRAME_ERR_LOST;
+				}
+			}
+			k++;
+		}
+
+		pos += len + 2;
+	}
+
+	while (k < count) {
+		ops[k++].status = FRAME_ERR_LOST;
+	}
+}
+
+
+// Tell the cache what a successful op did
+static void frame_cache(const struct frame_op *op)
+{
+	switch (op->op)
+	{
+		case CMD_CREATE:
+			cache_set_size(op->file_number, op->size);
+			break;
+		case CMD_WRITE:
+			cache_patch(op->file_number, 0, op->data, op->size);
+			break;
+		case CMD_READ:
+			if (cache_size(op->file_number) == op->length) {
+				cache_fill(op->file_number, op->data, op->length);
+			}
+			break;
+		case CMD_DELETE:
+			cache_set_size(op->file_number, 0);
+			break;
+		case CMD_PREAD:
+			cache_patch(op->file_number, op->offset, op->data, op->length);
+			break;
+		case CMD_PWRITE:
+			cache_patch(op->file_number, op->offset, op->data, op->size);
+			break;
+		case CMD_COPY:
+			cache_forget((uint8_t)op->size);
+			break;
+		case CMD_MOVE:
+			cache_forget((uint8_t)op->size);
+			cache_set_size(op->file_number, 0);
+			break;
+	}
+}
+
+
+// How many of ops, from the first, framed() sends in its first burst
+uint16_t framed_fit(const struct frame_op *ops, uint16_t count)
+{
+	uint16_t length;
+
+	return frame_pack(ops, count, &length);
+}
+
+// Run ops as framed requests behind a single SYNC per burst, splitting
+// into several bursts when they do not fit in one. Each op gets its own
+// status; returns how many came back FRAME_OK, or -1 if the slave did
+// not accept a burst.
+int framed(struct frame_op *ops, uint16_t count)
+{
+	uint16_t done = 0;
+	uint16_t ok = 0;
+	uint16_t n, length, k;
+
+	// write-back: the slave gets what the cache holds first, so what
+	// comes back does not land on dirty contents
+	if (cache_mode == CACHE_WRITE_BACK) {
+		cache_sync();
+	}
+
+	while (done < count) {
+		n = frame_pack(&ops[done], count - done, &length);
+		if (n == 0) {
+			return -1;
+		}
+
+		length = frame_encode(&ops[done], n, length);
+
+		STATS_START(stats_t0);
+
+	        spi1_transfer(0xfe);                    // SYNC
+	        spi1_transfer(CMD_FRAMED);              // FRAMED
+	        spi1_transfer(0xff);                    // 0xff
 
 		if (rxData1_f != 1 || rxData1 != 1) {
-			printf("master Write: No ACK received after sending file number");
-		}	
-		
+			printf("Framed error! \n\n");
+			STATS_COUNT(stats_no_ack[CMD_FRAMED]);
+			return -1;
+		}
+
+		if (spi1_transfer_burst(frame_tx, frame_rx, length) != 0) {
+			printf("master Framed: burst timed out \n\n");
+			return -1;
+		}
+		rxData1_f = 0;
+
+		STATS_STOP(stats_cmd[CMD_FRAMED], stats_t0);
+
+		frame_decode(&ops[done], n, length);
+
+		for (k = done; k < done + n; k++) {
+			if (ops[k].status == FRAME_OK) {
+				frame_cache(&ops[k]);
+				ok++;
+			}
+		}
+		done += n;
+	}
+
+	return ok;
+}
+
+
+
+
+
+// LIST one file number and one size byte at a time, for a slave without
+// BLIST
+static void list_pairs(void)
+{
+	uint8_t pairs[2 * MAX_FILE_NUMBER];
+	uint8_t listed[MAX_FILE_NUMBER + 1] = {0};
+	struct async_req req = {0};
+	uint8_t status;
+	uint8_t n;
+	uint16_t i;
+	STATS_START(stats_t0);
+
+	req.op = CMD_LIST;
+	req.slave = spi_slave;
+	req.size = sizeof(pairs);
+	req.data = pairs;
+
+	status = async_run(&req);
+	if (status == ASYNC_ERR_NACK) {
+		STATS_COUNT(stats_no_ack[CMD_LIST]);
+	}
+
+	// file number, size pairs
+	for (i = 0; i + 1 < req.length; i += 2) {
+		printf("%d  ", pairs[i]);
+		printf("%d\n", pairs[i + 1]);
+
+		// LIST reports sizes past 255 as 255
+		n = pairs[i];
+		if (n <= MAX_FILE_NUMBER) {
+			listed[n] = 1;
+			if (pairs[i + 1] < 0xff) {
+				cache_set_size(n, pairs[i + 1]);
+			}
+			else if (cache_size(n) < 0xff) {
+				cache_forget(n);
+			}
+		}
+	}
+
+	// a complete list: files not in it do not exist
+	if (status == ASYNC_OK) {
+		printf("\n");
+		for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+			if (!listed[n]) {
+				cache_set_size(n, 0);
+			}
+		}
+	}
+
+	STATS_STOP(stats_cmd[CMD_LIST], stats_t0);
+}
+
+// BLIST the whole table in one transfer and parse the image into table;
+// the cache learns every size, and that the other files do not exist.
+// Returns the number of files, or -1 if the slave did not send a whole,
+// consistent image.
+int list_get(struct list_table *table)
+{
+	static uint8_t image[LIST_IMAGE_SIZE];
+	struct async_req req = {0};
+	uint16_t pos = 1 + LIST_BITMAP_SIZE;
+	uint8_t count = 0;
+	uint8_t n;
+	STATS_START(stats_t0);
+
+	req.op = CMD_BLIST;
+	req.slave = spi_slave;
+	req.size = sizeof(image);
+	req.data = image;
+
+	if (async_run(&req) != ASYNC_OK) {
+		STATS_COUNT(stats_no_ack[CMD_BLIST]);
+		STATS_STOP(stats_cmd[CMD_BLIST], stats_t0);
+		return -1;
+	}
+
+	memset(table, 0, sizeof(*table));
+	memcpy(table->bitmap, image + 1, LIST_BITMAP_SIZE);
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		if (!(table->bitmap[(n - 1) / 8] & (1u << ((n - 1) % 8)))) {
+			continue;
+		}
+		if (pos + 2 > req.length) {
+			STATS_STOP(stats_cmd[CMD_BLIST], stats_t0);
+			return -1;
+		}
+		table->size[n] = image[pos] | image[pos + 1] << 8;
+		pos += 2;
+		count++;
+	}
+	if (count != image[0] || pos != req.length) {
+		STATS_STOP(stats_cmd[CMD_BLIST], stats_t0);
+		return -1;
+	}
+	table->count = count;
+
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		cache_set_size(n, table->size[n]);
+	}
+
+	STATS_STOP(stats_cmd[CMD_BLIST], stats_t0);
+	return count;
+}
+
+// The table from one BLIST, printed once it is all in
+void list()
+{
+	static struct list_table table;
+	uint8_t n;
+
+	if (list_get(&table) < 0) {
+		list_pairs();
+		return;
+	}
+
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		if (table.size[n] > 0) {
+			printf("%d  %u\n", n, table.size[n]);
+		}
+	}
+	printf("\n");
+}
+
+
+// SYNC, command and the name, for OPEN and NCREATE. Returns 0 if the
+// slave ACKed the command.
+static int name_start(uint8_t cmd, const char *name)
+{
+	uint8_t length = strlen(name);
+	uint8_t i;
+
+        spi1_transfer(0xfe);                    // SYNC
+        spi1_transfer(cmd);
+        spi1_transfer(0xff);                    // 0xff
+
+        if (rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[cmd]);
+		return -1;
+	}
+
+	spi1_transfer(length);
+	for (i = 0; i < length; i++) {
+		spi1_transfer((uint8_t)name[i]);
+	}
+	return 0;
+}
+
+// File number of a name, 0 if there is none; its size goes to *size.
+// The slave looks the name up, the master keeps no table of its own.
+uint8_t name_open(const char *name, uint16_t *size)
+{
+	uint8_t file_number = 0;
+	uint16_t file_size;
+	STATS_START(stats_t0);
+
+	if (strlen(name) < 1 || strlen(name) > DIR_NAME_SIZE
+	    || name_start(CMD_OPEN, name) != 0) {
+		STATS_STOP(stats_cmd[CMD_OPEN], stats_t0);
+		return 0;
+	}
+
+	spi1_transfer(0xff);                        // file number
+	file_number = rxData1;
+	spi1_transfer(0xff);                        // size, low byte first
+	file_size = rxData1;
+	spi1_transfer(0xff);
+	file_size |= rxData1 << 8;
+
+	if (rxData1_f != 1) {
+		file_number = 0;
+	}
+	if (file_number != 0) {
+		cache_set_size(file_number, file_size);
+		*size = file_size;
+	}
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_OPEN], stats_t0);
+	return file_number;
+}
+
+// Create a file under a name, or resize the one that has it. Returns its
+// file number, 0 if the slave had no room or the name is not valid.
+uint8_t name_create(const char *name, uint16_t size)
+{
+	uint8_t file_number = 0;
+	STATS_START(stats_t0);
+
+	if (strlen(name) < 1 || strlen(name) > DIR_NAME_SIZE
+	    || name_start(CMD_NCREATE, name) != 0) {
+		STATS_STOP(stats_cmd[CMD_NCREATE], stats_t0);
+		return 0;
+	}
+
+	spi1_transfer(size & 0xff);                 // size, low byte first
+	spi1_transfer(size >> 8);
+	spi1_transfer(0xff);                        // file number
+
+	if (rxData1_f == 1) {
+		file_number = rxData1;
+	}
+	if (file_number != 0) {
+		cache_set_size(file_number, size);
+	}
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_NCREATE], stats_t0);
+	return file_number;
+}
+
+// NLIST into entries, at most max of them; the rest are clocked through
+// and dropped. Returns how many were listed, and -1 if the slave did not
+// ACK or the list broke off.
+int name_list_get(struct name_entry *entries, int max)
+{
+	struct name_entry e;
+	int count = 0;
+	int listed;
+	uint8_t length, i;
+	STATS_START(stats_t0);
+
+        spi1_transfer(0xfe);			// SYNC
+        spi1_transfer(CMD_NLIST);
+        spi1_transfer(0xff);                    // 0xff
+
+        if (rxData1_f != 1 || rxData1 != 1) {
+		STATS_COUNT(stats_no_ack[CMD_NLIST]);
+		STATS_STOP(stats_cmd[CMD_NLIST], stats_t0);
+		return -1;
+	}
+
+	// a slave out of step could go on for ever; it has MAX_FILE_NUMBER
+	// files at most
+	for (listed = 0; listed <= MAX_FILE_NUMBER; listed++) {
+		spi1_transfer(0xff);
+		e.file_number = rxData1;
+		if (rxData1_f != 1 || e.file_number == 0 || e.file_number > MAX_FILE_NUMBER) {
+			break;
+		}
+
+		spi1_transfer(0xff);
+		e.size = rxData1;
+		spi1_transfer(0xff);
+		e.size |= rxData1 << 8;
+		spi1_transfer(0xff);
+		length = (rxData1 <= DIR_NAME_SIZE) ? rxData1 : DIR_NAME_SIZE;
+		for (i = 0; i < length; i++) {
+			spi1_transfer(0xff);
+			e.name[i] = (char)rxData1;
+		}
+		e.name[length] = '\0';
+
+		if (count < max) {
+			entries[count++] = e;
+		}
+	}
+
+	if (rxData1_f != 1 || e.file_number != 0) {
+		count = -1;
+	}
+
+	rxData1_f = 0;
+	STATS_STOP(stats_cmd[CMD_NLIST], stats_t0);
+	return count;
+}
+
+// LIST with full sizes and names: file number, size, name per line
+void name_list(void)
+{
+	static struct name_entry entries[MAX_FILE_NUMBER];
+	uint8_t listed[MAX_FILE_NUMBER + 1] = {0};
+	int count, i;
+
+	count = name_list_get(entries, MAX_FILE_NUMBER);
+
+	for (i = 0; i < count; i++) {
+		printf("%d  %u  %s\n", entries[i].file_number, entries[i].size, entries[i].name);
+		listed[entries[i].file_number] = 1;
+		cache_set_size(entries[i].file_number, entries[i].size);
+	}
+
+	// a complete list: files not in it do not exist
+	if (count >= 0) {
+		printf("\n");
+		for (i = 1; i <= MAX_FILE_NUMBER; i++) {
+			if (!listed[i]) {
+				cache_set_size(i, 0);
+			}
+		}
+	}
+}
+
+
+	
+ParserReturnVal_t spiinit(int mode)
+{
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        spi_init();
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("spiinit", spiinit, "               Initialize the SPI")
+
+
+ParserReturnVal_t CmdSpiWrite(int mode)
+{
+	uint32_t val = 0;
+	fetch_uint32_arg(&val);
+	spi_write((uint8_t *)&val, 1);
+	
+	return CmdReturnOk;
+}
+
+ADD_CMD("senddata", CmdSpiWrite,"   send data using SPI 1")
+
+ParserReturnVal_t CmdSpiWrite_2(int mode)
+{
+        uint32_t val = 0;
+        fetch_uint32_arg(&val);
+        spi_write_spi2((uint8_t *)&val, 1);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("senddata2", CmdSpiWrite_2,"   send data using SPI 2")
+
+
+ParserReturnVal_t CmdSpiWrite_1B(int mode)
+{
+        uint32_t val = 0;
+        fetch_uint32_arg(&val);
+        spi_write_1B((uint8_t *)&val);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("s1b", CmdSpiWrite_1B,"   send 1 byte data using SPI 1")
+
+ParserReturnVal_t CmdHandshake(int mode)
+{
+        uint32_t rc;
+        uint32_t val;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc = fetch_uint32_arg(&val);
+        if (rc)
+        {
+                printf("handshake: %s, %lu RX timeouts\n",
+                       handshake_mode == HANDSHAKE_EVENT ? "event" : "delay",
+                       (unsigned long)spi_rx_timeouts);
+                return CmdReturnOk;
+        }
+
+        if (val > HANDSHAKE_EVENT)
+        {
+                printf("Handshake must be 0 (delay) or 1 (event)!\n");
+                return CmdReturnBadParameter1;
+        }
+
+        handshake_mode = (enum handshake)val;
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("handshake", CmdHandshake,"   master handshake: 0 delay, 1 event")
+
+ParserReturnVal_t CmdDma(int mode)
+{
+        uint32_t rc;
+        uint32_t val;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc = fetch_uint32_arg(&val);
+        if (rc)
+        {
+                printf("payload DMA: %s\n", payload_dma ? "on" : "off");
+                return CmdReturnOk;
+        }
+
+        payload_dma = (val != 0);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("dma", CmdDma,"   READ/WRITE payload by DMA: 0 off, 1 on")
+
+ParserReturnVal_t CmdCompress(int mode)
+{
+        uint32_t val;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&val) == 0)
+        {
+                payload_compress = (val != 0);
+        }
+
+	printf("payload compression: %s, %lu bytes read and written in %lu on the wire",
+	       payload_compress ? "on" : "off", (unsigned long)compress_plain_bytes,
+	       (unsigned long)compress_wire_bytes);
+	if (compress_plain_bytes > 0) {
+		printf(" (%lu%%)", (unsigned long)((uint64_t)compress_wire_bytes * 100
+						   / compress_plain_bytes));
+	}
+	printf("\n");
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("compress", CmdCompress,"   RLE-compressed READ/WRITE: 0 off, 1 on")
+
+ParserReturnVal_t CmdCrc(int mode)
+{
+        uint32_t val;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&val) == 0)
+        {
+                payload_crc = (val != 0);
+        }
+
+	printf("CRC-checked chunks: %s, %lu chunks, %lu of them resent\n",
+	       payload_crc ? "on" : "off", (unsigned long)crc_chunks,
+	       (unsigned long)crc_resends);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("crc", CmdCrc,"   CRC-checked READ/WRITE chunks: 0 off, 1 on")
+
+ParserReturnVal_t CmdWide(int mode)
+{
+        uint32_t val;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&val) == 0)
+        {
+                payload_wide = (val != 0);
+        }
+
+	printf("16-bit data frames: %s\n", payload_wide ? "on" : "off");
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("wide", CmdWide,"   READ/WRITE data in 16-bit frames: 0 off, 1 on")
+
+ParserReturnVal_t CmdBaud(int mode)
+{
+        uint32_t rc;
+        uint32_t val;
+	uint8_t fastest = 0;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc = fetch_uint32_arg(&val);
+        if (rc == 0)
+        {
+		// the fastest divisor to try, 2 to 256
+		while (fastest < SPI_BR_SLOWEST && (2u << fastest) < val) {
+			fastest++;
+		}
+		if ((2u << fastest) != val) {
+			printf("Divisor must be a power of two from 2 to 256!\n");
+			return CmdReturnBadParameter1;
+		}
+        }
+
+	baud_negotiate(fastest);
+	printf("SPI clock 100MHz/%u\n\n", 2u << spi_link_br);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("baud", CmdBaud,"   negotiate a faster SPI clock: baud [fastest divisor]")
+
+ParserReturnVal_t CmdPersist(int mode)
+{
+	struct persist_stats s;
+	uint8_t i;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	persist_poll();
+	persist_get_stats(&s);
+
+	printf("sector   seq   erases\n");
+	for (i = 0; i < FLASH_LOG_SECTORS; i++) {
+		printf("%d %c  %6lu %8lu\n", FLASH_LOG_FIRST_SECTOR + i, (i == s.head) ? '*' : ' ',
+		       (unsigned long)s.seq[i], (unsigned long)s.erase_count[i]);
+	}
+	printf("head %lu bytes used, %lu records replayed at mount, %lu appended, "
+	       "%lu compactions, %lu failed appends\n\n",
+	       (unsigned long)s.head_used, (unsigned long)s.replayed, (unsigned long)s.appended,
+	       (unsigned long)s.compactions, (unsigned long)s.failures);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("persist", CmdPersist,"   log changed files to flash and show the log")
+
+#if FS_STATS || FS_TRACE
+static const char * const state_names[] = {
+	"SYNC", "CMD", "LIST", "CREATE", "WRITE", "READ", "DELETE", "FRAME",
+	"CREATE_FREE", "PREAD", "PWRITE", "BAUD", "OPEN", "NCREATE", "NLIST",
+	"ZWRITE", "ZREAD", "CWRITE", "CREAD", "BLIST", "WREAD", "WWRITE", "SOPEN",
+	"APPEND", "SNAPSHOT", "RESTORE", "COPY", "MOVE"
+};
+#endif
+
+#if FS_STATS
+
+static const char * const cmd_names[] = {
+	"list", "read", "write", "create", "delete", "framed", "createfree",
+	"pread", "pwrite", "baud", "nopen", "ncreate", "nlist", "zwrite", "zread",
+	"cwrite", "cread", "blist", "wread", "wwrite", "sopen", "append", "sclose",
+	"snapshot", "restore", "copy", "move"
+};
+
+// count, average and worst time, then the non-empty histogram buckets,
+// each as its upper bound
+static void stats_print(const char *name, const struct stats_timing *t)
+{
+	uint64_t bound;
+	uint8_t i;
+
+	if (t->count == 0) {
+		return;
+	}
+
+	printf("%-12s %8lu %10lu %10lu  ", name, (unsigned long)t->count,
+	       (unsigned long)(t->total * STATS_TICK_NS / t->count),
+	       (unsigned long)((uint64_t)t->max * STATS_TICK_NS));
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		if (t->hist[i] == 0) {
+			continue;
+		}
+		bound = 128ull << i;
+		if (i == STATS_BUCKETS - 1) {
+			printf(" more:%lu", (unsigned long)t->hist[i]);
+		}
+		else if (bound < 1000) {
+			printf(" <%luns:%lu", (unsigned long)bound, (unsigned long)t->hist[i]);
+		}
+		else if (bound < 1000000) {
+			printf(" <%luus:%lu", (unsigned long)(bound / 1000), (unsigned long)t->hist[i]);
+		}
+		else {
+			printf(" <%lums:%lu", (unsigned long)(bound / 1000000), (unsigned long)t->hist[i]);
+		}
+	}
+	printf("\n");
+}
+#endif
+
+ParserReturnVal_t CmdStats(int mode)
+{
+	char *arg;
+#if FS_STATS
+	uint8_t i;
+#endif
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_string_arg(&arg) == 0)
+        {
+		if (strcmp(arg, "reset") != 0) {
+			printf("stats takes no argument or 'reset'!\n");
+			return CmdReturnBadParameter1;
+		}
+#if FS_STATS
+		stats_reset();
+#endif
+		spi_rx_timeouts = 0;
+		spi2_rx_overruns = 0;
+		return CmdReturnOk;
+        }
+
+#if FS_STATS
+	printf("%-12s %8s %10s %10s  %s\n", "", "count", "avg ns", "max ns", "histogram");
+	stats_print("slave ISR", &stats_byte_isr);
+	for (i = 0; i < sizeof(state_names) / sizeof(state_names[0]); i++) {
+		stats_print(state_names[i], &stats_state[i]);
+	}
+	for (i = 0; i < sizeof(cmd_names) / sizeof(cmd_names[0]); i++) {
+		stats_print(cmd_names[i], &stats_cmd[i]);
+	}
+	for (i = 0; i < sizeof(cmd_names) / sizeof(cmd_names[0]); i++) {
+		if (stats_no_ack[i]) {
+			printf("%s: %lu without ACK\n", cmd_names[i], (unsigned long)stats_no_ack[i]);
+		}
+	}
+#else
+	printf("timing compiled out (FS_STATS=0)\n");
+#endif
+	printf("%lu RX timeouts, %lu slave RX queue overruns\n\n",
+	       (unsigned long)spi_rx_timeouts, (unsigned long)spi2_rx_overruns);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("stats", CmdStats,"   timing and error counters: stats [reset]")
+
+// One line per entry, oldest first, in the form sim/replay.c reads: the
+// time in ticks, r or t, the state number, the byte in hex, the state name
+ParserReturnVal_t CmdTrace(int mode)
+{
+	char *arg;
+#if FS_TRACE
+	struct trace_entry entry;
+	uint32_t count, seq;
+#endif
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+#if FS_TRACE
+        if (fetch_string_arg(&arg) == 0)
+        {
+		if (strcmp(arg, "on") == 0) {
+			trace_on = 1;
+		}
+		else if (strcmp(arg, "off") == 0) {
+			trace_on = 0;
+		}
+		else if (strcmp(arg, "clear") == 0) {
+			trace_clear();
+		}
+		else {
+			printf("trace takes no argument, 'on', 'off' or 'clear'!\n");
+			return CmdReturnBadParameter1;
+		}
+		return CmdReturnOk;
+        }
+
+	count = trace_count();
+	seq = (count > TRACE_RING_SIZE) ? count - TRACE_RING_SIZE : 0;
+	printf("# trace %s, %lu entries, %lu overwritten, %d ns per tick\n",
+	       trace_on ? "on" : "off", (unsigned long)(count - seq),
+	       (unsigned long)seq, TRACE_TICK_NS);
+	for (; seq < count; seq++) {
+		if (!trace_get(seq, &entry)) {
+			continue;	// overwritten while printing
+		}
+		printf("%lu %c %d %02x %s\n", (unsigned long)entry.time,
+		       (entry.dir == TRACE_RX) ? 'r' : 't', entry.state, entry.data,
+		       (entry.state < sizeof(state_names) / sizeof(state_names[0]))
+		       ? state_names[entry.state] : "?");
+	}
+	printf("\n");
+#else
+	(void)arg;
+	printf("trace compiled out (FS_TRACE=0)\n");
+#endif
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("trace", CmdTrace,"   protocol trace of the slave: trace [on|off|clear], none dumps it")
+
+ParserReturnVal_t CmdList(int mode)
+{
+
+	list();
+        
+        return CmdReturnOk;
+}
+
+ADD_CMD("list", CmdList,"   send CMD LIST using SPI 1")
+
+
+
+
+ParserReturnVal_t CmdCreate(int mode)
+{
+	uint32_t rc1, rc2;
+        uint32_t file_number;
+	uint32_t file_size;
+	struct frame_op op;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc1 = fetch_uint32_arg(&file_number);
+        if (rc1)
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
+        }
+
+        rc2 = fetch_uint32_arg(&file_size);
+        if (rc2)
+        {
+                printf("Must specify the file size!\n");
+                return CmdReturnBadParameter2;
+        }
+
+	if (file_size > MAX_FILE_SIZE) {
+		printf("File size is 0 to %u!\n", MAX_FILE_SIZE);
+		return CmdReturnBadParameter2;
+	}
+
+	// the CREATE command carries one size byte, larger files go framed
+	if (file_size > 0xff) {
+		op.op = CMD_CREATE;
+		op.file_number = (uint8_t)file_number;
+		op.size = (uint16_t)file_size;
+		if (framed(&op, 1) != 1) {
+			printf("Create error! \n\n");
+		}
+		return CmdReturnOk;
+	}
+
+        create((uint8_t)file_number, (uint8_t)file_size);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("create", CmdCreate,"   send CMD CREATE using SPI 1")
+
+
+ParserReturnVal_t CmdCreateFree(int mode)
+{
+	uint32_t rc;
+	uint32_t file_size;
+	uint8_t file_number;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc = fetch_uint32_arg(&file_size);
+        if (rc || file_size < 1 || file_size > 0xff)
+        {
+                printf("Must specify the file size, 1 to 255!\n");
+                return CmdReturnBadParameter1;
+        }
+
+	file_number = create_free((uint8_t)file_size);
+	if (file_number == 0) {
+		printf("Create error! \n\n");
+	}
+	else {
+		printf("Created file %d \n\n", file_number);
+	}
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("createfree", CmdCreateFree,"   CREATE in the first free file number")
+
+
+ParserReturnVal_t CmdWrite(int mode)
+{
+        uint32_t rc;
+	uint32_t para[100] = {0};
+	uint8_t para_num = 0;
+	uint8_t data[100];
+	uint8_t i;
+
+	if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	do {
+		rc = fetch_uint32_arg(para + para_num);
+		para_num++;
+	}
+	while (rc == 0);
+
+	// write-back: keep it in the cache until sync
+	if (cache_mode == CACHE_WRITE_BACK && para_num > 2) {
+		for (i = 1; i < para_num - 1; i++) {
+			data[i - 1] = (uint8_t)para[i];
+		}
+		if (cache_write((uint8_t)para[0], data, para_num - 2) == 0) {
+			return CmdReturnOk;
+		}
+	}
+
+	write(para_num - 1, para);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("write", CmdWrite,"   send Write command using SPI 1")
+
+ParserReturnVal_t CmdSOpen(int mode)
+{
+	uint32_t file_number = 0;
+	uint32_t fresh = 0;
+	uint8_t opened;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	fetch_uint32_arg(&file_number);
+	fetch_uint32_arg(&fresh);
+	if (file_number > MAX_FILE_NUMBER) {
+		printf("File number 0 to %d!\n", MAX_FILE_NUMBER);
+		return CmdReturnBadParameter1;
+	}
+
+	opened = stream_open((uint8_t)file_number, fresh ? STREAM_NEW : 0);
+	if (opened == 0) {
+		printf("Open error! \n\n");
+	}
+	else {
+		printf("Opened file %d \n\n", opened);
+	}
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("sopen", CmdSOpen,"   open a file to append to: sopen [n, 0 first free] [1 empty it]")
+
+ParserReturnVal_t CmdAppend(int mode)
+{
+	uint32_t val;
+	uint8_t data[100];
+	uint8_t length = 0;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	while (length < sizeof(data) && fetch_uint32_arg(&val) == 0) {
+		data[length] = (uint8_t)val;
+		length++;
+	}
+
+	if (stream_append(data, length) != 0) {
+		printf("Append error! \n\n");
+	}
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("append", CmdAppend,"   append bytes to the open file: append data...")
+
+ParserReturnVal_t CmdSClose(int mode)
+{
+	int32_t size;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	size = stream_close();
+	if (size < 0) {
+		printf("No file open! \n\n");
+	}
+	else {
+		printf("Closed at %ld bytes \n\n", (long)size);
+	}
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("sclose", CmdSClose,"   close the file open to append to, and show its size")
+
+static void snap_file_sink(const uint8_t *data, uint16_t length, void *context)
+{
+	if (length > 0) {
+		fwrite(data, 1, length, (FILE *)context);
+	}
+}
+
+static uint16_t snap_file_source(uint8_t *data, uint16_t room, void *context)
+{
+	return (uint16_t)fread(data, 1, room, (FILE *)context);
+}
+
+ParserReturnVal_t CmdSnapshot(int mode)
+{
+	char *path;
+	FILE *f;
+	int32_t length;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	if (fetch_string_arg(&path) != 0) {
+		printf("Must specify the file to save to!\n");
+		return CmdReturnBadParameter1;
+	}
+
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		printf("Cannot open %s! \n\n", path);
+		return CmdReturnOk;
+	}
+	length = snapshot(snap_file_sink, f);
+	fclose(f);
+
+	if (length < 0) {
+		printf("Snapshot error! \n\n");
+	}
+	else {
+		printf("%ld bytes saved \n\n", (long)length);
+	}
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("snapshot", CmdSnapshot,"   save every file on the slave to a file: snapshot <file>")
+
+ParserReturnVal_t CmdRestore(int mode)
+{
+	char *path;
+	FILE *f;
+	long length;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	if (fetch_string_arg(&path) != 0) {
+		printf("Must specify the file to load!\n");
+		return CmdReturnBadParameter1;
+	}
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		printf("Cannot open %s! \n\n", path);
+		return CmdReturnOk;
+	}
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (length < 5 || (uint32_t)length > SNAP_MAX_SIZE
+	    || restore(snap_file_source, f, (uint32_t)length) != 0) {
+		printf("Restore error! \n\n");
+	}
+	else {
+		printf("%ld bytes restored \n\n", length);
+	}
+	fclose(f);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("restore", CmdRestore,"   replace every file on the slave with a snapshot: restore <file>")
+
+
+// The batch the batch command builds up, and the text of its operations
+static struct batch console_batch;
+static uint8_t console_batch_ready = 0;
+static char batch_text[4096];
+
+// batch [add|run|clear|file <file>] [operations...]: operations are added
+// to the batch, checked as they come, and sent with run or when given
+// without add. One that fails the check leaves the batch as it was.
+ParserReturnVal_t CmdBatch(int mode)
+{
+	static int32_t sizes[MAX_FILE_NUMBER + 1];
+	char *word;
+	size_t used = 0;
+	FILE *f = NULL;
+	uint16_t count, data_used, lines;
+	int run = 1;
+	int rc = 0;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	if (!console_batch_ready) {
+		batch_init(&console_batch);
+		console_batch_ready = 1;
+	}
+
+	if (fetch_string_arg(&word) != 0) {
+		printf("Must specify operations, add, run, clear or file!\n");
+		return CmdReturnBadParameter1;
+	}
+
+	if (strcmp(word, "clear") == 0) {
+		batch_init(&console_batch);
+		return CmdReturnOk;
+	}
+	else if (strcmp(word, "file") == 0) {
+		if (fetch_string_arg(&word) != 0) {
+			printf("Must specify the file to run!\n");
+			return CmdReturnBadParameter2;
+		}
+		f = fopen(word, "r");
+		if (f == NULL) {
+			printf("Cannot open %s! \n\n", word);
+			return CmdReturnOk;
+		}
+		word = NULL;
+	}
+	else if (strcmp(word, "add") == 0) {
+		run = 0;
+		word = NULL;
+	}
+	else if (strcmp(word, "run") == 0) {
+		word = NULL;
+	}
+
+	count = console_batch.count;
+	data_used = console_batch.data_used;
+	lines = console_batch.lines;
+	memcpy(sizes, console_batch.size, sizeof(sizes));
+
+	// a line of the file at a time, then the rest of the command line,
+	// its words joined again
+	while (f != NULL && rc == 0 && fgets(batch_text, sizeof(batch_text), f) != NULL) {
+		if (strchr(batch_text, '\n') == NULL && !feof(f)) {
+			console_batch.error = "line too long";
+			rc = console_batch.lines + 1;
+			break;
+		}
+		rc = batch_parse(&console_batch, batch_text);
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	if (rc == 0 && (word != NULL || fetch_string_arg(&word) == 0)) {
+		do {
+			if (used + strlen(word) + 2 > sizeof(batch_text)) {
+				printf("Too long for one line!\n");
+				return CmdReturnBadParameter2;
+			}
+			used += sprintf(&batch_text[used], "%s ", word);
+		} while (fetch_string_arg(&word) == 0);
+
+		rc = batch_parse(&console_batch, batch_text);
+	}
+
+	if (rc != 0) {
+		printf("Line %d: %s; nothing added \n\n", rc - lines, console_batch.error);
+		console_batch.count = count;
+		console_batch.data_used = data_used;
+		console_batch.lines = lines;
+		memcpy(console_batch.size, sizes, sizeof(sizes));
+		return CmdReturnOk;
+	}
+
+	if (!run) {
+		printf("%u operations waiting \n\n", console_batch.count);
+		return CmdReturnOk;
+	}
+
+	batch_run(&console_batch);
+	batch_print(&console_batch);
+	batch_init(&console_batch);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("batch", CmdBatch,"   check, then send back to back: batch [add|run|clear|file <file>] op n args; ...")
+
+
+
+ParserReturnVal_t CmdRead(int mode)
+{
+        uint32_t rc1, rc2;
+        uint32_t file_number;
+        uint32_t file_size;
+	const uint8_t *data;
+	uint16_t length, i;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc1 = fetch_uint32_arg(&file_number);
+        if (rc1)
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
+        }
+
+        // the size can be left out once list, create, read or write saw it
+        rc2 = fetch_uint32_arg(&file_size);
+        if (rc2)
+        {
+		if (cache_size((uint8_t)file_number) < 0) {
+	                printf("Must specify the file size!\n");
+	                return CmdReturnBadParameter2;
+		}
+		file_size = cache_size((uint8_t)file_number);
+        }
+
+	// the whole file first, then the printing
+	data = read_buffer((uint8_t)file_number, (uint16_t)file_size, &length);
+	if (data == NULL) {
+		return CmdReturnOk;
+	}
+
+	for (i = 0; i < length; i++) {
+		printf("%d   ", data[i]);
+	}
+	printf("\n\n");
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("read", CmdRead,"   send CMD READ using SPI 1")
+
+
+ParserReturnVal_t CmdStream(int mode)
+{
+        uint32_t file_number;
+        uint32_t file_size;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&file_number))
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
+        }
+        if (fetch_uint32_arg(&file_size))
+        {
+		if (cache_size((uint8_t)file_number) < 0) {
+	                printf("Must specify the file size!\n");
+	                return CmdReturnBadParameter2;
+		}
+		file_size = cache_size((uint8_t)file_number);
+        }
+
+	// raw bytes, as they come off SPI1, then a line of its own
+	if (read_stream((uint8_t)file_number, (uint16_t)file_size, uart_dma_sink, NULL) != 0) {
+		printf("\nRead error! \n\n");
+		return CmdReturnOk;
+	}
+	printf("\n\n");
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("stream", CmdStream,"   READ a file out to the console by DMA, raw: stream n [size]")
+
+
+ParserReturnVal_t CmdPRead(int mode)
+{
+	uint8_t data[0xff];
+	const uint8_t *cached;
+	uint16_t cached_size;
+        uint32_t file_number, offset, length;
+	uint32_t i;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&file_number))
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
+        }
+        if (fetch_uint32_arg(&offset) || offset > MAX_FILE_SIZE)
+        {
+                printf("Must specify the offset!\n");
+                return CmdReturnBadParameter2;
+        }
+        if (fetch_uint32_arg(&length) || length > sizeof(data))
+        {
+                printf("Must specify the length, up to %u!\n", (unsigned)sizeof(data));
+                return CmdReturnBadParameter3;
+        }
+
+	cached = cache_data((uint8_t)file_number, &cached_size);
+	if (cached && offset + length <= cached_size) {
+		memcpy(data, cached + offset, length);
+	}
+	else if (read_range((uint8_t)file_number, (uint16_t)offset, data, (uint16_t)length) != 0) {
+		printf("Read error! \n\n");
+		return CmdReturnOk;
+	}
+
+	for (i = 0; i < length; i++) {
+		printf("%d   ", data[i]);
+	}
+	printf("\n\n");
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("pread", CmdPRead,"   READ length bytes from offset: pread n offset length")
+
+
+ParserReturnVal_t CmdPWrite(int mode)
+{
+	uint8_t data[100];
+        uint32_t file_number, offset, value;
+	uint16_t length = 0;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&file_number))
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
+        }
+        if (fetch_uint32_arg(&offset) || offset > MAX_FILE_SIZE)
+        {
+                printf("Must specify the offset!\n");
+                return CmdReturnBadParameter2;
+        }
+	while (length < sizeof(data) && fetch_uint32_arg(&value) == 0) {
+		data[length++] = (uint8_t)value;
+	}
+
+	if (write_range((uint8_t)file_number, (uint16_t)offset, data, length) != 0) {
+		printf("Write error! \n\n");
+	}
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("pwrite", CmdPWrite,"   WRITE bytes at offset: pwrite n offset data...")
+
+
+ParserReturnVal_t CmdCache(int mode)
+{
+	static const char *names[] = {"off", "write-through", "write-back"};
+	struct cache_stats s;
+	uint32_t rc;
+	uint32_t value;
 
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
 
-		for (i = 1; i < para_num; i++) {
-			rxData1_f = 0;
-			while (!(SPI1->SR & SPI_SR_TXE));
-                	SPI1->DR = (uint8_t)*(para + i);    // send data byte
-                	while (SPI1->SR & SPI_SR_BSY);
-                	HAL_Delay(50);
+	rc = fetch_uint32_arg(&value);
+	if (rc == 0) {
+		if (value > CACHE_WRITE_BACK) {
+			printf("Cache mode is 0 off, 1 write-through or 2 write-back!\n");
+			return CmdReturnBadParameter1;
 		}
+		cache_set_mode((enum cache_mode)value);
+	}
 
+	cache_get_stats(&s);
+	printf("cache %s, %lu hits, %lu misses, %lu written back, %lu writes coalesced\n\n",
+	       names[cache_mode], (unsigned long)s.hits, (unsigned long)s.misses,
+	       (unsigned long)s.flushes, (unsigned long)s.coalesced);
 
-		if (rxData1_f != 1 || rxData1 != 1) {
-                        printf("master Write: No ACK received after data");
-                }
+        return CmdReturnOk;
+}
+
+ADD_CMD("cache", CmdCache,"   master cache: 0 off, 1 write-through, 2 write-back")
+
+
+ParserReturnVal_t CmdSync(int mode)
+{
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	cache_sync();
+
+        return CmdReturnOk;
+}
 
-                rxData1_f = 0;
+ADD_CMD("sync", CmdSync,"   write back the files changed in the cache")
+
+
+ParserReturnVal_t CmdDelete(int mode)
+{
+        uint32_t rc;
+        uint32_t file_number;
+        
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        rc = fetch_uint32_arg(&file_number);
+        if (rc)
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
         }
-	else {
-		printf("Write error! \n\n");
-	}
+
+        delete((uint8_t)file_number);
+
+        return CmdReturnOk;
 }
 
+ADD_CMD("delete", CmdDelete,"   send CMD DELETE using SPI 1")
+
 
+// copy <src> <dst> and move <src> <dst> share their argument handling
+static ParserReturnVal_t copy_move_cmd(int (*fn)(uint8_t, uint8_t))
+{
+        uint32_t src, dst;
 
+        if (fetch_uint32_arg(&src) || fetch_uint32_arg(&dst))
+        {
+                printf("Must specify the source and destination file numbers!\n");
+                return CmdReturnBadParameter1;
+        }
 
+        if (fn((uint8_t)src, (uint8_t)dst) != 0) {
+                printf("Failed: no file %lu, or no room for its copy\n",
+                       (unsigned long)src);
+        }
 
-void list()
+        return CmdReturnOk;
+}
+
+ParserReturnVal_t CmdCopy(int mode)
 {
-        rxData1_f = 0;
-       
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xfe;			// SYNC
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0x00;                        // LIST
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+        return copy_move_cmd(copy_file);
+}
 
-        while (!(SPI1->SR & SPI_SR_TXE));
-        SPI1->DR = 0xff;                        // 0xff
-        while (SPI1->SR & SPI_SR_BSY);
-        HAL_Delay(50);
+ADD_CMD("copy", CmdCopy,"   copy a file on the slave, sharing its blocks: copy <src> <dst>")
 
-        if (rxData1_f == 1 && rxData1 == 1) {
-	        
-volatile uint8_t kk = 0;
+ParserReturnVal_t CmdMove(int mode)
+{
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
 
-	do {
-                while (!(SPI1->SR & SPI_SR_TXE));
-                SPI1->DR = 0xff;                        // 0xff
-                while (SPI1->SR & SPI_SR_BSY);
-                HAL_Delay(50);
-		if (rxData1 == 0) {
-			printf("\n");
-		}
-		else {
-			if (kk == 0) {
-				printf("%d  ", rxData1);
-				kk = 1;
-			}
-			else {
-				printf("%d\n", rxData1);
-				kk = 0;
-			}
-		}
-	
-	}
-	while (rxData1 != 0);
+        return copy_move_cmd(move_file);
+}
 
+ADD_CMD("move", CmdMove,"   move a file and its name to another number: move <src> <dst>")
 
-		rxData1_f = 0;
+
+ParserReturnVal_t CmdNCreate(int mode)
+{
+	char *name;
+	uint32_t file_size;
+	uint8_t file_number;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_string_arg(&name) || strlen(name) > DIR_NAME_SIZE)
+        {
+                printf("Must specify a name of 1 to %d characters!\n", DIR_NAME_SIZE);
+                return CmdReturnBadParameter1;
         }
+        if (fetch_uint32_arg(&file_size) || file_size < 1 || file_size > MAX_FILE_SIZE)
+        {
+                printf("Must specify the file size, 1 to %u!\n", MAX_FILE_SIZE);
+                return CmdReturnBadParameter2;
+        }
+
+	file_number = name_create(name, (uint16_t)file_size);
+	if (file_number == 0) {
+		printf("Create error! \n\n");
+	}
+	else {
+		printf("Created file %d \n\n", file_number);
+	}
 
+        return CmdReturnOk;
 }
 
+ADD_CMD("ncreate", CmdNCreate,"   CREATE a named file: ncreate name size")
 
-	
-ParserReturnVal_t spiinit(int mode)
+
+// The name argument of nopen, nread, nwrite and ndelete, looked up on the
+// slave. Returns the file number, 0 after printing why there is none.
+static uint8_t fetch_name_arg(uint16_t *size)
+{
+	char *name;
+	uint8_t file_number;
+
+        if (fetch_string_arg(&name))
+        {
+                printf("Must specify the file name!\n");
+                return 0;
+        }
+
+	file_number = name_open(name, size);
+	if (file_number == 0) {
+		printf("No file named %s \n\n", name);
+	}
+	return file_number;
+}
+
+ParserReturnVal_t CmdNOpen(int mode)
 {
+	uint16_t file_size;
+	uint8_t file_number;
+
         if (mode != CMD_INTERACTIVE)
         return CmdReturnOk;
 
-        spi_init();
+	file_number = fetch_name_arg(&file_size);
+	if (file_number != 0) {
+		printf("File %d, %u bytes \n\n", file_number, file_size);
+	}
 
         return CmdReturnOk;
 }
 
-ADD_CMD("spiinit", spiinit, "               Initialize the SPI")
+ADD_CMD("nopen", CmdNOpen,"   file number and size of a name: nopen name")
 
 
-ParserReturnVal_t CmdSpiWrite(int mode)
+ParserReturnVal_t CmdNRead(int mode)
 {
-	uint32_t val = 0;
-	fetch_uint32_arg(&val);
-	spi_write((uint8_t *)&val, 1);
-	
-	return CmdReturnOk;
+	const uint8_t *data;
+	uint16_t file_size, length, i;
+	uint8_t file_number;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	file_number = fetch_name_arg(&file_size);
+	if (file_number == 0) {
+		return CmdReturnOk;
+	}
+
+	data = read_buffer(file_number, file_size, &length);
+	if (data == NULL) {
+		return CmdReturnOk;
+	}
+
+	for (i = 0; i < length; i++) {
+		printf("%d   ", data[i]);
+	}
+	printf("\n\n");
+
+        return CmdReturnOk;
 }
 
-ADD_CMD("senddata", CmdSpiWrite,"   send data using SPI 1")
+ADD_CMD("nread", CmdNRead,"   READ a named file: nread name")
 
-ParserReturnVal_t CmdSpiWrite_2(int mode)
+
+ParserReturnVal_t CmdNWrite(int mode)
 {
-        uint32_t val = 0;
-        fetch_uint32_arg(&val);
-        spi_write_spi2((uint8_t *)&val, 1);
+	uint8_t data[100];
+	uint32_t value;
+	uint16_t file_size;
+	uint16_t length = 0;
+	uint8_t file_number;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	file_number = fetch_name_arg(&file_size);
+	if (file_number == 0) {
+		return CmdReturnOk;
+	}
+
+	while (length < sizeof(data) && fetch_uint32_arg(&value) == 0) {
+		data[length++] = (uint8_t)value;
+	}
+	if (length != file_size) {
+		printf("WRITE takes the whole file, %u bytes!\n", file_size);
+		return CmdReturnBadParameter2;
+	}
+
+	write_file(file_number, data, length);
 
         return CmdReturnOk;
 }
 
-ADD_CMD("senddata2", CmdSpiWrite_2,"   send data using SPI 2")
+ADD_CMD("nwrite", CmdNWrite,"   WRITE a named file: nwrite name data...")
 
 
-ParserReturnVal_t CmdSpiWrite_1B(int mode)
+ParserReturnVal_t CmdNDelete(int mode)
 {
-        uint32_t val = 0;
-        fetch_uint32_arg(&val);
-        spi_write_1B((uint8_t *)&val);
+	uint16_t file_size;
+	uint8_t file_number;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	file_number = fetch_name_arg(&file_size);
+	if (file_number != 0) {
+		delete(file_number);
+	}
 
         return CmdReturnOk;
 }
 
-ADD_CMD("s1b", CmdSpiWrite_1B,"   send 1 byte data using SPI 1")
+ADD_CMD("ndelete", CmdNDelete,"   DELETE a named file: ndelete name")
 
-ParserReturnVal_t CmdList(int mode)
+
+ParserReturnVal_t CmdNList(int mode)
 {
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+	name_list();
 
-	list();
-        
         return CmdReturnOk;
 }
 
-ADD_CMD("list", CmdList,"   send CMD LIST using SPI 1")
+ADD_CMD("nlist", CmdNList,"   LIST with sizes and names")
 
 
 
 
-ParserReturnVal_t CmdCreate(int mode)
+
+ParserReturnVal_t CmdSlaves(int mode)
 {
-	uint32_t rc1, rc2;
-        uint32_t file_number;
-	uint32_t file_size;
+	uint32_t count, selected;
+	uint8_t n;
 
         if (mode != CMD_INTERACTIVE)
         return CmdReturnOk;
 
-        rc1 = fetch_uint32_arg(&file_number);
-        if (rc1)
+	if (fetch_uint32_arg(&count) == 0) {
+		if (count < 1 || count > SPI_MAX_SLAVES) {
+			printf("Must specify 1 to %d slaves!\n", SPI_MAX_SLAVES);
+			return CmdReturnBadParameter1;
+		}
+		if (fetch_uint32_arg(&selected) != 0) {
+			selected = 0;
+		}
+		if (selected >= count) {
+			printf("Slaves are numbered 0 to %lu!\n", (unsigned long)count - 1);
+			return CmdReturnBadParameter2;
+		}
+
+		// the cache knows the files of the slave it talked to
+		if (selected != spi_slave) {
+			for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+				cache_forget(n);
+			}
+		}
+		spi_slaves = (uint8_t)count;
+		spi_slave = (uint8_t)selected;
+	}
+
+	printf("%d slaves, commands go to slave %d\n\n", spi_slaves, spi_slave);
+
+        return CmdReturnOk;
+}
+
+ADD_CMD("slaves", CmdSlaves,"   slaves on the bus and the one to talk to: slaves count [n]")
+
+
+ParserReturnVal_t CmdFCreate(int mode)
+{
+        uint32_t file_number, file_size;
+
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
+
+        if (fetch_uint32_arg(&file_number) || file_number < 1 || file_number > MAX_FILE_NUMBER)
         {
                 printf("Must specify the file number!\n");
                 return CmdReturnBadParameter1;
         }
-
-        rc2 = fetch_uint32_arg(&file_size);
-        if (rc2)
+        if (fetch_uint32_arg(&file_size) || file_size < 1 || file_size > FAN_MAX_SIZE)
         {
-                printf("Must specify the file size!\n");
+                printf("Must specify the file size, 1 to %u!\n", FAN_MAX_SIZE);
                 return CmdReturnBadParameter2;
         }
 
-        create((uint8_t)file_number, (uint8_t)file_size);
+	if (fan_create((uint8_t)file_number, (uint16_t)file_size) != 0) {
+		printf("Create error! \n\n");
+	}
 
         return CmdReturnOk;
 }
 
-ADD_CMD("create", CmdCreate,"   send CMD CREATE using SPI 1")
+ADD_CMD("fcreate", CmdFCreate,"   CREATE a file striped over the slaves: fcreate n size")
 
 
-ParserReturnVal_t CmdWrite(int mode)
+ParserReturnVal_t CmdFWrite(int mode)
 {
-        uint32_t rc;
-	uint32_t para[100] = {0};
-	uint8_t para_num = 0;
+	uint8_t data[100];
+        uint32_t file_number, value;
+	uint16_t length = 0;
 
-	if (mode != CMD_INTERACTIVE)
+        if (mode != CMD_INTERACTIVE)
         return CmdReturnOk;
 
-	do {
-		rc = fetch_uint32_arg(para + para_num);
-		para_num++;
+        if (fetch_uint32_arg(&file_number))
+        {
+                printf("Must specify the file number!\n");
+                return CmdReturnBadParameter1;
+        }
+	while (length < sizeof(data) && fetch_uint32_arg(&value) == 0) {
+		data[length++] = (uint8_t)value;
 	}
-	while (rc == 0);
 
-	write(para_num - 1, para);
+	if (fan_write((uint8_t)file_number, data, length) != 0) {
+		printf("Write error! \n\n");
+	}
 
         return CmdReturnOk;
 }
 
-ADD_CMD("write", CmdWrite,"   send Write command using SPI 1")
-
+ADD_CMD("fwrite", CmdFWrite,"   WRITE a striped file: fwrite n data...")
 
 
-ParserReturnVal_t CmdRead(int mode)
+ParserReturnVal_t CmdFRead(int mode)
 {
-        uint32_t rc1, rc2;
-        uint32_t file_number;
-        uint32_t file_size;
+	static uint8_t data[FAN_MAX_SIZE];
+        uint32_t file_number, file_size;
+	uint32_t i;
 
         if (mode != CMD_INTERACTIVE)
         return CmdReturnOk;
 
-        rc1 = fetch_uint32_arg(&file_number);
-        if (rc1)
+        if (fetch_uint32_arg(&file_number))
         {
                 printf("Must specify the file number!\n");
                 return CmdReturnBadParameter1;
         }
-
-        rc2 = fetch_uint32_arg(&file_size);
-        if (rc2)
+        if (fetch_uint32_arg(&file_size) || file_size > FAN_MAX_SIZE)
         {
-                printf("Must specify the file size!\n");
+                printf("Must specify the file size, up to %u!\n", FAN_MAX_SIZE);
                 return CmdReturnBadParameter2;
         }
 
-        read((uint8_t)file_number, (uint8_t)file_size);
+	if (fan_read((uint8_t)file_number, data, (uint16_t)file_size) != 0) {
+		printf("Read error! \n\n");
+		return CmdReturnOk;
+	}
+
+	for (i = 0; i < file_size; i++) {
+		printf("%d   ", data[i]);
+	}
+	printf("\n\n");
 
         return CmdReturnOk;
 }
 
-ADD_CMD("read", CmdRead,"   send CMD READ using SPI 1")
+ADD_CMD("fread", CmdFRead,"   READ a striped file: fread n size")
 
 
-ParserReturnVal_t CmdDelete(int mode)
+ParserReturnVal_t CmdFDelete(int mode)
 {
-        uint32_t rc;
         uint32_t file_number;
-        
 
         if (mode != CMD_INTERACTIVE)
         return CmdReturnOk;
 
-        rc = fetch_uint32_arg(&file_number);
-        if (rc)
+        if (fetch_uint32_arg(&file_number))
         {
                 printf("Must specify the file number!\n");
                 return CmdReturnBadParameter1;
         }
 
-        delete((uint8_t)file_number);
+	if (fan_delete((uint8_t)file_number) != 0) {
+		printf("Delete error! \n\n");
+	}
 
         return CmdReturnOk;
 }
 
-ADD_CMD("delete", CmdDelete,"   send CMD DELETE using SPI 1")
+ADD_CMD("fdelete", CmdFDelete,"   DELETE a file on every slave: fdelete n")
+
+
+ParserReturnVal_t CmdFList(int mode)
+{
+        if (mode != CMD_INTERACTIVE)
+        return CmdReturnOk;
 
+	fan_list();
 
+        return CmdReturnOk;
+}
 
+ADD_CMD("flist", CmdFList,"   LIST merged over the slaves: number, size, slaves, name")
@@ -0,0 +1,285 @@
+// File Name    : filesys.h
+// Project      : Simple File System by SPI
+// Description  : Master-side calls and slave-side storage of the simple
+//                file system, for code that drives them outside the monitor
+//                commands (the host simulator and benchmark)
+
+#ifndef FILESYS_H
+#define FILESYS_H
+
+#include <stdint.h>
+#include "storage.h"
+#include "dir.h"
+
+#define CPU_CYCLES_PER_US 100	// 100MHz core clock
+#define SPI_RX_TIMEOUT_US 2000	// event handshake: give up waiting for a reply
+#define SPI_TURNAROUND_US 5	// event handshake: slave ISR time before next byte
+#define SPI_DMA_TIMEOUT_US 100000	// payload DMA: give up on the whole transfer
+#define SPI_DMA_BUF_SIZE 255	// largest payload the master moves by DMA
+#define UART_DMA_TIMEOUT_US 1000000	// uart_dma_sink(): wait for the console to drain
+
+// Slave byte queues between SPI2_IRQHandler and the protocol worker, which
+// runs as a software interrupt on the otherwise unused SPI4 line, below
+// the SPI2 priority so the byte interrupt can always preempt it
+#define SPI2_RX_RING_SIZE 64
+#define SPI2_TX_RING_SIZE 256	// replies and read data staged ahead of the clock
+#define SPI2_WORKER_IRQn SPI4_IRQn
+#define SPI2_WORKER_IRQHandler SPI4_IRQHandler
+#define SPI2_WORKER_PRIORITY 1
+
+// Several slaves on SPI1, each selected by its own chip select, active
+// low, on PC0 to PC3. A slave board built with SPI2_HW_NSS 1 takes its
+// chip select on PB12 and leaves MISO to the selected board; with 0 it
+// keeps software NSS and is the only slave on the bus.
+#define SPI_MAX_SLAVES 4
+#ifndef SPI2_HW_NSS
+#define SPI2_HW_NSS 0
+#endif
+
+// Command bytes that follow SYNC (0xfe)
+#define CMD_LIST	0x00
+#define CMD_READ	0x01
+#define CMD_WRITE	0x02
+#define CMD_CREATE	0x03
+#define CMD_DELETE	0x04
+#define CMD_FRAMED	0x05
+#define CMD_CREATE_FREE	0x06	// size in, file number (0 if full) out
+#define CMD_PREAD	0x07	// file number, offset, length in; the bytes out
+#define CMD_PWRITE	0x08	// file number, offset, length, then the bytes in
+#define CMD_BAUD	0x09	// clock divisor in, then a test pattern echoed back
+#define CMD_OPEN	0x0a	// name in; file number (0 if none), size out
+#define CMD_NCREATE	0x0b	// name, size in; file number (0 if failed) out
+#define CMD_NLIST	0x0c	// per file: number, size, name length, name
+#define CMD_ZWRITE	0x0d	// file number, encoded length, the encoded file in
+#define CMD_ZREAD	0x0e	// file number in; encoded length, encoded file out
+#define CMD_CWRITE	0x0f	// file number, length, then CRC-checked chunks in
+#define CMD_CREAD	0x10	// file number, length, then chunk requests in;
+				// CRC-checked chunks out
+#define CMD_BLIST	0x11	// the file table out as one image, see list_get()
+#define CMD_WREAD	0x12	// file number, length in; the bytes out in 16-bit frames
+#define CMD_WWRITE	0x13	// file number, length, the bytes in 16-bit frames in
+#define CMD_SOPEN	0x14	// file number (0 for the first free), flags in;
+				// the number opened (0 if none) out
+#define CMD_APPEND	0x15	// length, then the bytes in, onto the open file
+#define CMD_SCLOSE	0x16	// the open file's size out
+#define CMD_SNAPSHOT	0x17	// the image length, then the image out
+#define CMD_RESTORE	0x18	// the image length, then the image in
+#define CMD_COPY	0x19	// source, destination file numbers in; 1 (0 if failed) out
+#define CMD_MOVE	0x1a	// the same, the name going along with the contents
+
+// Compressed READ and WRITE (rle.h). The master offers ZWRITE only when
+// encoding saves bytes, and the slave answers ZREAD with 0 instead of ACK
+// when it does not, or the file is past ZREAD_MAX_SIZE; either way the
+// plain command is used.
+#define ZREAD_MAX_SIZE 4096
+
+// CRC-checked READ and WRITE. The payload goes in chunks of
+// CRC_CHUNK_SIZE bytes, each followed by the CRC-32 of its number and its
+// bytes, low byte first. CWRITE: the slave answers each chunk with the
+// number of the chunk it wants next, the same one again if the CRC was
+// wrong, and gives up after CRC_RETRIES bad copies in a row. CREAD: the
+// master sends the number of the chunk it wants and clocks it out, and
+// asks again if the CRC was wrong; its next SYNC ends the command. Chunk
+// numbers go on the wire as their low 7 bits, so a request is never SYNC.
+#define CRC_CHUNK_SIZE 64
+#define CRC_RETRIES 8
+
+// 16-bit READ and WRITE. The command, its arguments and ACKs go in 8-bit
+// frames as always; after the ACK both sides switch to 16-bit frames
+// (DFF) for the data, two bytes per frame, low byte first, with the last
+// frame padded if the length is odd, and back to 8-bit after it. WREAD
+// needs 0 < length <= size, WWRITE the file's exact size; the slave
+// answers 0 otherwise, or an old slave no ACK, and the plain command runs.
+
+// BLIST image: the number of files, a bitmap of them, bit n - 1 for file
+// n, then each one's 16-bit size, low byte first, in file number order
+#define LIST_BITMAP_SIZE ((MAX_FILE_NUMBER + 7) / 8)
+#define LIST_IMAGE_SIZE (1 + LIST_BITMAP_SIZE + 2 * MAX_FILE_NUMBER)
+
+// Streams. SOPEN opens a file on the slave for APPEND, which grows it by
+// a 16-bit length and stores each byte as it comes in, so a file can be
+// written a piece at a time with no CREATE of its final size; it still
+// ends at MAX_FILE_SIZE. One file is open at a time, and SCLOSE returns
+// the size it got to.
+#define STREAM_NEW 0x01		// SOPEN flag: empty the file first
+#define STREAM_CHUNK_SIZE 256	// bytes per APPEND from stream_feed()
+
+// SNAPSHOT/RESTORE image of the whole file table: the number of files,
+// then per file its number, 16-bit size, name length and name, then the
+// contents of each in the same order, then the CRC-32 of all that, low
+// byte first. Its length goes ahead of it as 32 bits. RESTORE replaces
+// every file on the slave once the table in the image checks out, writes
+// the contents as they come and answers 1 after the CRC if it matched.
+#define SNAP_HEAD_SIZE (1 + MAX_FILE_NUMBER * (4 + DIR_NAME_SIZE))
+#define SNAP_MAX_SIZE ((uint32_t)SNAP_HEAD_SIZE + (uint32_t)BLOCK_COUNT * BLOCK_SIZE + 4)
+
+// Baud-rate negotiation, see baud_negotiate(). Divisors are SPI_CR1_BR
+// codes: the clock is 100MHz / (2 << br).
+#define SPI_BR_SLOWEST 7	// 100MHz/256, what spi_init() starts with
+#define SPI_SLAVE_MIN_BR 1	// the slave accepts at most 100MHz/4
+#define BAUD_PATTERN_SIZE 16
+
+// Framed protocol. After SYNC, CMD_FRAMED and the 0xff probe the master
+// sends request frames back to back and ends the burst with a 0 byte:
+//   request:  len, opcode (CMD_*), seq, arguments..., crc8
+//   response: len, seq, status, payload..., crc8
+// len counts the bytes between itself and the crc. The slave streams the
+// responses, in order, on the bytes after each request's crc.
+#define FRAME_BURST_SIZE 1024	// bytes in one burst, and the slave's response queue
+#define FRAME_MAX_SIZE 258	// len byte + 255 + crc
+#define FRAME_REQ_OVERHEAD 4	// len, opcode, seq, crc
+#define FRAME_RESP_OVERHEAD 4	// len, seq, status, crc
+#define FRAME_MAX_DATA 252	// most WRITE or READ bytes one frame carries
+
+#define FRAME_OK	0
+#define FRAME_ERR_CRC	1	// request frame failed its crc
+#define FRAME_ERR_FILE	2	// bad file number, size or length
+#define FRAME_ERR_OP	3	// unknown opcode
+#define FRAME_ERR_LOST	0xff	// master side: no valid response came back
+
+struct frame_op
+{
+	uint8_t op;		// CMD_CREATE, CMD_WRITE, CMD_READ, CMD_DELETE,
+				// CMD_PREAD, CMD_PWRITE, CMD_COPY or CMD_MOVE
+	uint8_t file_number;	// COPY, MOVE: the source
+	uint16_t offset;	// PREAD, PWRITE: first byte of the range
+	uint16_t size;		// CREATE: file size, WRITE: bytes in data, READ: room in
+				// data; WRITE and READ move at most FRAME_MAX_DATA;
+				// COPY, MOVE: the destination
+	uint8_t *data;		// WRITE, PWRITE: bytes to write, READ, PREAD: filled in
+	uint8_t seq;		// set by framed()
+	uint8_t status;		// FRAME_OK or FRAME_ERR_*, set by framed()
+	uint8_t length;		// READ, PREAD: bytes returned
+};
+
+// Asynchronous master calls. A request is queued with async_submit() and
+// run by the SPI1 interrupts, one at a time for each slave and those for
+// different slaves side by side; the caller gets a handle to poll, or a
+// done() callback. create(), read_file(), write_file(), delete() and
+// list() submit one and wait for it.
+#define ASYNC_QUEUE_SIZE 8
+#define READ_BUF_SIZE 4096	// the master's receive buffer, see read_buffer()
+
+#define ASYNC_PENDING	0	// queued or on the wire
+#define ASYNC_OK	1
+#define ASYNC_ERR_NACK	2	// the slave did not ACK the command
+#define ASYNC_ERR_FILE	3	// nor the file number or the data
+#define ASYNC_ERR_TIMEOUT 4	// a reply or the payload DMA never came
+
+struct async_req
+{
+	uint8_t op;		// CMD_LIST, CMD_READ, CMD_WRITE, CMD_CREATE, CMD_DELETE,
+				// CMD_ZREAD, CMD_ZWRITE, CMD_CREAD, CMD_CWRITE,
+				// CMD_BLIST, CMD_WREAD, CMD_WWRITE, CMD_SOPEN,
+				// CMD_APPEND, CMD_SCLOSE, CMD_COPY or CMD_MOVE
+	uint8_t slave;		// chip select it goes to, below spi_slaves
+	uint8_t file_number;	// SOPEN: 0 for the first free one, COPY, MOVE:
+				// the source
+	uint16_t size;		// CREATE: file size (one byte), READ, CREAD, WREAD:
+				// bytes to read, WRITE, ZWRITE, CWRITE, WWRITE,
+				// APPEND: bytes in data, LIST, ZREAD, BLIST: room
+				// in data, SOPEN: STREAM_* flags, COPY, MOVE:
+				// the destination
+	uint8_t *data;		// READ, CREAD, WREAD: filled in, WRITE, CWRITE,
+				// WWRITE, APPEND: bytes to write,
+				// LIST: filled with file number, size pairs,
+				// BLIST: filled with the image,
+				// ZWRITE: encoded file, ZREAD: filled with it
+	void (*done)(struct async_req *req);	// may be NULL, see async_submit()
+	void (*received)(struct async_req *req, uint16_t offset, uint16_t length);
+				// READ, CREAD, WREAD: may be NULL, see async_submit()
+	void *context;		// for done() and received()
+	volatile uint8_t status;	// ASYNC_*
+	volatile uint16_t length;	// READ, WREAD, LIST, ZREAD, BLIST: bytes of data
+					// filled in, SOPEN: the file number opened,
+					// SCLOSE: the file's size,
+					// CREAD: of them checked
+};
+
+// The file table as list_get() parses it from a BLIST image
+struct list_table
+{
+	uint8_t count;				// files in it
+	uint8_t bitmap[LIST_BITMAP_SIZE];	// bit n - 1 set if file n exists
+	uint16_t size[MAX_FILE_NUMBER + 1];	// by file number, 0 if none
+};
+
+// One file of an NLIST reply, see name_list_get()
+struct name_entry
+{
+	uint8_t file_number;
+	uint16_t size;
+	char name[DIR_NAME_SIZE + 1];
+};
+
+// Where read_stream() hands a file, a piece at a time as it lands in the
+// receive buffer, from the SPI1 or DMA interrupt. The pieces follow each
+// other in one buffer, and a last call with length 0, from the caller,
+// asks the sink to finish with it.
+typedef void (*read_sink)(const uint8_t *data, uint16_t length, void *context);
+
+// Where stream_feed() gets a file's bytes: fills data with up to room
+// bytes and returns how many, 0 at the end
+typedef uint16_t (*stream_source)(uint8_t *data, uint16_t room, void *context);
+
+// How the master paces the bytes of a command, see spi1_transfer()
+enum handshake {HANDSHAKE_DELAY, HANDSHAKE_EVENT};
+
+extern volatile enum handshake handshake_mode;
+extern volatile uint32_t spi_rx_timeouts;
+extern volatile uint32_t spi2_rx_overruns;
+extern volatile uint8_t spi_link_br;
+extern volatile uint8_t spi_slaves;
+extern volatile uint8_t spi_slave;
+extern volatile uint8_t payload_dma;
+extern volatile uint8_t payload_compress;
+extern uint32_t compress_plain_bytes;
+extern uint32_t compress_wire_bytes;
+extern volatile uint8_t payload_crc;
+extern uint32_t crc_chunks;
+extern uint32_t crc_resends;
+extern volatile uint8_t payload_wide;
+extern uint8_t spi1_dma_rx[SPI_DMA_BUF_SIZE];
+
+void spi_init(void);
+void spi_select(uint8_t slave);
+void delay_us(uint32_t us);
+uint8_t spi1_transfer(uint8_t data);
+int spi1_transfer_dma(const uint8_t *tx, uint8_t *rx, uint16_t length);
+int spi1_transfer_burst(const uint8_t *tx, uint8_t *rx, uint16_t length);
+uint8_t spi2_idle(void);
+
+void create(uint8_t file_number, uint8_t file_size);
+uint8_t create_free(uint8_t file_size);
+void delete(uint8_t file_number);
+int copy_file(uint8_t src, uint8_t dst);
+int move_file(uint8_t src, uint8_t dst);
+int32_t read_file(uint8_t file_number, uint8_t *data, uint16_t size);
+const uint8_t *read_buffer(uint8_t file_number, uint16_t size, uint16_t *length);
+int read_stream(uint8_t file_number, uint16_t size, read_sink sink, void *context);
+void uart_dma_sink(const uint8_t *data, uint16_t length, void *context);
+void write(uint8_t para_num, uint32_t * para);
+int write_file(uint8_t file_number, const uint8_t *data, uint16_t length);
+int read_range(uint8_t file_number, uint16_t offset, uint8_t *data, uint16_t length);
+int write_range(uint8_t file_number, uint16_t offset, const uint8_t *data, uint16_t length);
+uint8_t stream_open(uint8_t file_number, uint8_t flags);
+int stream_append(const uint8_t *data, uint16_t length);
+int32_t stream_feed(stream_source source, void *context);
+int32_t stream_close(void);
+int32_t snapshot(read_sink sink, void *context);
+int restore(stream_source source, void *context, uint32_t length);
+void list(void);
+int list_get(struct list_table *table);
+uint8_t name_open(const char *name, uint16_t *size);
+uint8_t name_create(const char *name, uint16_t size);
+void name_list(void);
+int name_list_get(struct name_entry *entries, int max);
+int framed(struct frame_op *ops, uint16_t count);
+uint16_t framed_fit(const struct frame_op *ops, uint16_t count);
+
+int32_t async_submit(struct async_req *req);
+int async_poll(int32_t handle);
+uint8_t async_wait(int32_t handle);
+uint8_t baud_negotiate(uint8_t fastest_br);
+
+#endif
@@ -0,0 +1,97 @@
+// File Name    : flash.c
+// Project      : Simple File System by SPI
+// Description  : Erase and program the log sectors of the STM32F411 internal
+//                flash. The F411 has one flash bank, and the CPU stalls on
+//                every fetch from it while an erase or a program runs, the
+//                interrupt handlers included. Only persist_poll() calls
+//                these, from the main loop while the slave is idle.
+//                The host simulator replaces this file with sim/flash_sim.c
+
+#include "common.h"
+#include "flash.h"
+#include <string.h>
+
+#define FLASH_KEY1 0x45670123u
+#define FLASH_KEY2 0xcdef89abu
+#define FLASH_SR_ERRORS (FLASH_SR_PGSERR | FLASH_SR_PGPERR | FLASH_SR_PGAERR \
+			 | FLASH_SR_WRPERR | FLASH_SR_OPERR)
+
+
+static void flash_unlock(void)
+{
+	while (FLASH->SR & FLASH_SR_BSY);
+
+	if (FLASH->CR & FLASH_CR_LOCK) {
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+	FLASH->SR = FLASH_SR_ERRORS | FLASH_SR_EOP;	// clear old status
+}
+
+static int flash_lock(void)
+{
+	uint32_t sr;
+
+	while (FLASH->SR & FLASH_SR_BSY);
+	sr = FLASH->SR;
+
+	FLASH->CR = FLASH_CR_LOCK;
+	return (sr & FLASH_SR_ERRORS) ? -1 : 0;
+}
+
+
+int flash_erase(uint8_t sector)
+{
+	if (sector >= FLASH_LOG_SECTORS) {
+		return -1;
+	}
+
+	flash_unlock();
+
+	// x32 parallelism (2.7V to 3.6V), sector number in SNB bits 6:3
+	FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_SER
+		  | ((uint32_t)(FLASH_LOG_FIRST_SECTOR + sector) << 3);
+	FLASH->CR |= FLASH_CR_STRT;
+
+	if (flash_lock() != 0) {
+		return -1;
+	}
+
+	// drop erased lines from the data cache
+	FLASH->ACR &= ~FLASH_ACR_DCEN;
+	FLASH->ACR |= FLASH_ACR_DCRST;
+	FLASH->ACR &= ~FLASH_ACR_DCRST;
+	FLASH->ACR |= FLASH_ACR_DCEN;
+
+	return 0;
+}
+
+int flash_program(uint32_t offset, const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+	uint32_t word;
+	uint32_t i;
+
+	if ((offset & 3) || (length & 3) || offset + length > FLASH_LOG_SIZE) {
+		return -1;
+	}
+
+	flash_unlock();
+	FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+
+	for (i = 0; i < length; i += 4) {
+		memcpy(&word, p + i, 4);
+		*(volatile uint32_t *)(FLASH_LOG_BASE + offset + i) = word;
+		while (FLASH->SR & FLASH_SR_BSY);
+		if (FLASH->SR & FLASH_SR_ERRORS) {
+			break;
+		}
+	}
+
+	return flash_lock();
+}
+
+const uint8_t * flash_addr(uint32_t offset)
+{
+	return (const uint8_t *)(FLASH_LOG_BASE + offset);
+}
@@ -0,0 +1,27 @@
+// File Name    : flash.h
+// Project      : Simple File System by SPI
+// Description  : Internal flash sectors used for the persistent file log.
+//                The STM32F411xE has 128KB sectors 5 to 7 at 0x08020000,
+//                which leaves sectors 0 to 4 (256KB) for the program
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+
+#define FLASH_LOG_FIRST_SECTOR 5
+#define FLASH_LOG_SECTORS 3
+#define FLASH_LOG_BASE 0x08020000u
+#define FLASH_SECTOR_SIZE 0x20000u	// 128KB
+#define FLASH_LOG_SIZE (FLASH_LOG_SECTORS * FLASH_SECTOR_SIZE)
+
+// Offsets are from FLASH_LOG_BASE. Programming is by 32-bit words, so
+// offset and length must be multiples of 4, and can only clear bits of
+// erased (0xff) flash. Both return 0, or -1 if the flash reports an error.
+int flash_erase(uint8_t sector);
+int flash_program(uint32_t offset, const void *data, uint32_t length);
+
+// Flash is memory mapped for reading
+const uint8_t * flash_addr(uint32_t offset);
+
+#endif
@@ -0,0 +1,528 @@
+// File Name    : persist.c
+// Project      : Simple File System by SPI
+// Description  : Log-structured persistence of the slave's files in flash.
+//
+//   Every change is appended, nothing is rewritten in place. A sector
+//   starts with a header (magic, sequence number, erase count) and a
+//   checkpoint record holding the log offset of every file's latest
+//   record. Then come FILE records (the file's whole contents, after its
+//   name if it has one) and DELETE tombstones. Each record ends with a
+//   commit word written last, so a record cut short by a reset is
+//   skipped.
+//
+//   Mounting reads the sector headers, the checkpoint of the newest sector
+//   and the records after it, so only one sector is replayed. When no
+//   erased sector is left, the oldest sector's live records are appended
+//   again and it is erased. Sectors are taken oldest first and the erased
+//   sector with the fewest erases is used next, which spreads the wear.
+//
+//   Erase and program only happen in persist_poll(), from the main loop,
+//   and only while the slave is idle in SYNC. The interrupt handlers run
+//   from the same flash bank, so they stall until the operation ends: a
+//   program for microseconds, a sector erase for up to two seconds. A
+//   command that starts during one waits for it, and the master may time
+//   out on it and send it again.
+
+#include "common.h"
+#include "filesys.h"
+#include "persist.h"
+#include "storage.h"
+#include "dir.h"
+#include <string.h>
+
+#define LOG_MAGIC	0x474c5346u	// "FSLG"
+#define LOG_COMMIT	0x4b4f4b4fu	// "OKOK"
+#define LOG_ERASED	0xffffffffu
+
+#define LOG_FILE	0x01
+#define LOG_DELETE	0x02
+#define LOG_CHECKPOINT	0x03
+#define LOG_NAMED	0x04		// FILE with the name first: length, bytes
+
+#define LOG_STAGE_SIZE	256		// bytes copied out of the file per program
+
+struct sector_header
+{
+	uint32_t magic;
+	uint32_t seq;			// higher is newer
+	uint32_t erase_count;
+	uint32_t commit;
+};
+
+struct record_header
+{
+	uint8_t type;
+	uint8_t file_number;
+	uint16_t size;			// data bytes, padded to a word in flash
+};
+
+// Log offset of each file's latest FILE record, 0 if none
+static uint32_t latest[MAX_FILE_NUMBER + 1];
+
+static uint32_t sector_seq[FLASH_LOG_SECTORS];	// 0 = no valid header
+static uint8_t sector_erased[FLASH_LOG_SECTORS];
+static uint32_t sector_erases[FLASH_LOG_SECTORS];
+
+static uint8_t has_head = 0;
+static uint8_t head = 0;
+static uint32_t head_pos = 0;			// next free byte in head
+static uint32_t next_seq = 1;
+static uint8_t mounted = 0;
+
+static uint32_t stage[LOG_STAGE_SIZE / 4];
+static struct persist_stats stats;
+
+
+static uint32_t record_length(uint16_t size)
+{
+	return sizeof(struct record_header) + ((size + 3u) & ~3u) + 4;
+}
+
+static uint32_t read_word(uint32_t offset)
+{
+	uint32_t word;
+
+	memcpy(&word, flash_addr(offset), 4);
+	return word;
+}
+
+static int sector_blank(uint8_t s)
+{
+	uint32_t pos;
+
+	for (pos = 0; pos < FLASH_SECTOR_SIZE; pos += 4) {
+		if (read_word(s * FLASH_SECTOR_SIZE + pos) != LOG_ERASED) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void erase_sector(uint8_t s)
+{
+	if (flash_erase(s) != 0) {
+		stats.failures++;
+		return;
+	}
+
+	sector_erases[s]++;
+	sector_seq[s] = 0;
+	sector_erased[s] = 1;
+	if (has_head && head == s) {
+		has_head = 0;
+	}
+}
+
+
+static uint32_t log_append(uint8_t type, uint8_t n, uint16_t size,
+			   const uint8_t *data, uint16_t data_length);
+
+// Start appending to the erased sector with the fewest erases
+static int activate_sector(void)
+{
+	struct sector_header h;
+	uint8_t best = FLASH_LOG_SECTORS;
+	uint8_t s;
+
+	for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+		if (sector_erased[s]
+		    && (best == FLASH_LOG_SECTORS || sector_erases[s] < sector_erases[best])) {
+			best = s;
+		}
+	}
+	if (best == FLASH_LOG_SECTORS) {
+		return -1;
+	}
+
+	h.magic = LOG_MAGIC;
+	h.seq = next_seq++;
+	h.erase_count = sector_erases[best];
+	h.commit = LOG_COMMIT;
+
+	sector_erased[best] = 0;
+	if (flash_program(best * FLASH_SECTOR_SIZE, &h, sizeof(h)) != 0) {
+		return -1;		// left for persist_poll() to erase
+	}
+
+	sector_seq[best] = h.seq;
+	has_head = 1;
+	head = best;
+	head_pos = sizeof(h);
+
+	return log_append(LOG_CHECKPOINT, 0, sizeof(latest), (const uint8_t *)latest,
+			  sizeof(latest)) ? 0 : -1;
+}
+
+// Copy part of file n to dst in the staging buffer. The SPI2 protocol
+// worker can change the file meanwhile, so it is held off for the copy; if
+// it changes the file anyway the file is dirty again and gets a newer record.
+static void stage_file(uint8_t n, uint16_t offset, uint8_t *dst, uint16_t count)
+{
+	uint8_t *span;
+	uint16_t span_length;
+	uint16_t i;
+
+	NVIC_DisableIRQ(SPI2_WORKER_IRQn);
+	for (i = 0; i < count; i += span_length) {
+		span = storage_span(n, offset + i, &span_length);
+		if (span == NULL) {
+			memset(dst + i, 0, count - i);	// shrunk meanwhile
+			break;
+		}
+		if (span_length > count - i) {
+			span_length = count - i;
+		}
+		memcpy(dst + i, span, span_length);
+	}
+	NVIC_EnableIRQ(SPI2_WORKER_IRQn);
+}
+
+// Append one record of size bytes: the data_length bytes of data, then
+// the contents of file n. Returns the record's log offset, or 0 if it could
+// not be written.
+static uint32_t log_append(uint8_t type, uint8_t n, uint16_t size,
+			   const uint8_t *data, uint16_t data_length)
+{
+	struct record_header h;
+	uint32_t length = record_length(size);
+	uint32_t commit = LOG_COMMIT;
+	uint32_t base, pos, done, chunk, padded, copied;
+
+	if (!has_head || head_pos + length > FLASH_SECTOR_SIZE) {
+		if (activate_sector() != 0) {
+			return 0;
+		}
+	}
+
+	base = head * FLASH_SECTOR_SIZE + head_pos;
+	head_pos += length;	// a failed record still uses its space
+
+	h.type = type;
+	h.file_number = n;
+	h.size = size;
+	if (flash_program(base, &h, sizeof(h)) != 0) {
+		head_pos = FLASH_SECTOR_SIZE;
+		return 0;
+	}
+
+	pos = base + sizeof(h);
+	for (done = 0; done < size; done += chunk) {
+		chunk = (size - done < LOG_STAGE_SIZE) ? size - done : LOG_STAGE_SIZE;
+		copied = 0;
+		if (done < data_length) {
+			copied = (data_length - done < chunk) ? data_length - done : chunk;
+			memcpy(stage, data + done, copied);
+		}
+		if (copied < chunk) {
+			stage_file(n, done + copied - data_length, (uint8_t *)stage + copied,
+				   chunk - copied);
+		}
+
+		padded = (chunk + 3) & ~3u;
+		memset((uint8_t *)stage + chunk, 0xff, padded - chunk);
+		if (flash_program(pos, stage, padded) != 0) {
+			head_pos = FLASH_SECTOR_SIZE;
+			return 0;
+		}
+		pos += padded;
+	}
+
+	if (flash_program(pos, &commit, 4) != 0) {
+		head_pos = FLASH_SECTOR_SIZE;
+		return 0;
+	}
+
+	stats.appended++;
+	return base;
+}
+
+// Append file n's size bytes of contents, after its name if it has one.
+// The caller reads the size once and decides on it: the worker can
+// resize or delete the file meanwhile, which marks it dirty again.
+static uint32_t log_file(uint8_t n, uint16_t size)
+{
+	uint8_t name[1 + DIR_NAME_SIZE];
+
+	NVIC_DisableIRQ(SPI2_WORKER_IRQn);
+	name[0] = dir_name(n, name + 1);
+	NVIC_EnableIRQ(SPI2_WORKER_IRQn);
+
+	// a name does not fit next to a file of nearly 64KB
+	if (name[0] == 0 || size > MAX_FILE_SIZE - sizeof(name)) {
+		return log_append(LOG_FILE, n, size, NULL, 0);
+	}
+	return log_append(LOG_NAMED, n, 1 + name[0] + size, name, 1 + name[0]);
+}
+
+
+// Replay sector s from its checkpoint. Returns 0 if the checkpoint is
+// missing or incomplete.
+static int replay_sector(uint8_t s)
+{
+	struct record_header h;
+	uint32_t base = s * FLASH_SECTOR_SIZE;
+	uint32_t pos = sizeof(struct sector_header);
+	uint32_t word, length;
+	uint32_t replayed = 0;
+
+	while (pos + sizeof(h) <= FLASH_SECTOR_SIZE) {
+		word = read_word(base + pos);
+		if (word == LOG_ERASED) {
+			break;
+		}
+
+		memcpy(&h, &word, sizeof(h));
+		length = record_length(h.size);
+		if (h.type < LOG_FILE || h.type > LOG_NAMED || h.file_number > MAX_FILE_NUMBER
+		    || pos + length > FLASH_SECTOR_SIZE) {
+			pos = FLASH_SECTOR_SIZE;	// damaged, append elsewhere
+			break;
+		}
+
+		if (replayed == 0 && (h.type != LOG_CHECKPOINT || h.size != sizeof(latest))) {
+			return 0;
+		}
+
+		if (read_word(base + pos + length - 4) == LOG_COMMIT) {
+			if (h.type == LOG_CHECKPOINT) {
+				memcpy(latest, flash_addr(base + pos + sizeof(h)), sizeof(latest));
+			}
+			else if (h.type == LOG_FILE || h.type == LOG_NAMED) {
+				latest[h.file_number] = base + pos;
+			}
+			else {
+				latest[h.file_number] = 0;
+			}
+			replayed++;
+		}
+		else if (replayed == 0) {
+			return 0;
+		}
+
+		pos += length;
+	}
+
+	if (replayed == 0) {
+		return 0;
+	}
+
+	stats.replayed = replayed;
+	head = s;
+	head_pos = pos;
+	has_head = 1;
+	return 1;
+}
+
+// Copy file n's latest record into the block pool
+static void load_file(uint8_t n)
+{
+	struct record_header h;
+	uint32_t offset = latest[n];
+	uint8_t *span;
+	uint16_t span_length;
+	uint16_t done;
+	uint16_t prefix = 0;
+	uint8_t name_length = 0;
+
+	if (offset < sizeof(struct sector_header) || offset >= FLASH_LOG_SIZE
+	    || sector_seq[offset / FLASH_SECTOR_SIZE] == 0) {
+		latest[n] = 0;
+		return;
+	}
+
+	memcpy(&h, flash_addr(offset), sizeof(h));
+	if (h.type == LOG_NAMED && h.size > 0) {
+		memcpy(&name_length, flash_addr(offset + sizeof(h)), 1);
+		prefix = 1 + name_length;
+	}
+	if ((h.type != LOG_FILE && h.type != LOG_NAMED) || h.file_number != n
+	    || prefix > h.size || name_length > DIR_NAME_SIZE
+	    || read_word(offset + record_length(h.size) - 4) != LOG_COMMIT
+	    || storage_resize(n, h.size - prefix) != 0) {
+		latest[n] = 0;
+		return;
+	}
+
+	for (done = 0; done < h.size - prefix; done += span_length) {
+		span = storage_span(n, done, &span_length);
+		memcpy(span, flash_addr(offset + sizeof(h) + prefix + done), span_length);
+	}
+
+	if (name_length) {
+		dir_insert(flash_addr(offset + sizeof(h) + 1), name_length, n);
+	}
+}
+
+
+void persist_mount(void)
+{
+	struct sector_header h;
+	uint32_t max_erases = 0;
+	uint8_t s, newest;
+	uint8_t n;
+
+	memset(latest, 0, sizeof(latest));
+	memset(&stats, 0, sizeof(stats));
+	has_head = 0;
+	next_seq = 1;
+
+	for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+		memcpy(&h, flash_addr(s * FLASH_SECTOR_SIZE), sizeof(h));
+		if (h.magic == LOG_MAGIC && h.commit == LOG_COMMIT && h.seq != 0) {
+			sector_seq[s] = h.seq;
+			sector_erases[s] = h.erase_count;
+			sector_erased[s] = 0;
+			if (h.seq >= next_seq) {
+				next_seq = h.seq + 1;
+			}
+			if (h.erase_count > max_erases) {
+				max_erases = h.erase_count;
+			}
+		}
+		else {
+			sector_seq[s] = 0;
+			sector_erases[s] = LOG_ERASED;
+			sector_erased[s] = sector_blank(s);
+		}
+	}
+
+	// a sector without a header has lost its count, assume the worst
+	for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+		if (sector_erases[s] == LOG_ERASED) {
+			sector_erases[s] = max_erases;
+		}
+	}
+
+	// the newest sector with a complete checkpoint; a newer one without is
+	// dropped, persist_poll() erases it
+	for (;;) {
+		newest = FLASH_LOG_SECTORS;
+		for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+			if (sector_seq[s] && (newest == FLASH_LOG_SECTORS || sector_seq[s] > sector_seq[newest])) {
+				newest = s;
+			}
+		}
+		if (newest == FLASH_LOG_SECTORS) {
+			memset(latest, 0, sizeof(latest));
+			break;
+		}
+		if (replay_sector(newest)) {
+			break;
+		}
+		sector_seq[newest] = 0;
+		memset(latest, 0, sizeof(latest));
+	}
+
+	storage_init();
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		if (latest[n]) {
+			load_file(n);
+		}
+	}
+	while (storage_take_dirty() != 0);
+
+	mounted = 1;
+}
+
+
+// Log the live records of the oldest sector again, then erase it
+static void compact(void)
+{
+	uint8_t victim = FLASH_LOG_SECTORS;
+	uint32_t base, offset;
+	uint16_t size;
+	uint8_t s, n;
+
+	for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+		if (sector_seq[s] && !(has_head && s == head)
+		    && (victim == FLASH_LOG_SECTORS || sector_seq[s] < sector_seq[victim])) {
+			victim = s;
+		}
+	}
+	if (victim == FLASH_LOG_SECTORS) {
+		return;
+	}
+
+	base = victim * FLASH_SECTOR_SIZE;
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		if (latest[n] < base || latest[n] >= base + FLASH_SECTOR_SIZE) {
+			continue;
+		}
+
+		size = file[n].size;
+		if (size) {
+			offset = log_file(n, size);
+		}
+		else {
+			offset = log_append(LOG_DELETE, n, 0, NULL, 0);
+		}
+		if (offset == 0) {
+			stats.failures++;
+			return;
+		}
+		latest[n] = size ? offset : 0;
+	}
+
+	erase_sector(victim);
+	stats.compactions++;
+}
+
+void persist_poll(void)
+{
+	uint32_t offset;
+	uint16_t size;
+	uint8_t s, n;
+	uint8_t erased = 0;
+
+	if (!mounted || !spi2_idle()) {
+		return;
+	}
+
+	// sectors left half written by a reset hold nothing live
+	for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+		if (!sector_erased[s] && sector_seq[s] == 0) {
+			erase_sector(s);
+		}
+	}
+
+	while (spi2_idle() && (n = storage_take_dirty()) != 0) {
+		size = file[n].size;
+		if (size) {
+			offset = log_file(n, size);
+		}
+		else if (latest[n]) {
+			offset = log_append(LOG_DELETE, n, 0, NULL, 0);
+		}
+		else {
+			continue;		// created and deleted before it was logged
+		}
+
+		if (offset == 0) {
+			storage_mark_dirty(n);
+			stats.failures++;
+			break;
+		}
+		latest[n] = size ? offset : 0;	// what was logged, not what is there now
+	}
+
+	for (s = 0; s < FLASH_LOG_SECTORS; s++) {
+		erased += sector_erased[s];
+	}
+	if (erased == 0 && spi2_idle()) {
+		compact();
+	}
+}
+
+
+void persist_get_stats(struct persist_stats *s)
+{
+	uint8_t i;
+
+	*s = stats;
+	s->head = head;
+	s->head_used = has_head ? head_pos : 0;
+	for (i = 0; i < FLASH_LOG_SECTORS; i++) {
+		s->seq[i] = sector_seq[i];
+		s->erase_count[i] = sector_erases[i];
+	}
+}
@@ -0,0 +1,35 @@
+// File Name    : persist.h
+// Project      : Simple File System by SPI
+// Description  : Keeps the slave's files in the internal flash as a log, so
+//                they survive a reset
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include "flash.h"
+
+struct persist_stats
+{
+	uint8_t head;				// sector being appended to
+	uint32_t head_used;			// bytes used in it
+	uint32_t seq[FLASH_LOG_SECTORS];	// 0 = erased or unused
+	uint32_t erase_count[FLASH_LOG_SECTORS];
+	uint32_t appended;			// records written since mount
+	uint32_t replayed;			// records read back by the mount
+	uint32_t compactions;
+	uint32_t failures;			// appends that will be retried
+};
+
+// Rebuild the file table from the log, in place of storage_init()
+void persist_mount(void);
+
+// Main-loop work: log the files changed since the last call, and erase or
+// compact sectors so that one erased sector is always ready. Does nothing
+// unless the slave is idle in SYNC (spi2_idle()), as the flash stalls the
+// SPI interrupts while it erases or programs.
+void persist_poll(void);
+
+void persist_get_stats(struct persist_stats *s);
+
+#endif
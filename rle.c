@@ -0,0 +1,116 @@
+// File Name    : rle.c
+// Project      : Simple File System by SPI
+// Description  : Run-length codec for compressed READ and WRITE payloads,
+//                see rle.h. The master encodes from and decodes into its
+//                own buffers; the slave decodes a ZWRITE straight into the
+//                file as the bytes arrive.
+
+#include "rle.h"
+#include <string.h>
+
+#define RLE_RUN_MAX 128
+#define RLE_RUN_MIN 3		// a run of 2 costs as much as 2 literals
+
+
+// Length of the run of equal bytes starting at src[i], up to RLE_RUN_MAX
+static uint16_t run_length(const uint8_t *src, uint16_t length, uint16_t i)
+{
+	uint16_t run = 1;
+
+	while (i + run < length && run < RLE_RUN_MAX && src[i + run] == src[i]) {
+		run++;
+	}
+	return run;
+}
+
+uint16_t rle_encode(const uint8_t *src, uint16_t length, uint8_t *dst, uint16_t room)
+{
+	uint16_t i = 0;
+	uint16_t o = 0;
+	uint16_t run, start;
+
+	while (i < length) {
+		run = run_length(src, length, i);
+		if (run >= RLE_RUN_MIN) {
+			if (o + 2 > room) {
+				return 0;
+			}
+			dst[o++] = (uint8_t)(257 - run);
+			dst[o++] = src[i];
+			i += run;
+			continue;
+		}
+
+		// literals up to the next run worth encoding
+		start = i;
+		while (i < length && i - start < RLE_RUN_MAX
+		       && run_length(src, length, i) < RLE_RUN_MIN) {
+			i++;
+		}
+		if (o + 1 + (i - start) > room) {
+			return 0;
+		}
+		dst[o++] = (uint8_t)(i - start - 1);
+		memcpy(dst + o, src + start, i - start);
+		o += i - start;
+	}
+
+	return o;
+}
+
+void rle_decoder_init(struct rle_decoder *d)
+{
+	d->left = 0;
+	d->repeat = 0;
+}
+
+uint8_t rle_decoder_put(struct rle_decoder *d, uint8_t in, uint8_t *out)
+{
+	uint8_t count;
+
+	if (d->left == 0) {
+		if (in < 128) {
+			d->left = in + 1;
+			d->repeat = 0;
+		}
+		else if (in > 128) {
+			d->left = (uint8_t)(257 - in);
+			d->repeat = 1;
+		}
+		return 0;
+	}
+
+	*out = in;
+	if (d->repeat) {
+		count = d->left;
+		d->left = 0;
+		return count;
+	}
+	d->left--;
+	return 1;
+}
+
+int rle_decoder_done(const struct rle_decoder *d)
+{
+	return d->left == 0;
+}
+
+int32_t rle_decode(const uint8_t *src, uint16_t length, uint8_t *dst, uint16_t room)
+{
+	struct rle_decoder d;
+	uint32_t o = 0;
+	uint16_t i;
+	uint8_t count, value = 0;
+
+	rle_decoder_init(&d);
+	for (i = 0; i < length; i++) {
+		count = rle_decoder_put(&d, src[i], &value);
+		if (o + count > room) {
+			return -1;
+		}
+		memset(dst + o, value, count);
+		o += count;
+	}
+
+	return rle_decoder_done(&d) ? (int32_t)o : -1;
+}
@@ -0,0 +1,42 @@
+// File Name    : rle.h
+// Project      : Simple File System by SPI
+// Description  : Run-length codec for READ and WRITE payloads, PackBits
+//                style: a header byte h below 128 is followed by h + 1
+//                literal bytes, one above 128 by a byte to repeat 257 - h
+//                times. No heap, no tables; a run costs two bytes however
+//                long it is, up to 128, and data with no runs grows by one
+//                byte in 128.
+
+#ifndef RLE_H
+#define RLE_H
+
+#include <stdint.h>
+
+// Most bytes length bytes can take encoded
+#define RLE_BOUND(length) ((length) + ((length) + 127) / 128)
+
+// Encode src into dst. Returns the encoded length, or 0 if it would not
+// fit in room bytes; a room of length - 1 asks for a real saving.
+uint16_t rle_encode(const uint8_t *src, uint16_t length, uint8_t *dst, uint16_t room);
+
+// Decode src into dst. Returns the decoded length, -1 if it would not fit
+// in room bytes or src ends inside a run.
+int32_t rle_decode(const uint8_t *src, uint16_t length, uint8_t *dst, uint16_t room);
+
+// Decoding a byte at a time, for a receiver that stores as bytes come in
+struct rle_decoder
+{
+	uint8_t left;		// bytes still to come of this run, 0 = a header is next
+	uint8_t repeat;		// the run is one byte repeated left times
+};
+
+void rle_decoder_init(struct rle_decoder *d);
+
+// Take one encoded byte. Returns how many times *out is to be stored,
+// 0 for a header byte.
+uint8_t rle_decoder_put(struct rle_decoder *d, uint8_t in, uint8_t *out);
+
+// 1 if the bytes so far ended on a run boundary
+int rle_decoder_done(const struct rle_decoder *d);
+
+#endif
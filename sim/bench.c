@@ -0,0 +1,1508 @@
+// File Name    : bench.c
+// Project      : Simple File System by SPI
+// Description  : Throughput benchmark for the master calls. Each command is
+//                run against the simulated slave for a range of file sizes
+//                and timed on the simulator's virtual clock, so the numbers
+//                are the link time the boards would spend and are the same
+//                on every machine
+//
+// Usage        : fsbench [ops per size]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "filesys.h"
+#include "dir.h"
+#include "fanout.h"
+#include "batch.h"
+#include "cache.h"
+#include "rle.h"
+#include "persist.h"
+#include "spi_sim.h"
+
+#define DEFAULT_OPS	10
+#define MAX_OPS		MAX_FILE_NUMBER
+#define MAX_SIZE	FRAME_MAX_DATA
+#define PERSIST_ROUNDS	500
+#define RANGE_SIZE	4	// bytes moved by each pwrite/pread
+#define NOISE_HZ	6250000	// bit errors from 100MHz/16 up
+#define NOISE_ONE_IN	4
+#define FAN_FILE_SIZE	1024	// 16 stripes
+#define FAN_DELAY_SIZE	256	// 4 stripes, 12.8 s a WRITE on one slave
+#define TELEMETRY_SIZE	1024	// compressed transfers
+#define TELEMETRY_RECORD 16
+#define CRC_FILE_SIZE	1024	// 16 chunks
+#define WIDE_FILE_SIZE	1023	// odd, so the last 16-bit frame is padded
+#define STREAM_FILE_SIZE 4000	// streamed past what one WRITE can carry
+#define SNAP_FILES	50	// a table rebuilt file by file and restored
+#define SNAP_FILE_SIZE	200
+#define COPY_FILE_SIZE	1000	// 16 blocks, a copy sharing them all
+#define PERSIST_COPY_SIZE 20000	// 313 blocks: the pool holds three in full
+#define BATCH_SCRIPT_SIZE 32768
+
+// past 100 bytes a file spans several blocks
+static const uint8_t sizes[] = { 1, 16, 64, 100, 200 };
+
+// line noise for the CRC-checked transfers, one frame in n
+static const uint32_t crc_noise[] = { 0, 20000, 2000, 500 };
+
+static const struct
+{
+	const char *name;
+	enum handshake handshake;
+	uint8_t dma;
+	uint8_t framed;
+} modes[] = {
+	{ "delay handshake", HANDSHAKE_DELAY, 0, 0 },
+	{ "event handshake", HANDSHAKE_EVENT, 0, 0 },
+	{ "event handshake, payload DMA", HANDSHAKE_EVENT, 1, 0 },
+	{ "framed bursts", HANDSHAKE_EVENT, 0, 1 },
+	{ "framed bursts, payload DMA", HANDSHAKE_EVENT, 1, 1 },
+};
+
+struct result
+{
+	const char *cmd;
+	uint32_t size;
+	uint32_t ops;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+};
+
+static int failures = 0;
+
+
+static void result_start(struct result *r, const char *cmd, uint32_t size)
+{
+	memset(r, 0, sizeof(*r));
+	r->cmd = cmd;
+	r->size = size;
+	r->min_ns = UINT64_MAX;
+}
+
+static void result_add(struct result *r, uint64_t ns, uint64_t bytes)
+{
+	r->ops++;
+	r->bytes += bytes;
+	r->total_ns += ns;
+	if (ns < r->min_ns)
+		r->min_ns = ns;
+	if (ns > r->max_ns)
+		r->max_ns = ns;
+}
+
+static void result_print(const struct result *r)
+{
+	double secs = r->total_ns / 1e9;
+
+	printf("%-8s %6u %5u %12.1f %12.1f %12.1f %10.2f %12.1f\n",
+	       r->cmd, r->size, r->ops,
+	       r->total_ns / 1e3 / r->ops, r->min_ns / 1e3, r->max_ns / 1e3,
+	       r->ops / secs, r->bytes / secs);
+}
+
+static uint8_t pattern(uint8_t file_number, uint32_t i)
+{
+	return (uint8_t)(file_number * 31 + i * 7 + 1);
+}
+
+static int verify(uint8_t file_number, uint8_t size)
+{
+	uint32_t i;
+
+	if (file[file_number].size != size)
+		return 0;
+	for (i = 0; i < size; i++) {
+		if (storage_get(file_number, i) != pattern(file_number, i))
+			return 0;
+	}
+	return 1;
+}
+
+// What read_file() filled in
+static int read_back(uint8_t file_number, const uint8_t *data, uint8_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] != pattern(file_number, i))
+			return 0;
+	}
+	return 1;
+}
+
+static void bench_size(uint8_t size, uint32_t ops)
+{
+	struct result create_r, write_r, read_r, list_r, delete_r;
+	struct result pwrite_r, pread_r;
+	uint32_t para[MAX_SIZE + 1];
+	uint8_t buf[RANGE_SIZE];
+	uint8_t back[MAX_SIZE];
+	uint16_t offset, length;
+	uint64_t t;
+	uint32_t n, i;
+
+	result_start(&create_r, "create", size);
+	result_start(&write_r, "write", size);
+	result_start(&read_r, "read", size);
+	result_start(&list_r, "list", size);
+	result_start(&delete_r, "delete", size);
+	result_start(&pwrite_r, "pwrite", size);
+	result_start(&pread_r, "pread", size);
+
+	sim_console_mute(1);
+
+	for (n = 1; n <= ops; n++) {
+		t = sim_now_ns();
+		create((uint8_t)n, size);
+		result_add(&create_r, sim_now_ns() - t, 0);
+	}
+
+	for (n = 1; n <= ops; n++) {
+		para[0] = n;
+		for (i = 0; i < size; i++)
+			para[i + 1] = pattern((uint8_t)n, i);
+
+		t = sim_now_ns();
+		write(size + 1, para);
+		result_add(&write_r, sim_now_ns() - t, size);
+
+		if (!verify((uint8_t)n, size))
+			failures++;
+	}
+
+	for (n = 1; n <= ops; n++) {
+		t = sim_now_ns();
+		if (read_file((uint8_t)n, back, size) != size)
+			failures++;
+		result_add(&read_r, sim_now_ns() - t, size);
+
+		if (!read_back((uint8_t)n, back, size))
+			failures++;
+	}
+
+	// ranges: the same few bytes whatever the file size
+	length = (size < RANGE_SIZE) ? size : RANGE_SIZE;
+	offset = (size - length) / 2;
+	for (n = 1; n <= ops; n++) {
+		for (i = 0; i < length; i++)
+			buf[i] = pattern((uint8_t)n, offset + i);
+
+		t = sim_now_ns();
+		if (write_range((uint8_t)n, offset, buf, length) != 0)
+			failures++;
+		result_add(&pwrite_r, sim_now_ns() - t, length);
+
+		memset(buf, 0, sizeof(buf));
+		t = sim_now_ns();
+		if (read_range((uint8_t)n, offset, buf, length) != 0)
+			failures++;
+		result_add(&pread_r, sim_now_ns() - t, length);
+
+		for (i = 0; i < length; i++) {
+			if (buf[i] != pattern((uint8_t)n, offset + i)) {
+				failures++;
+				break;
+			}
+		}
+		if (!verify((uint8_t)n, size))
+			failures++;
+	}
+
+	t = sim_now_ns();
+	list();
+	result_add(&list_r, sim_now_ns() - t, 2 * ops);
+
+	for (n = 1; n <= ops; n++) {
+		t = sim_now_ns();
+		delete((uint8_t)n);
+		result_add(&delete_r, sim_now_ns() - t, 0);
+
+		if (file[n].size != 0)
+			failures++;
+	}
+
+	sim_console_mute(0);
+
+	result_print(&create_r);
+	result_print(&write_r);
+	result_print(&read_r);
+	result_print(&pwrite_r);
+	result_print(&pread_r);
+	result_print(&list_r);
+	result_print(&delete_r);
+}
+
+// One burst per command type: all ops creates, then all writes, and so on.
+// Each op is charged an equal share of its burst.
+static void run_framed(struct result *r, struct frame_op *fops, uint32_t ops,
+		       uint64_t bytes)
+{
+	uint64_t t;
+	uint32_t n;
+
+	t = sim_now_ns();
+	if (framed(fops, ops) != (int)ops)
+		failures++;
+	t = sim_now_ns() - t;
+
+	for (n = 0; n < ops; n++)
+		result_add(r, t / ops, bytes);
+}
+
+static void bench_framed(uint8_t size, uint32_t ops)
+{
+	static uint8_t data[MAX_OPS][MAX_SIZE];
+	struct frame_op fops[MAX_OPS];
+	struct result create_r, write_r, read_r, delete_r;
+	uint32_t n, i;
+
+	result_start(&create_r, "create", size);
+	result_start(&write_r, "write", size);
+	result_start(&read_r, "read", size);
+	result_start(&delete_r, "delete", size);
+
+	sim_console_mute(1);
+
+	for (n = 0; n < ops; n++) {
+		fops[n].op = CMD_CREATE;
+		fops[n].file_number = n + 1;
+		fops[n].size = size;
+	}
+	run_framed(&create_r, fops, ops, 0);
+
+	for (n = 0; n < ops; n++) {
+		for (i = 0; i < size; i++)
+			data[n][i] = pattern(n + 1, i);
+		fops[n].op = CMD_WRITE;
+		fops[n].data = data[n];
+	}
+	run_framed(&write_r, fops, ops, size);
+
+	for (n = 0; n < ops; n++) {
+		if (!verify(n + 1, size))
+			failures++;
+		memset(data[n], 0, size);
+		fops[n].op = CMD_READ;
+	}
+	run_framed(&read_r, fops, ops, size);
+
+	for (n = 0; n < ops; n++) {
+		for (i = 0; i < size; i++) {
+			if (fops[n].length != size || data[n][i] != pattern(n + 1, i)) {
+				failures++;
+				break;
+			}
+		}
+		fops[n].op = CMD_DELETE;
+	}
+	run_framed(&delete_r, fops, ops, 0);
+
+	for (n = 1; n <= ops; n++) {
+		if (file[n].size != 0)
+			failures++;
+	}
+
+	sim_console_mute(0);
+
+	result_print(&create_r);
+	result_print(&write_r);
+	result_print(&read_r);
+	result_print(&delete_r);
+}
+
+// Rewrite, resize and delete files for many rounds with the flash log
+// flushed after each, so the log wraps and compacts several times; then
+// remount and check every file came back.
+static void bench_persist(uint32_t ops)
+{
+	static uint8_t data[MAX_OPS][MAX_SIZE];
+	static uint8_t expect[MAX_OPS + 1][MAX_SIZE];
+	static uint16_t expect_size[MAX_OPS + 1];
+	struct frame_op fops[2 * MAX_OPS];
+	struct persist_stats before, after;
+	struct sim_flash_stats flash;
+	uint32_t round, n, i, k;
+	uint16_t size;
+
+	sim_flash_open(NULL);
+	spi_init();
+	handshake_mode = HANDSHAKE_EVENT;
+	payload_dma = 0;
+
+	sim_console_mute(1);
+
+	for (round = 0; round < PERSIST_ROUNDS; round++) {
+		k = 0;
+		for (n = 1; n <= ops; n++) {
+			size = 1 + (round * 37 + n * 13) % MAX_SIZE;
+			if ((round + n) % 7 == 0) {
+				fops[k].op = CMD_DELETE;
+				fops[k++].file_number = n;
+				continue;
+			}
+			for (i = 0; i < size; i++)
+				data[n - 1][i] = pattern(n, i + round);
+			fops[k].op = CMD_CREATE;
+			fops[k].file_number = n;
+			fops[k++].size = size;
+			fops[k].op = CMD_WRITE;
+			fops[k].file_number = n;
+			fops[k].data = data[n - 1];
+			fops[k++].size = size;
+		}
+		if (framed(fops, k) != (int)k)
+			failures++;
+
+		persist_poll();
+	}
+
+	sim_console_mute(0);
+
+	for (n = 1; n <= ops; n++) {
+		expect_size[n] = file[n].size;
+		for (i = 0; i < file[n].size; i++)
+			expect[n][i] = storage_get(n, i);
+	}
+
+	persist_get_stats(&before);
+	spi_init();			// reset: rebuild the table from flash
+	persist_get_stats(&after);
+	sim_flash_get_stats(&flash);
+
+	for (n = 1; n <= ops; n++) {
+		if (file[n].size != expect_size[n]) {
+			failures++;
+			continue;
+		}
+		for (i = 0; i < expect_size[n]; i++) {
+			if (storage_get(n, i) != expect[n][i]) {
+				failures++;
+				break;
+			}
+		}
+	}
+
+	printf("flash log, %u files, %u rounds\n", ops, PERSIST_ROUNDS);
+	printf("%lu records appended, %llu bytes programmed, %lu compactions, "
+	       "%lu failed appends\n",
+	       (unsigned long)before.appended, (unsigned long long)flash.programmed,
+	       (unsigned long)before.compactions, (unsigned long)before.failures);
+	printf("erases per sector:");
+	for (i = 0; i < FLASH_LOG_SECTORS; i++)
+		printf(" %lu", (unsigned long)flash.erases[i]);
+	printf("\nmount replayed %lu records\n\n", (unsigned long)after.replayed);
+
+	if (before.failures || flash.errors)
+		failures++;
+}
+
+// Copies share blocks on the slave but go to flash in full: copy a file
+// until the pool could not restore another, then remount and check each
+// came back and the log kept up
+static void bench_persist_copy(void)
+{
+	static uint8_t data[PERSIST_COPY_SIZE];
+	static const uint8_t patch[RANGE_SIZE] = { 0xa5, 0xa5, 0xa5, 0xa5 };
+	struct persist_stats before;
+	struct sim_flash_stats flash;
+	struct frame_op fop;
+	uint32_t n, i;
+	uint8_t expect;
+
+	sim_flash_open(NULL);
+	spi_init();
+	handshake_mode = HANDSHAKE_EVENT;
+	payload_dma = 0;
+
+	sim_console_mute(1);
+
+	for (i = 0; i < PERSIST_COPY_SIZE; i++)
+		data[i] = pattern(1, i);
+	memset(&fop, 0, sizeof(fop));
+	fop.op = CMD_CREATE;
+	fop.file_number = 1;
+	fop.size = PERSIST_COPY_SIZE;
+	if (framed(&fop, 1) != 1 || write_file(1, data, PERSIST_COPY_SIZE) != 0)
+		failures++;
+
+	// two copies fit, a third or a new file that size would not
+	if (copy_file(1, 2) != 0 || copy_file(1, 3) != 0
+	    || write_range(3, 0, patch, RANGE_SIZE) != 0)
+		failures++;
+	fop.file_number = 5;
+	fop.size = PERSIST_COPY_SIZE / 2;
+	if (copy_file(1, 4) == 0 || framed(&fop, 1) != 0)
+		failures++;
+
+	persist_poll();
+	persist_get_stats(&before);
+	spi_init();			// reset: rebuild the table from flash
+	sim_flash_get_stats(&flash);
+
+	sim_console_mute(0);
+
+	for (n = 1; n <= 3; n++) {
+		if (file[n].size != PERSIST_COPY_SIZE) {
+			failures++;
+			continue;
+		}
+		for (i = 0; i < PERSIST_COPY_SIZE; i++) {
+			expect = (n == 3 && i < RANGE_SIZE) ? 0xa5 : data[i];
+			if (storage_get(n, i) != expect) {
+				failures++;
+				break;
+			}
+		}
+	}
+	if (file[4].size != 0 || file[5].size != 0)
+		failures++;
+
+	printf("3 files of %u bytes, 2 of them copies, back after a remount: %s\n\n",
+	       PERSIST_COPY_SIZE, (file[1].size && file[2].size && file[3].size) ? "yes" : "no");
+
+	if (before.failures || flash.errors)
+		failures++;
+
+	for (n = 1; n <= 3; n++)
+		storage_delete(n);
+	persist_poll();
+}
+
+// CREATE and OPEN by name with the directory holding count names, then
+// a DELETE of each; the size column is the number of names
+static void bench_names(uint32_t count)
+{
+	struct result create_r, open_r, delete_r;
+	uint8_t numbers[MAX_FILE_NUMBER + 1];
+	char name[DIR_NAME_SIZE + 1];
+	uint16_t size;
+	uint64_t t;
+	uint32_t i;
+
+	result_start(&create_r, "ncreate", count);
+	result_start(&open_r, "nopen", count);
+	result_start(&delete_r, "ndelete", count);
+
+	sim_console_mute(1);
+
+	// every file number is needed for the full directory
+	for (i = 1; i <= MAX_FILE_NUMBER; i++) {
+		if (file[i].size)
+			delete((uint8_t)i);
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "obj%03u", (unsigned)i);
+		t = sim_now_ns();
+		numbers[i] = name_create(name, 16);
+		result_add(&create_r, sim_now_ns() - t, 0);
+
+		if (numbers[i] == 0
+		    || dir_lookup((const uint8_t *)name, strlen(name)) != numbers[i])
+			failures++;
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "obj%03u", (unsigned)i);
+		t = sim_now_ns();
+		if (name_open(name, &size) != numbers[i] || size != 16)
+			failures++;
+		result_add(&open_r, sim_now_ns() - t, 0);
+	}
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "obj%03u", (unsigned)i);
+		t = sim_now_ns();
+		delete(name_open(name, &size));
+		result_add(&delete_r, sim_now_ns() - t, 0);
+
+		if (dir_lookup((const uint8_t *)name, strlen(name)) != 0)
+			failures++;
+	}
+
+	sim_console_mute(0);
+
+	result_print(&create_r);
+	result_print(&open_r);
+	result_print(&delete_r);
+}
+
+// 16-byte records: a sequence number, the file number, a few readings
+// that barely change and zero padding
+static uint8_t telemetry(uint8_t file_number, uint32_t i)
+{
+	uint32_t k = i % TELEMETRY_RECORD;
+
+	if (k == 0)
+		return (uint8_t)(i / TELEMETRY_RECORD);
+	if (k == 1)
+		return file_number;
+	if (k < 6)
+		return 25;
+	return 0;
+}
+
+// read_stream() sink that checks each piece against the telemetry data
+struct stream_check
+{
+	uint8_t file_number;
+	uint16_t next;		// offset of the next piece
+	uint16_t pieces;
+	int bad;
+};
+
+static void stream_check_sink(const uint8_t *data, uint16_t length, void *context)
+{
+	struct stream_check *check = context;
+	uint16_t i;
+
+	for (i = 0; i < length; i++) {
+		if (data[i] != telemetry(check->file_number, check->next + i))
+			check->bad = 1;
+	}
+	check->next += length;
+	if (length > 0)
+		check->pieces++;
+}
+
+// write_file() and read_file() of telemetry files, plain or compressed,
+// and plain read_stream() into a checking sink
+static void bench_compress(uint16_t size, uint32_t ops, uint8_t compress)
+{
+	static uint8_t data[TELEMETRY_SIZE], back[TELEMETRY_SIZE];
+	struct result write_r, read_r, stream_r;
+	struct stream_check check;
+	struct frame_op fop;
+	uint32_t plain = compress_plain_bytes, wire = compress_wire_bytes;
+	uint64_t t;
+	uint32_t n, i;
+
+	result_start(&write_r, compress ? "zwrite" : "write", size);
+	result_start(&read_r, compress ? "zread" : "read", size);
+	result_start(&stream_r, "stream", size);
+
+	sim_console_mute(1);
+	payload_compress = compress;
+
+	for (n = 1; n <= ops; n++) {
+		memset(&fop, 0, sizeof(fop));
+		fop.op = CMD_CREATE;
+		fop.file_number = n;
+		fop.size = size;
+		if (framed(&fop, 1) != 1)
+			failures++;
+
+		for (i = 0; i < size; i++)
+			data[i] = telemetry((uint8_t)n, i);
+
+		t = sim_now_ns();
+		if (write_file((uint8_t)n, data, size) != 0)
+			failures++;
+		result_add(&write_r, sim_now_ns() - t, size);
+
+		for (i = 0; i < size; i++) {
+			if (storage_get(n, i) != data[i]) {
+				failures++;
+				break;
+			}
+		}
+	}
+
+	for (n = 1; n <= ops; n++) {
+		memset(back, 0, size);
+		t = sim_now_ns();
+		if (read_file((uint8_t)n, back, size) != size)
+			failures++;
+		result_add(&read_r, sim_now_ns() - t, size);
+
+		for (i = 0; i < size; i++) {
+			if (back[i] != telemetry((uint8_t)n, i)) {
+				failures++;
+				break;
+			}
+		}
+	}
+
+	for (n = 1; n <= ops && !compress; n++) {
+		memset(&check, 0, sizeof(check));
+		check.file_number = (uint8_t)n;
+		cache_forget((uint8_t)n);
+
+		t = sim_now_ns();
+		if (read_stream((uint8_t)n, size, stream_check_sink, &check) != 0)
+			failures++;
+		result_add(&stream_r, sim_now_ns() - t, size);
+
+		if (check.bad || check.next != size
+		    || check.pieces != (size + SPI_DMA_BUF_SIZE - 1) / SPI_DMA_BUF_SIZE)
+			failures++;
+	}
+
+	payload_compress = 0;
+	sim_console_mute(0);
+
+	result_print(&write_r);
+	result_print(&read_r);
+	if (!compress)
+		result_print(&stream_r);
+	if (compress)
+		printf("%lu bytes in %lu on the wire\n",
+		       (unsigned long)(compress_plain_bytes - plain),
+		       (unsigned long)(compress_wire_bytes - wire));
+}
+
+// The whole table of MAX_FILE_NUMBER files, with LIST one file number and
+// size byte at a time and with one BLIST image, parsed by list_get()
+static void bench_list(uint32_t ops)
+{
+	static struct list_table table;
+	static uint8_t pairs[2 * MAX_FILE_NUMBER];
+	struct result list_r, blist_r;
+	struct async_req req;
+	struct frame_op fop;
+	uint64_t t;
+	uint32_t n, i;
+
+	result_start(&list_r, "list", MAX_FILE_NUMBER);
+	result_start(&blist_r, "blist", MAX_FILE_NUMBER);
+
+	sim_console_mute(1);
+
+	for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+		memset(&fop, 0, sizeof(fop));
+		fop.op = CMD_CREATE;
+		fop.file_number = n;
+		fop.size = n * 3;
+		if (framed(&fop, 1) != 1)
+			failures++;
+	}
+
+	for (i = 0; i < ops; i++) {
+		memset(&req, 0, sizeof(req));
+		req.op = CMD_LIST;
+		req.size = sizeof(pairs);
+		req.data = pairs;
+
+		t = sim_now_ns();
+		if (async_wait(async_submit(&req)) != ASYNC_OK
+		    || req.length != 2 * MAX_FILE_NUMBER)
+			failures++;
+		result_add(&list_r, sim_now_ns() - t, req.length);
+
+		t = sim_now_ns();
+		if (list_get(&table) != MAX_FILE_NUMBER)
+			failures++;
+		result_add(&blist_r, sim_now_ns() - t,
+			   1 + LIST_BITMAP_SIZE + 2 * MAX_FILE_NUMBER);
+
+		for (n = 1; n <= MAX_FILE_NUMBER; n++) {
+			if (table.size[n] != n * 3)
+				failures++;
+		}
+	}
+
+	for (n = 1; n <= MAX_FILE_NUMBER; n++)
+		storage_delete((uint8_t)n);
+
+	sim_console_mute(0);
+
+	result_print(&list_r);
+	result_print(&blist_r);
+}
+
+// write_file() and read_file() of CRC_FILE_SIZE-byte files with a bit
+// flipped in about one frame in one_in, plain or in CRC-checked chunks.
+// The files are created, and checked against the slave's storage, with
+// the link clean. A CRC-checked call that succeeds with the wrong data
+// is a failure; the plain calls only count what they got wrong.
+static void bench_crc(uint32_t ops, uint32_t one_in, uint8_t crc)
+{
+	static uint8_t data[CRC_FILE_SIZE], back[CRC_FILE_SIZE];
+	struct result write_r, read_r;
+	struct frame_op fop;
+	uint32_t chunks = crc_chunks, resends = crc_resends;
+	uint64_t errors = sim_spi_errors_injected();
+	uint32_t failed = 0, wrong = 0;
+	uint64_t t;
+	uint32_t n, i;
+	int ok;
+
+	result_start(&write_r, crc ? "cwrite" : "write", one_in);
+	result_start(&read_r, crc ? "cread" : "read", one_in);
+
+	sim_console_mute(1);
+	payload_crc = crc;
+
+	for (n = 1; n <= ops; n++) {
+		memset(&fop, 0, sizeof(fop));
+		fop.op = CMD_CREATE;
+		fop.file_number = n;
+		fop.size = CRC_FILE_SIZE;
+		if (framed(&fop, 1) != 1)
+			failures++;
+	}
+
+	for (n = 1; n <= ops; n++) {
+		for (i = 0; i < CRC_FILE_SIZE; i++)
+			data[i] = pattern((uint8_t)n, i);
+
+		sim_spi_bit_errors(0, one_in);
+		t = sim_now_ns();
+		ok = (write_file((uint8_t)n, data, CRC_FILE_SIZE) == 0);
+		result_add(&write_r, sim_now_ns() - t, CRC_FILE_SIZE);
+		sim_spi_bit_errors(0, 0);
+
+		if (!ok)
+			failed++;
+		for (i = 0; i < CRC_FILE_SIZE; i++) {
+			if (storage_get(n, i) != data[i]) {
+				wrong++;
+				if (ok && crc)
+					failures++;
+				break;
+			}
+		}
+	}
+
+	for (n = 1; n <= ops; n++) {
+		// what the slave really has, so only the read is measured
+		for (i = 0; i < CRC_FILE_SIZE; i++)
+			data[i] = storage_get(n, i);
+		memset(back, 0, sizeof(back));
+
+		sim_spi_bit_errors(0, one_in);
+		t = sim_now_ns();
+		ok = (read_file((uint8_t)n, back, CRC_FILE_SIZE) == CRC_FILE_SIZE);
+		result_add(&read_r, sim_now_ns() - t, CRC_FILE_SIZE);
+		sim_spi_bit_errors(0, 0);
+
+		if (!ok)
+			failed++;
+		if (memcmp(back, data, CRC_FILE_SIZE) != 0) {
+			wrong++;
+			if (ok && crc)
+				failures++;
+		}
+	}
+
+	payload_crc = 0;
+	sim_console_mute(0);
+
+	result_print(&write_r);
+	result_print(&read_r);
+	printf("%llu bit errors, %lu calls failed, %lu files wrong",
+	       (unsigned long long)(sim_spi_errors_injected() - errors),
+	       (unsigned long)failed, (unsigned long)wrong);
+	if (crc)
+		printf(", %lu of %lu chunks resent", (unsigned long)(crc_resends - resends),
+		       (unsigned long)(crc_chunks - chunks));
+	printf("\n");
+}
+
+// write and read of WIDE_FILE_SIZE-byte files in 8-bit or 16-bit data
+// frames, checked against the slave's storage, with the frames each took
+static void bench_wide(uint32_t ops, uint8_t wide)
+{
+	static uint8_t data[WIDE_FILE_SIZE], back[WIDE_FILE_SIZE];
+	struct result write_r, read_r;
+	struct frame_op fop;
+	uint64_t write_frames = 0, read_frames = 0;
+	uint64_t t, frames;
+	uint32_t n, i;
+
+	result_start(&write_r, wide ? "wwrite" : "write", WIDE_FILE_SIZE);
+	result_start(&read_r, wide ? "wread" : "read", WIDE_FILE_SIZE);
+
+	sim_console_mute(1);
+	payload_wide = wide;
+
+	for (n = 1; n <= ops; n++) {
+		memset(&fop, 0, sizeof(fop));
+		fop.op = CMD_CREATE;
+		fop.file_number = n;
+		fop.size = WIDE_FILE_SIZE;
+		if (framed(&fop, 1) != 1)
+			failures++;
+
+		for (i = 0; i < WIDE_FILE_SIZE; i++)
+			data[i] = pattern((uint8_t)n, i);
+
+		t = sim_now_ns();
+		frames = sim_frames();
+		if (write_file((uint8_t)n, data, WIDE_FILE_SIZE) != 0)
+			failures++;
+		result_add(&write_r, sim_now_ns() - t, WIDE_FILE_SIZE);
+		write_frames += sim_frames() - frames;
+
+		for (i = 0; i < WIDE_FILE_SIZE; i++) {
+			if (storage_get(n, i) != data[i]) {
+				failures++;
+				break;
+			}
+		}
+	}
+
+	for (n = 1; n <= ops; n++) {
+		memset(back, 0, sizeof(back));
+
+		t = sim_now_ns();
+		frames = sim_frames();
+		if (read_file((uint8_t)n, back, WIDE_FILE_SIZE) != WIDE_FILE_SIZE)
+			failures++;
+		result_add(&read_r, sim_now_ns() - t, WIDE_FILE_SIZE);
+		read_frames += sim_frames() - frames;
+
+		for (i = 0; i < WIDE_FILE_SIZE; i++) {
+			if (back[i] != pattern((uint8_t)n, i)) {
+				failures++;
+				break;
+			}
+		}
+		storage_delete(n);
+	}
+
+	payload_wide = 0;
+	sim_console_mute(0);
+
+	result_print(&write_r);
+	result_print(&read_r);
+	printf("%llu frames per write, %llu per read\n",
+	       (unsigned long long)(write_frames / ops), (unsigned long long)(read_frames / ops));
+}
+
+// A sensor for stream_feed(): as many TELEMETRY_RECORD-byte records as
+// fit, until STREAM_FILE_SIZE bytes of them
+struct sensor
+{
+	uint8_t file_number;
+	uint32_t pos;
+};
+
+static uint16_t sensor_read(uint8_t *data, uint16_t room, void *context)
+{
+	struct sensor *sensor = context;
+	uint16_t length = 0;
+	uint16_t i;
+
+	while (sensor->pos < STREAM_FILE_SIZE && room - length >= TELEMETRY_RECORD) {
+		for (i = 0; i < TELEMETRY_RECORD; i++)
+			data[length++] = pattern(sensor->file_number, sensor->pos++);
+	}
+	return length;
+}
+
+// STREAM_FILE_SIZE-byte files logged with sopen, then either one APPEND
+// per record (chunk TELEMETRY_RECORD) or stream_feed() (chunk
+// STREAM_CHUNK_SIZE), then sclose, checked against the slave's storage
+static void bench_stream(uint32_t ops, uint16_t chunk)
+{
+	static uint8_t record[TELEMETRY_RECORD];
+	struct result r;
+	struct sensor sensor;
+	uint64_t t;
+	uint32_t n, i;
+	int32_t size;
+
+	result_start(&r, chunk == STREAM_CHUNK_SIZE ? "feed" : "append", chunk);
+	sim_console_mute(1);
+
+	for (n = 1; n <= ops; n++) {
+		sensor.file_number = (uint8_t)n;
+		sensor.pos = 0;
+
+		t = sim_now_ns();
+		if (stream_open((uint8_t)n, STREAM_NEW) != n)
+			failures++;
+		if (chunk == STREAM_CHUNK_SIZE) {
+			if (stream_feed(sensor_read, &sensor) != STREAM_FILE_SIZE)
+				failures++;
+		}
+		else {
+			while (sensor.pos < STREAM_FILE_SIZE) {
+				sensor_read(record, TELEMETRY_RECORD, &sensor);
+				if (stream_append(record, TELEMETRY_RECORD) != 0)
+					failures++;
+			}
+		}
+		size = stream_close();
+		result_add(&r, sim_now_ns() - t, STREAM_FILE_SIZE);
+
+		if (size != STREAM_FILE_SIZE)
+			failures++;
+		for (i = 0; i < STREAM_FILE_SIZE; i++) {
+			if (storage_get(n, i) != pattern((uint8_t)n, i)) {
+				failures++;
+				break;
+			}
+		}
+		storage_delete(n);
+	}
+
+	sim_console_mute(0);
+	result_print(&r);
+}
+
+// A SNAPSHOT image in memory, filled by snapshot() and read by restore()
+struct image
+{
+	uint8_t data[SNAP_MAX_SIZE];
+	uint32_t length;
+	uint32_t pos;
+};
+
+static void image_sink(const uint8_t *data, uint16_t length, void *context)
+{
+	struct image *image = context;
+
+	memcpy(image->data + image->length, data, length);
+	image->length += length;
+}
+
+static uint16_t image_source(uint8_t *data, uint16_t room, void *context)
+{
+	struct image *image = context;
+
+	if (room > image->length - image->pos)
+		room = image->length - image->pos;
+	memcpy(data, image->data + image->pos, room);
+	image->pos += room;
+	return room;
+}
+
+// A table of SNAP_FILES files of SNAP_FILE_SIZE bytes: rebuilt with a
+// create() and write_file() per file, taken with one SNAPSHOT and put
+// back with one RESTORE over an emptied slave, checked each time against
+// the slave's storage; the size column is the number of files
+static void bench_snapshot(uint32_t ops)
+{
+	static struct image image;
+	static uint8_t data[SNAP_FILE_SIZE];
+	struct result rebuild_r, snapshot_r, restore_r;
+	uint64_t t;
+	uint32_t k, n, i;
+
+	result_start(&rebuild_r, "rebuild", SNAP_FILES);
+	result_start(&snapshot_r, "snapshot", SNAP_FILES);
+	result_start(&restore_r, "restore", SNAP_FILES);
+
+	sim_console_mute(1);
+
+	for (k = 0; k < ops; k++) {
+		t = sim_now_ns();
+		for (n = 1; n <= SNAP_FILES; n++) {
+			for (i = 0; i < SNAP_FILE_SIZE; i++)
+				data[i] = pattern((uint8_t)n, i);
+			create((uint8_t)n, SNAP_FILE_SIZE);
+			if (write_file((uint8_t)n, data, SNAP_FILE_SIZE) != 0)
+				failures++;
+		}
+		result_add(&rebuild_r, sim_now_ns() - t, SNAP_FILES * SNAP_FILE_SIZE);
+
+		image.length = 0;
+		t = sim_now_ns();
+		if (snapshot(image_sink, &image) != (int32_t)image.length)
+			failures++;
+		result_add(&snapshot_r, sim_now_ns() - t, image.length);
+
+		for (n = 1; n <= SNAP_FILES; n++)
+			storage_delete((uint8_t)n);
+
+		image.pos = 0;
+		t = sim_now_ns();
+		if (restore(image_source, &image, image.length) != 0)
+			failures++;
+		result_add(&restore_r, sim_now_ns() - t, image.length);
+
+		for (n = 1; n <= SNAP_FILES; n++) {
+			if (file[n].size != SNAP_FILE_SIZE) {
+				failures++;
+				continue;
+			}
+			for (i = 0; i < SNAP_FILE_SIZE; i++) {
+				if (storage_get(n, i) != pattern((uint8_t)n, i)) {
+					failures++;
+					break;
+				}
+			}
+			storage_delete((uint8_t)n);
+		}
+	}
+
+	sim_console_mute(0);
+
+	result_print(&rebuild_r);
+	result_print(&snapshot_r);
+	result_print(&restore_r);
+}
+
+// A COPY_FILE_SIZE-byte file copied by reading it back and writing it to
+// another number, then by COPY, which shares its blocks until a write to
+// the copy takes one of its own, and moved to a third number by MOVE
+static void bench_copy(uint32_t ops)
+{
+	static uint8_t data[COPY_FILE_SIZE], back[COPY_FILE_SIZE];
+	static const uint8_t patch[RANGE_SIZE] = { 0xa5, 0xa5, 0xa5, 0xa5 };
+	struct result wire_r, copy_r, move_r;
+	struct frame_op fop;
+	uint16_t free_blocks;
+	uint64_t t;
+	uint32_t k, i;
+
+	result_start(&wire_r, "rd+wr", COPY_FILE_SIZE);
+	result_start(&copy_r, "copy", COPY_FILE_SIZE);
+	result_start(&move_r, "move", COPY_FILE_SIZE);
+
+	sim_console_mute(1);
+
+	for (i = 0; i < COPY_FILE_SIZE; i++)
+		data[i] = pattern(1, i);
+
+	memset(&fop, 0, sizeof(fop));
+	fop.op = CMD_CREATE;
+	fop.size = COPY_FILE_SIZE;
+
+	for (k = 0; k < ops; k++) {
+		fop.file_number = 1;
+		if (framed(&fop, 1) != 1 || write_file(1, data, COPY_FILE_SIZE) != 0)
+			failures++;
+
+		t = sim_now_ns();
+		fop.file_number = 2;
+		if (read_file(1, back, COPY_FILE_SIZE) != COPY_FILE_SIZE
+		    || framed(&fop, 1) != 1 || write_file(2, back, COPY_FILE_SIZE) != 0)
+			failures++;
+		result_add(&wire_r, sim_now_ns() - t, COPY_FILE_SIZE);
+		storage_delete(2);
+
+		// the copy takes no blocks until it is written to, then one
+		free_blocks = storage_free_blocks();
+		t = sim_now_ns();
+		if (copy_file(1, 2) != 0)
+			failures++;
+		result_add(&copy_r, sim_now_ns() - t, COPY_FILE_SIZE);
+		if (storage_free_blocks() != free_blocks
+		    || storage_blocks_shared() != (COPY_FILE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+			failures++;
+
+		if (write_range(2, COPY_FILE_SIZE / 2, patch, RANGE_SIZE) != 0
+		    || storage_free_blocks() != free_blocks - 1)
+			failures++;
+
+		t = sim_now_ns();
+		if (move_file(2, 3) != 0)
+			failures++;
+		result_add(&move_r, sim_now_ns() - t, COPY_FILE_SIZE);
+
+		for (i = 0; i < COPY_FILE_SIZE; i++) {
+			if (storage_get(1, i) != data[i]
+			    || storage_get(3, i) != ((i - COPY_FILE_SIZE / 2 < RANGE_SIZE) ? 0xa5 : data[i])) {
+				failures++;
+				break;
+			}
+		}
+		if (file[2].size != 0)
+			failures++;
+
+		storage_delete(1);
+		storage_delete(3);
+		if (storage_free_blocks() != free_blocks + (COPY_FILE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+			failures++;
+	}
+
+	sim_console_mute(0);
+
+	result_print(&wire_r);
+	result_print(&copy_r);
+	result_print(&move_r);
+}
+
+// A provisioning job: create, write and read back count files of size
+// bytes, one blocking call after another and then as one batch; the
+// size column is the number of files, each row one whole job
+static void bench_batch(uint32_t ops, uint8_t count, uint16_t size)
+{
+	static struct batch b;
+	static char script[BATCH_SCRIPT_SIZE];
+	static uint8_t data[BATCH_DATA_SIZE / 2], back[BATCH_DATA_SIZE / 2];
+	struct result single_r, batch_r;
+	struct frame_op fop;
+	uint64_t t;
+	uint32_t k, i, n, used;
+
+	result_start(&single_r, "singles", count);
+	result_start(&batch_r, "batch", count);
+
+	sim_console_mute(1);
+
+	for (k = 0; k < ops; k++) {
+		t = sim_now_ns();
+		for (n = 1; n <= count; n++) {
+			for (i = 0; i < size; i++)
+				data[i] = pattern((uint8_t)n, i);
+			memset(&fop, 0, sizeof(fop));
+			fop.op = CMD_CREATE;
+			fop.file_number = n;
+			fop.size = size;
+			if (framed(&fop, 1) != 1 || write_file((uint8_t)n, data, size) != 0
+			    || read_file((uint8_t)n, back, size) != size
+			    || memcmp(back, data, size) != 0)
+				failures++;
+		}
+		result_add(&single_r, sim_now_ns() - t, 2 * count * size);
+
+		for (n = 1; n <= count; n++)
+			storage_delete((uint8_t)n);
+
+		used = 0;
+		for (n = 1; n <= count; n++) {
+			used += snprintf(&script[used], sizeof(script) - used, "create %u %u\nwrite %u",
+					 (unsigned)n, size, (unsigned)n);
+			for (i = 0; i < size; i++)
+				used += snprintf(&script[used], sizeof(script) - used, " %u",
+						 pattern((uint8_t)n, i));
+			used += snprintf(&script[used], sizeof(script) - used, "\nread %u %u\n",
+					 (unsigned)n, size);
+		}
+
+		batch_init(&b);
+		if (batch_parse(&b, script) != 0) {
+			failures++;
+			continue;
+		}
+		t = sim_now_ns();
+		if (batch_run(&b) != 3 * count)
+			failures++;
+		result_add(&batch_r, sim_now_ns() - t, 2 * count * size);
+
+		for (n = 1; n <= count; n++) {
+			for (i = 0; i < size; i++) {
+				if (b.data[b.ops[3 * n - 1].data + i] != pattern((uint8_t)n, i)
+				    || storage_get((uint8_t)n, i) != pattern((uint8_t)n, i)) {
+					failures++;
+					break;
+				}
+			}
+			storage_delete((uint8_t)n);
+		}
+	}
+
+	sim_console_mute(0);
+
+	result_print(&single_r);
+	result_print(&batch_r);
+}
+
+// fcreate, fwrite, fread and fdelete of size-byte files striped over
+// count slaves; the size column is the number of slaves
+static void bench_fanout(uint8_t count, uint16_t size, uint32_t ops)
+{
+	static uint8_t data[FAN_FILE_SIZE], back[FAN_FILE_SIZE];
+	struct result create_r, write_r, read_r, delete_r;
+	uint64_t t;
+	uint32_t n, i;
+
+	result_start(&create_r, "fcreate", count);
+	result_start(&write_r, "fwrite", count);
+	result_start(&read_r, "fread", count);
+	result_start(&delete_r, "fdelete", count);
+
+	if (sim_spi_slaves(count, spi_init, NULL) != 0) {
+		printf("could not start %u slaves\n", count);
+		failures++;
+		return;
+	}
+	spi_slaves = count;
+	spi_slave = 0;
+
+	sim_console_mute(1);
+
+	for (n = 1; n <= ops; n++) {
+		t = sim_now_ns();
+		if (fan_create((uint8_t)n, size) != 0)
+			failures++;
+		result_add(&create_r, sim_now_ns() - t, 0);
+	}
+
+	for (n = 1; n <= ops; n++) {
+		for (i = 0; i < size; i++)
+			data[i] = pattern((uint8_t)n, i);
+
+		t = sim_now_ns();
+		if (fan_write((uint8_t)n, data, size) != 0)
+			failures++;
+		result_add(&write_r, sim_now_ns() - t, size);
+	}
+
+	for (n = 1; n <= ops; n++) {
+		t = sim_now_ns();
+		if (fan_read((uint8_t)n, back, size) != 0)
+			failures++;
+		result_add(&read_r, sim_now_ns() - t, size);
+
+		for (i = 0; i < size; i++) {
+			if (back[i] != pattern((uint8_t)n, i)) {
+				failures++;
+				break;
+			}
+		}
+	}
+
+	// slave 0's share, checked on its own file table
+	if (file[1].size != fan_part(1, size, 0))
+		failures++;
+
+	for (n = 1; n <= ops; n++) {
+		t = sim_now_ns();
+		if (fan_delete((uint8_t)n) != 0)
+			failures++;
+		result_add(&delete_r, sim_now_ns() - t, 0);
+	}
+
+	sim_console_mute(0);
+
+	result_print(&create_r);
+	result_print(&write_r);
+	result_print(&read_r);
+	result_print(&delete_r);
+
+	sim_spi_slaves(1, NULL, NULL);
+	spi_slaves = 1;
+}
+
+// Negotiate the clock on a clean link, where the slave's limit stops it,
+// and on one that flips bits from NOISE_HZ up, where the probe has to fall
+// back; then time the commands at each clock it settled on.
+static void bench_baud(uint32_t ops)
+{
+	uint8_t br;
+
+	handshake_mode = HANDSHAKE_EVENT;
+	payload_dma = 0;
+
+	printf("baud negotiation, clean link\n");
+	spi_link_br = SPI_BR_SLOWEST;
+	spi_init();
+	br = baud_negotiate(0);
+	if (br != SPI_SLAVE_MIN_BR)
+		failures++;
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "size", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	bench_size(200, ops);
+
+	printf("\nbaud negotiation, bit errors from %u Hz\n", NOISE_HZ);
+	sim_spi_bit_errors(NOISE_HZ, NOISE_ONE_IN);
+	spi_link_br = SPI_BR_SLOWEST;
+	spi_init();
+	br = baud_negotiate(0);
+	if (SIM_SPI_PCLK_HZ / (2u << br) >= NOISE_HZ)
+		failures++;
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "size", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	bench_size(200, ops);
+	printf("%llu bit errors injected\n\n",
+	       (unsigned long long)sim_spi_errors_injected());
+
+	sim_spi_bit_errors(0, 0);
+	spi_link_br = SPI_BR_SLOWEST;
+	spi_init();
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t ops = DEFAULT_OPS;
+	uint32_t m, i;
+
+	if (argc > 1)
+		ops = (uint32_t)strtoul(argv[1], NULL, 0);
+	if (ops < 1 || ops > MAX_OPS) {
+		fprintf(stderr, "ops per size must be 1 to %d\n", MAX_OPS);
+		return 2;
+	}
+
+	spi_init();
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		handshake_mode = modes[m].handshake;
+		payload_dma = modes[m].dma;
+
+		printf("%s\n", modes[m].name);
+		printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+		       "command", "size", "ops", "avg us", "min us", "max us",
+		       "ops/s", "bytes/s");
+
+		for (i = 0; i < sizeof(sizes); i++) {
+			if (modes[m].framed)
+				bench_framed(sizes[i], ops);
+			else
+				bench_size(sizes[i], ops);
+		}
+
+		printf("\n");
+	}
+
+	bench_persist(ops);
+	bench_persist_copy();
+
+	handshake_mode = HANDSHAKE_EVENT;
+	payload_dma = 0;
+	printf("named files, event handshake\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "files", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	bench_names(ops);
+	bench_names(MAX_FILE_NUMBER);
+	printf("\n");
+
+	printf("listing a full table\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "files", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	handshake_mode = HANDSHAKE_DELAY;
+	bench_list(1);
+	handshake_mode = HANDSHAKE_EVENT;
+	bench_list(ops);
+	payload_dma = 1;
+	bench_list(ops);
+	payload_dma = 0;
+	printf("\n");
+
+	printf("telemetry records, event handshake\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "size", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	bench_compress(200, ops, 0);
+	bench_compress(200, ops, 1);
+	bench_compress(TELEMETRY_SIZE, ops, 0);
+	bench_compress(TELEMETRY_SIZE, ops, 1);
+	printf("\n");
+
+	payload_dma = 1;
+	printf("files striped over several slaves, event handshake, payload DMA\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "slaves", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	bench_fanout(1, FAN_FILE_SIZE, ops);
+	bench_fanout(2, FAN_FILE_SIZE, ops);
+	bench_fanout(4, FAN_FILE_SIZE, ops);
+	printf("\n");
+
+	// each slave's bytes go in the others' 50 ms pauses
+	handshake_mode = HANDSHAKE_DELAY;
+	payload_dma = 0;
+	printf("%u-byte files striped over several slaves, delay handshake\n",
+	       FAN_DELAY_SIZE);
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "slaves", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	bench_fanout(1, FAN_DELAY_SIZE, 2);
+	bench_fanout(2, FAN_DELAY_SIZE, 2);
+	bench_fanout(4, FAN_DELAY_SIZE, 2);
+	handshake_mode = HANDSHAKE_EVENT;
+	payload_dma = 1;
+	printf("\n");
+
+	bench_baud(ops);
+
+	printf("16-bit data frames, event handshake\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "size", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	handshake_mode = HANDSHAKE_EVENT;
+	for (m = 0; m < 2; m++) {
+		payload_dma = m;
+		if (m)
+			printf("payload DMA\n");
+		bench_wide(ops, 0);
+		bench_wide(ops, 1);
+	}
+	payload_dma = 0;
+	printf("\n");
+
+	printf("a table of %d files of %d bytes\n", SNAP_FILES, SNAP_FILE_SIZE);
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "files", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	printf("delay handshake\n");
+	handshake_mode = HANDSHAKE_DELAY;
+	bench_snapshot(1);
+	printf("event handshake\n");
+	handshake_mode = HANDSHAKE_EVENT;
+	bench_snapshot(ops);
+	printf("\n");
+
+	printf("a %d-byte file copied and moved, event handshake\n", COPY_FILE_SIZE);
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "size", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	for (m = 0; m < 2; m++) {
+		payload_dma = m;
+		if (m)
+			printf("payload DMA\n");
+		bench_copy(ops);
+	}
+	payload_dma = 0;
+	printf("\n");
+
+	printf("provisioning jobs, create, write and read back, event handshake\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "files", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	printf("32-byte files\n");
+	bench_batch(ops, 50, 32);
+	printf("400-byte files\n");
+	bench_batch(ops, 10, 400);
+	printf("400-byte files, payload DMA\n");
+	payload_dma = 1;
+	bench_batch(ops, 10, 400);
+	payload_dma = 0;
+	printf("\n");
+
+	printf("streamed %d-byte files, event handshake\n", STREAM_FILE_SIZE);
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "chunk", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	for (m = 0; m < 2; m++) {
+		payload_dma = m;
+		if (m)
+			printf("payload DMA\n");
+		bench_stream(ops, TELEMETRY_RECORD);
+		bench_stream(ops, STREAM_CHUNK_SIZE);
+	}
+	payload_dma = 0;
+	printf("\n");
+
+	// the column after the command is one_in, 0 for a clean link
+	handshake_mode = HANDSHAKE_EVENT;
+	payload_dma = 0;
+	printf("CRC-checked chunks, event handshake, a bit error in one frame in n\n");
+	printf("%-8s %6s %5s %12s %12s %12s %10s %12s\n",
+	       "command", "n", "ops", "avg us", "min us", "max us",
+	       "ops/s", "bytes/s");
+	for (i = 0; i < sizeof(crc_noise) / sizeof(crc_noise[0]); i++) {
+		bench_crc(ops, crc_noise[i], 0);
+		bench_crc(ops, crc_noise[i], 1);
+	}
+	printf("\n");
+
+	printf("%llu frames on the wire, %.3f s of link time\n",
+	       (unsigned long long)sim_frames(), sim_now_ns() / 1e9);
+
+	if (spi_rx_timeouts)
+		printf("%lu bytes timed out waiting for the slave\n",
+		       (unsigned long)spi_rx_timeouts);
+
+	if (failures) {
+		printf("%d operations left the slave with unexpected contents\n",
+		       failures);
+		return 1;
+	}
+
+	return 0;
+}
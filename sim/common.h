@@ -0,0 +1,391 @@
+// File Name    : common.h
+// Project      : Simple File System by SPI
+// Description  : Host (Linux) stand-in for the board support header used by
+//                filesys.c. It models the STM32F411 registers the file system
+//                touches, the HAL delay/tick calls, the NVIC and the monitor
+//                command parser, so the master and slave code can run in one
+//                process against the SPI simulator in spi_sim.c
+
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdint.h>
+
+#define FS_HOST_SIM 1
+
+// filesys.c names its master calls read()/write(), which clash with the
+// POSIX calls of the same name once linked against the host C library
+#define read fs_read
+#define write fs_write
+
+
+// ---------------------------------------------------------------------------
+// Peripheral registers
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+	volatile uint32_t CR1;
+	volatile uint32_t CR2;
+	volatile uint32_t SR;
+	volatile uint32_t DR;
+	volatile uint32_t CRCPR;
+	volatile uint32_t RXCRCR;
+	volatile uint32_t TXCRCR;
+	volatile uint32_t I2SCFGR;
+	volatile uint32_t I2SPR;
+} SPI_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t CR;
+	volatile uint32_t PLLCFGR;
+	volatile uint32_t CFGR;
+	volatile uint32_t CIR;
+	volatile uint32_t AHB1RSTR;
+	volatile uint32_t AHB2RSTR;
+	volatile uint32_t APB1RSTR;
+	volatile uint32_t APB2RSTR;
+	volatile uint32_t AHB1ENR;
+	volatile uint32_t AHB2ENR;
+	volatile uint32_t APB1ENR;
+	volatile uint32_t APB2ENR;
+} RCC_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t MODER;
+	volatile uint32_t OTYPER;
+	volatile uint32_t OSPEEDR;
+	volatile uint32_t PUPDR;
+	volatile uint32_t IDR;
+	volatile uint32_t ODR;
+	volatile uint32_t BSRR;
+	volatile uint32_t LCKR;
+	volatile uint32_t AFR[2];
+} GPIO_TypeDef;
+
+// The address registers are wide enough for a host pointer
+typedef struct
+{
+	volatile uint32_t CR;
+	volatile uint32_t NDTR;
+	volatile uintptr_t PAR;
+	volatile uintptr_t M0AR;
+	volatile uintptr_t M1AR;
+	volatile uint32_t FCR;
+} DMA_Stream_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t LISR;
+	volatile uint32_t HISR;
+	volatile uint32_t LIFCR;
+	volatile uint32_t HIFCR;
+} DMA_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t SR;
+	volatile uint32_t DR;
+	volatile uint32_t BRR;
+	volatile uint32_t CR1;
+	volatile uint32_t CR2;
+	volatile uint32_t CR3;
+	volatile uint32_t GTPR;
+} USART_TypeDef;
+
+// DR is wider than on the board so the simulator can tell a written word
+// from the result it left there
+typedef struct
+{
+	volatile uint64_t DR;
+	volatile uint32_t IDR;
+	volatile uint32_t CR;
+} CRC_TypeDef;
+
+// Every access to an SPI instance goes through sim_spi(), which lets the
+// simulator notice DR writes and clock the byte across to the other side
+SPI_TypeDef * sim_spi(int n);
+DMA_TypeDef * sim_dma(int n);
+DMA_Stream_TypeDef * sim_dma_stream(int n, int stream);
+// USART2, the monitor's console; only its TX DMA request is modelled, and
+// the bytes it takes go to stdout
+USART_TypeDef * sim_usart(int n);
+// The CRC unit: CRC-32, polynomial 0x04c11db7, one 32-bit word per DR
+// write, worked out in software
+CRC_TypeDef * sim_crc(void);
+// GPIOC carries the slave chip selects: sim_gpio() applies BSRR writes to
+// ODR, and the simulator reads ODR to see which slave is selected
+GPIO_TypeDef * sim_gpio(int n);
+
+extern RCC_TypeDef sim_rcc;
+extern GPIO_TypeDef sim_gpioa;
+extern GPIO_TypeDef sim_gpiob;
+
+#define SPI1	(sim_spi(0))
+#define SPI2	(sim_spi(1))
+#define DMA1	(sim_dma(1))
+#define DMA2	(sim_dma(2))
+#define DMA1_Stream0	(sim_dma_stream(1, 0))
+#define DMA1_Stream1	(sim_dma_stream(1, 1))
+#define DMA1_Stream2	(sim_dma_stream(1, 2))
+#define DMA1_Stream3	(sim_dma_stream(1, 3))
+#define DMA1_Stream4	(sim_dma_stream(1, 4))
+#define DMA1_Stream5	(sim_dma_stream(1, 5))
+#define DMA1_Stream6	(sim_dma_stream(1, 6))
+#define DMA1_Stream7	(sim_dma_stream(1, 7))
+#define DMA2_Stream0	(sim_dma_stream(2, 0))
+#define DMA2_Stream1	(sim_dma_stream(2, 1))
+#define DMA2_Stream2	(sim_dma_stream(2, 2))
+#define DMA2_Stream3	(sim_dma_stream(2, 3))
+#define DMA2_Stream4	(sim_dma_stream(2, 4))
+#define DMA2_Stream5	(sim_dma_stream(2, 5))
+#define DMA2_Stream6	(sim_dma_stream(2, 6))
+#define DMA2_Stream7	(sim_dma_stream(2, 7))
+#define RCC	(&sim_rcc)
+#define GPIOA	(&sim_gpioa)
+#define GPIOB	(&sim_gpiob)
+#define GPIOC	(sim_gpio(2))
+#define USART2	(sim_usart(2))
+#define CRC	(sim_crc())
+
+
+// SPI_CR1
+#define SPI_CR1_CPHA		(1u << 0)
+#define SPI_CR1_CPOL		(1u << 1)
+#define SPI_CR1_MSTR		(1u << 2)
+#define SPI_CR1_BR_0		(1u << 3)
+#define SPI_CR1_BR_1		(1u << 4)
+#define SPI_CR1_BR_2		(1u << 5)
+#define SPI_CR1_BR		(7u << 3)
+#define SPI_CR1_SPE		(1u << 6)
+#define SPI_CR1_LSBFIRST	(1u << 7)
+#define SPI_CR1_SSI		(1u << 8)
+#define SPI_CR1_SSM		(1u << 9)
+#define SPI_CR1_RXONLY		(1u << 10)
+#define SPI_CR1_DFF		(1u << 11)
+#define SPI_CR1_CRCNEXT		(1u << 12)
+#define SPI_CR1_CRCEN		(1u << 13)
+#define SPI_CR1_BIDIOE		(1u << 14)
+#define SPI_CR1_BIDIMODE	(1u << 15)
+
+// SPI_CR2
+#define SPI_CR2_RXDMAEN		(1u << 0)
+#define SPI_CR2_TXDMAEN		(1u << 1)
+#define SPI_CR2_SSOE		(1u << 2)
+#define SPI_CR2_FRF		(1u << 4)
+#define SPI_CR2_ERRIE		(1u << 5)
+#define SPI_CR2_RXNEIE		(1u << 6)
+#define SPI_CR2_TXEIE		(1u << 7)
+
+// SPI_SR
+#define SPI_SR_RXNE		(1u << 0)
+#define SPI_SR_TXE		(1u << 1)
+#define SPI_SR_CHSIDE		(1u << 2)
+#define SPI_SR_UDR		(1u << 3)
+#define SPI_SR_CRCERR		(1u << 4)
+#define SPI_SR_MODF		(1u << 5)
+#define SPI_SR_OVR		(1u << 6)
+#define SPI_SR_BSY		(1u << 7)
+
+// DMA_SxCR
+#define DMA_SxCR_EN		(1u << 0)
+#define DMA_SxCR_DMEIE		(1u << 1)
+#define DMA_SxCR_TEIE		(1u << 2)
+#define DMA_SxCR_HTIE		(1u << 3)
+#define DMA_SxCR_TCIE		(1u << 4)
+#define DMA_SxCR_PFCTRL		(1u << 5)
+#define DMA_SxCR_DIR_0		(1u << 6)
+#define DMA_SxCR_DIR_1		(1u << 7)
+#define DMA_SxCR_DIR		(3u << 6)
+#define DMA_SxCR_CIRC		(1u << 8)
+#define DMA_SxCR_PINC		(1u << 9)
+#define DMA_SxCR_MINC		(1u << 10)
+#define DMA_SxCR_PSIZE_0	(1u << 11)
+#define DMA_SxCR_PSIZE_1	(1u << 12)
+#define DMA_SxCR_PSIZE		(3u << 11)
+#define DMA_SxCR_MSIZE_0	(1u << 13)
+#define DMA_SxCR_MSIZE_1	(1u << 14)
+#define DMA_SxCR_MSIZE		(3u << 13)
+#define DMA_SxCR_PL_0		(1u << 16)
+#define DMA_SxCR_PL_1		(1u << 17)
+#define DMA_SxCR_CHSEL_0	(1u << 25)
+#define DMA_SxCR_CHSEL_1	(1u << 26)
+#define DMA_SxCR_CHSEL_2	(1u << 27)
+#define DMA_SxCR_CHSEL		(7u << 25)
+
+// DMA_LISR / DMA_LIFCR (streams 0-3), DMA_HISR / DMA_HIFCR (streams 4-7)
+#define DMA_LISR_TCIF0		(1u << 5)
+#define DMA_LISR_TCIF1		(1u << 11)
+#define DMA_LISR_TCIF2		(1u << 21)
+#define DMA_LISR_TCIF3		(1u << 27)
+#define DMA_HISR_TCIF4		(1u << 5)
+#define DMA_HISR_TCIF5		(1u << 11)
+#define DMA_HISR_TCIF6		(1u << 21)
+#define DMA_HISR_TCIF7		(1u << 27)
+#define DMA_LIFCR_CTCIF0	(1u << 5)
+#define DMA_LIFCR_CTCIF1	(1u << 11)
+#define DMA_LIFCR_CTCIF2	(1u << 21)
+#define DMA_LIFCR_CTCIF3	(1u << 27)
+#define DMA_HIFCR_CTCIF4	(1u << 5)
+#define DMA_HIFCR_CTCIF5	(1u << 11)
+#define DMA_HIFCR_CTCIF6	(1u << 21)
+#define DMA_HIFCR_CTCIF7	(1u << 27)
+
+// RCC
+#define RCC_AHB1ENR_GPIOAEN	(1u << 0)
+#define RCC_AHB1ENR_GPIOBEN	(1u << 1)
+#define RCC_AHB1ENR_GPIOCEN	(1u << 2)
+#define RCC_AHB1ENR_CRCEN	(1u << 12)
+#define RCC_AHB1ENR_DMA1EN	(1u << 21)
+#define RCC_AHB1ENR_DMA2EN	(1u << 22)
+#define RCC_APB1RSTR_SPI2RST	(1u << 14)
+#define RCC_APB2RSTR_SPI1RST	(1u << 12)
+#define RCC_APB1ENR_SPI2EN	(1u << 14)
+#define RCC_APB2ENR_SPI1EN	(1u << 12)
+
+// USART
+#define USART_SR_TC		(1u << 6)
+#define USART_SR_TXE		(1u << 7)
+#define USART_CR3_DMAT		(1u << 7)
+
+// CRC
+#define CRC_CR_RESET		(1u << 0)
+
+// GPIO
+#define GPIO_MODER_MODER0_0	(1u << 0)
+#define GPIO_MODER_MODER1_0	(1u << 2)
+#define GPIO_MODER_MODER2_0	(1u << 4)
+#define GPIO_MODER_MODER3_0	(1u << 6)
+#define GPIO_MODER_MODER3_1	(2u << 6)
+#define GPIO_MODER_MODER6_1	(2u << 12)
+#define GPIO_MODER_MODER7_1	(2u << 14)
+#define GPIO_MODER_MODER10_1	(2u << 20)
+#define GPIO_MODER_MODER12_1	(2u << 24)
+#define GPIO_MODER_MODER14_1	(2u << 28)
+#define GPIO_MODER_MODER15_1	(2u << 30)
+
+#define GPIO_OSPEEDER_OSPEEDR3	(3u << 6)
+#define GPIO_OSPEEDER_OSPEEDR6	(3u << 12)
+#define GPIO_OSPEEDER_OSPEEDR7	(3u << 14)
+#define GPIO_OSPEEDER_OSPEEDR10	(3u << 20)
+#define GPIO_OSPEEDER_OSPEEDR14	(3u << 28)
+#define GPIO_OSPEEDER_OSPEEDR15	(3u << 30)
+
+#define GPIO_AFRL_AFRL3_0	(1u << 12)
+#define GPIO_AFRL_AFRL3_2	(4u << 12)
+#define GPIO_AFRL_AFRL6_0	(1u << 24)
+#define GPIO_AFRL_AFRL6_2	(4u << 24)
+#define GPIO_AFRL_AFRL7_0	(1u << 28)
+#define GPIO_AFRL_AFRL7_2	(4u << 28)
+#define GPIO_AFRH_AFRH2_0	(1u << 8)
+#define GPIO_AFRH_AFRH2_2	(4u << 8)
+#define GPIO_AFRH_AFRH4_0	(1u << 16)
+#define GPIO_AFRH_AFRH4_2	(4u << 16)
+#define GPIO_AFRH_AFRH6_0	(1u << 24)
+#define GPIO_AFRH_AFRH6_2	(4u << 24)
+#define GPIO_AFRH_AFRH7_0	(1u << 28)
+#define GPIO_AFRH_AFRH7_2	(4u << 28)
+
+
+// ---------------------------------------------------------------------------
+// Core and HAL
+// ---------------------------------------------------------------------------
+
+typedef struct
+{
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+	volatile uint32_t DHCSR;
+	volatile uint32_t DCRSR;
+	volatile uint32_t DCRDR;
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+// Reading the cycle counter advances the virtual clock a little, the way a
+// polling loop costs time on the core
+DWT_Type * sim_dwt(void);
+extern CoreDebug_Type sim_coredebug;
+
+#define DWT		(sim_dwt())
+#define CoreDebug	(&sim_coredebug)
+
+#define DWT_CTRL_CYCCNTENA_Msk		(1u << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk	(1u << 24)
+
+typedef enum
+{
+	DMA1_Stream0_IRQn = 11,
+	DMA1_Stream1_IRQn = 12,
+	DMA1_Stream2_IRQn = 13,
+	DMA1_Stream3_IRQn = 14,
+	DMA1_Stream4_IRQn = 15,
+	DMA1_Stream5_IRQn = 16,
+	DMA1_Stream6_IRQn = 17,
+	SPI1_IRQn = 35,
+	SPI2_IRQn = 36,
+	DMA1_Stream7_IRQn = 47,
+	DMA2_Stream0_IRQn = 56,
+	DMA2_Stream1_IRQn = 57,
+	DMA2_Stream2_IRQn = 58,
+	DMA2_Stream3_IRQn = 59,
+	DMA2_Stream4_IRQn = 60,
+	DMA2_Stream5_IRQn = 68,
+	DMA2_Stream6_IRQn = 69,
+	DMA2_Stream7_IRQn = 70,
+	SPI4_IRQn = 84,
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type irqn);
+void NVIC_DisableIRQ(IRQn_Type irqn);
+void NVIC_SetPendingIRQ(IRQn_Type irqn);
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority);
+
+void HAL_Delay(uint32_t delay);
+uint32_t HAL_GetTick(void);
+
+
+// ---------------------------------------------------------------------------
+// Monitor command parser
+// ---------------------------------------------------------------------------
+
+typedef enum
+{
+	CmdReturnOk = 0,
+	CmdReturnBadParameter1,
+	CmdReturnBadParameter2,
+	CmdReturnBadParameter3,
+	CmdReturnBadParameter4,
+	CmdReturnBadParameter5,
+	CmdReturnUnknownCommand,
+} ParserReturnVal_t;
+
+#define CMD_INTERACTIVE	0
+#define CMD_SHORT_HELP	1
+#define CMD_LONG_HELP	2
+
+typedef struct
+{
+	const char *name;
+	ParserReturnVal_t (*func)(int mode);
+	const char *help;
+} sim_cmd_t;
+
+void sim_cmd_register(const sim_cmd_t *cmd);
+
+#define ADD_CMD(name, func, help) \
+	static const sim_cmd_t func##_sim_cmd = { name, func, help }; \
+	static void __attribute__((constructor)) func##_sim_register(void) \
+	{ \
+		sim_cmd_register(&func##_sim_cmd); \
+	}
+
+int fetch_uint32_arg(uint32_t *dest);
+int fetch_string_arg(char **dest);
+
+#endif
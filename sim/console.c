@@ -0,0 +1,70 @@
+// File Name    : console.c
+// Project      : Simple File System by SPI
+// Description  : Interactive host console. Reads monitor commands from
+//                stdin and runs them against the simulated master and slave,
+//                the same way they would be typed on the board's terminal.
+//                The slave's flash is kept in a file, so files written in one
+//                session are there after 'spiinit' in the next. -e makes
+//                the link flip bits at that SPI clock and above, one frame
+//                in 4, to try 'baud' against; -n flips a bit in one frame
+//                in n at any clock, to try 'crc 1' against. -s puts that
+//                many slaves on the bus for the f* commands; all but the
+//                first keep their flash in memory
+//
+// Usage        : fsconsole [-e hz | -n n] [-s slaves] [flash file, default fsflash.bin]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "filesys.h"
+#include "monitor.h"
+#include "persist.h"
+#include "spi_sim.h"
+
+int main(int argc, char **argv)
+{
+	char line[1024];
+	int slaves = 1;
+	int arg = 1;
+
+	if (argc > arg + 1 && strcmp(argv[arg], "-e") == 0) {
+		sim_spi_bit_errors((uint32_t)strtoul(argv[arg + 1], NULL, 0), 4);
+		arg += 2;
+	}
+	else if (argc > arg + 1 && strcmp(argv[arg], "-n") == 0) {
+		sim_spi_bit_errors(0, (uint32_t)strtoul(argv[arg + 1], NULL, 0));
+		arg += 2;
+	}
+	if (argc > arg + 1 && strcmp(argv[arg], "-s") == 0) {
+		slaves = atoi(argv[arg + 1]);
+		arg += 2;
+	}
+
+	if (sim_flash_open((argc > arg) ? argv[arg] : "fsflash.bin") != 0)
+		return 1;
+
+	// the other slaves boot now, each with a copy of this program
+	if (sim_spi_slaves(slaves, spi_init, persist_poll) != 0) {
+		fprintf(stderr, "1 to %d slaves\n", SIM_MAX_SLAVES);
+		return 1;
+	}
+	spi_slaves = (uint8_t)slaves;
+
+	printf("filesys host console, 'help' lists the commands\n");
+	for (;;) {
+		printf("> ");
+		fflush(stdout);
+		if (fgets(line, sizeof(line), stdin) == NULL)
+			break;
+		sim_cmd_run(line);
+
+		// the board's main loop between commands
+		persist_poll();
+		sim_spi_slaves_idle();
+	}
+	printf("\n");
+
+	return 0;
+}
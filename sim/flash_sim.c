@@ -0,0 +1,114 @@
+// File Name    : flash_sim.c
+// Project      : Simple File System by SPI
+// Description  : Host stand-in for flash.c. The log sectors are kept in a
+//                file (or in memory until sim_flash_open() is called) and
+//                behave like NOR flash: erase sets a whole sector to 0xff and
+//                programming can only clear bits, anything else is reported
+//                as an error the way the flash controller would
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "flash.h"
+#include "spi_sim.h"
+
+static uint8_t flash_ram[FLASH_LOG_SIZE];
+static uint8_t *flash_mem = NULL;
+static struct sim_flash_stats stats;
+
+
+static uint8_t * flash_mem_get(void)
+{
+	if (flash_mem == NULL) {
+		memset(flash_ram, 0xff, sizeof(flash_ram));
+		flash_mem = flash_ram;
+	}
+	return flash_mem;
+}
+
+int sim_flash_open(const char *path)
+{
+	off_t size;
+	uint8_t *mem;
+	int fd;
+
+	if (path == NULL) {
+		flash_mem = NULL;		// fresh, erased, in memory
+		flash_mem_get();
+		return 0;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size != FLASH_LOG_SIZE && ftruncate(fd, FLASH_LOG_SIZE) != 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	mem = mmap(NULL, FLASH_LOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	if (size != FLASH_LOG_SIZE) {
+		memset(mem, 0xff, FLASH_LOG_SIZE);	// new file: erased flash
+	}
+
+	flash_mem = mem;
+	return 0;
+}
+
+void sim_flash_get_stats(struct sim_flash_stats *s)
+{
+	*s = stats;
+}
+
+
+int flash_erase(uint8_t sector)
+{
+	if (sector >= FLASH_LOG_SECTORS) {
+		return -1;
+	}
+
+	memset(flash_mem_get() + sector * FLASH_SECTOR_SIZE, 0xff, FLASH_SECTOR_SIZE);
+	stats.erases[sector]++;
+	return 0;
+}
+
+int flash_program(uint32_t offset, const void *data, uint32_t length)
+{
+	const uint8_t *p = data;
+	uint8_t *mem = flash_mem_get();
+	uint32_t i;
+
+	if ((offset & 3) || (length & 3) || offset + length > FLASH_LOG_SIZE) {
+		return -1;
+	}
+
+	for (i = 0; i < length; i++) {
+		if ((mem[offset + i] & p[i]) != p[i]) {
+			stats.errors++;
+			return -1;		// would need a 0 bit set back to 1
+		}
+		mem[offset + i] = p[i];
+	}
+
+	stats.programmed += length;
+	return 0;
+}
+
+const uint8_t * flash_addr(uint32_t offset)
+{
+	return flash_mem_get() + offset;
+}
@@ -0,0 +1,99 @@
+// File Name    : monitor.c
+// Project      : Simple File System by SPI
+// Description  : Host version of the monitor command parser. Commands added
+//                with ADD_CMD register themselves at start-up, and a line is
+//                run by looking up its first word and letting the command
+//                fetch the remaining words as arguments
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "monitor.h"
+
+#define MAX_COMMANDS	64
+#define MAX_ARGS	128
+
+static const sim_cmd_t *commands[MAX_COMMANDS];
+static int command_count = 0;
+
+static char *args[MAX_ARGS];
+static int arg_count = 0;
+static int arg_next = 0;
+
+
+void sim_cmd_register(const sim_cmd_t *cmd)
+{
+	if (command_count < MAX_COMMANDS)
+		commands[command_count++] = cmd;
+}
+
+int fetch_string_arg(char **dest)
+{
+	if (arg_next >= arg_count)
+		return -1;
+	*dest = args[arg_next++];
+	return 0;
+}
+
+int fetch_uint32_arg(uint32_t *dest)
+{
+	char *end;
+	char *s;
+
+	if (fetch_string_arg(&s))
+		return -1;
+	*dest = (uint32_t)strtoul(s, &end, 0);
+	if (*end != '\0')
+		return -1;
+	return 0;
+}
+
+static const sim_cmd_t * find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < command_count; i++) {
+		if (strcmp(commands[i]->name, name) == 0)
+			return commands[i];
+	}
+	return NULL;
+}
+
+static void help(void)
+{
+	int i;
+
+	for (i = 0; i < command_count; i++)
+		printf("%-12s%s\n", commands[i]->name, commands[i]->help);
+}
+
+ParserReturnVal_t sim_cmd_run(char *line)
+{
+	const sim_cmd_t *cmd;
+	char *tok;
+
+	arg_count = 0;
+	arg_next = 0;
+	for (tok = strtok(line, " \t\r\n"); tok && arg_count < MAX_ARGS;
+	     tok = strtok(NULL, " \t\r\n"))
+		args[arg_count++] = tok;
+
+	if (arg_count == 0)
+		return CmdReturnOk;
+
+	if (strcmp(args[0], "help") == 0) {
+		help();
+		return CmdReturnOk;
+	}
+
+	cmd = find(args[0]);
+	if (cmd == NULL) {
+		printf("Unknown command: %s\n", args[0]);
+		return CmdReturnUnknownCommand;
+	}
+
+	arg_next = 1;
+	return cmd->func(CMD_INTERACTIVE);
+}
@@ -0,0 +1,13 @@
+// File Name    : monitor.h
+// Project      : Simple File System by SPI
+// Description  : Entry point into the host monitor command parser
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include "common.h"
+
+// Runs one command line; the line is split in place
+ParserReturnVal_t sim_cmd_run(char *line);
+
+#endif
@@ -0,0 +1,222 @@
+// File Name    : replay.c
+// Project      : Simple File System by SPI
+// Description  : Replays a protocol trace, as the monitor's 'trace'
+//                command dumps it, through the simulated slave: each byte
+//                the master sent goes into SPI2_IRQHandler again, from the
+//                first SYNC in the trace, and the bytes the slave loads to
+//                send back and the states it takes them in are checked
+//                against the trace. Prints, per state, the bytes, the link
+//                time they took in the trace and the time the slave takes
+//                for them here, so traffic from the field can serve as a
+//                benchmark. The slave starts from the flash file given, or
+//                empty; payload the board moved by DMA is not in a trace.
+//
+// Usage        : fsreplay <trace file> [flash file]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "filesys.h"
+#include "spi_sim.h"
+#include "trace.h"
+
+#define STATES 32
+
+struct state_time
+{
+	char name[16];		// as the dump gives it
+	uint32_t frames;
+	uint64_t link_ns;	// in the trace, to the next byte from the master
+	uint64_t host_ns;	// replaying them
+	uint64_t host_max;	// replaying one frame
+};
+
+static struct trace_entry *entries;
+static uint32_t count;
+static uint32_t tick_ns = 1;
+
+static struct state_time times[STATES];
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Lines of the dump, with or without the console's prompt in front;
+// anything else is skipped
+static int load(const char *path)
+{
+	char line[256];
+	const char *p;
+	uint32_t room = 0;
+	unsigned long time;
+	unsigned int state, data;
+	char dir;
+	char name[16] = "";
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		for (p = line; *p == '>' || *p == ' '; p++)
+			;
+		if (*p == '#') {
+			p = strstr(p, "ns per tick");
+			if (p != NULL) {
+				while (p > line && p[-1] == ' ')
+					p--;
+				while (p > line && p[-1] >= '0' && p[-1] <= '9')
+					p--;
+				tick_ns = (uint32_t)strtoul(p, NULL, 10);
+			}
+			continue;
+		}
+		if (sscanf(p, "%lu %c %u %x %15s", &time, &dir, &state, &data, name) < 4
+		    || (dir != 'r' && dir != 't') || state >= STATES) {
+			continue;
+		}
+		if (name[0] != '\0')
+			strcpy(times[state].name, name);
+
+		if (count == room) {
+			room = room ? room * 2 : 1024;
+			entries = realloc(entries, room * sizeof(*entries));
+			if (entries == NULL) {
+				fclose(f);
+				return -1;
+			}
+		}
+		entries[count].time = (uint32_t)time;
+		entries[count].dir = (dir == 'r') ? TRACE_RX : TRACE_TX;
+		entries[count].state = (uint8_t)state;
+		entries[count].data = (uint8_t)data;
+		count++;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+// The next entry from the master at or after i, count if none
+static uint32_t next_rx(uint32_t i)
+{
+	while (i < count && entries[i].dir != TRACE_RX)
+		i++;
+	return i;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_entry got;
+	uint32_t i, next, tx, seq;
+	uint32_t frames = 0, state_errors = 0, tx_errors = 0, first_error = 0;
+	uint64_t t, link_total = 0, host_total = 0, sim_start;
+	uint16_t frame;
+	uint8_t state;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: fsreplay <trace file> [flash file]\n");
+		return 2;
+	}
+	if (load(argv[1]) != 0 || sim_flash_open((argc > 2) ? argv[2] : NULL) != 0)
+		return 2;
+
+	// the slave comes up as at a reset, then picks up at the first SYNC
+	spi_init();
+	payload_dma = 0;
+
+	for (i = next_rx(0); i < count; i = next_rx(i + 1)) {
+		if (entries[i].state == 0 && entries[i].data == 0xfe)
+			break;
+	}
+	if (i == count) {
+		fprintf(stderr, "%s: no SYNC from the master in %lu entries\n",
+			argv[1], (unsigned long)count);
+		return 2;
+	}
+
+	tx = i;
+	trace_clear();
+	trace_on = 1;
+	seq = 0;
+	sim_start = sim_now_ns();
+
+	while (i < count) {
+		state = entries[i].state;
+		frame = entries[i].data;
+		next = next_rx(i + 1);
+		if ((SPI2->CR1 & SPI_CR1_DFF) && next < count) {
+			frame |= entries[next].data << 8;
+			next = next_rx(next + 1);
+		}
+
+		t = host_ns();
+		sim_spi_slave_frame(frame);
+		t = host_ns() - t;
+
+		times[state].frames++;
+		times[state].host_ns += t;
+		if (t > times[state].host_max)
+			times[state].host_max = t;
+		host_total += t;
+		if (next < count) {
+			times[state].link_ns += (uint64_t)(entries[next].time - entries[i].time) * tick_ns;
+			link_total += (uint64_t)(entries[next].time - entries[i].time) * tick_ns;
+		}
+		frames++;
+
+		// what the slave did with it, against the trace
+		for (; seq < trace_count(); seq++) {
+			if (!trace_get(seq, &got))
+				continue;
+			if (got.dir == TRACE_RX) {
+				if (got.state != entries[i].state && state_errors++ == 0)
+					first_error = i;
+				continue;
+			}
+			while (tx < count && entries[tx].dir != TRACE_TX)
+				tx++;
+			if (tx < count) {
+				if (got.data != entries[tx].data && tx_errors++ == 0)
+					first_error = tx;
+				tx++;
+			}
+		}
+
+		i = next;
+	}
+
+	printf("%lu entries, %lu frames from the master replayed, %.3f ms of link time\n",
+	       (unsigned long)count, (unsigned long)frames,
+	       (sim_now_ns() - sim_start) / 1e6);
+	printf("%-12s %8s %12s %12s %12s\n", "state", "frames", "trace us",
+	       "replay ns", "max ns");
+	for (state = 0; state < STATES; state++) {
+		if (times[state].frames == 0)
+			continue;
+		printf("%-12s %8lu %12.1f %12.0f %12lu\n", times[state].name,
+		       (unsigned long)times[state].frames, times[state].link_ns / 1e3,
+		       (double)times[state].host_ns / times[state].frames,
+		       (unsigned long)times[state].host_max);
+	}
+	printf("%-12s %8lu %12.1f %12.0f\n", "total", (unsigned long)frames,
+	       link_total / 1e3, frames ? (double)host_total / frames : 0.0);
+
+	if (state_errors || tx_errors) {
+		printf("%lu states and %lu replies differ from the trace, the first at entry %lu\n",
+		       (unsigned long)state_errors, (unsigned long)tx_errors,
+		       (unsigned long)first_error);
+		return 1;
+	}
+	printf("every state and reply matches the trace\n");
+	return 0;
+}
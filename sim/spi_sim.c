@@ -0,0 +1,924 @@
+// File Name    : spi_sim.c
+// Project      : Simple File System by SPI
+// Description  : Host model of the SPI1 (master) / SPI2 (slave) pair wired
+//                back to back. A DR write on the master shifts one frame:
+//                the slave receives it and raises its RXNE interrupt, and
+//                the master receives whatever the slave had loaded into its
+//                transmit buffer. As on the STM32F411, a slave that has not
+//                loaded new data (underrun) sends its previous frame again.
+//                The DMA1/DMA2 streams wired to SPI1/SPI2 are modelled too:
+//                an enabled stream serves the TXE/RXNE requests of its SPI
+//                and raises its transfer-complete interrupt when NDTR runs out.
+//                The TXE interrupt of either side fires while TXEIE is set and
+//                its transmit buffer is empty, and a line pended from a handler
+//                runs once that handler returns, as a lower priority one would.
+//                With sim_spi_slaves() more slaves share the bus, each in a
+//                child process with its own copy of the slave code and flash;
+//                the GPIOC chip selects decide which one a frame goes to.
+//                USART2's TX DMA request is served too, at once, onto stdout,
+//                and the CRC unit is worked out in software
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "spi_sim.h"
+
+// DR holds this tag in its upper half while nobody has written it, so a
+// write of any 8/16-bit frame can be told apart from the idle contents
+#define DR_TAG		0x5a5a0000u
+#define DR_WRITTEN(v)	(((v) & 0xffff0000u) != DR_TAG)
+
+// The CRC unit's result sits in DR with CRC_TAG above it; a DR write
+// stores a bare 32-bit word, which is folded in at the next access
+#define CRC_TAG		0xc5c5c5c500000000ull
+
+#define NVIC_LINES	96
+
+void SPI1_IRQHandler(void);
+void SPI2_IRQHandler(void);
+
+// Only the handlers filesys.c actually defines get called
+#define WEAK_HANDLER(name)	void name(void) __attribute__((weak));
+WEAK_HANDLER(DMA1_Stream0_IRQHandler)
+WEAK_HANDLER(DMA1_Stream1_IRQHandler)
+WEAK_HANDLER(DMA1_Stream2_IRQHandler)
+WEAK_HANDLER(DMA1_Stream3_IRQHandler)
+WEAK_HANDLER(DMA1_Stream4_IRQHandler)
+WEAK_HANDLER(DMA1_Stream5_IRQHandler)
+WEAK_HANDLER(DMA1_Stream6_IRQHandler)
+WEAK_HANDLER(DMA1_Stream7_IRQHandler)
+WEAK_HANDLER(DMA2_Stream0_IRQHandler)
+WEAK_HANDLER(DMA2_Stream1_IRQHandler)
+WEAK_HANDLER(DMA2_Stream2_IRQHandler)
+WEAK_HANDLER(DMA2_Stream3_IRQHandler)
+WEAK_HANDLER(DMA2_Stream4_IRQHandler)
+WEAK_HANDLER(DMA2_Stream5_IRQHandler)
+WEAK_HANDLER(DMA2_Stream6_IRQHandler)
+WEAK_HANDLER(DMA2_Stream7_IRQHandler)
+WEAK_HANDLER(SPI4_IRQHandler)
+
+struct sim_port
+{
+	SPI_TypeDef reg;
+	IRQn_Type irqn;
+	void (*handler)(void);
+	uint16_t rx;
+	uint16_t tx;
+	uint8_t tx_full;
+	uint16_t last_shift;
+	uint8_t rxne;
+	uint8_t ovr;
+};
+
+struct sim_stream
+{
+	DMA_Stream_TypeDef reg;
+	uint8_t armed;
+	uint32_t done;		// items moved since the stream was enabled
+};
+
+struct sim_dma
+{
+	DMA_TypeDef reg;
+	struct sim_stream stream[8];
+};
+
+// DMA request mapping of the F411 (RM0383 tables 27 and 28)
+struct sim_request
+{
+	uint8_t dma;		// 0 = DMA1, 1 = DMA2
+	uint8_t stream;
+	uint8_t channel;
+	uint8_t port;		// 0 = SPI1, 1 = SPI2, 2 = USART2
+	uint8_t tx;
+};
+
+static const struct sim_request requests[] = {
+	{ 1, 0, 3, 0, 0 },	// SPI1_RX
+	{ 1, 2, 3, 0, 0 },	// SPI1_RX
+	{ 1, 3, 3, 0, 1 },	// SPI1_TX
+	{ 1, 5, 3, 0, 1 },	// SPI1_TX
+	{ 0, 3, 0, 1, 0 },	// SPI2_RX
+	{ 0, 4, 0, 1, 1 },	// SPI2_TX
+	{ 0, 6, 4, 2, 1 },	// USART2_TX
+};
+
+static const IRQn_Type stream_irqn[2][8] = {
+	{ DMA1_Stream0_IRQn, DMA1_Stream1_IRQn, DMA1_Stream2_IRQn,
+	  DMA1_Stream3_IRQn, DMA1_Stream4_IRQn, DMA1_Stream5_IRQn,
+	  DMA1_Stream6_IRQn, DMA1_Stream7_IRQn },
+	{ DMA2_Stream0_IRQn, DMA2_Stream1_IRQn, DMA2_Stream2_IRQn,
+	  DMA2_Stream3_IRQn, DMA2_Stream4_IRQn, DMA2_Stream5_IRQn,
+	  DMA2_Stream6_IRQn, DMA2_Stream7_IRQn },
+};
+
+static void (* const stream_handler[2][8])(void) = {
+	{ DMA1_Stream0_IRQHandler, DMA1_Stream1_IRQHandler,
+	  DMA1_Stream2_IRQHandler, DMA1_Stream3_IRQHandler,
+	  DMA1_Stream4_IRQHandler, DMA1_Stream5_IRQHandler,
+	  DMA1_Stream6_IRQHandler, DMA1_Stream7_IRQHandler },
+	{ DMA2_Stream0_IRQHandler, DMA2_Stream1_IRQHandler,
+	  DMA2_Stream2_IRQHandler, DMA2_Stream3_IRQHandler,
+	  DMA2_Stream4_IRQHandler, DMA2_Stream5_IRQHandler,
+	  DMA2_Stream6_IRQHandler, DMA2_Stream7_IRQHandler },
+};
+
+// Bit offset of each stream's flags within LISR/HISR
+static const uint8_t flag_shift[4] = { 0, 6, 16, 22 };
+
+RCC_TypeDef sim_rcc;
+GPIO_TypeDef sim_gpioa;
+GPIO_TypeDef sim_gpiob;
+static GPIO_TypeDef gpioc;
+CoreDebug_Type sim_coredebug;
+
+static struct sim_port port[2] = {
+	{ .irqn = SPI1_IRQn, .handler = SPI1_IRQHandler },
+	{ .irqn = SPI2_IRQn, .handler = SPI2_IRQHandler },
+};
+
+static struct sim_dma dma[2];
+static USART_TypeDef usart2;
+static CRC_TypeDef crc_unit = { .DR = CRC_TAG | 0xffffffffu };
+static uint32_t crc_value = 0xffffffffu;
+static DWT_Type dwt;
+static uint64_t dwt_last_cycles = 0;
+
+static uint8_t nvic_enabled[NVIC_LINES];
+static uint8_t nvic_pending[NVIC_LINES];
+static uint8_t in_pump = 0;
+static uint64_t now_ns = 0;
+static uint64_t frame_count = 0;
+static uint32_t error_hz = 0;
+static uint32_t error_one_in = 0;
+static uint32_t error_seed = 0x2545f491u;
+static uint64_t errors_injected = 0;
+static int saved_stdout = -1;
+
+// Slaves 1 and up, each a child process served one frame at a time over
+// a socket
+enum remote_op {REMOTE_FRAME, REMOTE_IDLE};
+
+struct remote_msg
+{
+	uint64_t now_ns;
+	uint16_t val;		// frame to the slave, its frame back
+	uint8_t op;
+};
+
+struct remote_slave
+{
+	pid_t pid;
+	int fd;
+};
+
+static struct remote_slave remote[SIM_MAX_SLAVES];
+static int slave_count = 1;
+
+
+static int irq_enabled(IRQn_Type irqn)
+{
+	return irqn >= 0 && irqn < NVIC_LINES && nvic_enabled[irqn];
+}
+
+// Time one frame of a port's width takes on the wire at the master's
+// current divisor
+static uint64_t frame_ns(const struct sim_port *p)
+{
+	uint32_t br = (port[0].reg.CR1 & SPI_CR1_BR) >> 3;
+	uint32_t bits = (p->reg.CR1 & SPI_CR1_DFF) ? 16 : 8;
+	uint64_t div = 2ull << br;
+
+	return (uint64_t)bits * div * 1000000000ull / SIM_SPI_PCLK_HZ;
+}
+
+// Software-pended lines; only SPI4, the slave's protocol worker, has a
+// handler to run
+static void run_pending(void)
+{
+	while (nvic_pending[SPI4_IRQn] && irq_enabled(SPI4_IRQn) && SPI4_IRQHandler) {
+		nvic_pending[SPI4_IRQn] = 0;
+		SPI4_IRQHandler();
+	}
+}
+
+// Flip one bit of a frame now and then, if the clock is fast enough
+static uint16_t line_noise(uint16_t val)
+{
+	uint32_t br = (port[0].reg.CR1 & SPI_CR1_BR) >> 3;
+	uint32_t bits = (port[0].reg.CR1 & SPI_CR1_DFF) ? 16 : 8;
+
+	if (error_one_in == 0 || SIM_SPI_PCLK_HZ / (2u << br) < error_hz)
+		return val;
+
+	// xorshift32, fixed seed so runs repeat
+	error_seed ^= error_seed << 13;
+	error_seed ^= error_seed >> 17;
+	error_seed ^= error_seed << 5;
+	if (error_seed % error_one_in != 0)
+		return val;
+
+	errors_injected++;
+	return val ^ (1u << ((error_seed >> 8) % bits));
+}
+
+static void refresh_sr(struct sim_port *p)
+{
+	uint32_t sr = 0;
+
+	if (p->rxne)
+		sr |= SPI_SR_RXNE;
+	if (!p->tx_full)
+		sr |= SPI_SR_TXE;
+	if (p->ovr)
+		sr |= SPI_SR_OVR;
+	p->reg.SR = sr;
+}
+
+
+// ---------------------------------------------------------------------------
+// DMA
+// ---------------------------------------------------------------------------
+
+// Apply flag clears and notice streams the code enabled or disabled
+static void dma_sync(void)
+{
+	int d, s;
+
+	for (d = 0; d < 2; d++) {
+		dma[d].reg.LISR &= ~dma[d].reg.LIFCR;
+		dma[d].reg.HISR &= ~dma[d].reg.HIFCR;
+		dma[d].reg.LIFCR = 0;
+		dma[d].reg.HIFCR = 0;
+
+		for (s = 0; s < 8; s++) {
+			struct sim_stream *st = &dma[d].stream[s];
+
+			if ((st->reg.CR & DMA_SxCR_EN) && !st->armed) {
+				st->armed = 1;
+				st->done = 0;
+			}
+			else if (!(st->reg.CR & DMA_SxCR_EN)) {
+				st->armed = 0;
+			}
+		}
+	}
+}
+
+// The enabled stream serving a port's TX or RX request, if any
+static const struct sim_request * find_request(int p, int tx)
+{
+	uint32_t i;
+
+	for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+		const struct sim_request *r = &requests[i];
+		struct sim_stream *st = &dma[r->dma].stream[r->stream];
+
+		if (r->port != p || r->tx != tx || !st->armed)
+			continue;
+		if (((st->reg.CR & DMA_SxCR_CHSEL) >> 25) != r->channel)
+			continue;
+		if (st->reg.NDTR == 0)
+			continue;
+		return r;
+	}
+	return NULL;
+}
+
+static uint32_t stream_size(struct sim_stream *st)
+{
+	return (st->reg.CR & DMA_SxCR_MSIZE) ? 2 : 1;
+}
+
+static volatile uint8_t * stream_addr(struct sim_stream *st)
+{
+	uintptr_t addr = st->reg.M0AR;
+
+	if (st->reg.CR & DMA_SxCR_MINC)
+		addr += st->done * stream_size(st);
+	return (volatile uint8_t *)addr;
+}
+
+static uint16_t stream_read(const struct sim_request *r)
+{
+	struct sim_stream *st = &dma[r->dma].stream[r->stream];
+	volatile uint8_t *mem = stream_addr(st);
+
+	if (stream_size(st) == 2)
+		return *(volatile uint16_t *)mem;
+	return *mem;
+}
+
+static void stream_write(const struct sim_request *r, uint16_t val)
+{
+	struct sim_stream *st = &dma[r->dma].stream[r->stream];
+	volatile uint8_t *mem = stream_addr(st);
+
+	if (stream_size(st) == 2)
+		*(volatile uint16_t *)mem = val;
+	else
+		*mem = (uint8_t)val;
+}
+
+static void stream_advance(const struct sim_request *r)
+{
+	struct sim_dma *ctrl = &dma[r->dma];
+	struct sim_stream *st = &ctrl->stream[r->stream];
+	uint32_t tcif = 1u << (flag_shift[r->stream & 3] + 5);
+
+	st->done++;
+	st->reg.NDTR--;
+	if (st->reg.NDTR != 0)
+		return;
+
+	st->reg.CR &= ~DMA_SxCR_EN;
+	st->armed = 0;
+	if (r->stream < 4)
+		ctrl->reg.LISR |= tcif;
+	else
+		ctrl->reg.HISR |= tcif;
+
+	if ((st->reg.CR & DMA_SxCR_TCIE) && irq_enabled(stream_irqn[r->dma][r->stream])
+	    && stream_handler[r->dma][r->stream])
+		stream_handler[r->dma][r->stream]();
+}
+
+
+// ---------------------------------------------------------------------------
+// SPI
+// ---------------------------------------------------------------------------
+
+// Pick up a frame the code stored in DR since the last look
+static int take_write(struct sim_port *p, uint16_t *val)
+{
+	uint32_t dr = p->reg.DR;
+
+	if (!DR_WRITTEN(dr))
+		return 0;
+	*val = (uint16_t)dr;
+	p->reg.DR = DR_TAG | p->rx;
+	return 1;
+}
+
+static void deliver(struct sim_port *p, uint16_t val)
+{
+	const struct sim_request *r = NULL;
+
+	if (p->reg.CR2 & SPI_CR2_RXDMAEN)
+		r = find_request(p - port, 0);
+
+	p->rx = val;
+	p->reg.DR = DR_TAG | val;
+
+	if (r) {
+		stream_write(r, val);
+		stream_advance(r);
+		return;
+	}
+
+	if (p->rxne)
+		p->ovr = 1;
+	p->rxne = 1;
+	refresh_sr(p);
+
+	if ((p->reg.CR2 & SPI_CR2_RXNEIE) && irq_enabled(p->irqn)) {
+		p->handler();
+		// the handlers always read DR, which clears RXNE
+		p->rxne = 0;
+		run_pending();
+	}
+}
+
+static void slave_collect(void)
+{
+	struct sim_port *s = &port[1];
+	uint16_t val;
+
+	if (take_write(s, &val)) {
+		s->tx = val;
+		s->tx_full = 1;
+	}
+}
+
+// The slave's TXE interrupt, while it has one enabled and nothing is
+// loaded. Returns 1 if the handler loaded a frame.
+static int slave_txe(void)
+{
+	struct sim_port *s = &port[1];
+
+	if (s->tx_full || !(s->reg.CR2 & SPI_CR2_TXEIE) || !irq_enabled(s->irqn))
+		return 0;
+
+	refresh_sr(s);
+	s->handler();
+	run_pending();
+	slave_collect();
+	return s->tx_full;
+}
+
+// The master's TXE interrupt, the same way. Returns 1 if the handler did
+// anything: loaded a frame or turned TXEIE off.
+static int master_txe(void)
+{
+	struct sim_port *m = &port[0];
+
+	if (DR_WRITTEN(m->reg.DR) || !(m->reg.CR2 & SPI_CR2_TXEIE) || !irq_enabled(m->irqn))
+		return 0;
+
+	refresh_sr(m);
+	m->handler();
+	run_pending();
+	return DR_WRITTEN(m->reg.DR) || !(m->reg.CR2 & SPI_CR2_TXEIE);
+}
+
+// The slave's half of a frame: what it shifts out, then what it takes in
+static uint16_t slave_shift_out(void)
+{
+	struct sim_port *s = &port[1];
+
+	if (s->tx_full) {
+		s->last_shift = s->tx;
+		s->tx_full = 0;
+	}
+	return s->last_shift;
+}
+
+static void slave_shift_in(uint16_t out)
+{
+	struct sim_port *s = &port[1];
+
+	if (s->reg.CR1 & SPI_CR1_SPE) {
+		slave_txe();
+		deliver(s, out);
+		slave_collect();
+	}
+}
+
+static void gpio_apply(GPIO_TypeDef *g)
+{
+	uint32_t bsrr = g->BSRR;
+
+	// a set bit wins over a reset of the same pin
+	g->ODR = (g->ODR & ~(bsrr >> 16)) | (bsrr & 0xffffu);
+	g->BSRR = 0;
+}
+
+// The slave whose chip select is low, -1 if none is. A single slave is
+// always selected, as with software NSS on one board.
+static int selected_slave(void)
+{
+	int i;
+
+	if (slave_count == 1)
+		return 0;
+
+	gpio_apply(&gpioc);
+	for (i = 0; i < slave_count; i++) {
+		if (!(gpioc.ODR & (1u << i)))
+			return i;
+	}
+	return -1;
+}
+
+static int remote_call(int fd, struct remote_msg *msg)
+{
+	if (send(fd, msg, sizeof(*msg), 0) != (ssize_t)sizeof(*msg))
+		return -1;
+	if (recv(fd, msg, sizeof(*msg), MSG_WAITALL) != (ssize_t)sizeof(*msg))
+		return -1;
+	return 0;
+}
+
+static uint16_t remote_frame(int n, uint16_t out)
+{
+	struct remote_msg msg = { now_ns, out, REMOTE_FRAME };
+
+	if (remote_call(remote[n].fd, &msg) != 0)
+		return 0xffff;
+	return msg.val;
+}
+
+// One frame each way, as wide as the master's DFF makes it; a side
+// configured for the other width is not modelled
+static void exchange(uint16_t out)
+{
+	struct sim_port *m = &port[0];
+	int slave = selected_slave();
+	uint16_t mask = (m->reg.CR1 & SPI_CR1_DFF) ? 0xffff : 0xff;
+	uint16_t in;
+
+	out &= mask;
+
+	if (slave == 0) {
+		in = line_noise(slave_shift_out());
+		out = line_noise(out);
+		slave_shift_in(out);
+	}
+	else {
+		// the same draws from the noise as above, applied to the
+		// other slave's frame, or to an undriven MISO pulled high
+		in = line_noise(0);
+		out = line_noise(out);
+		in ^= (slave > 0) ? remote_frame(slave, out) : 0xffff;
+	}
+
+	// the master's RXNE comes at the end of the frame
+	now_ns += frame_ns(m);
+	frame_count++;
+
+	deliver(m, in & mask);
+}
+
+static int master_enabled(void)
+{
+	return (port[0].reg.CR1 & SPI_CR1_SPE) && (port[0].reg.CR1 & SPI_CR1_MSTR);
+}
+
+// Move at most one item: a DMA load of the slave's transmit buffer or one
+// frame from the master. Returns 0 when nothing is left to do.
+static int service(void)
+{
+	struct sim_port *m = &port[0];
+	struct sim_port *s = &port[1];
+	const struct sim_request *r;
+	uint16_t val;
+
+	dma_sync();
+	slave_collect();
+
+	if (slave_txe())
+		return 1;
+
+	if ((s->reg.CR2 & SPI_CR2_TXDMAEN) && !s->tx_full
+	    && (r = find_request(1, 1)) != NULL) {
+		s->tx = stream_read(r);
+		s->tx_full = 1;
+		stream_advance(r);
+		return 1;
+	}
+
+	// the console takes its bytes as fast as DMA gives them
+	if ((usart2.CR3 & USART_CR3_DMAT) && (r = find_request(2, 1)) != NULL) {
+		fputc(stream_read(r), stdout);
+		stream_advance(r);
+		return 1;
+	}
+
+	if (take_write(m, &val)) {
+		if (master_enabled())
+			exchange(val);
+		return 1;
+	}
+
+	if ((m->reg.CR2 & SPI_CR2_TXDMAEN) && master_enabled()
+	    && (r = find_request(0, 1)) != NULL) {
+		val = stream_read(r);
+		stream_advance(r);
+		exchange(val);
+		return 1;
+	}
+
+	if (master_enabled() && master_txe())
+		return 1;
+
+	return 0;
+}
+
+// Run the wire until neither side has anything left to shift
+static void pump(void)
+{
+	if (in_pump)
+		return;
+	in_pump = 1;
+
+	while (service())
+		;
+
+	refresh_sr(&port[0]);
+	refresh_sr(&port[1]);
+	in_pump = 0;
+}
+
+// A frame into slave 0 from outside the master, for sim/replay.c: as
+// wide as the slave's DFF, at the master's clock divisor
+uint16_t sim_spi_slave_frame(uint16_t out)
+{
+	struct sim_port *s = &port[1];
+	uint16_t mask = (s->reg.CR1 & SPI_CR1_DFF) ? 0xffff : 0xff;
+	uint16_t in;
+
+	pump();
+	in_pump = 1;		// as when the master shifts it
+	in = slave_shift_out();
+	slave_shift_in(out & mask);
+	in_pump = 0;
+	pump();
+
+	now_ns += frame_ns(s);
+	frame_count++;
+	return in & mask;
+}
+
+
+// ---------------------------------------------------------------------------
+// Register access, core and HAL
+// ---------------------------------------------------------------------------
+
+SPI_TypeDef * sim_spi(int n)
+{
+	pump();
+	if (in_pump && n == 1) {
+		// a handler looking at the slave sees its own DR writes in SR
+		slave_collect();
+		refresh_sr(&port[1]);
+	}
+	return &port[n].reg;
+}
+
+GPIO_TypeDef * sim_gpio(int n)
+{
+	if (n == 0)
+		return &sim_gpioa;
+	if (n == 1)
+		return &sim_gpiob;
+	gpio_apply(&gpioc);
+	return &gpioc;
+}
+
+DMA_TypeDef * sim_dma(int n)
+{
+	pump();
+	return &dma[n - 1].reg;
+}
+
+DMA_Stream_TypeDef * sim_dma_stream(int n, int stream)
+{
+	pump();
+	return &dma[n - 1].stream[stream].reg;
+}
+
+USART_TypeDef * sim_usart(int n)
+{
+	(void)n;
+	pump();
+	usart2.SR |= USART_SR_TXE | USART_SR_TC;
+	return &usart2;
+}
+
+CRC_TypeDef * sim_crc(void)
+{
+	uint32_t word;
+	int i;
+
+	if ((crc_unit.DR & ~0xffffffffull) != CRC_TAG) {
+		word = (uint32_t)crc_unit.DR;
+		crc_value ^= word;
+		for (i = 0; i < 32; i++)
+			crc_value = (crc_value & 0x80000000u) ? (crc_value << 1) ^ 0x04c11db7u
+							      : crc_value << 1;
+	}
+	if (crc_unit.CR & CRC_CR_RESET) {
+		crc_unit.CR &= ~CRC_CR_RESET;
+		crc_value = 0xffffffffu;
+	}
+
+	crc_unit.DR = CRC_TAG | crc_value;
+	return &crc_unit;
+}
+
+DWT_Type * sim_dwt(void)
+{
+	uint64_t cycles;
+
+	pump();
+	now_ns += SIM_POLL_CYCLES * 1000000000ull / SIM_CPU_HZ;
+
+	cycles = now_ns * (SIM_CPU_HZ / 1000000u) / 1000u;
+	if (dwt.CTRL & DWT_CTRL_CYCCNTENA_Msk)
+		dwt.CYCCNT += (uint32_t)(cycles - dwt_last_cycles);
+	dwt_last_cycles = cycles;
+
+	return &dwt;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irqn)
+{
+	if (irqn >= 0 && irqn < NVIC_LINES)
+		nvic_enabled[irqn] = 1;
+}
+
+void NVIC_DisableIRQ(IRQn_Type irqn)
+{
+	if (irqn >= 0 && irqn < NVIC_LINES)
+		nvic_enabled[irqn] = 0;
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type irqn)
+{
+	if (irqn >= 0 && irqn < NVIC_LINES)
+		nvic_pending[irqn] = 1;
+	if (!in_pump)
+		run_pending();
+}
+
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority)
+{
+	// handlers run in the order the model raises them
+	(void)irqn;
+	(void)priority;
+}
+
+void HAL_Delay(uint32_t delay)
+{
+	pump();
+	now_ns += (uint64_t)delay * 1000000ull;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	pump();
+	return (uint32_t)(now_ns / 1000000ull);
+}
+
+
+// ---------------------------------------------------------------------------
+// Simulator control
+// ---------------------------------------------------------------------------
+
+static void port_reset(struct sim_port *p)
+{
+	memset(&p->reg, 0, sizeof(p->reg));
+	p->reg.DR = DR_TAG;
+	p->rx = 0;
+	p->tx = 0;
+	p->tx_full = 0;
+	p->last_shift = 0;
+	p->rxne = 0;
+	p->ovr = 0;
+	refresh_sr(p);
+}
+
+void sim_reset(void)
+{
+	sim_spi_slaves(1, NULL, NULL);
+
+	port_reset(&port[0]);
+	port_reset(&port[1]);
+	memset(dma, 0, sizeof(dma));
+	memset(&usart2, 0, sizeof(usart2));
+	crc_unit.CR = CRC_CR_RESET;
+	memset(nvic_enabled, 0, sizeof(nvic_enabled));
+	memset(nvic_pending, 0, sizeof(nvic_pending));
+	memset(&sim_rcc, 0, sizeof(sim_rcc));
+	memset(&sim_gpioa, 0, sizeof(sim_gpioa));
+	memset(&sim_gpiob, 0, sizeof(sim_gpiob));
+	memset(&gpioc, 0, sizeof(gpioc));
+	memset(&sim_coredebug, 0, sizeof(sim_coredebug));
+	memset(&dwt, 0, sizeof(dwt));
+	dwt_last_cycles = 0;
+	now_ns = 0;
+	frame_count = 0;
+}
+
+uint64_t sim_now_ns(void)
+{
+	pump();
+	return now_ns;
+}
+
+uint64_t sim_frames(void)
+{
+	return frame_count;
+}
+
+void sim_spi_bit_errors(uint32_t hz, uint32_t one_in)
+{
+	error_hz = hz;
+	error_one_in = one_in;
+}
+
+uint64_t sim_spi_errors_injected(void)
+{
+	return errors_injected;
+}
+
+// Benchmarks drive the master calls, which report over printf; this keeps
+// that output off the terminal while a measurement runs
+void sim_console_mute(int mute)
+{
+	fflush(stdout);
+	if (mute && saved_stdout < 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+
+		if (null_fd < 0)
+			return;
+		saved_stdout = dup(STDOUT_FILENO);
+		dup2(null_fd, STDOUT_FILENO);
+		close(null_fd);
+	}
+	else if (!mute && saved_stdout >= 0) {
+		dup2(saved_stdout, STDOUT_FILENO);
+		close(saved_stdout);
+		saved_stdout = -1;
+	}
+}
+
+// A child slave: answers frames until the parent closes the socket
+static void remote_serve(int fd, void (*idle)(void))
+{
+	struct remote_msg msg;
+	uint16_t out;
+
+	while (recv(fd, &msg, sizeof(msg), MSG_WAITALL) == (ssize_t)sizeof(msg)) {
+		now_ns = msg.now_ns;
+		if (msg.op == REMOTE_FRAME) {
+			out = msg.val;
+			pump();
+
+			// as if from pump(), like exchange() in the parent
+			in_pump = 1;
+			msg.val = slave_shift_out();
+			slave_shift_in(out);
+			in_pump = 0;
+		}
+		else if (idle) {
+			idle();
+		}
+		if (send(fd, &msg, sizeof(msg), 0) != (ssize_t)sizeof(msg))
+			break;
+	}
+	_exit(0);
+}
+
+int sim_spi_slaves(int count, void (*boot)(void), void (*idle)(void))
+{
+	int sv[2];
+	int i, j;
+	pid_t pid;
+
+	for (i = 1; i < slave_count; i++) {
+		close(remote[i].fd);
+		waitpid(remote[i].pid, NULL, 0);
+	}
+	slave_count = 1;
+
+	if (count < 1 || count > SIM_MAX_SLAVES)
+		return count == 1 ? 0 : -1;
+
+	for (i = 1; i < count; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+			return -1;
+
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid < 0) {
+			close(sv[0]);
+			close(sv[1]);
+			return -1;
+		}
+
+		if (pid == 0) {
+			close(sv[0]);
+			for (j = 1; j < i; j++)
+				close(remote[j].fd);
+			slave_count = 1;
+			port_reset(&port[1]);
+			memset(&dma[0], 0, sizeof(dma[0]));
+			sim_flash_open(NULL);
+			if (boot)
+				boot();
+			remote_serve(sv[1], idle);
+		}
+
+		close(sv[1]);
+		remote[i].pid = pid;
+		remote[i].fd = sv[0];
+		slave_count = i + 1;
+	}
+
+	return 0;
+}
+
+void sim_spi_slaves_idle(void)
+{
+	struct remote_msg msg;
+	int i;
+
+	for (i = 1; i < slave_count; i++) {
+		msg.now_ns = now_ns;
+		msg.val = 0;
+		msg.op = REMOTE_IDLE;
+		remote_call(remote[i].fd, &msg);
+	}
+}
+
+static void __attribute__((constructor)) sim_power_on(void)
+{
+	sim_reset();
+}
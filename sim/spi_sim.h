@@ -0,0 +1,62 @@
+// File Name    : spi_sim.h
+// Project      : Simple File System by SPI
+// Description  : Control interface of the host SPI simulator. The simulator
+//                keeps a virtual clock that advances by one SPI frame time
+//                per exchanged byte and by the requested time on HAL_Delay,
+//                so throughput numbers do not depend on the host machine
+
+#ifndef SPI_SIM_H
+#define SPI_SIM_H
+
+#include <stdint.h>
+
+#include "flash.h"
+
+// SPI kernel clock the baud-rate divisor is applied to
+#define SIM_SPI_PCLK_HZ		100000000u
+// Core clock behind DWT->CYCCNT
+#define SIM_CPU_HZ		100000000u
+// Core cycles one pass of a polling loop is charged
+#define SIM_POLL_CYCLES		10
+
+void sim_reset(void);
+
+uint64_t sim_now_ns(void);
+uint64_t sim_frames(void);
+
+void sim_console_mute(int mute);
+
+// One frame shifted into slave 0 as if from the master, as wide as the
+// slave has set DFF; returns the frame the slave shifted out. The master
+// must be idle. sim/replay.c drives the slave with it.
+uint16_t sim_spi_slave_frame(uint16_t out);
+
+// Line noise: while the master clocks at hz or faster, about one frame in
+// one_in has a bit flipped, in each direction. one_in 0 turns it off.
+void sim_spi_bit_errors(uint32_t hz, uint32_t one_in);
+uint64_t sim_spi_errors_injected(void);
+
+// Slaves on the bus, up to SIM_MAX_SLAVES. Slave 0 runs in this process;
+// each other one is a child process that gets a fresh in-memory flash,
+// calls boot() (spi_init(), say) and then serves the frames its chip
+// select lets through. sim_spi_slaves_idle() runs idle() in each child,
+// as its board's main loop would between commands. sim_reset() goes back
+// to one slave.
+#define SIM_MAX_SLAVES		4
+
+int sim_spi_slaves(int count, void (*boot)(void), void (*idle)(void));
+void sim_spi_slaves_idle(void);
+
+// Flash emulator (flash_sim.c). Without sim_flash_open(path) the log
+// sectors live in memory; sim_flash_open(NULL) erases them again.
+struct sim_flash_stats
+{
+	uint32_t erases[FLASH_LOG_SECTORS];
+	uint64_t programmed;	// bytes
+	uint32_t errors;	// programs that needed an erase first
+};
+
+int sim_flash_open(const char *path);
+void sim_flash_get_stats(struct sim_flash_stats *s);
+
+#endif
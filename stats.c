@@ -0,0 +1,47 @@
+// File Name    : stats.c
+// Project      : Simple File System by SPI
+// Description  : Storage for the timing counters declared in stats.h
+
+#include "common.h"
+#include "filesys.h"
+#include "stats.h"
+#include <string.h>
+
+#if FS_STATS
+
+struct stats_timing stats_byte_isr;
+struct stats_timing stats_state[STATS_STATES];
+struct stats_timing stats_cmd[STATS_CMDS];
+uint32_t stats_no_ack[STATS_CMDS];
+
+// Short enough for the byte interrupt: a few adds and a count of leading
+// zeros for the histogram bucket
+void stats_record(struct stats_timing *t, uint32_t ticks)
+{
+	uint64_t ns = (uint64_t)ticks * STATS_TICK_NS;
+	uint32_t bucket = 0;
+
+	if (ns >= 128) {
+		bucket = 63 - __builtin_clzll(ns) - 6;
+		if (bucket >= STATS_BUCKETS) {
+			bucket = STATS_BUCKETS - 1;
+		}
+	}
+
+	t->count++;
+	t->total += ticks;
+	if (ticks > t->max) {
+		t->max = ticks;
+	}
+	t->hist[bucket]++;
+}
+
+void stats_reset(void)
+{
+	memset(&stats_byte_isr, 0, sizeof(stats_byte_isr));
+	memset(stats_state, 0, sizeof(stats_state));
+	memset(stats_cmd, 0, sizeof(stats_cmd));
+	memset(stats_no_ack, 0, sizeof(stats_no_ack));
+}
+
+#endif
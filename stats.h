@@ -0,0 +1,77 @@
+// File Name    : stats.h
+// Project      : Simple File System by SPI
+// Description  : Timing counters and latency histograms for the slave's
+//                interrupt and worker and the master's commands. Times are
+//                DWT->CYCCNT cycles on the board and clock_gettime()
+//                nanoseconds on the host. Building with FS_STATS=0 leaves
+//                none of it in the code.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#ifndef FS_STATS
+#define FS_STATS 1
+#endif
+
+#define STATS_BUCKETS 24	// bucket i counts times under 128ns << i
+#define STATS_STATES 32		// slave states, by enum state
+#define STATS_CMDS 32		// master commands, by CMD_* code
+
+struct stats_timing
+{
+	uint32_t count;
+	uint64_t total;		// clock ticks
+	uint32_t max;
+	uint32_t hist[STATS_BUCKETS];
+};
+
+#if FS_STATS
+
+#ifdef FS_HOST_SIM
+#include <time.h>
+
+#define STATS_TICK_NS 1
+
+static inline uint32_t stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+#else
+#define STATS_TICK_NS (1000 / CPU_CYCLES_PER_US)
+
+static inline uint32_t stats_clock(void)
+{
+	return DWT->CYCCNT;
+}
+#endif
+
+extern struct stats_timing stats_byte_isr;		// SPI2_IRQHandler
+extern struct stats_timing stats_state[STATS_STATES];	// worker, per byte
+extern struct stats_timing stats_cmd[STATS_CMDS];	// master, whole command
+extern uint32_t stats_no_ack[STATS_CMDS];		// master saw no ACK
+
+void stats_record(struct stats_timing *t, uint32_t ticks);
+void stats_reset(void);
+
+// Time a stretch of code: STATS_START(t) ... STATS_STOP(timing, t).
+// STATS_KEY keeps a value only the instrumentation needs.
+#define STATS_START(t)		uint32_t t = stats_clock()
+#define STATS_STOP(timing, t)	stats_record(&(timing), stats_clock() - (t))
+#define STATS_KEY(k, v)		uint8_t k = (v)
+#define STATS_COUNT(counter)	((counter)++)
+
+#else
+
+#define STATS_START(t)
+#define STATS_STOP(timing, t)	((void)0)
+#define STATS_KEY(k, v)
+#define STATS_COUNT(counter)	((void)0)
+
+#endif
+
+#endif
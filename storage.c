@@ -0,0 +1,630 @@
+// File Name    : storage.c
+// Project      : Simple File System by SPI
+// Description  : Slave-side file storage. File contents live in a pool of
+//                BLOCK_SIZE blocks. Each file owns a linked list of extents,
+//                runs of consecutive blocks, taken from a shared extent pool,
+//                and a bitmap tracks which blocks are free. A file only holds
+//                the blocks its size needs, and it can grow in place when the
+//                blocks after its last extent are free. A copied file shares
+//                its blocks with the original, each block counting the files
+//                that hold it, until one of them writes to a block
+
+#include "storage.h"
+#include "dir.h"
+#include <string.h>
+
+struct extent
+{
+	uint16_t start;		// first block
+	uint16_t count;		// blocks in the run
+	uint16_t next;		// next extent of the file, EXTENT_NONE at the end
+};
+
+volatile struct file_record file[MAX_FILE_NUMBER + 1];
+
+static uint8_t block_pool[BLOCK_COUNT][BLOCK_SIZE];
+static uint32_t block_map[BLOCK_COUNT / 32];		// 1 = block in use
+static uint8_t block_refs[BLOCK_COUNT];			// files holding each block
+static uint16_t blocks_free = 0;
+
+// Bit n set while file n has a non-zero size
+#define FILE_MAP_WORDS ((MAX_FILE_NUMBER + 32) / 32)
+static uint32_t file_map[FILE_MAP_WORDS];
+// Bit n set while file n is dirty. The SPI2 worker and the DMA interrupt
+// set bits while the main loop takes them, so each change to a word is
+// one atomic read-modify-write (LDREX/STREX on the M4)
+static volatile uint32_t dirty_map[FILE_MAP_WORDS];
+
+static struct extent extent_pool[EXTENT_COUNT];
+static uint16_t extent_free = EXTENT_NONE;		// free extents, linked by next
+
+// Last extent looked up by storage_span(), so sequential access does not
+// walk the list from the start every time
+static uint8_t cursor_file = 0;
+static uint16_t cursor_extent = EXTENT_NONE;
+static uint32_t cursor_base = 0;			// file offset of cursor_extent
+
+
+void storage_init(void)
+{
+	uint16_t i;
+
+	for (i = 0; i <= MAX_FILE_NUMBER; i++) {
+		file[i].size = 0;
+		file[i].extent = EXTENT_NONE;
+	}
+
+	memset(file_map, 0, sizeof(file_map));
+	for (i = 0; i < FILE_MAP_WORDS; i++) {
+		dirty_map[i] = 0;
+	}
+	memset(block_map, 0, sizeof(block_map));
+	memset(block_refs, 0, sizeof(block_refs));
+	blocks_free = BLOCK_COUNT;
+
+	for (i = 0; i < EXTENT_COUNT; i++) {
+		extent_pool[i].next = (i + 1 < EXTENT_COUNT) ? i + 1 : EXTENT_NONE;
+	}
+	extent_free = 0;
+
+	cursor_file = 0;
+
+	dir_init();
+}
+
+
+static int block_used(uint16_t block)
+{
+	return (block_map[block >> 5] >> (block & 31)) & 1;
+}
+
+// Take blocks for one file, or let one file go of them: a block shared
+// with other files stays in use until the last lets go
+static void blocks_mark(uint16_t start, uint16_t count, int used)
+{
+	uint16_t b;
+
+	for (b = start; b < start + count; b++) {
+		if (used) {
+			block_map[b >> 5] |= 1u << (b & 31);
+			block_refs[b] = 1;
+			memset(block_pool[b], 0, BLOCK_SIZE);
+			blocks_free--;
+		}
+		else if (--block_refs[b] == 0) {
+			block_map[b >> 5] &= ~(1u << (b & 31));
+			blocks_free++;
+		}
+	}
+}
+
+// First free run of at least want blocks, or else the longest free run
+static uint16_t find_run(uint16_t want, uint16_t *length)
+{
+	uint16_t best_start = 0, best_len = 0;
+	uint16_t start = 0, len = 0;
+	uint16_t b;
+
+	for (b = 0; b < BLOCK_COUNT; b++) {
+		if ((b & 31) == 0 && block_map[b >> 5] == 0xffffffffu) {
+			b += 31;		// whole word in use
+			len = 0;
+			continue;
+		}
+		if (block_used(b)) {
+			len = 0;
+			continue;
+		}
+
+		if (len == 0) {
+			start = b;
+		}
+		len++;
+		if (len == want) {
+			*length = len;
+			return start;
+		}
+		if (len > best_len) {
+			best_len = len;
+			best_start = start;
+		}
+	}
+
+	*length = best_len;
+	return best_start;
+}
+
+static uint16_t extent_alloc(void)
+{
+	uint16_t e = extent_free;
+
+	if (e != EXTENT_NONE) {
+		extent_free = extent_pool[e].next;
+		extent_pool[e].next = EXTENT_NONE;
+	}
+	return e;
+}
+
+static void extent_release(uint16_t e)
+{
+	extent_pool[e].next = extent_free;
+	extent_free = e;
+}
+
+
+static uint16_t blocks_for(uint16_t size)
+{
+	return (uint16_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+// Cut a file's extent list down to its first keep blocks
+static void truncate_blocks(uint8_t n, uint16_t keep)
+{
+	uint16_t *link = (uint16_t *)&file[n].extent;
+	uint16_t e, next;
+
+	while (*link != EXTENT_NONE && keep >= extent_pool[*link].count) {
+		keep -= extent_pool[*link].count;
+		link = &extent_pool[*link].next;
+	}
+
+	e = *link;
+	if (e != EXTENT_NONE && keep > 0) {
+		blocks_mark(extent_pool[e].start + keep, extent_pool[e].count - keep, 0);
+		extent_pool[e].count = keep;
+		link = &extent_pool[e].next;
+		e = *link;
+	}
+	*link = EXTENT_NONE;
+
+	while (e != EXTENT_NONE) {
+		next = extent_pool[e].next;
+		blocks_mark(extent_pool[e].start, extent_pool[e].count, 0);
+		extent_release(e);
+		e = next;
+	}
+}
+
+// Add more blocks to the end of a file: in place after its last extent if
+// those blocks are free, then in as few new extents as possible
+static int grow_blocks(uint8_t n, uint16_t more)
+{
+	uint16_t *link = (uint16_t *)&file[n].extent;
+	uint16_t last = EXTENT_NONE;
+	uint16_t start, len, e;
+
+	while (*link != EXTENT_NONE) {
+		last = *link;
+		link = &extent_pool[*link].next;
+	}
+
+	if (last != EXTENT_NONE) {
+		start = extent_pool[last].start + extent_pool[last].count;
+		len = 0;
+		while (len < more && start + len < BLOCK_COUNT && !block_used(start + len)) {
+			len++;
+		}
+		blocks_mark(start, len, 1);
+		extent_pool[last].count += len;
+		more -= len;
+	}
+
+	while (more > 0) {
+		start = find_run(more, &len);
+		if (len == 0) {
+			return -1;
+		}
+		e = extent_alloc();
+		if (e == EXTENT_NONE) {
+			return -1;
+		}
+
+		blocks_mark(start, len, 1);
+		extent_pool[e].start = start;
+		extent_pool[e].count = len;
+		*link = e;
+		link = &extent_pool[e].next;
+		more -= len;
+	}
+
+	return 0;
+}
+
+// Blocks the files would take with nothing shared, as the flash log
+// holds them and a remount gives them back (persist.c). Kept within
+// BLOCK_COUNT, so a copy is never more than the pool can restore.
+static uint32_t blocks_held(void)
+{
+	uint32_t count = 0;
+	uint8_t n;
+
+	for (n = storage_next_file(1); n != 0; n = storage_next_file(n + 1)) {
+		count += blocks_for(file[n].size);
+	}
+	return count;
+}
+
+static uint16_t file_blocks(uint8_t n)
+{
+	uint16_t e = file[n].extent;
+	uint16_t count = 0;
+
+	while (e != EXTENT_NONE) {
+		count += extent_pool[e].count;
+		e = extent_pool[e].next;
+	}
+	return count;
+}
+
+
+int storage_resize(uint8_t file_number, uint16_t size)
+{
+	uint16_t have, need;
+
+	if (file_number == 0 || file_number > MAX_FILE_NUMBER) {
+		return -1;
+	}
+
+	if (cursor_file == file_number) {
+		cursor_file = 0;
+	}
+
+	have = file_blocks(file_number);
+	need = blocks_for(size);
+
+	if (need > have) {
+		if (need - have > blocks_free
+		    || blocks_held() + need - have > BLOCK_COUNT
+		    || grow_blocks(file_number, need - have) != 0) {
+			truncate_blocks(file_number, have);	// out of extents
+			return -1;
+		}
+	}
+	else if (need < have) {
+		truncate_blocks(file_number, need);
+	}
+
+	if (file[file_number].size != size) {
+		storage_mark_dirty(file_number);
+	}
+	file[file_number].size = size;
+	if (size) {
+		file_map[file_number >> 5] |= 1u << (file_number & 31);
+	}
+	else {
+		file_map[file_number >> 5] &= ~(1u << (file_number & 31));
+		dir_remove(file_number);	// a file that is gone has no name
+	}
+	return 0;
+}
+
+void storage_delete(uint8_t file_number)
+{
+	storage_resize(file_number, 0);
+}
+
+
+uint8_t * storage_span(uint8_t file_number, uint16_t offset, uint16_t *length)
+{
+	uint16_t e;
+	uint32_t base, end;
+
+	if (file_number == 0 || file_number > MAX_FILE_NUMBER
+	    || offset >= file[file_number].size) {
+		return NULL;
+	}
+
+	if (cursor_file == file_number && offset >= cursor_base) {
+		e = cursor_extent;
+		base = cursor_base;
+	}
+	else {
+		e = file[file_number].extent;
+		base = 0;
+	}
+
+	while (e != EXTENT_NONE) {
+		end = base + (uint32_t)extent_pool[e].count * BLOCK_SIZE;
+		if (offset < end) {
+			break;
+		}
+		base = end;
+		e = extent_pool[e].next;
+	}
+	if (e == EXTENT_NONE) {
+		return NULL;
+	}
+
+	cursor_file = file_number;
+	cursor_extent = e;
+	cursor_base = base;
+
+	if (end > file[file_number].size) {
+		end = file[file_number].size;
+	}
+	*length = (uint16_t)(end - offset);
+	return &block_pool[extent_pool[e].start][0] + (offset - base);
+}
+
+// Give file n its own copy of the block holding offset, if it shares it.
+// The extent around the block is split, and the copy joins the extent
+// before it when it lands right after it, so a file written from the
+// start ends up in one run again where the free blocks allow. Returns -1
+// if there is no free block or extent for it.
+static int unshare_block(uint8_t n, uint16_t offset)
+{
+	uint16_t *link = (uint16_t *)&file[n].extent;
+	uint16_t prev = EXTENT_NONE;
+	uint16_t e, tail, start, count, idx, copy, len;
+	uint32_t base = 0;
+
+	while ((e = *link) != EXTENT_NONE
+	       && offset >= base + (uint32_t)extent_pool[e].count * BLOCK_SIZE) {
+		base += (uint32_t)extent_pool[e].count * BLOCK_SIZE;
+		prev = e;
+		link = &extent_pool[e].next;
+	}
+	if (e == EXTENT_NONE) {
+		return -1;
+	}
+
+	start = extent_pool[e].start;
+	count = extent_pool[e].count;
+	idx = (uint16_t)((offset - base) / BLOCK_SIZE);
+	if (block_refs[start + idx] <= 1) {
+		return 0;
+	}
+
+	copy = find_run(1, &len);
+	if (len == 0) {
+		return -1;
+	}
+
+	// the blocks after the copied one keep an extent of their own
+	tail = EXTENT_NONE;
+	if (idx + 1 < count) {
+		tail = extent_alloc();
+		if (tail == EXTENT_NONE) {
+			return -1;
+		}
+		extent_pool[tail].start = start + idx + 1;
+		extent_pool[tail].count = count - idx - 1;
+		extent_pool[tail].next = extent_pool[e].next;
+		extent_pool[e].next = tail;
+	}
+
+	if (idx == 0 && prev != EXTENT_NONE
+	    && extent_pool[prev].start + extent_pool[prev].count == copy) {
+		// the copy goes on the end of the extent before; e held only
+		// the copied block now
+		extent_pool[prev].count++;
+		extent_pool[prev].next = extent_pool[e].next;
+		extent_release(e);
+	}
+	else if (idx == 0) {
+		extent_pool[e].start = copy;
+		extent_pool[e].count = 1;
+	}
+	else {
+		e = extent_alloc();
+		if (e == EXTENT_NONE) {
+			// put the tail back on the extent it came from
+			if (tail != EXTENT_NONE) {
+				extent_pool[*link].next = extent_pool[tail].next;
+				extent_release(tail);
+			}
+			return -1;
+		}
+		extent_pool[*link].count = idx;
+		extent_pool[e].start = copy;
+		extent_pool[e].count = 1;
+		extent_pool[e].next = extent_pool[*link].next;
+		extent_pool[*link].next = e;
+	}
+
+	blocks_mark(copy, 1, 1);
+	memcpy(block_pool[copy], block_pool[start + idx], BLOCK_SIZE);
+	block_refs[start + idx]--;
+
+	if (cursor_file == n) {
+		cursor_file = 0;
+	}
+	return 0;
+}
+
+uint8_t * storage_span_write(uint8_t file_number, uint16_t offset, uint16_t want, uint16_t *length)
+{
+	uint32_t at;
+
+	if (file_number == 0 || file_number > MAX_FILE_NUMBER
+	    || offset >= file[file_number].size) {
+		return NULL;
+	}
+
+	for (at = offset - offset % BLOCK_SIZE; at < (uint32_t)offset + want
+	     && at < file[file_number].size; at += BLOCK_SIZE) {
+		if (unshare_block(file_number, (uint16_t)at) != 0) {
+			return NULL;
+		}
+	}
+	return storage_span(file_number, offset, length);
+}
+
+uint8_t storage_get(uint8_t file_number, uint16_t offset)
+{
+	uint16_t length;
+	uint8_t *p = storage_span(file_number, offset, &length);
+
+	return p ? *p : 0;
+}
+
+int storage_put(uint8_t file_number, uint16_t offset, uint8_t data)
+{
+	uint16_t length;
+	uint8_t *p = storage_span(file_number, offset, &length);
+
+	// one lookup of the block's count; shared only after a copy
+	if (p && block_refs[(p - &block_pool[0][0]) / BLOCK_SIZE] > 1) {
+		p = storage_span_write(file_number, offset, 1, &length);
+	}
+
+	if (!p) {
+		return -1;
+	}
+	*p = data;
+	__atomic_fetch_or(&dirty_map[file_number >> 5], 1u << (file_number & 31),
+			  __ATOMIC_RELAXED);
+	return 0;
+}
+
+
+int storage_copy(uint8_t src, uint8_t dst)
+{
+	uint16_t *link;
+	uint16_t e, copy, b;
+
+	if (src == 0 || src > MAX_FILE_NUMBER || dst == 0 || dst > MAX_FILE_NUMBER
+	    || src == dst || file[src].size == 0) {
+		return -1;
+	}
+	if (blocks_held() - blocks_for(file[dst].size) + blocks_for(file[src].size)
+	    > BLOCK_COUNT) {
+		return -1;
+	}
+
+	storage_resize(dst, 0);
+
+	link = (uint16_t *)&file[dst].extent;
+	for (e = file[src].extent; e != EXTENT_NONE; e = extent_pool[e].next) {
+		copy = extent_alloc();
+		if (copy == EXTENT_NONE) {
+			truncate_blocks(dst, 0);
+			return -1;
+		}
+		extent_pool[copy].start = extent_pool[e].start;
+		extent_pool[copy].count = extent_pool[e].count;
+		for (b = 0; b < extent_pool[e].count; b++) {
+			block_refs[extent_pool[e].start + b]++;
+		}
+		*link = copy;
+		link = &extent_pool[copy].next;
+	}
+
+	file[dst].size = file[src].size;
+	file_map[dst >> 5] |= 1u << (dst & 31);
+	storage_mark_dirty(dst);
+	return 0;
+}
+
+int storage_move(uint8_t src, uint8_t dst)
+{
+	uint8_t name[DIR_NAME_SIZE];
+	uint8_t length;
+
+	if (src == 0 || src > MAX_FILE_NUMBER || dst == 0 || dst > MAX_FILE_NUMBER
+	    || src == dst || file[src].size == 0) {
+		return -1;
+	}
+
+	storage_resize(dst, 0);
+	length = dir_name(src, name);
+	dir_remove(src);
+
+	file[dst].size = file[src].size;
+	file[dst].extent = file[src].extent;
+	file[src].size = 0;
+	file[src].extent = EXTENT_NONE;
+	file_map[dst >> 5] |= 1u << (dst & 31);
+	file_map[src >> 5] &= ~(1u << (src & 31));
+	if (cursor_file == src) {
+		cursor_file = 0;
+	}
+
+	if (length) {
+		dir_insert(name, length, dst);
+	}
+	storage_mark_dirty(src);
+	storage_mark_dirty(dst);
+	return 0;
+}
+
+uint16_t storage_blocks_shared(void)
+{
+	uint16_t b, count = 0;
+
+	for (b = 0; b < BLOCK_COUNT; b++) {
+		if (block_refs[b] > 1) {
+			count++;
+		}
+	}
+	return count;
+}
+
+
+uint16_t storage_free_blocks(void)
+{
+	return blocks_free;
+}
+
+
+// One count-trailing-zeros per bitmap word, so the cost is bounded by
+// FILE_MAP_WORDS however sparse the table is
+uint8_t storage_next_file(uint8_t file_number)
+{
+	uint32_t w, bits;
+
+	if (file_number > MAX_FILE_NUMBER) {
+		return 0;
+	}
+
+	w = file_number >> 5;
+	bits = file_map[w] & (0xffffffffu << (file_number & 31));
+	while (bits == 0) {
+		if (++w == FILE_MAP_WORDS) {
+			return 0;
+		}
+		bits = file_map[w];
+	}
+	return (uint8_t)((w << 5) + __builtin_ctz(bits));
+}
+
+void storage_mark_dirty(uint8_t file_number)
+{
+	if (file_number <= MAX_FILE_NUMBER) {
+		__atomic_fetch_or(&dirty_map[file_number >> 5], 1u << (file_number & 31),
+				  __ATOMIC_RELAXED);
+	}
+}
+
+uint8_t storage_take_dirty(void)
+{
+	uint32_t w, bits;
+	uint8_t n;
+
+	for (w = 0; w < FILE_MAP_WORDS; w++) {
+		bits = dirty_map[w];
+		if (bits) {
+			n = (uint8_t)((w << 5) + __builtin_ctz(bits));
+			__atomic_fetch_and(&dirty_map[w], ~(1u << (n & 31)), __ATOMIC_RELAXED);
+			return n;
+		}
+	}
+	return 0;
+}
+
+uint8_t storage_first_free(void)
+{
+	uint32_t w, bits, n;
+
+	for (w = 0; w < FILE_MAP_WORDS; w++) {
+		bits = ~file_map[w];
+		if (w == 0) {
+			bits &= ~1u;		// there is no file 0
+		}
+		if (bits) {
+			n = (w << 5) + __builtin_ctz(bits);
+			return (n <= MAX_FILE_NUMBER) ? (uint8_t)n : 0;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+// File Name    : storage.h
+// Project      : Simple File System by SPI
+// Description  : Slave-side file storage: a pool of fixed-size blocks, a
+//                list of extents (runs of consecutive blocks) per file and a
+//                free-block bitmap
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+
+#define MAX_FILE_NUMBER 100	// file_number: 1 to 100
+#define MAX_FILE_SIZE 0xffffu	// size is 16 bits, as far as free blocks allow
+
+#define BLOCK_SIZE 64		// bytes per block
+#define BLOCK_COUNT 1024	// 64KB of file data
+#define EXTENT_COUNT 512	// extents shared by all files
+#define EXTENT_NONE 0xffffu
+
+struct file_record
+{
+	uint16_t size;		// bytes, 0 = no file
+	uint16_t extent;	// first extent, EXTENT_NONE if no blocks
+};
+
+extern volatile struct file_record file[MAX_FILE_NUMBER + 1];
+
+void storage_init(void);
+
+// Create, grow or shrink a file, keeping the bytes that still fit.
+// Returns -1, leaving the file as it was, if there are not enough blocks.
+int storage_resize(uint8_t file_number, uint16_t size);
+void storage_delete(uint8_t file_number);
+
+// The bytes of a file from offset to the end of the extent holding it:
+// returns a pointer to them and their count in *length, or NULL past the
+// end of the file. Sequential calls on one file cost O(1).
+uint8_t * storage_span(uint8_t file_number, uint16_t offset, uint16_t *length);
+
+// The same, for writing want bytes from offset: the blocks they fall in
+// are the file's own first (see storage_copy()). NULL if they cannot be.
+uint8_t * storage_span_write(uint8_t file_number, uint16_t offset, uint16_t want, uint16_t *length);
+
+uint8_t storage_get(uint8_t file_number, uint16_t offset);
+
+// Store one byte. Returns -1 past the end of the file, or if its block is
+// shared and there is no free block to copy it into.
+int storage_put(uint8_t file_number, uint16_t offset, uint8_t data);
+
+// Make dst a copy of src, or give it src's contents and name, replacing
+// whatever dst held; src must exist. A copy shares src's blocks: a block
+// is copied only when one of the files writes to it. The files still
+// count in full against BLOCK_COUNT, as flash keeps and restores each
+// one whole, so a copy or a resize past that returns -1 with nothing
+// changed. Both return -1, leaving dst empty for a copy, if there are
+// not enough extents.
+int storage_copy(uint8_t src, uint8_t dst);
+int storage_move(uint8_t src, uint8_t dst);
+uint16_t storage_blocks_shared(void);		// blocks held by more than one file
+
+uint16_t storage_free_blocks(void);
+
+// Occupancy index: the first file at or after file_number with a non-zero
+// size, and the lowest unused file number. Both return 0 if there is none.
+uint8_t storage_next_file(uint8_t file_number);
+uint8_t storage_first_free(void);
+
+// Files changed since they were last taken: resize, delete and put mark
+// them; a caller that writes through storage_span() marks the file itself.
+// storage_take_dirty() returns and clears the lowest one, 0 if none.
+void storage_mark_dirty(uint8_t file_number);
+uint8_t storage_take_dirty(void);
+
+#endif
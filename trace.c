@@ -0,0 +1,48 @@
+// File Name    : trace.c
+// Project      : Simple File System by SPI
+// Description  : The protocol trace ring declared in trace.h
+
+#include "common.h"
+#include "trace.h"
+
+#if FS_TRACE
+
+volatile uint8_t trace_on = 0;
+
+static struct trace_entry trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t trace_head = 0;	// entries recorded
+
+void trace_record(uint8_t dir, uint8_t state, uint8_t data)
+{
+	struct trace_entry *entry = &trace_ring[trace_head & (TRACE_RING_SIZE - 1)];
+
+	entry->time = trace_clock();
+	entry->dir = dir;
+	entry->state = state;
+	entry->data = data;
+	trace_head++;
+}
+
+void trace_clear(void)
+{
+	trace_head = 0;
+}
+
+uint32_t trace_count(void)
+{
+	return trace_head;
+}
+
+int trace_get(uint32_t seq, struct trace_entry *entry)
+{
+	uint32_t head = trace_head;
+
+	if (seq >= head || head - seq > TRACE_RING_SIZE) {
+		return 0;
+	}
+
+	*entry = trace_ring[seq & (TRACE_RING_SIZE - 1)];
+	return 1;
+}
+
+#endif
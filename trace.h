@@ -0,0 +1,74 @@
+// File Name    : trace.h
+// Project      : Simple File System by SPI
+// Description  : Protocol trace of the slave: a ring of the last
+//                TRACE_RING_SIZE bytes SPI2 received and loaded to send,
+//                each with the protocol state it met and a timestamp, for
+//                dumping from the monitor and replaying in the simulator
+//                (sim/replay.c). Bytes the slave moves by DMA are not in
+//                it. Building with FS_TRACE=0 leaves none of it in the code.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#ifndef FS_TRACE
+#define FS_TRACE 1
+#endif
+
+#define TRACE_RING_SIZE 1024	// entries, a power of two
+
+#define TRACE_RX 0		// a byte from the master
+#define TRACE_TX 1		// a byte loaded into DR for the master
+
+struct trace_entry
+{
+	uint32_t time;		// clock ticks, see TRACE_TICK_NS
+	uint8_t dir;		// TRACE_RX or TRACE_TX
+	uint8_t state;		// enum state the slave was in
+	uint8_t data;
+};
+
+#if FS_TRACE
+
+#ifdef FS_HOST_SIM
+// the simulator's link time, so a trace taken there is reproducible
+uint64_t sim_now_ns(void);
+
+#define TRACE_TICK_NS 1
+
+static inline uint32_t trace_clock(void)
+{
+	return (uint32_t)sim_now_ns();
+}
+#else
+#define TRACE_TICK_NS (1000 / CPU_CYCLES_PER_US)
+
+static inline uint32_t trace_clock(void)
+{
+	return DWT->CYCCNT;
+}
+#endif
+
+extern volatile uint8_t trace_on;
+
+// Short enough for the byte interrupt: one store of a few bytes. Once
+// the ring is full the oldest entries are overwritten.
+void trace_record(uint8_t dir, uint8_t state, uint8_t data);
+void trace_clear(void);
+
+// Entries recorded since trace_clear(), the overwritten ones included,
+// and entry seq of them: 0 if it has been overwritten or not recorded yet
+uint32_t trace_count(void);
+int trace_get(uint32_t seq, struct trace_entry *entry);
+
+#define TRACE(dir, state, data) \
+	do { if (trace_on) trace_record((dir), (state), (data)); } while (0)
+
+#else
+
+#define TRACE(dir, state, data)	((void)0)
+
+#endif
+
+#endif